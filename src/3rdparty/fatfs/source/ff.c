@@ -498,6 +498,9 @@ static const BYTE GUID_MS_Basic[16] = {0xA2,0xA0,0xD0,0xEB,0xE5,0xB9,0x33,0x44,0
 #if FF_FS_EXFAT
 #error LFN must be enabled when enable exFAT
 #endif
+#if FF_USE_DIRCACHE
+#error LFN must be enabled when enable the directory cache
+#endif
 #define DEF_NAMBUF
 #define INIT_NAMBUF(fs)
 #define FREE_NAMBUF()
@@ -2377,6 +2380,385 @@ static FRESULT dir_read (
 
 
 
+#if FF_USE_DIRCACHE
+/*-----------------------------------------------------------------------*/
+/* Directory cache - Names and free entries of recent directories        */
+/*-----------------------------------------------------------------------*/
+/* The cache mirrors what dir_find() and dir_alloc() would see when they
+/  scan the table so that creating many files in one directory does not
+/  rescan it on every call. It is updated by dir_register() and dir_remove()
+/  and dropped on any error or when the directory itself goes away. */
+
+#define DC_ZERO		0	/* Free entry that has never been used (end of table) */
+#define DC_FREE		1	/* Deleted entry */
+#define DC_USED		2	/* SFN, volume label or dot entry */
+#define DC_LFN		3	/* LFN entry */
+
+typedef struct {
+	DWORD	idx;		/* Index of the SFN entry in the directory table */
+	DWORD	blk_ofs;	/* Entry block offset as dir_find() reports it (0xFFFFFFFF:none) */
+	DWORD	hash;		/* Hash of the up-cased LFN */
+	WCHAR*	lfn;		/* Up-cased LFN (null:no valid LFN) */
+	BYTE	sfn[11];	/* SFN */
+} DCITEM;
+
+typedef struct {
+	FATFS*	fs;			/* Filesystem object (null:slot not used) */
+	WORD	id;			/* Volume mount ID */
+	DWORD	sclust;		/* Directory start cluster (0:root directory) */
+	DWORD	stamp;		/* Time of last use for the LRU replacement */
+	DWORD	n_ent;		/* Number of entries in the directory table */
+	DWORD	sz_state;	/* Size of the state array */
+	DWORD	end;		/* Index of the first DC_ZERO entry (n_ent:none) */
+	BYTE*	state;		/* State of each entry in the directory table (DC_*) */
+	UINT	n_items;	/* Number of named items */
+	UINT	sz_items;	/* Size of the items array */
+	DCITEM*	items;		/* Named items in the order of the directory table */
+} DIRCACHE;
+
+#define FF_DIRCACHE_SLOTS	8	/* Number of directories to keep in the cache */
+
+static DIRCACHE DirCache[FF_DIRCACHE_SLOTS];
+static DWORD DirCacheStamp;
+
+
+static void dircache_drop (
+	DIRCACHE* dc		/* Cache slot to release */
+)
+{
+	UINT i;
+
+
+	for (i = 0; i < dc->n_items; i++) ff_memfree(dc->items[i].lfn);
+	ff_memfree(dc->items);
+	ff_memfree(dc->state);
+	memset(dc, 0, sizeof *dc);
+}
+
+
+static void dircache_purge (
+	FATFS* fs,			/* Filesystem object */
+	DWORD sclust		/* Directory start cluster (0xFFFFFFFF:all directories) */
+)
+{
+	UINT i;
+
+
+	for (i = 0; i < FF_DIRCACHE_SLOTS; i++) {
+		if (DirCache[i].fs == fs && (sclust == 0xFFFFFFFF || DirCache[i].sclust == sclust)) {
+			dircache_drop(&DirCache[i]);
+		}
+	}
+}
+
+
+void ff_dircache_clear (void)
+{
+	UINT i;
+
+
+	for (i = 0; i < FF_DIRCACHE_SLOTS; i++) {
+		if (DirCache[i].fs) dircache_drop(&DirCache[i]);
+	}
+}
+
+
+static DWORD dircache_hash (	/* Returns the hash of the up-cased name */
+	const WCHAR* name
+)
+{
+	DWORD hash = 0;
+
+
+	while (*name) hash = hash * 31 + ff_wtoupper(*name++);
+	return hash;
+}
+
+
+static DIRCACHE* dircache_slot (	/* Returns the cache of the directory (null:not cached) */
+	DIR* dp				/* Directory object */
+)
+{
+	FATFS *fs = dp->obj.fs;
+	UINT i;
+
+
+	if (FF_FS_EXFAT && fs->fs_type == FS_EXFAT) return 0;
+	for (i = 0; i < FF_DIRCACHE_SLOTS; i++) {
+		if (DirCache[i].fs == fs && DirCache[i].id == fs->id && DirCache[i].sclust == dp->obj.sclust) {
+			DirCache[i].stamp = ++DirCacheStamp;
+			return &DirCache[i];
+		}
+	}
+	return 0;
+}
+
+
+static int dircache_grow (	/* 1:succeeded, 0:not enough core */
+	DIRCACHE* dc,		/* Cache slot */
+	DWORD n_ent			/* New number of entries in the directory table */
+)
+{
+	BYTE *state;
+	DWORD sz;
+
+
+	if (n_ent > dc->sz_state) {
+		for (sz = dc->sz_state ? dc->sz_state : 64; sz < n_ent; sz *= 2) ;
+		state = ff_memalloc(sz);
+		if (!state) return 0;
+		if (dc->state) memcpy(state, dc->state, dc->n_ent);
+		ff_memfree(dc->state);
+		dc->state = state;
+		dc->sz_state = sz;
+	}
+	memset(dc->state + dc->n_ent, DC_ZERO, n_ent - dc->n_ent);
+	dc->n_ent = n_ent;
+	return 1;
+}
+
+
+static UINT dircache_search (	/* Returns the position of the item at or after the index */
+	const DIRCACHE* dc,	/* Cache slot */
+	DWORD idx			/* Index of the SFN entry */
+)
+{
+	UINT lo = 0, hi = dc->n_items, mid;
+
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (dc->items[mid].idx < idx) lo = mid + 1; else hi = mid;
+	}
+	return lo;
+}
+
+
+static int dircache_insert (	/* 1:succeeded, 0:not enough core */
+	DIRCACHE* dc,		/* Cache slot */
+	DWORD idx,			/* Index of the SFN entry */
+	DWORD blk_ofs,		/* Entry block offset */
+	const BYTE* sfn,	/* SFN */
+	const WCHAR* lfn	/* LFN (null:no valid LFN) */
+)
+{
+	DCITEM *items, *it;
+	UINT i, len;
+
+
+	if (dc->n_items == dc->sz_items) {
+		items = ff_memalloc((dc->sz_items ? dc->sz_items * 2 : 32) * sizeof (DCITEM));
+		if (!items) return 0;
+		if (dc->items) memcpy(items, dc->items, dc->n_items * sizeof (DCITEM));
+		ff_memfree(dc->items);
+		dc->items = items;
+		dc->sz_items = dc->sz_items ? dc->sz_items * 2 : 32;
+	}
+	i = dircache_search(dc, idx);
+	memmove(dc->items + i + 1, dc->items + i, (dc->n_items - i) * sizeof (DCITEM));
+	dc->n_items++;
+	it = &dc->items[i];
+	it->idx = idx;
+	it->blk_ofs = blk_ofs;
+	it->hash = 0;
+	it->lfn = 0;
+	memcpy(it->sfn, sfn, 11);
+	if (lfn) {
+		for (len = 0; lfn[len]; len++) ;
+		it->lfn = ff_memalloc((len + 1) * sizeof (WCHAR));
+		if (!it->lfn) return 0;
+		for (len = 0; lfn[len]; len++) it->lfn[len] = (WCHAR)ff_wtoupper(lfn[len]);
+		it->lfn[len] = 0;
+		it->hash = dircache_hash(lfn);
+	}
+	return 1;
+}
+
+
+static DIRCACHE* dircache_get (	/* Returns the cache of the directory (null:could not be loaded) */
+	DIR* dp				/* Directory object */
+)
+{
+	FATFS *fs = dp->obj.fs;
+	DIRCACHE *dc;
+	FRESULT res;
+	DWORD idx, blk_ofs;
+	BYTE c, a, ord, sum, st;
+	WCHAR lfn[FF_MAX_LFN + 1];
+	UINT i;
+
+
+	if (FF_FS_EXFAT && fs->fs_type == FS_EXFAT) return 0;
+	dc = dircache_slot(dp);
+	if (dc) return dc;
+
+	for (dc = &DirCache[0], i = 1; i < FF_DIRCACHE_SLOTS; i++) {	/* Pick the least recently used slot */
+		if (DirCache[i].stamp < dc->stamp) dc = &DirCache[i];
+	}
+	if (dc->fs) dircache_drop(dc);
+	dc->fs = fs; dc->id = fs->id; dc->sclust = dp->obj.sclust;
+	dc->stamp = ++DirCacheStamp;
+
+	/* Scan the whole table the same way as dir_find() does */
+	ord = sum = 0xFF; blk_ofs = 0xFFFFFFFF; dc->end = 0xFFFFFFFF;
+	res = dir_sdi(dp, 0);
+	for (idx = 0; res == FR_OK; idx++) {
+		res = move_window(fs, dp->sect);
+		if (res != FR_OK) break;
+		if (idx >= dc->sz_state) {
+			if (!dircache_grow(dc, idx + 1)) { res = FR_NOT_ENOUGH_CORE; break; }
+		}
+		c = dp->dir[DIR_Name];
+		a = dp->dir[DIR_Attr] & AM_MASK;
+		st = (c == 0) ? DC_ZERO : (c == DDEM) ? DC_FREE : (a == AM_LFN) ? DC_LFN : DC_USED;
+		dc->state[idx] = st;
+		if (st == DC_ZERO) {
+			if (dc->end == 0xFFFFFFFF) dc->end = idx;	/* dir_find() stops here */
+		} else if (dc->end == 0xFFFFFFFF) {
+			if (c == DDEM || ((a & AM_VOL) && a != AM_LFN)) {	/* An entry without valid data */
+				ord = 0xFF; blk_ofs = 0xFFFFFFFF;
+			} else if (a == AM_LFN) {	/* An LFN entry */
+				if (c & LLEF) {
+					sum = dp->dir[LDIR_Chksum];
+					c &= (BYTE)~LLEF; ord = c;
+					blk_ofs = dp->dptr;
+				}
+				ord = (c == ord && sum == dp->dir[LDIR_Chksum] && pick_lfn(lfn, dp->dir)) ? ord - 1 : 0xFF;
+			} else {					/* An SFN entry */
+				if (!dircache_insert(dc, idx, blk_ofs, dp->dir, (ord == 0 && sum == sum_sfn(dp->dir)) ? lfn : 0)) {
+					res = FR_NOT_ENOUGH_CORE; break;
+				}
+				ord = 0xFF; blk_ofs = 0xFFFFFFFF;
+			}
+		}
+		dc->n_ent = idx + 1;
+		res = dir_next(dp, 0);
+	}
+	if (res != FR_NO_FILE) {	/* Could not load the whole table */
+		dircache_drop(dc);
+		return 0;
+	}
+	if (dc->end == 0xFFFFFFFF) dc->end = dc->n_ent;
+	return dc;
+}
+
+
+static FRESULT dircache_find (	/* FR_OK(0):succeeded, !=0:error */
+	DIRCACHE* dc,		/* Cache of the directory */
+	DIR* dp				/* Directory object with the file name */
+)
+{
+	FATFS *fs = dp->obj.fs;
+	const DCITEM *it;
+	const WCHAR *lfn;
+	DWORD hash = 0;
+	UINT i, n;
+	int use_lfn = !(dp->fn[NSFLAG] & NS_NOLFN);
+	int use_sfn = !(dp->fn[NSFLAG] & NS_LOSS);
+	FRESULT res;
+
+
+	if (use_lfn) hash = dircache_hash(fs->lfnbuf);
+	for (i = 0; i < dc->n_items && dc->items[i].idx < dc->end; i++) {
+		it = &dc->items[i];
+		if (use_lfn && it->lfn && it->hash == hash) {	/* Compare the LFN */
+			for (lfn = fs->lfnbuf, n = 0; lfn[n] && (WCHAR)ff_wtoupper(lfn[n]) == it->lfn[n]; n++) ;
+			if (!lfn[n] && !it->lfn[n]) break;
+		}
+		if (use_sfn && !memcmp(it->sfn, dp->fn, 11)) break;	/* Compare the SFN */
+	}
+	if (i == dc->n_items || dc->items[i].idx >= dc->end) return FR_NO_FILE;
+
+	it = &dc->items[i];
+	res = dir_sdi(dp, it->idx * SZDIRE);
+	if (res == FR_OK) res = move_window(fs, dp->sect);
+	if (res == FR_OK) {
+		dp->obj.attr = dp->dir[DIR_Attr] & AM_MASK;
+		dp->blk_ofs = use_lfn ? it->blk_ofs : 0xFFFFFFFF;
+	}
+	return res;
+}
+
+
+#if !FF_FS_READONLY
+static FRESULT dircache_alloc (	/* FR_OK(0):succeeded, !=0:error */
+	DIRCACHE* dc,		/* Cache of the directory */
+	DIR* dp,			/* Directory object */
+	UINT n_ent			/* Number of contiguous entries to allocate */
+)
+{
+	FATFS *fs = dp->obj.fs;
+	FRESULT res;
+	DWORD i, n = 0;
+
+
+	for (i = 0; i < dc->n_ent; i++) {	/* Find the first block of free entries */
+		if (dc->state[i] <= DC_FREE) {
+			if (++n == n_ent) return dir_sdi(dp, i * SZDIRE);
+		} else {
+			n = 0;
+		}
+	}
+
+	/* Stretch the table after the free entries at its end */
+	res = dir_sdi(dp, (dc->n_ent - 1) * SZDIRE);
+	while (res == FR_OK && n < n_ent) {
+		res = dir_next(dp, 1);
+		n++;
+	}
+	if (res == FR_NO_FILE) res = FR_DENIED;	/* No directory entry to allocate */
+	if (res == FR_OK && dp->dptr / SZDIRE >= dc->n_ent) {
+		n = (DWORD)fs->csize * SS(fs) / SZDIRE;	/* Entries per cluster */
+		if (!dircache_grow(dc, (dp->dptr / SZDIRE / n + 1) * n)) res = FR_NOT_ENOUGH_CORE;
+	}
+	return res;
+}
+
+
+static int dircache_add (	/* 1:succeeded, 0:cache needs to be dropped */
+	DIRCACHE* dc,		/* Cache of the directory */
+	DIR* dp,			/* Directory object pointing the new SFN entry */
+	UINT n_ent			/* Number of entries of the new object */
+)
+{
+	DWORD idx = dp->dptr / SZDIRE, i;
+
+
+	if (idx >= dc->n_ent) return 0;
+	if (n_ent == 1 && idx > 0 && dc->state[idx - 1] == DC_LFN) return 0;	/* It would be tied to a stray LFN entry */
+	for (i = idx + 1 - n_ent; i < idx; i++) dc->state[i] = DC_LFN;
+	dc->state[idx] = DC_USED;
+	while (dc->end < dc->n_ent && dc->state[dc->end] != DC_ZERO) dc->end++;
+	return dircache_insert(dc, idx, (n_ent > 1) ? dp->dptr - (n_ent - 1) * SZDIRE : 0xFFFFFFFF,
+		dp->fn, (n_ent > 1) ? dp->obj.fs->lfnbuf : 0);
+}
+
+
+#if FF_FS_MINIMIZE == 0
+static int dircache_remove (	/* 1:succeeded, 0:cache needs to be dropped */
+	DIRCACHE* dc,		/* Cache of the directory */
+	DIR* dp				/* Directory object pointing the removed SFN entry */
+)
+{
+	DWORD idx = dp->dptr / SZDIRE, i;
+	UINT pos;
+
+
+	pos = dircache_search(dc, idx);
+	if (idx >= dc->n_ent || pos == dc->n_items || dc->items[pos].idx != idx) return 0;
+	for (i = (dp->blk_ofs == 0xFFFFFFFF) ? idx : dp->blk_ofs / SZDIRE; i <= idx; i++) dc->state[i] = DC_FREE;
+	ff_memfree(dc->items[pos].lfn);
+	memmove(dc->items + pos, dc->items + pos + 1, (dc->n_items - pos - 1) * sizeof (DCITEM));
+	dc->n_items--;
+	return 1;
+}
+#endif
+#endif	/* !FF_FS_READONLY */
+
+#endif	/* FF_USE_DIRCACHE */
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Directory handling - Find an object in the directory                  */
 /*-----------------------------------------------------------------------*/
@@ -2415,6 +2797,17 @@ static FRESULT dir_find (	/* FR_OK(0):succeeded, !=0:error */
 	}
 #endif
 	/* On the FAT/FAT32 volume */
+#if FF_USE_DIRCACHE
+	{
+		DIRCACHE *dc = dircache_get(dp);
+
+		if (dc) {	/* Look up the name in the cache if the directory could be loaded */
+			res = dircache_find(dc, dp);
+			if (res != FR_OK && res != FR_NO_FILE) dircache_drop(dc);
+			return res;
+		}
+	}
+#endif
 #if FF_USE_LFN
 	ord = sum = 0xFF; dp->blk_ofs = 0xFFFFFFFF;	/* Reset LFN sequence */
 #endif
@@ -2471,6 +2864,10 @@ static FRESULT dir_register (	/* FR_OK:succeeded, FR_DENIED:no free entry or too
 #if FF_USE_LFN		/* LFN configuration */
 	UINT n, len, n_ent;
 	BYTE sn[12], sum;
+#if FF_USE_DIRCACHE
+	DIRCACHE *dc;
+	UINT n_alloc;
+#endif
 
 
 	if (dp->fn[NSFLAG] & (NS_DOT | NS_NONAME)) return FR_INVALID_NAME;	/* Check name validity */
@@ -2523,7 +2920,13 @@ static FRESULT dir_register (	/* FR_OK:succeeded, FR_DENIED:no free entry or too
 
 	/* Create an SFN with/without LFNs. */
 	n_ent = (sn[NSFLAG] & NS_LFN) ? (len + 12) / 13 + 1 : 1;	/* Number of entries to allocate */
+#if FF_USE_DIRCACHE
+	n_alloc = n_ent;
+	dc = dircache_slot(dp);
+	res = dc ? dircache_alloc(dc, dp, n_ent) : dir_alloc(dp, n_ent);	/* Allocate entries */
+#else
 	res = dir_alloc(dp, n_ent);		/* Allocate entries */
+#endif
 	if (res == FR_OK && --n_ent) {	/* Set LFN entry if needed */
 		res = dir_sdi(dp, dp->dptr - n_ent * SZDIRE);
 		if (res == FR_OK) {
@@ -2555,6 +2958,9 @@ static FRESULT dir_register (	/* FR_OK:succeeded, FR_DENIED:no free entry or too
 			fs->wflag = 1;
 		}
 	}
+#if FF_USE_DIRCACHE
+	if (dc && (res != FR_OK || !dircache_add(dc, dp, n_alloc))) dircache_drop(dc);
+#endif
 
 	return res;
 }
@@ -2593,6 +2999,13 @@ static FRESULT dir_remove (	/* FR_OK:Succeeded, FR_DISK_ERR:A disk error */
 		} while (res == FR_OK);
 		if (res == FR_NO_FILE) res = FR_INT_ERR;
 	}
+#if FF_USE_DIRCACHE
+	{
+		DIRCACHE *dc = dircache_slot(dp);
+
+		if (dc && (res != FR_OK || !dircache_remove(dc, dp))) dircache_drop(dc);
+	}
+#endif
 #else			/* Non LFN configuration */
 
 	res = move_window(fs, dp->sect);
@@ -3680,6 +4093,9 @@ FRESULT f_mount (
 		ff_mutex_delete(vol);
 #endif
 		cfs->fs_type = 0;		/* Invalidate the filesystem object to be unregistered */
+#if FF_USE_DIRCACHE
+		dircache_purge(cfs, 0xFFFFFFFF);
+#endif
 	}
 
 	if (fs) {					/* Register new filesystem object */
@@ -5035,6 +5451,9 @@ FRESULT f_unlink (
 					res = remove_chain(&obj, dclst, 0);
 #else
 					res = remove_chain(&dj.obj, dclst, 0);
+#endif
+#if FF_USE_DIRCACHE
+					dircache_purge(fs, dclst);	/* Forget the removed sub-directory */
 #endif
 				}
 				if (res == FR_OK) res = sync_fs(fs);
@@ -5548,6 +5967,9 @@ FRESULT f_setlabel (
 			}
 		}
 	}
+#if FF_USE_DIRCACHE
+	dircache_purge(fs, 0);	/* The root directory has been modified behind the cache */
+#endif
 
 	LEAVE_FF(fs, res);
 }
@@ -5907,6 +6329,9 @@ FRESULT f_mkfs (
 	vol = get_ldnumber(&path);					/* Get target logical drive */
 	if (vol < 0) return FR_INVALID_DRIVE;
 	if (FatFs[vol]) FatFs[vol]->fs_type = 0;	/* Clear the fs object if mounted */
+#if FF_USE_DIRCACHE
+	if (FatFs[vol]) dircache_purge(FatFs[vol], 0xFFFFFFFF);
+#endif
 	pdrv = LD2PD(vol);		/* Hosting physical drive */
 	ipart = LD2PT(vol);		/* Hosting partition (0:create as new, 1..:existing partition) */
 
@@ -34,14 +34,21 @@
 /* This option switches f_mkfs() function. (0:Disable or 1:Enable) */
 
 
-#define FF_USE_FASTSEEK	0
+#define FF_USE_FASTSEEK	1
 /* This option switches fast seek function. (0:Disable or 1:Enable) */
 
 
-#define FF_USE_EXPAND	0
+#define FF_USE_EXPAND	1
 /* This option switches f_expand function. (0:Disable or 1:Enable) */
 
 
+#define FF_USE_DIRCACHE	1
+/* This option switches the directory cache. It keeps the names and free entries of
+/  recently used directories in memory so that opening and creating files does not
+/  rescan the directory table each time. It requires LFN and allocates memory with
+/  ff_memalloc(). Call ff_dircache_clear() to release it. (0:Disable or 1:Enable) */
+
+
 #define FF_USE_CHMOD	1
 /* This option switches attribute manipulation functions, f_chmod() and f_utime().
 /  (0:Disable or 1:Enable) Also FF_FS_READONLY needs to be 0 to enable this option. */
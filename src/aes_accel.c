@@ -0,0 +1,334 @@
+/*
+ * Copyright 2026 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "aes_accel.h"
+
+#include <string.h>
+
+// Round keys are loaded directly from memory in FIPS-197 byte order, so
+// only build for little endian targets where that matches mbedtls.
+#if defined(__GNUC__) && defined(__x86_64__)
+#define AES_ACCEL_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) && defined(__aarch64__) && !defined(__ARM_BIG_ENDIAN)
+#define AES_ACCEL_ARM 1
+#include <arm_neon.h>
+#if defined(__linux__)
+#include <sys/auxv.h>
+#ifndef HWCAP_AES
+#define HWCAP_AES (1 << 3)
+#endif
+#endif
+#endif
+
+// Helpers for unrolling the interleaved blocks
+#define REPEAT2(S) S(0) S(1)
+#define REPEAT8(S) S(0) S(1) S(2) S(3) S(4) S(5) S(6) S(7)
+
+#if AES_ACCEL_X86
+// AES-NI: 8 blocks are in flight at a time to cover the latency of aesenc.
+
+#define AESNI_LOAD(i) __m128i b##i = _mm_xor_si128(_mm_loadu_si128((const __m128i *) &input[16 * i]), k[0]);
+#define AESNI_ENC(i) b##i = _mm_aesenc_si128(b##i, k[r]);
+#define AESNI_ENCLAST(i) _mm_storeu_si128((__m128i *) &output[16 * i], _mm_aesenclast_si128(b##i, k[rounds]));
+#define AESNI_DEC(i) b##i = _mm_aesdec_si128(b##i, k[r]);
+#define AESNI_DECLAST(i) _mm_storeu_si128((__m128i *) &output[16 * i], _mm_aesdeclast_si128(b##i, k[rounds]));
+
+__attribute__((target("sse2,aes")))
+static void aesni_encrypt(const uint8_t *round_keys, int rounds, const uint8_t *input, uint8_t *output, size_t blocks)
+{
+    __m128i k[AES_ACCEL_MAX_ROUNDS + 1];
+    for (int r = 0; r <= rounds; r++)
+        k[r] = _mm_loadu_si128((const __m128i *) &round_keys[16 * r]);
+
+    for (; blocks >= 8; blocks -= 8, input += 128, output += 128) {
+        REPEAT8(AESNI_LOAD)
+        for (int r = 1; r < rounds; r++) {
+            REPEAT8(AESNI_ENC)
+        }
+        REPEAT8(AESNI_ENCLAST)
+    }
+    for (; blocks > 0; blocks--, input += 16, output += 16) {
+        AESNI_LOAD(0)
+        for (int r = 1; r < rounds; r++) {
+            AESNI_ENC(0)
+        }
+        AESNI_ENCLAST(0)
+    }
+}
+
+__attribute__((target("sse2,aes")))
+static void aesni_decrypt(const uint8_t *round_keys, int rounds, const uint8_t *input, uint8_t *output, size_t blocks)
+{
+    __m128i k[AES_ACCEL_MAX_ROUNDS + 1];
+    for (int r = 0; r <= rounds; r++)
+        k[r] = _mm_loadu_si128((const __m128i *) &round_keys[16 * r]);
+
+    for (; blocks >= 8; blocks -= 8, input += 128, output += 128) {
+        REPEAT8(AESNI_LOAD)
+        for (int r = 1; r < rounds; r++) {
+            REPEAT8(AESNI_DEC)
+        }
+        REPEAT8(AESNI_DECLAST)
+    }
+    for (; blocks > 0; blocks--, input += 16, output += 16) {
+        AESNI_LOAD(0)
+        for (int r = 1; r < rounds; r++) {
+            AESNI_DEC(0)
+        }
+        AESNI_DECLAST(0)
+    }
+}
+
+static bool has_aesni(void)
+{
+    return __builtin_cpu_supports("aes");
+}
+
+// VAES: Each 256-bit register holds 2 blocks and 8 registers are in flight
+// at a time. Leftover blocks go through the 128-bit AES-NI instructions.
+
+#define VAES_LOAD(i) __m256i v##i = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) &input[32 * i]), k[0]);
+#define VAES_ENC(i) v##i = _mm256_aesenc_epi128(v##i, k[r]);
+#define VAES_ENCLAST(i) _mm256_storeu_si256((__m256i *) &output[32 * i], _mm256_aesenclast_epi128(v##i, k[rounds]));
+#define VAES_DEC(i) v##i = _mm256_aesdec_epi128(v##i, k[r]);
+#define VAES_DECLAST(i) _mm256_storeu_si256((__m256i *) &output[32 * i], _mm256_aesdeclast_epi128(v##i, k[rounds]));
+
+__attribute__((target("avx2,vaes,aes")))
+static void vaes_encrypt(const uint8_t *round_keys, int rounds, const uint8_t *input, uint8_t *output, size_t blocks)
+{
+    __m256i k[AES_ACCEL_MAX_ROUNDS + 1];
+    for (int r = 0; r <= rounds; r++)
+        k[r] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) &round_keys[16 * r]));
+
+    for (; blocks >= 16; blocks -= 16, input += 256, output += 256) {
+        REPEAT8(VAES_LOAD)
+        for (int r = 1; r < rounds; r++) {
+            REPEAT8(VAES_ENC)
+        }
+        REPEAT8(VAES_ENCLAST)
+    }
+    for (; blocks >= 4; blocks -= 4, input += 64, output += 64) {
+        REPEAT2(VAES_LOAD)
+        for (int r = 1; r < rounds; r++) {
+            REPEAT2(VAES_ENC)
+        }
+        REPEAT2(VAES_ENCLAST)
+    }
+    if (blocks > 0)
+        aesni_encrypt(round_keys, rounds, input, output, blocks);
+}
+
+__attribute__((target("avx2,vaes,aes")))
+static void vaes_decrypt(const uint8_t *round_keys, int rounds, const uint8_t *input, uint8_t *output, size_t blocks)
+{
+    __m256i k[AES_ACCEL_MAX_ROUNDS + 1];
+    for (int r = 0; r <= rounds; r++)
+        k[r] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) &round_keys[16 * r]));
+
+    for (; blocks >= 16; blocks -= 16, input += 256, output += 256) {
+        REPEAT8(VAES_LOAD)
+        for (int r = 1; r < rounds; r++) {
+            REPEAT8(VAES_DEC)
+        }
+        REPEAT8(VAES_DECLAST)
+    }
+    for (; blocks >= 4; blocks -= 4, input += 64, output += 64) {
+        REPEAT2(VAES_LOAD)
+        for (int r = 1; r < rounds; r++) {
+            REPEAT2(VAES_DEC)
+        }
+        REPEAT2(VAES_DECLAST)
+    }
+    if (blocks > 0)
+        aesni_decrypt(round_keys, rounds, input, output, blocks);
+}
+
+static bool has_vaes(void)
+{
+    return __builtin_cpu_supports("aes") &&
+           __builtin_cpu_supports("avx2") &&
+           __builtin_cpu_supports("vaes");
+}
+#endif // AES_ACCEL_X86
+
+#if AES_ACCEL_ARM
+// ARMv8 Crypto Extensions: aese/aesd include the AddRoundKey step, so the
+// final round key is applied with an xor. 8 blocks are in flight at a time.
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("aes"))), apply_to=function)
+#else
+#pragma GCC push_options
+#pragma GCC target ("+crypto")
+#endif
+
+#define ARMV8_LOAD(i) uint8x16_t b##i = vld1q_u8(&input[16 * i]);
+#define ARMV8_ENC(i) b##i = vaesmcq_u8(vaeseq_u8(b##i, k[r]));
+#define ARMV8_ENCLAST(i) vst1q_u8(&output[16 * i], veorq_u8(vaeseq_u8(b##i, k[rounds - 1]), k[rounds]));
+#define ARMV8_DEC(i) b##i = vaesimcq_u8(vaesdq_u8(b##i, k[r]));
+#define ARMV8_DECLAST(i) vst1q_u8(&output[16 * i], veorq_u8(vaesdq_u8(b##i, k[rounds - 1]), k[rounds]));
+
+static void armv8_encrypt(const uint8_t *round_keys, int rounds, const uint8_t *input, uint8_t *output, size_t blocks)
+{
+    uint8x16_t k[AES_ACCEL_MAX_ROUNDS + 1];
+    for (int r = 0; r <= rounds; r++)
+        k[r] = vld1q_u8(&round_keys[16 * r]);
+
+    for (; blocks >= 8; blocks -= 8, input += 128, output += 128) {
+        REPEAT8(ARMV8_LOAD)
+        for (int r = 0; r < rounds - 1; r++) {
+            REPEAT8(ARMV8_ENC)
+        }
+        REPEAT8(ARMV8_ENCLAST)
+    }
+    for (; blocks > 0; blocks--, input += 16, output += 16) {
+        ARMV8_LOAD(0)
+        for (int r = 0; r < rounds - 1; r++) {
+            ARMV8_ENC(0)
+        }
+        ARMV8_ENCLAST(0)
+    }
+}
+
+static void armv8_decrypt(const uint8_t *round_keys, int rounds, const uint8_t *input, uint8_t *output, size_t blocks)
+{
+    uint8x16_t k[AES_ACCEL_MAX_ROUNDS + 1];
+    for (int r = 0; r <= rounds; r++)
+        k[r] = vld1q_u8(&round_keys[16 * r]);
+
+    for (; blocks >= 8; blocks -= 8, input += 128, output += 128) {
+        REPEAT8(ARMV8_LOAD)
+        for (int r = 0; r < rounds - 1; r++) {
+            REPEAT8(ARMV8_DEC)
+        }
+        REPEAT8(ARMV8_DECLAST)
+    }
+    for (; blocks > 0; blocks--, input += 16, output += 16) {
+        ARMV8_LOAD(0)
+        for (int r = 0; r < rounds - 1; r++) {
+            ARMV8_DEC(0)
+        }
+        ARMV8_DECLAST(0)
+    }
+}
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+
+static bool has_armv8_crypto(void)
+{
+#if defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_AES) || defined(__APPLE__)
+    return true;
+#elif defined(__linux__)
+    return (getauxval(AT_HWCAP) & HWCAP_AES) != 0;
+#else
+    return false;
+#endif
+}
+#endif // AES_ACCEL_ARM
+
+static bool has_mbedtls(void)
+{
+    return true;
+}
+
+// Ordered from fastest to slowest
+static const struct aes_accel implementations[] = {
+#if AES_ACCEL_X86
+    { "vaes", vaes_encrypt, vaes_decrypt, has_vaes },
+    { "aes-ni", aesni_encrypt, aesni_decrypt, has_aesni },
+#endif
+#if AES_ACCEL_ARM
+    { "armv8-ce", armv8_encrypt, armv8_decrypt, has_armv8_crypto },
+#endif
+    { "mbedtls", NULL, NULL, has_mbedtls }
+};
+#define NUM_IMPLEMENTATIONS (sizeof(implementations) / sizeof(implementations[0]))
+
+// Set by aes_accel_select() to override automatic selection
+static const struct aes_accel *forced_implementation = NULL;
+
+/**
+ * @brief Return the implementation to use
+ *
+ * The "mbedtls" implementation has NULL function pointers. Callers should
+ * use mbedtls's one block at a time functions for it.
+ */
+const struct aes_accel *aes_accel_current(void)
+{
+    if (forced_implementation)
+        return forced_implementation;
+
+    for (size_t i = 0; i < NUM_IMPLEMENTATIONS; i++) {
+        if (implementations[i].supported())
+            return &implementations[i];
+    }
+    return &implementations[NUM_IMPLEMENTATIONS - 1];
+}
+
+/**
+ * @brief Return the name of a compiled-in implementation
+ *
+ * @param index 0 to N-1
+ * @return the name or NULL if index is past the end
+ */
+const char *aes_accel_implementation(int index)
+{
+    if (index < 0 || index >= (int) NUM_IMPLEMENTATIONS)
+        return NULL;
+    return implementations[index].name;
+}
+
+/**
+ * @brief Return the name of the implementation that will be used
+ */
+const char *aes_accel_selected(void)
+{
+    return aes_accel_current()->name;
+}
+
+/**
+ * @brief Force a specific implementation
+ *
+ * This is intended for benchmarking and testing. It only affects
+ * disk_crypto sessions that are initialized afterwards.
+ *
+ * @param name the implementation's name or NULL to select automatically
+ * @return 0 on success, -1 if unknown or not supported by this CPU
+ */
+int aes_accel_select(const char *name)
+{
+    if (!name) {
+        forced_implementation = NULL;
+        return 0;
+    }
+
+    for (size_t i = 0; i < NUM_IMPLEMENTATIONS; i++) {
+        if (strcmp(implementations[i].name, name) == 0) {
+            if (!implementations[i].supported())
+                return -1;
+
+            forced_implementation = &implementations[i];
+            return 0;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright 2026 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AES_ACCEL_H
+#define AES_ACCEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Multi-block AES using CPU instructions (AES-NI, VAES and the ARMv8 Crypto
+// Extensions). Independent blocks are interleaved so that the AES units stay
+// busy. The fastest implementation that the CPU supports is picked at
+// runtime. When none are available, callers fall back to mbedtls.
+//
+// Round keys are passed in the same layout that mbedtls uses on little
+// endian CPUs: rounds + 1 16-byte keys in FIPS-197 byte order. Decryption
+// keys are for the Equivalent Inverse Cipher.
+
+#define AES_ACCEL_MAX_ROUNDS 14
+
+typedef void (*aes_accel_fn)(const uint8_t *round_keys, int rounds, const uint8_t *input, uint8_t *output, size_t blocks);
+
+struct aes_accel {
+    const char *name;
+
+    // NULL when using mbedtls
+    aes_accel_fn encrypt;
+    aes_accel_fn decrypt;
+
+    bool (*supported)(void);
+};
+
+const struct aes_accel *aes_accel_current(void);
+
+const char *aes_accel_implementation(int index);
+const char *aes_accel_selected(void);
+int aes_accel_select(const char *name);
+
+#endif // AES_ACCEL_H
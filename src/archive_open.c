@@ -34,6 +34,7 @@ struct fwup_archive_data {
     bool is_stdin;
     bool is_eof;
     int fd;
+    off_t range_remaining;
     struct fwup_progress *progress;
 
     char name[PATH_MAX];
@@ -132,6 +133,35 @@ static ssize_t framed_stdin_read(struct archive *a, void *client_data, const voi
     }
 }
 
+static ssize_t range_read(struct archive *a, void *client_data, const void **buff)
+{
+    struct fwup_archive_data *ad = (struct fwup_archive_data *) client_data;
+
+    *buff = ad->buffer;
+    size_t amount_to_read = sizeof(ad->buffer);
+    if ((off_t) amount_to_read > ad->range_remaining)
+        amount_to_read = ad->range_remaining;
+    if (amount_to_read == 0)
+        return 0;
+
+    for (;;) {
+        ssize_t bytes_read = read(ad->fd, ad->buffer, amount_to_read);
+        if (bytes_read < 0) {
+            if (errno == EINTR)
+                continue;
+
+            archive_set_error(a, errno, "Error reading '%s'", ad->name);
+            return -1;
+        }
+
+        ad->range_remaining -= bytes_read;
+        if (ad->progress)
+            ad->progress->input_bytes += bytes_read;
+
+        return bytes_read;
+    }
+}
+
 /**
  * @brief Open the specified file for use with libarchive.
  *
@@ -189,6 +219,56 @@ int fwup_archive_open_filename(struct archive *a, const char *filename, struct f
     return archive_read_open1(a);
 }
 
+/**
+ * @brief Open part of a file for use with libarchive.
+ *
+ * This is used to read one ZIP entry at a time when the location of each
+ * one is known from the central directory. Nothing outside of the range is
+ * read.
+ *
+ * @param a a libarchive handle
+ * @param filename the file to open
+ * @param offset where the range starts
+ * @param length the number of bytes in the range
+ * @param progress input progress is reported if non-NULL
+ * @return a libarchive error code (e.g., ARCHIVE_OK or ARCHIVE_FATAL)
+ */
+int fwup_archive_open_range(struct archive *a, const char *filename, off_t offset, off_t length, struct fwup_progress *progress)
+{
+    struct fwup_archive_data *ad = (struct fwup_archive_data *) calloc(1, sizeof(struct fwup_archive_data));
+    if (ad == NULL) {
+        archive_set_error(a, ENOMEM, "No memory");
+        return ARCHIVE_FATAL;
+    }
+
+    strncpy(ad->name, filename, sizeof(ad->name) - 1);
+    ad->progress = progress;
+    ad->range_remaining = length;
+
+    ad->fd = open(ad->name, O_RDONLY | O_WIN32_BINARY);
+    if (ad->fd < 0) {
+        archive_set_error(a, errno, "Failed to open '%s'", ad->name);
+        free(ad);
+        return ARCHIVE_FATAL;
+    }
+#ifdef HAVE_FCNTL
+    (void) fcntl(ad->fd, F_SETFD, FD_CLOEXEC);
+#endif
+
+    if (lseek(ad->fd, offset, SEEK_SET) != offset) {
+        archive_set_error(a, errno, "Failed to seek in '%s'", ad->name);
+        close(ad->fd);
+        free(ad);
+        return ARCHIVE_FATAL;
+    }
+
+    archive_read_set_callback_data(a, ad);
+    archive_read_set_close_callback(a, normal_close);
+    archive_read_set_read_callback(a, range_read);
+
+    return archive_read_open1(a);
+}
+
 int fwup_archive_read_data_block(struct archive *a, const void **buff, size_t *s, int64_t *o)
 {
     // Handle case where archive_read_data_block returns a 0 byte read
@@ -19,11 +19,13 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 struct fwup_progress;
 struct archive;
 
 int fwup_archive_open_filename(struct archive *a, const char *filename, struct fwup_progress *progress);
+int fwup_archive_open_range(struct archive *a, const char *filename, off_t offset, off_t length, struct fwup_progress *progress);
 int fwup_archive_read_data_block(struct archive *a, const void **buff, size_t *s, int64_t *o);
 
 #endif // ARCHIVE_OPEN_H
@@ -0,0 +1,517 @@
+/*
+ * Copyright 2026 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "blake2b_simd.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+// The vectorized implementations load message words directly from memory
+// so they're only built for little endian targets.
+#if defined(__GNUC__) && defined(__x86_64__)
+#define BLAKE2B_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) && !defined(__ARM_BIG_ENDIAN)
+#define BLAKE2B_NEON 1
+#include <arm_neon.h>
+#endif
+
+#if BLAKE2B_X86 || BLAKE2B_NEON
+static const uint64_t blake2b_iv[8] = {
+    0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
+    0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+    0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+    0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+static const uint8_t blake2b_sigma[12][16] = {
+    {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+    { 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+    { 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 },
+    {  7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8 },
+    {  9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13 },
+    {  2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9 },
+    { 12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11 },
+    { 13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10 },
+    {  6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5 },
+    { 10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0 },
+    {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+    { 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 }
+};
+#endif
+
+#if BLAKE2B_X86
+// SSE4.1: The 4x4 state is held in pairs of 128-bit registers with each
+// register holding half of a row.
+#define SSE_ROTR32(x) _mm_shuffle_epi32((x), _MM_SHUFFLE(2, 3, 0, 1))
+#define SSE_ROTR24(x) _mm_shuffle_epi8((x), r24)
+#define SSE_ROTR16(x) _mm_shuffle_epi8((x), r16)
+#define SSE_ROTR63(x) _mm_xor_si128(_mm_srli_epi64((x), 63), _mm_add_epi64((x), (x)))
+#define SSE_LOAD(a, b) sse_load_msg(m, a, b)
+
+// Pair up message words m[a] and m[b] from the message held as 8 registers.
+// The indices are constants once the rounds are unrolled, so this is one
+// instruction instead of loading each word separately.
+__attribute__((target("sse4.1"), always_inline))
+static inline __m128i sse_load_msg(const __m128i m[8], int a, int b)
+{
+    __m128i x = m[a / 2];
+    __m128i y = m[b / 2];
+    if (a / 2 == b / 2)
+        return (a & 1) ? _mm_shuffle_epi32(x, _MM_SHUFFLE(1, 0, 3, 2)) : x;
+    else if (!(a & 1) && !(b & 1))
+        return _mm_unpacklo_epi64(x, y);
+    else if ((a & 1) && (b & 1))
+        return _mm_unpackhi_epi64(x, y);
+    else if (!(a & 1))
+        return _mm_blend_epi16(x, y, 0xf0);
+    else
+        return _mm_alignr_epi8(y, x, 8);
+}
+
+#define SSE_G(b0, b1, rot_d, rot_b) \
+    row1l = _mm_add_epi64(_mm_add_epi64(row1l, b0), row2l); \
+    row1h = _mm_add_epi64(_mm_add_epi64(row1h, b1), row2h); \
+    row4l = rot_d(_mm_xor_si128(row4l, row1l)); \
+    row4h = rot_d(_mm_xor_si128(row4h, row1h)); \
+    row3l = _mm_add_epi64(row3l, row4l); \
+    row3h = _mm_add_epi64(row3h, row4h); \
+    row2l = rot_b(_mm_xor_si128(row2l, row3l)); \
+    row2h = rot_b(_mm_xor_si128(row2h, row3h));
+
+// Row 2 is the last one that G computes, so it's left in place and rows 1,
+// 3 and 4 are moved instead. Rows 1 and 3 can then be moved while row 2 is
+// still being computed. This shifts the columns by one, so the message
+// words for the diagonal steps are rotated to match.
+#define SSE_DIAGONALIZE() do { \
+    __m128i t0 = _mm_alignr_epi8(row1l, row1h, 8); \
+    __m128i t1 = _mm_alignr_epi8(row1h, row1l, 8); \
+    row1l = t0; row1h = t1; \
+    t0 = _mm_alignr_epi8(row3h, row3l, 8); \
+    t1 = _mm_alignr_epi8(row3l, row3h, 8); \
+    row3l = t0; row3h = t1; \
+    t0 = row4l; row4l = row4h; row4h = t0; \
+} while (0)
+
+#define SSE_UNDIAGONALIZE() do { \
+    __m128i t0 = _mm_alignr_epi8(row1h, row1l, 8); \
+    __m128i t1 = _mm_alignr_epi8(row1l, row1h, 8); \
+    row1l = t0; row1h = t1; \
+    t0 = _mm_alignr_epi8(row3l, row3h, 8); \
+    t1 = _mm_alignr_epi8(row3h, row3l, 8); \
+    row3l = t0; row3h = t1; \
+    t0 = row4l; row4l = row4h; row4h = t0; \
+} while (0)
+
+#define SSE_ROUND(r) do { \
+    const uint8_t *s = blake2b_sigma[r]; \
+    __m128i b0, b1; \
+    b0 = SSE_LOAD(s[0], s[2]); \
+    b1 = SSE_LOAD(s[4], s[6]); \
+    SSE_G(b0, b1, SSE_ROTR32, SSE_ROTR24); \
+    b0 = SSE_LOAD(s[1], s[3]); \
+    b1 = SSE_LOAD(s[5], s[7]); \
+    SSE_G(b0, b1, SSE_ROTR16, SSE_ROTR63); \
+    SSE_DIAGONALIZE(); \
+    b0 = SSE_LOAD(s[14], s[8]); \
+    b1 = SSE_LOAD(s[10], s[12]); \
+    SSE_G(b0, b1, SSE_ROTR32, SSE_ROTR24); \
+    b0 = SSE_LOAD(s[15], s[9]); \
+    b1 = SSE_LOAD(s[11], s[13]); \
+    SSE_G(b0, b1, SSE_ROTR16, SSE_ROTR63); \
+    SSE_UNDIAGONALIZE(); \
+} while (0)
+
+__attribute__((target("sse4.1")))
+static void compress_sse41(uint64_t hash[8], const uint8_t block[128], uint64_t t0, uint64_t t1, uint64_t last)
+{
+    const __m128i r16 = _mm_setr_epi8(2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9);
+    const __m128i r24 = _mm_setr_epi8(3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10);
+
+    __m128i m[8];
+    for (int i = 0; i < 8; i++)
+        m[i] = _mm_loadu_si128((const __m128i *) &block[i * 16]);
+
+    __m128i row1l = _mm_loadu_si128((const __m128i *) &hash[0]);
+    __m128i row1h = _mm_loadu_si128((const __m128i *) &hash[2]);
+    __m128i row2l = _mm_loadu_si128((const __m128i *) &hash[4]);
+    __m128i row2h = _mm_loadu_si128((const __m128i *) &hash[6]);
+    __m128i row3l = _mm_loadu_si128((const __m128i *) &blake2b_iv[0]);
+    __m128i row3h = _mm_loadu_si128((const __m128i *) &blake2b_iv[2]);
+    __m128i row4l = _mm_xor_si128(_mm_loadu_si128((const __m128i *) &blake2b_iv[4]), _mm_set_epi64x((long long) t1, (long long) t0));
+    __m128i row4h = _mm_xor_si128(_mm_loadu_si128((const __m128i *) &blake2b_iv[6]), _mm_set_epi64x(0, (long long) last));
+
+    // Unrolled so that the message schedule is known at compile time
+    SSE_ROUND(0); SSE_ROUND(1); SSE_ROUND(2); SSE_ROUND(3);
+    SSE_ROUND(4); SSE_ROUND(5); SSE_ROUND(6); SSE_ROUND(7);
+    SSE_ROUND(8); SSE_ROUND(9); SSE_ROUND(10); SSE_ROUND(11);
+
+
+    row1l = _mm_xor_si128(row1l, row3l);
+    row1h = _mm_xor_si128(row1h, row3h);
+    row2l = _mm_xor_si128(row2l, row4l);
+    row2h = _mm_xor_si128(row2h, row4h);
+    _mm_storeu_si128((__m128i *) &hash[0], _mm_xor_si128(_mm_loadu_si128((const __m128i *) &hash[0]), row1l));
+    _mm_storeu_si128((__m128i *) &hash[2], _mm_xor_si128(_mm_loadu_si128((const __m128i *) &hash[2]), row1h));
+    _mm_storeu_si128((__m128i *) &hash[4], _mm_xor_si128(_mm_loadu_si128((const __m128i *) &hash[4]), row2l));
+    _mm_storeu_si128((__m128i *) &hash[6], _mm_xor_si128(_mm_loadu_si128((const __m128i *) &hash[6]), row2h));
+}
+
+// AVX2: Each row of the 4x4 state fits in one 256-bit register. Like with
+// SSE4.1, rows a, c and d are moved for the diagonal steps rather than b.
+#define AVX_ROTR32(x) _mm256_shuffle_epi32((x), _MM_SHUFFLE(2, 3, 0, 1))
+#define AVX_ROTR24(x) _mm256_shuffle_epi8((x), r24)
+#define AVX_ROTR16(x) _mm256_shuffle_epi8((x), r16)
+#define AVX_ROTR63(x) _mm256_xor_si256(_mm256_srli_epi64((x), 63), _mm256_add_epi64((x), (x)))
+#define AVX_LOAD(a, b, c, d) _mm256_inserti128_si256(_mm256_castsi128_si256(sse_load_msg(m, a, b)), sse_load_msg(m, c, d), 1)
+
+#define AVX_G(msg, rot_d, rot_b) \
+    a = _mm256_add_epi64(_mm256_add_epi64(a, msg), b); \
+    d = rot_d(_mm256_xor_si256(d, a)); \
+    c = _mm256_add_epi64(c, d); \
+    b = rot_b(_mm256_xor_si256(b, c));
+
+#define AVX_ROUND(r) do { \
+    const uint8_t *s = blake2b_sigma[r]; \
+    AVX_G(AVX_LOAD(s[0], s[2], s[4], s[6]), AVX_ROTR32, AVX_ROTR24); \
+    AVX_G(AVX_LOAD(s[1], s[3], s[5], s[7]), AVX_ROTR16, AVX_ROTR63); \
+    a = _mm256_permute4x64_epi64(a, _MM_SHUFFLE(2, 1, 0, 3)); \
+    c = _mm256_permute4x64_epi64(c, _MM_SHUFFLE(0, 3, 2, 1)); \
+    d = _mm256_permute4x64_epi64(d, _MM_SHUFFLE(1, 0, 3, 2)); \
+    AVX_G(AVX_LOAD(s[14], s[8], s[10], s[12]), AVX_ROTR32, AVX_ROTR24); \
+    AVX_G(AVX_LOAD(s[15], s[9], s[11], s[13]), AVX_ROTR16, AVX_ROTR63); \
+    a = _mm256_permute4x64_epi64(a, _MM_SHUFFLE(0, 3, 2, 1)); \
+    c = _mm256_permute4x64_epi64(c, _MM_SHUFFLE(2, 1, 0, 3)); \
+    d = _mm256_permute4x64_epi64(d, _MM_SHUFFLE(1, 0, 3, 2)); \
+} while (0)
+
+__attribute__((target("avx2")))
+static void compress_avx2(uint64_t hash[8], const uint8_t block[128], uint64_t t0, uint64_t t1, uint64_t last)
+{
+    const __m256i r16 = _mm256_setr_epi8(2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9,
+                                         2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9);
+    const __m256i r24 = _mm256_setr_epi8(3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10,
+                                         3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10);
+
+    __m128i m[8];
+    for (int i = 0; i < 8; i++)
+        m[i] = _mm_loadu_si128((const __m128i *) &block[i * 16]);
+
+    const __m256i h0 = _mm256_loadu_si256((const __m256i *) &hash[0]);
+    const __m256i h1 = _mm256_loadu_si256((const __m256i *) &hash[4]);
+    __m256i a = h0;
+    __m256i b = h1;
+    __m256i c = _mm256_loadu_si256((const __m256i *) &blake2b_iv[0]);
+    __m256i d = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) &blake2b_iv[4]),
+                                 _mm256_set_epi64x(0, (long long) last, (long long) t1, (long long) t0));
+
+    AVX_ROUND(0); AVX_ROUND(1); AVX_ROUND(2); AVX_ROUND(3);
+    AVX_ROUND(4); AVX_ROUND(5); AVX_ROUND(6); AVX_ROUND(7);
+    AVX_ROUND(8); AVX_ROUND(9); AVX_ROUND(10); AVX_ROUND(11);
+
+
+    _mm256_storeu_si256((__m256i *) &hash[0], _mm256_xor_si256(h0, _mm256_xor_si256(a, c)));
+    _mm256_storeu_si256((__m256i *) &hash[4], _mm256_xor_si256(h1, _mm256_xor_si256(b, d)));
+}
+
+static bool has_sse41(void)
+{
+    return __builtin_cpu_supports("sse4.1");
+}
+
+static bool has_avx2(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+#endif // BLAKE2B_X86
+
+#if BLAKE2B_NEON
+// NEON: Same layout as SSE4.1 with each row split across two registers.
+#define NEON_ROTR32(x) vreinterpretq_u64_u32(vrev64q_u32(vreinterpretq_u32_u64(x)))
+#define NEON_ROTR(x, n) vorrq_u64(vshrq_n_u64((x), (n)), vshlq_n_u64((x), 64 - (n)))
+#define NEON_ROTR24(x) NEON_ROTR(x, 24)
+#define NEON_ROTR16(x) NEON_ROTR(x, 16)
+#define NEON_ROTR63(x) NEON_ROTR(x, 63)
+#define NEON_LOAD(a, b) vcombine_u64(vcreate_u64(m[a]), vcreate_u64(m[b]))
+
+#define NEON_G(b0, b1, rot_d, rot_b) \
+    row1l = vaddq_u64(vaddq_u64(row1l, b0), row2l); \
+    row1h = vaddq_u64(vaddq_u64(row1h, b1), row2h); \
+    row4l = rot_d(veorq_u64(row4l, row1l)); \
+    row4h = rot_d(veorq_u64(row4h, row1h)); \
+    row3l = vaddq_u64(row3l, row4l); \
+    row3h = vaddq_u64(row3h, row4h); \
+    row2l = rot_b(veorq_u64(row2l, row3l)); \
+    row2h = rot_b(veorq_u64(row2h, row3h));
+
+// vextq_u64(lo, hi, 1) is the same as _mm_alignr_epi8(hi, lo, 8). Rows 1, 3
+// and 4 are moved like in SSE_DIAGONALIZE().
+#define NEON_DIAGONALIZE() do { \
+    uint64x2_t t0 = vextq_u64(row1h, row1l, 1); \
+    uint64x2_t t1 = vextq_u64(row1l, row1h, 1); \
+    row1l = t0; row1h = t1; \
+    t0 = vextq_u64(row3l, row3h, 1); \
+    t1 = vextq_u64(row3h, row3l, 1); \
+    row3l = t0; row3h = t1; \
+    t0 = row4l; row4l = row4h; row4h = t0; \
+} while (0)
+
+#define NEON_UNDIAGONALIZE() do { \
+    uint64x2_t t0 = vextq_u64(row1l, row1h, 1); \
+    uint64x2_t t1 = vextq_u64(row1h, row1l, 1); \
+    row1l = t0; row1h = t1; \
+    t0 = vextq_u64(row3h, row3l, 1); \
+    t1 = vextq_u64(row3l, row3h, 1); \
+    row3l = t0; row3h = t1; \
+    t0 = row4l; row4l = row4h; row4h = t0; \
+} while (0)
+
+static void compress_neon(uint64_t hash[8], const uint8_t block[128], uint64_t t0, uint64_t t1, uint64_t last)
+{
+    uint64_t m[16];
+    memcpy(m, block, sizeof(m));
+
+    const uint64_t counter[4] = { t0, t1, last, 0 };
+
+    uint64x2_t row1l = vld1q_u64(&hash[0]);
+    uint64x2_t row1h = vld1q_u64(&hash[2]);
+    uint64x2_t row2l = vld1q_u64(&hash[4]);
+    uint64x2_t row2h = vld1q_u64(&hash[6]);
+    uint64x2_t row3l = vld1q_u64(&blake2b_iv[0]);
+    uint64x2_t row3h = vld1q_u64(&blake2b_iv[2]);
+    uint64x2_t row4l = veorq_u64(vld1q_u64(&blake2b_iv[4]), vld1q_u64(&counter[0]));
+    uint64x2_t row4h = veorq_u64(vld1q_u64(&blake2b_iv[6]), vld1q_u64(&counter[2]));
+
+    for (int r = 0; r < 12; r++) {
+        const uint8_t *s = blake2b_sigma[r];
+        uint64x2_t b0, b1;
+
+        b0 = NEON_LOAD(s[0], s[2]);
+        b1 = NEON_LOAD(s[4], s[6]);
+        NEON_G(b0, b1, NEON_ROTR32, NEON_ROTR24);
+        b0 = NEON_LOAD(s[1], s[3]);
+        b1 = NEON_LOAD(s[5], s[7]);
+        NEON_G(b0, b1, NEON_ROTR16, NEON_ROTR63);
+        NEON_DIAGONALIZE();
+
+        b0 = NEON_LOAD(s[14], s[8]);
+        b1 = NEON_LOAD(s[10], s[12]);
+        NEON_G(b0, b1, NEON_ROTR32, NEON_ROTR24);
+        b0 = NEON_LOAD(s[15], s[9]);
+        b1 = NEON_LOAD(s[11], s[13]);
+        NEON_G(b0, b1, NEON_ROTR16, NEON_ROTR63);
+        NEON_UNDIAGONALIZE();
+    }
+
+    vst1q_u64(&hash[0], veorq_u64(vld1q_u64(&hash[0]), veorq_u64(row1l, row3l)));
+    vst1q_u64(&hash[2], veorq_u64(vld1q_u64(&hash[2]), veorq_u64(row1h, row3h)));
+    vst1q_u64(&hash[4], veorq_u64(vld1q_u64(&hash[4]), veorq_u64(row2l, row4l)));
+    vst1q_u64(&hash[6], veorq_u64(vld1q_u64(&hash[6]), veorq_u64(row2h, row4h)));
+}
+
+static bool has_neon(void)
+{
+    // NEON is a compile-time option on ARM
+    return true;
+}
+#endif // BLAKE2B_NEON
+
+static bool has_portable(void)
+{
+    return true;
+}
+
+struct blake2b_implementation {
+    const char *name;
+    blake2b_compress_fn compress;
+    bool (*supported)(void);
+
+    // Whether it can be picked without calling fwup_blake2b_select()
+    bool automatic;
+};
+
+// Ordered by preference. The portable one must be last. The NEON one is
+// only used when selected since 64-bit rotates are slow on many ARM cores
+// and Monocypher's is often faster there.
+static const struct blake2b_implementation implementations[] = {
+#if BLAKE2B_X86
+    { "avx2", compress_avx2, has_avx2, true },
+    { "sse4.1", compress_sse41, has_sse41, true },
+#endif
+#if BLAKE2B_NEON
+    { "neon", compress_neon, has_neon, false },
+#endif
+    { "portable", NULL, has_portable, true }
+};
+#define NUM_IMPLEMENTATIONS (sizeof(implementations) / sizeof(implementations[0]))
+
+// Set by fwup_blake2b_select() to override automatic selection
+static const struct blake2b_implementation *forced_implementation = NULL;
+
+static const struct blake2b_implementation *current_implementation(void)
+{
+    if (forced_implementation)
+        return forced_implementation;
+
+    // Pick the first one that the CPU supports. This only depends on the
+    // CPU, so the same one is picked every time.
+    size_t i;
+    for (i = 0; i < NUM_IMPLEMENTATIONS - 1; i++) {
+        if (implementations[i].automatic && implementations[i].supported())
+            break;
+    }
+    return &implementations[i];
+}
+
+/**
+ * @brief Return the name of a compiled-in implementation
+ *
+ * @param index 0 to N-1
+ * @return the name or NULL if index is past the end
+ */
+const char *fwup_blake2b_implementation(int index)
+{
+    if (index < 0 || index >= (int) NUM_IMPLEMENTATIONS)
+        return NULL;
+    return implementations[index].name;
+}
+
+/**
+ * @brief Return the name of the implementation that will be used
+ */
+const char *fwup_blake2b_selected(void)
+{
+    return current_implementation()->name;
+}
+
+/**
+ * @brief Force a specific implementation
+ *
+ * This is intended for benchmarking and testing. It's not thread safe, so
+ * call it before any hashing starts.
+ *
+ * @param name the implementation's name or NULL to select automatically
+ * @return 0 on success, -1 if unknown or not supported by this CPU
+ */
+int fwup_blake2b_select(const char *name)
+{
+    if (!name) {
+        forced_implementation = NULL;
+        return 0;
+    }
+
+    for (size_t i = 0; i < NUM_IMPLEMENTATIONS; i++) {
+        if (strcmp(implementations[i].name, name) == 0) {
+            if (!implementations[i].supported())
+                return -1;
+
+            forced_implementation = &implementations[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Start a BLAKE2b hash
+ *
+ * @param ctx the hash context
+ * @param hash_size the digest length in bytes (1 to 64)
+ */
+void fwup_blake2b_init(struct fwup_blake2b_ctx *ctx, size_t hash_size)
+{
+    ctx->compress = current_implementation()->compress;
+    if (!ctx->compress) {
+        crypto_blake2b_general_init(&ctx->portable, hash_size, NULL, 0);
+        return;
+    }
+
+#if BLAKE2B_X86 || BLAKE2B_NEON
+    memcpy(ctx->hash, blake2b_iv, sizeof(ctx->hash));
+    ctx->hash[0] ^= 0x01010000 ^ hash_size;
+    ctx->counter[0] = 0;
+    ctx->counter[1] = 0;
+    ctx->input_idx = 0;
+    ctx->hash_size = hash_size;
+#endif
+}
+
+static void increment_counter(struct fwup_blake2b_ctx *ctx, uint64_t amount)
+{
+    ctx->counter[0] += amount;
+    if (ctx->counter[0] < amount)
+        ctx->counter[1]++;
+}
+
+void fwup_blake2b_update(struct fwup_blake2b_ctx *ctx, const void *data, size_t len)
+{
+    if (!ctx->compress) {
+        crypto_blake2b_update(&ctx->portable, (const uint8_t *) data, len);
+        return;
+    }
+
+    // The last block is compressed differently, so always hold on to at
+    // least one byte until fwup_blake2b_final().
+    const uint8_t *p = (const uint8_t *) data;
+    while (len > 0) {
+        if (ctx->input_idx == sizeof(ctx->input)) {
+            increment_counter(ctx, sizeof(ctx->input));
+            ctx->compress(ctx->hash, ctx->input, ctx->counter[0], ctx->counter[1], 0);
+            ctx->input_idx = 0;
+        }
+
+        if (ctx->input_idx == 0) {
+            // Compress directly from the caller's buffer when possible
+            while (len > sizeof(ctx->input)) {
+                increment_counter(ctx, sizeof(ctx->input));
+                ctx->compress(ctx->hash, p, ctx->counter[0], ctx->counter[1], 0);
+                p += sizeof(ctx->input);
+                len -= sizeof(ctx->input);
+            }
+        }
+
+        size_t to_copy = sizeof(ctx->input) - ctx->input_idx;
+        if (to_copy > len)
+            to_copy = len;
+        memcpy(&ctx->input[ctx->input_idx], p, to_copy);
+        ctx->input_idx += to_copy;
+        p += to_copy;
+        len -= to_copy;
+    }
+}
+
+/**
+ * @brief Finish the hash
+ *
+ * @param ctx the hash context
+ * @param hash where to store the digest (hash_size bytes)
+ */
+void fwup_blake2b_final(struct fwup_blake2b_ctx *ctx, uint8_t *hash)
+{
+    if (!ctx->compress) {
+        crypto_blake2b_final(&ctx->portable, hash);
+        return;
+    }
+
+    increment_counter(ctx, ctx->input_idx);
+    memset(&ctx->input[ctx->input_idx], 0, sizeof(ctx->input) - ctx->input_idx);
+    ctx->compress(ctx->hash, ctx->input, ctx->counter[0], ctx->counter[1], ~(uint64_t) 0);
+
+    for (size_t i = 0; i < ctx->hash_size; i++)
+        hash[i] = (uint8_t) (ctx->hash[i / 8] >> (8 * (i % 8)));
+}
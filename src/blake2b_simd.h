@@ -0,0 +1,52 @@
+/*
+ * Copyright 2026 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BLAKE2B_SIMD_H
+#define BLAKE2B_SIMD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "monocypher.h"
+
+// BLAKE2b with vectorized compression functions. The fastest implementation
+// that the CPU supports is picked based on its features (AVX2, then SSE4.1).
+// Monocypher's portable implementation is used otherwise.
+
+typedef void (*blake2b_compress_fn)(uint64_t hash[8], const uint8_t block[128], uint64_t t0, uint64_t t1, uint64_t last);
+
+struct fwup_blake2b_ctx {
+    // NULL when using monocypher
+    blake2b_compress_fn compress;
+
+    crypto_blake2b_ctx portable;
+
+    uint64_t hash[8];
+    uint64_t counter[2];
+    uint8_t input[128];
+    size_t input_idx;
+    size_t hash_size;
+};
+
+void fwup_blake2b_init(struct fwup_blake2b_ctx *ctx, size_t hash_size);
+void fwup_blake2b_update(struct fwup_blake2b_ctx *ctx, const void *data, size_t len);
+void fwup_blake2b_final(struct fwup_blake2b_ctx *ctx, uint8_t *hash);
+
+const char *fwup_blake2b_implementation(int index);
+const char *fwup_blake2b_selected(void);
+int fwup_blake2b_select(const char *name);
+
+#endif // BLAKE2B_SIMD_H
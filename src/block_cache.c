@@ -188,15 +188,238 @@ static int calculate_io_size(struct block_cache *bc, off_t offset, size_t *count
     return 0;
 }
 
+static struct block_cache_decrypted_segment *find_decrypted(struct block_cache *bc, off_t offset)
+{
+    if (!bc->decrypted)
+        return NULL;
+
+    for (size_t i = 0; i < bc->num_decrypted; i++) {
+        struct block_cache_decrypted_segment *dseg = &bc->decrypted[i];
+        if (dseg->in_use && dseg->offset == offset) {
+            dseg->last_access = bc->decrypted_timestamp++;
+            return dseg;
+        }
+    }
+    return NULL;
+}
+
+static void save_decrypted(struct block_cache *bc, off_t offset, const void *data)
+{
+    if (bc->num_decrypted == 0)
+        return;
+
+    if (!bc->decrypted) {
+        bc->decrypted = (struct block_cache_decrypted_segment *) calloc(bc->num_decrypted, sizeof(struct block_cache_decrypted_segment));
+        if (!bc->decrypted)
+            fwup_err(EXIT_FAILURE, "calloc decrypted segments");
+    }
+
+    // Use an unused entry or replace the least recently used one
+    struct block_cache_decrypted_segment *lru = &bc->decrypted[0];
+    for (size_t i = 0; i < bc->num_decrypted && lru->in_use; i++) {
+        struct block_cache_decrypted_segment *dseg = &bc->decrypted[i];
+        if (!dseg->in_use || dseg->last_access < lru->last_access)
+            lru = dseg;
+    }
+
+    if (!lru->data)
+        alloc_page_aligned((void **) &lru->data, BLOCK_CACHE_SEGMENT_SIZE);
+
+    memcpy(lru->data, data, BLOCK_CACHE_SEGMENT_SIZE);
+    lru->offset = offset;
+    lru->last_access = bc->decrypted_timestamp++;
+    lru->in_use = true;
+}
+
+static void forget_decrypted(struct block_cache *bc, off_t offset, off_t count)
+{
+    if (!bc->decrypted)
+        return;
+
+    for (size_t i = 0; i < bc->num_decrypted; i++) {
+        struct block_cache_decrypted_segment *dseg = &bc->decrypted[i];
+        if (dseg->in_use && dseg->offset >= offset && dseg->offset < offset + count)
+            dseg->in_use = false;
+    }
+}
+
+static void free_decrypted(struct block_cache *bc)
+{
+    if (!bc->decrypted)
+        return;
+
+    for (size_t i = 0; i < bc->num_decrypted; i++) {
+        if (bc->decrypted[i].data)
+            free_page_aligned(bc->decrypted[i].data);
+    }
+    free(bc->decrypted);
+    bc->decrypted = NULL;
+}
+
+#if USE_PTHREADS
+static struct block_cache_prefetch *find_prefetch(struct block_cache *bc, off_t offset)
+{
+    for (size_t i = 0; i < BLOCK_CACHE_PREFETCH_SEGMENTS; i++) {
+        struct block_cache_prefetch *p = &bc->prefetch[i];
+        if (p->state != PREFETCH_EMPTY && p->offset == offset)
+            return p;
+    }
+    return NULL;
+}
+
+static void *prefetch_worker(void *void_bc)
+{
+    struct block_cache *bc = (struct block_cache *) void_bc;
+
+    OK_OR_FAIL(pthread_mutex_lock(&bc->prefetch_mutex));
+    while (bc->prefetch_running) {
+        // Read segments in the order that they were requested
+        struct block_cache_prefetch *next = NULL;
+        for (size_t i = 0; i < BLOCK_CACHE_PREFETCH_SEGMENTS; i++) {
+            struct block_cache_prefetch *p = &bc->prefetch[i];
+            if (p->state == PREFETCH_QUEUED &&
+                    (!next || (int32_t) (p->sequence - next->sequence) < 0))
+                next = p;
+        }
+        if (!next) {
+            OK_OR_FAIL(pthread_cond_wait(&bc->prefetch_cond, &bc->prefetch_mutex));
+            continue;
+        }
+
+        next->state = PREFETCH_LOADING;
+        OK_OR_FAIL(pthread_mutex_unlock(&bc->prefetch_mutex));
+        ssize_t bytes_read = pread(bc->fd, next->data, next->count, next->offset);
+        OK_OR_FAIL(pthread_mutex_lock(&bc->prefetch_mutex));
+
+        if (next->stale) {
+            next->state = PREFETCH_EMPTY;
+        } else {
+            next->bytes_read = bytes_read;
+            next->state = PREFETCH_READY;
+        }
+        OK_OR_FAIL(pthread_cond_broadcast(&bc->prefetch_cond));
+    }
+    pthread_mutex_unlock(&bc->prefetch_mutex);
+    return NULL;
+}
+
+static void start_prefetch(struct block_cache *bc)
+{
+    bc->prefetch = (struct block_cache_prefetch *) calloc(BLOCK_CACHE_PREFETCH_SEGMENTS, sizeof(struct block_cache_prefetch));
+    if (!bc->prefetch)
+        fwup_err(EXIT_FAILURE, "calloc prefetch");
+
+    pthread_mutex_init(&bc->prefetch_mutex, NULL);
+    pthread_cond_init(&bc->prefetch_cond, NULL);
+    bc->prefetch_running = true;
+    if (pthread_create(&bc->prefetch_thread, NULL, prefetch_worker, bc))
+        fwup_errx(EXIT_FAILURE, "pthread_create");
+}
+
+static void stop_prefetch(struct block_cache *bc)
+{
+    if (!bc->prefetch)
+        return;
+
+    pthread_mutex_lock(&bc->prefetch_mutex);
+    bc->prefetch_running = false;
+    pthread_cond_broadcast(&bc->prefetch_cond);
+    pthread_mutex_unlock(&bc->prefetch_mutex);
+
+    if (pthread_join(bc->prefetch_thread, NULL))
+        fwup_errx(EXIT_FAILURE, "pthread_join");
+    pthread_mutex_destroy(&bc->prefetch_mutex);
+    pthread_cond_destroy(&bc->prefetch_cond);
+
+    for (size_t i = 0; i < BLOCK_CACHE_PREFETCH_SEGMENTS; i++) {
+        if (bc->prefetch[i].data)
+            free_page_aligned(bc->prefetch[i].data);
+    }
+    free(bc->prefetch);
+    bc->prefetch = NULL;
+}
+
+static ssize_t take_prefetched(struct block_cache *bc, off_t offset, void *data)
+{
+    if (!bc->prefetch)
+        return -1;
+
+    ssize_t bytes_read = -1;
+    OK_OR_FAIL(pthread_mutex_lock(&bc->prefetch_mutex));
+    struct block_cache_prefetch *p = find_prefetch(bc, offset);
+    if (p) {
+        while (p->state == PREFETCH_LOADING)
+            OK_OR_FAIL(pthread_cond_wait(&bc->prefetch_cond, &bc->prefetch_mutex));
+
+        // If it's still queued, reading it now is faster than waiting.
+        if (p->state == PREFETCH_READY && p->bytes_read >= 0) {
+            bytes_read = p->bytes_read;
+            memcpy(data, p->data, bytes_read);
+        }
+        p->state = PREFETCH_EMPTY;
+    }
+    OK_OR_FAIL(pthread_mutex_unlock(&bc->prefetch_mutex));
+    return bytes_read;
+}
+
+static void forget_prefetched(struct block_cache *bc, off_t offset, off_t count)
+{
+    if (!bc->prefetch)
+        return;
+
+    OK_OR_FAIL(pthread_mutex_lock(&bc->prefetch_mutex));
+    for (size_t i = 0; i < BLOCK_CACHE_PREFETCH_SEGMENTS; i++) {
+        struct block_cache_prefetch *p = &bc->prefetch[i];
+        if (p->state != PREFETCH_EMPTY && p->offset >= offset && p->offset < offset + count) {
+            if (p->state == PREFETCH_LOADING)
+                p->stale = true;
+            else
+                p->state = PREFETCH_EMPTY;
+        }
+    }
+    OK_OR_FAIL(pthread_mutex_unlock(&bc->prefetch_mutex));
+}
+#else
+static inline ssize_t take_prefetched(struct block_cache *bc, off_t offset, void *data)
+{
+    (void) bc;
+    (void) offset;
+    (void) data;
+    return -1;
+}
+static inline void forget_prefetched(struct block_cache *bc, off_t offset, off_t count)
+{
+    (void) bc;
+    (void) offset;
+    (void) count;
+}
+static inline void stop_prefetch(struct block_cache *bc)
+{
+    (void) bc;
+}
+#endif
+
 static int read_segment(struct block_cache *bc, struct block_cache_segment *seg, void *data)
 {
     if (is_trimmed(bc, seg->offset)) {
         // Trimmed, so we'd be reading uninitialized data (in theory), if we called pread.
         memset(data, 0, BLOCK_CACHE_SEGMENT_SIZE);
     } else {
+        // If this segment has already been decrypted, don't read and decrypt it again.
+        if (bc->decrypt_callback) {
+            struct block_cache_decrypted_segment *dseg = find_decrypted(bc, seg->offset);
+            if (dseg) {
+                memcpy(data, dseg->data, BLOCK_CACHE_SEGMENT_SIZE);
+                bc->decrypted_hits++;
+                return 0;
+            }
+        }
+
         size_t count;
         OK_OR_RETURN(calculate_io_size(bc, seg->offset, &count));
-        ssize_t bytes_read = pread(bc->fd, data, count, seg->offset);
+        ssize_t bytes_read = take_prefetched(bc, seg->offset, data);
+        if (bytes_read < 0)
+            bytes_read = pread(bc->fd, data, count, seg->offset);
         if (bytes_read < 0) {
             ERR_RETURN("unexpected error reading %zu bytes at offset %" PRId64 ": %s.\nPossible causes are that the destination is too small, the device (e.g., an SD card) is going bad, or the connection to it is flaky.",
                     count, seg->offset, strerror(errno));
@@ -211,6 +434,8 @@ static int read_segment(struct block_cache *bc, struct block_cache_segment *seg,
         // This ensures cache holds decrypted data, avoiding redundant decryption on cache hits
         if (bc->decrypt_callback) {
             bc->decrypt_callback(bc->decrypt_cookie, data, count, seg->offset);
+            save_decrypted(bc, seg->offset, data);
+            bc->decrypted_segments++;
         }
     }
     return 0;
@@ -487,22 +712,51 @@ int block_cache_init(struct block_cache *bc,
     return 0;
 }
 
+/**
+ * @brief Check the size of the decrypted segment cache
+ *
+ * @param cache_size_mb the size in MB
+ * @return 0 if ok; <0 on error
+ */
+int block_cache_check_decrypted_size(long cache_size_mb)
+{
+    if (cache_size_mb < 0 || cache_size_mb > BLOCK_CACHE_MAX_DECRYPTED_MB)
+        ERR_RETURN("delta-source-decrypt-cache-mb should be between 0 and %d", BLOCK_CACHE_MAX_DECRYPTED_MB);
+
+    return 0;
+}
+
 /**
  * @brief Set decrypt callback for reading encrypted disks
  * 
  * When set, data will be decrypted once when loaded from disk into cache.
- * This eliminates redundant decryption on cache hits.
+ * This eliminates redundant decryption on cache hits. Decrypted segments
+ * are also kept in a separate cache so that segments evicted from the main
+ * cache aren't decrypted again when re-read. That cache isn't allocated
+ * until something is decrypted. Pass NULL to clear the callback and free the
+ * decrypted segments.
  * 
  * @param bc block cache
  * @param decrypt_callback function to decrypt data in-place
  * @param cookie context pointer passed to decrypt_callback
+ * @param cache_size_mb the size of the decrypted segment cache in MB (0 to not keep any)
  */
 void block_cache_set_decrypt(struct block_cache *bc, 
                             void (*decrypt_callback)(void *, void *, size_t, off_t),
-                            void *cookie)
+                            void *cookie,
+                            size_t cache_size_mb)
 {
+    free_decrypted(bc);
+
     bc->decrypt_callback = decrypt_callback;
     bc->decrypt_cookie = cookie;
+    bc->num_decrypted = decrypt_callback ? (cache_size_mb * 1024 * 1024) / BLOCK_CACHE_SEGMENT_SIZE : 0;
+
+    if (decrypt_callback) {
+        bc->decrypted_timestamp = 0;
+        bc->decrypted_segments = 0;
+        bc->decrypted_hits = 0;
+    }
 }
 
 static int lrucompare(const void *pa, const void *pb)
@@ -587,6 +841,8 @@ int block_cache_flush(struct block_cache *bc)
  */
 int block_cache_free(struct block_cache *bc)
 {
+    stop_prefetch(bc);
+
 #if USE_PTHREADS
     // Wait for the most recent async write to complete and
     // signal that the thread should exit.
@@ -612,6 +868,7 @@ int block_cache_free(struct block_cache *bc)
             seg->in_use = false;
         }
     }
+    free_decrypted(bc);
     free_page_aligned(bc->read_temp);
     if (bc->verify_temp)
         free_page_aligned(bc->verify_temp);
@@ -669,6 +926,11 @@ static int get_segment(struct block_cache *bc, off_t offset, struct block_cache_
     }
 
     OK_OR_RETURN(flush_segment(bc, lru));
+
+    // The LRU may still be getting streamed out. Don't reuse its buffer until
+    // that's done. This also guarantees that the media has its contents for
+    // anything that reads it back or prefetches it.
+    wait_for_write_completion(bc, lru);
     init_segment(bc, offset, lru);
     *segment = lru;
     return 0;
@@ -770,6 +1032,8 @@ int block_cache_trim(struct block_cache *bc, off_t offset, off_t count, bool hwt
                 seg->in_use = false;
             }
         }
+        forget_decrypted(bc, aligned_offset, count);
+        forget_prefetched(bc, aligned_offset, count);
     }
 
     // Try to issue a trim to the storage device. This is best effort, so if
@@ -821,6 +1085,10 @@ static int block_segment_pwrite(struct block_cache *bc, struct block_cache_segme
     // Write the block to the cache
     memcpy(&seg->data[offset_into_segment], buf, count);
 
+    // Any decrypted or prefetched copy of what was on disk is now stale
+    forget_decrypted(bc, seg->offset, BLOCK_CACHE_SEGMENT_SIZE);
+    forget_prefetched(bc, seg->offset, BLOCK_CACHE_SEGMENT_SIZE);
+
     // Mark everything that was written as dirty
     int block_start = offset_into_segment / FWUP_BLOCK_SIZE;
     int block_end = block_start + count / FWUP_BLOCK_SIZE;
@@ -918,3 +1186,93 @@ int block_cache_pread(struct block_cache *bc, void *buf, size_t count, off_t off
 
     return count;
 }
+
+#if USE_PTHREADS
+static bool is_cached(struct block_cache *bc, off_t offset)
+{
+    for (size_t i = 0; i < bc->num_segments; i++) {
+        if (bc->segments[i].in_use && bc->segments[i].offset == offset)
+            return true;
+    }
+    if (bc->decrypted) {
+        for (size_t i = 0; i < bc->num_decrypted; i++) {
+            if (bc->decrypted[i].in_use && bc->decrypted[i].offset == offset)
+                return true;
+        }
+    }
+    return false;
+}
+
+static struct block_cache_prefetch *unused_prefetch(struct block_cache *bc, uint32_t before)
+{
+    // Use an empty entry or replace the oldest one that was never used. Only
+    // replace ones from earlier calls so that a long range doesn't evict itself.
+    struct block_cache_prefetch *oldest = NULL;
+    for (size_t i = 0; i < BLOCK_CACHE_PREFETCH_SEGMENTS; i++) {
+        struct block_cache_prefetch *p = &bc->prefetch[i];
+        if (p->state == PREFETCH_EMPTY)
+            return p;
+        if (p->state == PREFETCH_READY &&
+                (int32_t) (p->sequence - before) < 0 &&
+                (!oldest || (int32_t) (p->sequence - oldest->sequence) < 0))
+            oldest = p;
+    }
+    return oldest;
+}
+#endif
+
+/**
+ * @brief Start reading a range in the background
+ *
+ * This is a hint for ranges that will be read soon. Segments are read by a
+ * separate thread so that the reads overlap whatever the caller does next.
+ * Segments that are already cached are skipped and up to
+ * BLOCK_CACHE_PREFETCH_SEGMENTS segments are read ahead at a time.
+ *
+ * @param bc
+ * @param offset the byte offset of the range
+ * @param count how many bytes will be read
+ */
+void block_cache_prefetch(struct block_cache *bc, off_t offset, off_t count)
+{
+#if USE_PTHREADS
+    off_t end = offset + count;
+    offset &= BLOCK_CACHE_SEGMENT_MASK;
+
+    if (!bc->prefetch)
+        start_prefetch(bc);
+
+    OK_OR_FAIL(pthread_mutex_lock(&bc->prefetch_mutex));
+    uint32_t first_sequence = bc->prefetch_sequence;
+    for (; offset < end; offset += BLOCK_CACHE_SEGMENT_SIZE) {
+        size_t io_size = BLOCK_CACHE_SEGMENT_SIZE;
+        if (bc->end_offset > 0 && !bc->is_soft_end_offset) {
+            if (offset >= bc->end_offset)
+                break;
+            if (offset + BLOCK_CACHE_SEGMENT_SIZE > bc->end_offset)
+                io_size = bc->end_offset - offset;
+        }
+
+        if (is_trimmed(bc, offset) || is_cached(bc, offset) || find_prefetch(bc, offset))
+            continue;
+
+        struct block_cache_prefetch *p = unused_prefetch(bc, first_sequence);
+        if (!p)
+            break;
+
+        if (!p->data)
+            alloc_page_aligned((void **) &p->data, BLOCK_CACHE_SEGMENT_SIZE);
+        p->state = PREFETCH_QUEUED;
+        p->offset = offset;
+        p->sequence = bc->prefetch_sequence++;
+        p->stale = false;
+        p->count = io_size;
+    }
+    OK_OR_FAIL(pthread_cond_broadcast(&bc->prefetch_cond));
+    OK_OR_FAIL(pthread_mutex_unlock(&bc->prefetch_mutex));
+#else
+    (void) bc;
+    (void) offset;
+    (void) count;
+#endif
+}
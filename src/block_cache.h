@@ -19,17 +19,7 @@
 
 #include "config.h"
 #include "util.h"
-
-// Don't use pthreads on Windows yet.
-#ifndef _WIN32
-#if HAVE_PTHREAD
-#define USE_PTHREADS 1
-#endif
-#endif
-
-#if USE_PTHREADS
-#include <pthread.h>
-#endif
+#include "work_pool.h"
 
 // The segment size defines the minimum read/write size
 // actually made to the output. Additionally, all reads and
@@ -38,6 +28,10 @@
 #define BLOCK_CACHE_BLOCKS_PER_SEGMENT (BLOCK_CACHE_SEGMENT_SIZE / FWUP_BLOCK_SIZE)
 #define BLOCK_CACHE_SEGMENT_MASK       (~(BLOCK_CACHE_SEGMENT_SIZE - 1))
 
+// Limit on the decrypted source cache that's kept when a decrypt callback is
+// set. Entries are allocated as they're used.
+#define BLOCK_CACHE_MAX_DECRYPTED_MB 1024
+
 struct block_cache_segment {
     bool in_use;
 
@@ -63,6 +57,38 @@ struct block_cache_segment {
     uint8_t flags[BLOCK_CACHE_BLOCKS_PER_SEGMENT * 2 / 8];
 };
 
+// Maximum number of segments that can be read ahead by the prefetch thread
+#define BLOCK_CACHE_PREFETCH_SEGMENTS 32 // 4 MB
+
+enum block_cache_prefetch_state {
+    PREFETCH_EMPTY = 0,
+    PREFETCH_QUEUED,
+    PREFETCH_LOADING,
+    PREFETCH_READY
+};
+
+// A segment that's been requested or read by the prefetch thread. Data is
+// exactly what pread returned, so it still needs to be decrypted.
+struct block_cache_prefetch {
+    enum block_cache_prefetch_state state;
+    off_t offset;
+    uint32_t sequence;
+    bool stale; // set if written while loading
+    size_t count;
+    ssize_t bytes_read;
+    uint8_t *data;
+};
+
+// A segment that was read from disk and decrypted. These are kept
+// separately from the main cache so that evicting a segment doesn't
+// mean decrypting it again the next time that it's read.
+struct block_cache_decrypted_segment {
+    bool in_use;
+    off_t offset;
+    uint32_t last_access;
+    uint8_t *data;
+};
+
 struct block_cache {
     int fd;
 
@@ -102,6 +128,15 @@ struct block_cache {
     void (*decrypt_callback)(void *decrypt_cookie, void *buffer, size_t count, off_t offset);
     void *decrypt_cookie;
 
+    // Decrypted source segments (allocated on the first decrypted read)
+    struct block_cache_decrypted_segment *decrypted;
+    size_t num_decrypted;
+    uint32_t decrypted_timestamp;
+
+    // Statistics for verbose output
+    uint64_t decrypted_segments;
+    uint64_t decrypted_hits;
+
     // Asynchronous writes
 #if USE_PTHREADS
     pthread_t writer_thread;
@@ -112,15 +147,25 @@ struct block_cache {
     volatile bool running;
     volatile struct block_cache_segment *seg_to_write;
     volatile off_t bad_offset; // set if pwrite fails asynchronously
+
+    // Read ahead (started on the first call to block_cache_prefetch)
+    pthread_t prefetch_thread;
+    pthread_mutex_t prefetch_mutex;
+    pthread_cond_t prefetch_cond;
+    struct block_cache_prefetch *prefetch;
+    uint32_t prefetch_sequence;
+    bool prefetch_running;
 #endif
 };
 
 int block_cache_init(struct block_cache *bc, int fd, off_t end_offset, bool is_soft_end_offset, bool enable_trim, bool verify_writes, bool minimize_writes, size_t cache_size_mb);
-void block_cache_set_decrypt(struct block_cache *bc, void (*decrypt_callback)(void *, void *, size_t, off_t), void *cookie);
+int block_cache_check_decrypted_size(long cache_size_mb);
+void block_cache_set_decrypt(struct block_cache *bc, void (*decrypt_callback)(void *, void *, size_t, off_t), void *cookie, size_t cache_size_mb);
 int block_cache_trim(struct block_cache *bc, off_t offset, off_t count, bool hwtrim);
 int block_cache_trim_after(struct block_cache *bc, off_t offset, bool hwtrim);
 int block_cache_pwrite(struct block_cache *bc, const void *buf, size_t count, off_t offset, bool streamed);
 int block_cache_pread(struct block_cache *bc, void *buf, size_t count, off_t offset);
+void block_cache_prefetch(struct block_cache *bc, off_t offset, off_t count);
 int block_cache_flush(struct block_cache *bc);
 void block_cache_reset(struct block_cache *bc);
 int block_cache_free(struct block_cache *bc);
@@ -434,9 +434,12 @@ static cfg_opt_t file_resource_opts[] = {
 #else
     CFG_INT_LIST("length", 0, CFGF_NONE),
 #endif
+    CFG_STR("sparse-map", 0, CFGF_NONE), // Set by fwup for maps too long for "length"
     CFG_STR("contents", 0, CFGF_NONE),
     CFG_STR("blake2b-256", 0, CFGF_NONE),
+    CFG_STR("blake2b-256-tree", 0, CFGF_NONE),
     CFG_STR("sha256", 0, CFGF_NONE), // Old hash for files - use blake2b-256 now
+    CFG_STR("duplicate-of", 0, CFGF_NONE), // Set by fwup when the data is stored under another resource
     CFG_INT("assert-size-lte", -1, CFGF_NONE),
     CFG_INT("assert-size-gte", -1, CFGF_NONE),
     CFG_IGNORE_UNKNOWN
@@ -592,6 +595,12 @@ static cfg_opt_t opts[] = {
 
     CFG_STR("require-fwup-version", "0", CFGF_NONE),
     CFG_INT("block-cache-size-mb", 8, CFGF_NONE),
+    CFG_INT("delta-source-cache-blocks", 32, CFGF_NONE),
+    CFG_INT("delta-source-block-size-kb", 128, CFGF_NONE),
+    CFG_INT("delta-decode-threads", 1, CFGF_NONE),
+    CFG_INT("delta-source-decrypt-cache-mb", 4, CFGF_NONE),
+    CFG_BOOL("dedup-resources", cfg_false, CFGF_NONE),
+    CFG_STR("resource-hash", "blake2b-256", CFGF_NONE),
     CFG_FUNC("define", cb_define),
     CFG_FUNC("define!", cb_define_bang),
     CFG_FUNC("define-eval", cb_define_eval),
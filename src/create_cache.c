@@ -0,0 +1,294 @@
+/*
+ * Copyright 2026 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE // for asprintf
+#include "create_cache.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef _WIN32
+#include <direct.h> // for mkdir
+#endif
+
+#ifndef FWUP_MINIMAL
+
+// Bump this if the contents of a cache entry change
+#define CREATE_CACHE_VERSION "fwup-create-cache-2"
+
+/**
+ * @brief Initialize the create cache
+ *
+ * The cache directory is created if it doesn't exist.
+ *
+ * @param cc the cache
+ * @param dir the directory to hold cache entries
+ * @return 0 on success
+ */
+int create_cache_init(struct create_cache *cc, const char *dir)
+{
+    cc->dir = dir;
+    cc->hits = 0;
+    cc->misses = 0;
+    cc->entry_hits = 0;
+    cc->entry_misses = 0;
+
+#ifdef _WIN32
+    int rc = mkdir(dir);
+#else
+    int rc = mkdir(dir, 0755);
+#endif
+    if (rc < 0 && errno != EEXIST)
+        ERR_RETURN("can't create cache directory '%s'", dir);
+
+    struct stat st;
+    if (stat(dir, &st) < 0 || !S_ISDIR(st.st_mode))
+        ERR_RETURN("cache directory '%s' isn't a directory", dir);
+
+    return 0;
+}
+
+/**
+ * @brief Start computing a cache key for a file-resource
+ *
+ * @param key the key
+ * @param config_filename the config file so that relative host-paths are unique
+ * @param paths the file-resource's host-path
+ * @param skip_holes the file-resource's skip-holes setting
+ * @param skip_zero_blocks true if blocks of zeros are recorded as holes
+ * @param hash_name the hash used for the resource
+ */
+void create_cache_key_start(struct create_cache_key *key, const char *config_filename, const char *paths, bool skip_holes, bool skip_zero_blocks, const char *hash_name)
+{
+    crypto_blake2b_general_init(&key->hash_state, FWUP_BLAKE2b_256_LEN, NULL, 0);
+
+    char header[96];
+    int len = snprintf(header, sizeof(header), "%s\nskip-holes=%d\nhash=%s\n%s", CREATE_CACHE_VERSION, skip_holes, hash_name,
+                       skip_zero_blocks ? "skip-zero-blocks=1\n" : "");
+    crypto_blake2b_update(&key->hash_state, (const uint8_t *) header, len);
+
+    // Include the NULL terminators to keep the fields separate
+    if (config_filename)
+        crypto_blake2b_update(&key->hash_state, (const uint8_t *) config_filename, strlen(config_filename) + 1);
+    crypto_blake2b_update(&key->hash_state, (const uint8_t *) paths, strlen(paths) + 1);
+    key->name[0] = '\0';
+}
+
+/**
+ * @brief Add the identity of one host file to the key
+ *
+ * @param key the key
+ * @param fd an open file descriptor to the host file
+ * @return 0 on success
+ */
+int create_cache_key_add_fd(struct create_cache_key *key, int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        ERR_RETURN("can't stat host-path for create cache");
+
+    // Whole seconds aren't enough since a file can be rewritten within a
+    // second of the cache entry being made. Include nanoseconds when the
+    // platform has them.
+#if defined(HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC)
+    long mtime_nsec = st.st_mtim.tv_nsec;
+    long ctime_nsec = st.st_ctim.tv_nsec;
+#elif defined(HAVE_STRUCT_STAT_ST_MTIMESPEC_TV_NSEC)
+    long mtime_nsec = st.st_mtimespec.tv_nsec;
+    long ctime_nsec = st.st_ctimespec.tv_nsec;
+#else
+    long mtime_nsec = 0;
+    long ctime_nsec = 0;
+#endif
+
+    char identity[160];
+    int len = snprintf(identity, sizeof(identity), "%llu:%llu:%lld:%lld.%09ld:%lld.%09ld\n",
+                       (unsigned long long) st.st_dev,
+                       (unsigned long long) st.st_ino,
+                       (long long) st.st_size,
+                       (long long) st.st_mtime, mtime_nsec,
+                       (long long) st.st_ctime, ctime_nsec);
+    crypto_blake2b_update(&key->hash_state, (const uint8_t *) identity, len);
+    return 0;
+}
+
+/**
+ * @brief Finish computing the key
+ *
+ * After this, key->name holds the name of the cache entry.
+ *
+ * @param key the key
+ */
+void create_cache_key_finish(struct create_cache_key *key)
+{
+    unsigned char digest[FWUP_BLAKE2b_256_LEN];
+    crypto_blake2b_final(&key->hash_state, digest);
+    bytes_to_hex(digest, key->name, sizeof(digest));
+}
+
+/**
+ * @brief Compute the key for a file-resource's compressed archive entry
+ *
+ * The key only depends on what gets stored, so the entry can be reused
+ * even if the host file was touched or copied.
+ *
+ * @param key the key
+ * @param archive_path the entry's path in the archive
+ * @param hash_name the name of the resource's hash
+ * @param hash the resource's hash as a hex string
+ * @param data_size the number of bytes stored in the entry
+ * @param compression_level the deflate compression level
+ */
+void create_cache_entry_key(struct create_cache_key *key, const char *archive_path, const char *hash_name, const char *hash, off_t data_size, int compression_level)
+{
+    crypto_blake2b_general_init(&key->hash_state, FWUP_BLAKE2b_256_LEN, NULL, 0);
+
+    char header[192];
+    int len = snprintf(header, sizeof(header), "%s\nentry\nlevel=%d\nsize=%lld\n%s=%s\n",
+                       CREATE_CACHE_VERSION, compression_level, (long long) data_size, hash_name, hash);
+    crypto_blake2b_update(&key->hash_state, (const uint8_t *) header, len);
+    crypto_blake2b_update(&key->hash_state, (const uint8_t *) archive_path, strlen(archive_path) + 1);
+    create_cache_key_finish(key);
+}
+
+/**
+ * @brief Return the path to a file in the cache directory
+ *
+ * @param cc the cache
+ * @param key a finished key
+ * @param suffix appended to the key's name
+ * @return the path. Call free() when done.
+ */
+char *create_cache_path(const struct create_cache *cc, const struct create_cache_key *key, const char *suffix)
+{
+    char *path;
+    if (asprintf(&path, "%s/%s%s", cc->dir, key->name, suffix) < 0)
+        fwup_err(EXIT_FAILURE, "asprintf");
+    return path;
+}
+
+/**
+ * @brief Look up a file-resource's metadata in the cache
+ *
+ * Corrupt or unreadable entries are treated as misses.
+ *
+ * @param cc the cache
+ * @param key a finished key
+ * @param sfm an initialized sparse map to hold the result
+ * @param hash a FWUP_BLAKE2b_256_LEN buffer for the hash
+ * @return 1 on a hit, 0 on a miss
+ */
+int create_cache_lookup(struct create_cache *cc, const struct create_cache_key *key, struct sparse_file_map *sfm, unsigned char *hash)
+{
+    char *path = create_cache_path(cc, key, "");
+    FILE *fp = fopen(path, "r");
+    free(path);
+    if (!fp)
+        goto miss;
+
+    char line[FWUP_BLAKE2b_256_LEN * 2 + 32];
+    if (!fgets(line, sizeof(line), fp) ||
+            strncmp(line, CREATE_CACHE_VERSION "\n", sizeof(CREATE_CACHE_VERSION)) != 0)
+        goto corrupt;
+
+    char hash_str[FWUP_BLAKE2b_256_LEN * 2 + 1];
+    int map_len;
+    if (fscanf(fp, "%64s %d", hash_str, &map_len) != 2 ||
+            map_len <= 0 || map_len > INT_MAX / (int) sizeof(off_t) ||
+            hex_to_bytes(hash_str, hash, FWUP_BLAKE2b_256_LEN) < 0)
+        goto corrupt;
+
+    sparse_file_free(sfm);
+    sfm->map = (off_t *) malloc(map_len * sizeof(off_t));
+    if (!sfm->map)
+        goto corrupt;
+    sfm->map_len = map_len;
+    sfm->map_capacity = map_len;
+    for (int i = 0; i < map_len; i++) {
+        long long value;
+        if (fscanf(fp, "%lld", &value) != 1 || value < 0) {
+            sparse_file_free(sfm);
+            goto corrupt;
+        }
+        sfm->map[i] = (off_t) value;
+    }
+
+    fclose(fp);
+    cc->hits++;
+    return 1;
+
+corrupt:
+    fclose(fp);
+miss:
+    cc->misses++;
+    return 0;
+}
+
+/**
+ * @brief Save a file-resource's metadata in the cache
+ *
+ * The entry is written to a temporary file first so that a partially
+ * written entry is never seen.
+ *
+ * @param cc the cache
+ * @param key a finished key
+ * @param sfm the sparse map
+ * @param hash the resource's BLAKE2b-256 hash
+ * @return 0 on success
+ */
+int create_cache_store(struct create_cache *cc, const struct create_cache_key *key, const struct sparse_file_map *sfm, const unsigned char *hash)
+{
+    int rc = 0;
+    char *path = create_cache_path(cc, key, "");
+    char *tmp_path = create_cache_path(cc, key, ".tmp");
+
+    FILE *fp = fopen(tmp_path, "w");
+    if (!fp)
+        ERR_CLEANUP_MSG("can't write to cache directory '%s'", cc->dir);
+
+    char hash_str[FWUP_BLAKE2b_256_LEN * 2 + 1];
+    bytes_to_hex(hash, hash_str, FWUP_BLAKE2b_256_LEN);
+    fprintf(fp, "%s\n%s %d\n", CREATE_CACHE_VERSION, hash_str, sfm->map_len);
+    for (int i = 0; i < sfm->map_len; i++)
+        fprintf(fp, "%lld\n", (long long) sfm->map[i]);
+
+    if (fclose(fp) != 0) {
+        unlink(tmp_path);
+        ERR_CLEANUP_MSG("error writing cache entry '%s'", tmp_path);
+    }
+
+#ifdef _WIN32
+    // rename() won't replace existing files on Windows
+    unlink(path);
+#endif
+    if (rename(tmp_path, path) < 0) {
+        unlink(tmp_path);
+        ERR_CLEANUP_MSG("can't rename cache entry to '%s'", path);
+    }
+
+cleanup:
+    free(tmp_path);
+    free(path);
+    return rc;
+}
+
+#endif // FWUP_MINIMAL
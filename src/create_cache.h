@@ -0,0 +1,63 @@
+/*
+ * Copyright 2026 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CREATE_CACHE_H
+#define CREATE_CACHE_H
+
+#include <stdbool.h>
+#include "monocypher.h"
+#include "sparse_file.h"
+#include "util.h"
+
+// The create cache remembers the metadata that fwup computes for each
+// file-resource so that it doesn't need to be recomputed on the next
+// `fwup -c` if none of the host files changed. Entries are keyed on the
+// identity of the host files (path, size, mtime, ctime, inode) and the
+// options that affect the metadata. Each entry is a small text file in
+// the cache directory.
+//
+// It also keeps each file-resource's compressed archive entry in a one
+// entry ZIP file so that unchanged data isn't compressed again. These are
+// keyed on what's stored (archive path, hash, size and compression level).
+
+struct create_cache {
+    const char *dir;
+
+    // Statistics for verbose output
+    int hits;
+    int misses;
+    int entry_hits;
+    int entry_misses;
+};
+
+struct create_cache_key {
+    crypto_blake2b_ctx hash_state;
+    char name[FWUP_BLAKE2b_256_LEN * 2 + 1];
+};
+
+int create_cache_init(struct create_cache *cc, const char *dir);
+
+void create_cache_key_start(struct create_cache_key *key, const char *config_filename, const char *paths, bool skip_holes, bool skip_zero_blocks, const char *hash_name);
+int create_cache_key_add_fd(struct create_cache_key *key, int fd);
+void create_cache_key_finish(struct create_cache_key *key);
+
+int create_cache_lookup(struct create_cache *cc, const struct create_cache_key *key, struct sparse_file_map *sfm, unsigned char *hash);
+int create_cache_store(struct create_cache *cc, const struct create_cache_key *key, const struct sparse_file_map *sfm, const unsigned char *hash);
+
+void create_cache_entry_key(struct create_cache_key *key, const char *archive_path, const char *hash_name, const char *hash, off_t data_size, int compression_level);
+char *create_cache_path(const struct create_cache *cc, const struct create_cache_key *key, const char *suffix);
+
+#endif // CREATE_CACHE_H
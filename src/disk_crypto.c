@@ -15,7 +15,6 @@
  */
 
 #include "disk_crypto.h"
-#include "3rdparty/mbedtls/mbedtls_aes.h"
 #include "3rdparty/base64.h"
 #include "monocypher.h"
 
@@ -28,37 +27,133 @@
 #define AES_KEYLEN 32
 #define AES_XTS_KEYLEN 64 // 2 x 256-bit keys for AES-256-XTS
 
-static void aes_cbc_plain_encrypt(struct disk_crypto *dc, uint64_t lba, const uint8_t *input, uint8_t *output)
+// Sectors handled per call to the multi-block AES functions
+#define ACCEL_BATCH_SECTORS 8
+#define ACCEL_BATCH_SIZE (ACCEL_BATCH_SECTORS * FWUP_BLOCK_SIZE)
+
+// Sectors handed to a worker thread at a time
+#define DISK_CRYPTO_JOB_SECTORS 64
+
+static const uint8_t *round_keys(const mbedtls_aes_context *ctx)
+{
+    return (const uint8_t *) (ctx->buf + ctx->rk_offset);
+}
+
+static void xor_bytes(uint8_t *output, const uint8_t *a, const uint8_t *b, size_t len)
+{
+    for (size_t i = 0; i < len; i += sizeof(uint64_t)) {
+        uint64_t x, y;
+        memcpy(&x, &a[i], sizeof(x));
+        memcpy(&y, &b[i], sizeof(y));
+        x ^= y;
+        memcpy(&output[i], &x, sizeof(x));
+    }
+}
+
+static size_t batch_sectors(size_t sectors)
+{
+    return sectors < ACCEL_BATCH_SECTORS ? sectors : ACCEL_BATCH_SECTORS;
+}
+
+static void aes_cbc_plain_encrypt(struct disk_crypto *dc, uint64_t lba, const uint8_t *input, uint8_t *output, size_t sectors)
+{
+    for (size_t i = 0; i < sectors; i++) {
+        uint8_t iv[AES_BLOCKLEN] = {0};
+        copy_le32(iv, (uint32_t) (lba + i));
+
+        if (mbedtls_aes_crypt_cbc(&dc->ctx.cbc.enc, MBEDTLS_AES_ENCRYPT, FWUP_BLOCK_SIZE, iv, input, output) != 0)
+            fwup_err(EXIT_FAILURE, "mbedtls_aes_crypt_cbc encrypt failed");
+
+        input += FWUP_BLOCK_SIZE;
+        output += FWUP_BLOCK_SIZE;
+    }
+}
+static void aes_cbc_plain_decrypt(struct disk_crypto *dc, uint64_t lba, const uint8_t *input, uint8_t *output, size_t sectors)
+{
+    for (size_t i = 0; i < sectors; i++) {
+        uint8_t iv[AES_BLOCKLEN] = {0};
+        copy_le32(iv, (uint32_t) (lba + i));
+
+        if (mbedtls_aes_crypt_cbc(&dc->ctx.cbc.dec, MBEDTLS_AES_DECRYPT, FWUP_BLOCK_SIZE, iv, input, output) != 0)
+            fwup_err(EXIT_FAILURE, "mbedtls_aes_crypt_cbc decrypt failed");
+
+        input += FWUP_BLOCK_SIZE;
+        output += FWUP_BLOCK_SIZE;
+    }
+}
+// CBC encryption is serial within a sector, so encrypt the same block of
+// several sectors at a time instead.
+static void aes_cbc_plain_encrypt_accel(struct disk_crypto *dc, uint64_t lba, const uint8_t *input, uint8_t *output, size_t sectors)
 {
-    uint8_t iv[AES_BLOCKLEN] = {0};
-    copy_le32(iv, (uint32_t) lba);
+    const mbedtls_aes_context *ctx = &dc->ctx.cbc.enc;
+    uint8_t chain[ACCEL_BATCH_SECTORS * AES_BLOCKLEN];
+
+    while (sectors > 0) {
+        size_t n = batch_sectors(sectors);
+
+        memset(chain, 0, sizeof(chain));
+        for (size_t i = 0; i < n; i++)
+            copy_le32(&chain[i * AES_BLOCKLEN], (uint32_t) (lba + i));
 
-    mbedtls_aes_context ctx;
-    mbedtls_aes_init(&ctx);
+        for (size_t j = 0; j < FWUP_BLOCK_SIZE; j += AES_BLOCKLEN) {
+            for (size_t i = 0; i < n; i++)
+                xor_bytes(&chain[i * AES_BLOCKLEN], &chain[i * AES_BLOCKLEN], &input[i * FWUP_BLOCK_SIZE + j], AES_BLOCKLEN);
 
-    if (mbedtls_aes_setkey_enc(&ctx, dc->key, AES_KEYLEN * 8) != 0)
-        fwup_err(EXIT_FAILURE, "mbedtls_aes_setkey_enc failed");
+            dc->accel->encrypt(round_keys(ctx), ctx->nr, chain, chain, n);
 
-    if (mbedtls_aes_crypt_cbc(&ctx, MBEDTLS_AES_ENCRYPT, FWUP_BLOCK_SIZE, iv, input, output) != 0)
-        fwup_err(EXIT_FAILURE, "mbedtls_aes_crypt_cbc encrypt failed");
+            for (size_t i = 0; i < n; i++)
+                memcpy(&output[i * FWUP_BLOCK_SIZE + j], &chain[i * AES_BLOCKLEN], AES_BLOCKLEN);
+        }
 
-    mbedtls_aes_free(&ctx);
+        lba += n;
+        input += n * FWUP_BLOCK_SIZE;
+        output += n * FWUP_BLOCK_SIZE;
+        sectors -= n;
+    }
 }
-static void aes_cbc_plain_decrypt(struct disk_crypto *dc, uint64_t lba, const uint8_t *input, uint8_t *output)
+static void aes_cbc_plain_decrypt_accel(struct disk_crypto *dc, uint64_t lba, const uint8_t *input, uint8_t *output, size_t sectors)
 {
-    uint8_t iv[AES_BLOCKLEN] = {0};
-    copy_le32(iv, (uint32_t) lba);
+    const mbedtls_aes_context *ctx = &dc->ctx.cbc.dec;
+
+    // Keep a copy of the ciphertext since decryption may be in-place
+    uint8_t ciphertext[ACCEL_BATCH_SIZE];
 
-    mbedtls_aes_context ctx;
-    mbedtls_aes_init(&ctx);
+    while (sectors > 0) {
+        size_t n = batch_sectors(sectors);
+        size_t len = n * FWUP_BLOCK_SIZE;
 
-    if (mbedtls_aes_setkey_dec(&ctx, dc->key, AES_KEYLEN * 8) != 0)
-        fwup_err(EXIT_FAILURE, "mbedtls_aes_setkey_dec failed");
+        memcpy(ciphertext, input, len);
+        dc->accel->decrypt(round_keys(ctx), ctx->nr, ciphertext, output, len / AES_BLOCKLEN);
 
-    if (mbedtls_aes_crypt_cbc(&ctx, MBEDTLS_AES_DECRYPT, FWUP_BLOCK_SIZE, iv, input, output) != 0)
-        fwup_err(EXIT_FAILURE, "mbedtls_aes_crypt_cbc decrypt failed");
+        for (size_t i = 0; i < n; i++) {
+            uint8_t iv[AES_BLOCKLEN] = {0};
+            copy_le32(iv, (uint32_t) (lba + i));
 
-    mbedtls_aes_free(&ctx);
+            uint8_t *sector = &output[i * FWUP_BLOCK_SIZE];
+            xor_bytes(sector, sector, iv, AES_BLOCKLEN);
+            xor_bytes(sector + AES_BLOCKLEN, sector + AES_BLOCKLEN, &ciphertext[i * FWUP_BLOCK_SIZE], FWUP_BLOCK_SIZE - AES_BLOCKLEN);
+        }
+
+        lba += n;
+        input += len;
+        output += len;
+        sectors -= n;
+    }
+}
+static int aes_cbc_plain_setkey(struct disk_crypto *dc)
+{
+    mbedtls_aes_init(&dc->ctx.cbc.enc);
+    mbedtls_aes_init(&dc->ctx.cbc.dec);
+
+    if (mbedtls_aes_setkey_enc(&dc->ctx.cbc.enc, dc->key, AES_KEYLEN * 8) != 0 ||
+        mbedtls_aes_setkey_dec(&dc->ctx.cbc.dec, dc->key, AES_KEYLEN * 8) != 0)
+        ERR_RETURN("Failed to expand the aes-cbc-plain key");
+
+    if (dc->accel->encrypt) {
+        dc->encrypt = aes_cbc_plain_encrypt_accel;
+        dc->decrypt = aes_cbc_plain_decrypt_accel;
+    }
+    return 0;
 }
 static int aes_cbc_plain_init(struct disk_crypto *dc, const char *secret_key)
 {
@@ -67,7 +162,7 @@ static int aes_cbc_plain_init(struct disk_crypto *dc, const char *secret_key)
 
     if (secret_key) {
         if (hex_to_bytes(secret_key, dc->key, AES_KEYLEN) == 0)
-            return 0;
+            return aes_cbc_plain_setkey(dc);
 
         // Try base64 since that was was used in fwup 1.5.0, but it turned out
         // to be inconvenient to actually use. Do not copy/paste this to other
@@ -75,7 +170,7 @@ static int aes_cbc_plain_init(struct disk_crypto *dc, const char *secret_key)
         size_t decoded_len = AES_KEYLEN;
         if (from_base64(dc->key, &decoded_len, secret_key) != NULL &&
             decoded_len == AES_KEYLEN)
-            return 0;
+            return aes_cbc_plain_setkey(dc);
     }
 
     ERR_RETURN("aes-cbc-plain requires a hex-encoded %d-bit key", AES_KEYLEN * 8);
@@ -88,47 +183,102 @@ static void aes_xts_plain64_data_unit(uint64_t lba, uint8_t data_unit[AES_BLOCKL
         data_unit[i] = (uint8_t) (lba >> (8 * i));
 }
 
-static void aes_xts_plain64_encrypt(struct disk_crypto *dc, uint64_t lba, const uint8_t *input, uint8_t *output)
+static void aes_xts_plain64_encrypt(struct disk_crypto *dc, uint64_t lba, const uint8_t *input, uint8_t *output, size_t sectors)
 {
-    uint8_t data_unit[AES_BLOCKLEN];
-    aes_xts_plain64_data_unit(lba, data_unit);
+    for (size_t i = 0; i < sectors; i++) {
+        uint8_t data_unit[AES_BLOCKLEN];
+        aes_xts_plain64_data_unit(lba + i, data_unit);
 
-    mbedtls_aes_xts_context ctx;
-    mbedtls_aes_xts_init(&ctx);
+        if (mbedtls_aes_crypt_xts(&dc->ctx.xts.enc, MBEDTLS_AES_ENCRYPT, FWUP_BLOCK_SIZE, data_unit, input, output) != 0)
+            fwup_err(EXIT_FAILURE, "mbedtls_aes_crypt_xts encrypt failed");
 
-    if (mbedtls_aes_xts_setkey_enc(&ctx, dc->key, AES_XTS_KEYLEN * 8) != 0)
-        fwup_err(EXIT_FAILURE, "mbedtls_aes_xts_setkey_enc failed");
+        input += FWUP_BLOCK_SIZE;
+        output += FWUP_BLOCK_SIZE;
+    }
+}
+static void aes_xts_plain64_decrypt(struct disk_crypto *dc, uint64_t lba, const uint8_t *input, uint8_t *output, size_t sectors)
+{
+    for (size_t i = 0; i < sectors; i++) {
+        uint8_t data_unit[AES_BLOCKLEN];
+        aes_xts_plain64_data_unit(lba + i, data_unit);
 
-    if (mbedtls_aes_crypt_xts(&ctx, MBEDTLS_AES_ENCRYPT, FWUP_BLOCK_SIZE, data_unit, input, output) != 0)
-        fwup_err(EXIT_FAILURE, "mbedtls_aes_crypt_xts encrypt failed");
+        if (mbedtls_aes_crypt_xts(&dc->ctx.xts.dec, MBEDTLS_AES_DECRYPT, FWUP_BLOCK_SIZE, data_unit, input, output) != 0)
+            fwup_err(EXIT_FAILURE, "mbedtls_aes_crypt_xts decrypt failed");
 
-    mbedtls_aes_xts_free(&ctx);
+        input += FWUP_BLOCK_SIZE;
+        output += FWUP_BLOCK_SIZE;
+    }
 }
-static void aes_xts_plain64_decrypt(struct disk_crypto *dc, uint64_t lba, const uint8_t *input, uint8_t *output)
+// Compute the tweaks for every block in a sector from the encrypted data
+// unit by repeatedly multiplying by x in GF(2^128).
+static void aes_xts_plain64_tweaks(const uint8_t *first, uint8_t *tweaks)
 {
-    uint8_t data_unit[AES_BLOCKLEN];
-    aes_xts_plain64_data_unit(lba, data_unit);
-
-    mbedtls_aes_xts_context ctx;
-    mbedtls_aes_xts_init(&ctx);
+    uint64_t lo = MBEDTLS_GET_UINT64_LE(first, 0);
+    uint64_t hi = MBEDTLS_GET_UINT64_LE(first, 8);
 
-    if (mbedtls_aes_xts_setkey_dec(&ctx, dc->key, AES_XTS_KEYLEN * 8) != 0)
-        fwup_err(EXIT_FAILURE, "mbedtls_aes_xts_setkey_dec failed");
+    for (size_t j = 0; j < FWUP_BLOCK_SIZE; j += AES_BLOCKLEN) {
+        MBEDTLS_PUT_UINT64_LE(lo, tweaks, j);
+        MBEDTLS_PUT_UINT64_LE(hi, tweaks, j + 8);
 
-    if (mbedtls_aes_crypt_xts(&ctx, MBEDTLS_AES_DECRYPT, FWUP_BLOCK_SIZE, data_unit, input, output) != 0)
-        fwup_err(EXIT_FAILURE, "mbedtls_aes_crypt_xts decrypt failed");
+        uint64_t carry = hi >> 63;
+        hi = (hi << 1) | (lo >> 63);
+        lo = (lo << 1) ^ (carry * 0x87);
+    }
+}
 
-    mbedtls_aes_xts_free(&ctx);
+static void aes_xts_plain64_crypt_accel(struct disk_crypto *dc, const mbedtls_aes_xts_context *ctx, aes_accel_fn crypt, uint64_t lba, const uint8_t *input, uint8_t *output, size_t sectors)
+{
+    uint8_t tweaks[ACCEL_BATCH_SIZE];
+    uint8_t buffer[ACCEL_BATCH_SIZE];
+
+    while (sectors > 0) {
+        size_t n = batch_sectors(sectors);
+        size_t len = n * FWUP_BLOCK_SIZE;
+
+        for (size_t i = 0; i < n; i++)
+            aes_xts_plain64_data_unit(lba + i, &buffer[i * AES_BLOCKLEN]);
+        dc->accel->encrypt(round_keys(&ctx->tweak), ctx->tweak.nr, buffer, buffer, n);
+        for (size_t i = 0; i < n; i++)
+            aes_xts_plain64_tweaks(&buffer[i * AES_BLOCKLEN], &tweaks[i * FWUP_BLOCK_SIZE]);
+
+        xor_bytes(buffer, input, tweaks, len);
+        crypt(round_keys(&ctx->crypt), ctx->crypt.nr, buffer, buffer, len / AES_BLOCKLEN);
+        xor_bytes(output, buffer, tweaks, len);
+
+        lba += n;
+        input += len;
+        output += len;
+        sectors -= n;
+    }
+}
+static void aes_xts_plain64_encrypt_accel(struct disk_crypto *dc, uint64_t lba, const uint8_t *input, uint8_t *output, size_t sectors)
+{
+    aes_xts_plain64_crypt_accel(dc, &dc->ctx.xts.enc, dc->accel->encrypt, lba, input, output, sectors);
+}
+static void aes_xts_plain64_decrypt_accel(struct disk_crypto *dc, uint64_t lba, const uint8_t *input, uint8_t *output, size_t sectors)
+{
+    aes_xts_plain64_crypt_accel(dc, &dc->ctx.xts.dec, dc->accel->decrypt, lba, input, output, sectors);
 }
 static int aes_xts_plain64_init(struct disk_crypto *dc, const char *secret_key)
 {
     dc->encrypt = aes_xts_plain64_encrypt;
     dc->decrypt = aes_xts_plain64_decrypt;
 
-    if (secret_key && hex_to_bytes(secret_key, dc->key, AES_XTS_KEYLEN) == 0)
-        return 0;
+    if (!secret_key || hex_to_bytes(secret_key, dc->key, AES_XTS_KEYLEN) != 0)
+        ERR_RETURN("aes-xts-plain64 requires a hex-encoded %d-bit key", AES_XTS_KEYLEN * 8);
 
-    ERR_RETURN("aes-xts-plain64 requires a hex-encoded %d-bit key", AES_XTS_KEYLEN * 8);
+    mbedtls_aes_xts_init(&dc->ctx.xts.enc);
+    mbedtls_aes_xts_init(&dc->ctx.xts.dec);
+
+    if (mbedtls_aes_xts_setkey_enc(&dc->ctx.xts.enc, dc->key, AES_XTS_KEYLEN * 8) != 0 ||
+        mbedtls_aes_xts_setkey_dec(&dc->ctx.xts.dec, dc->key, AES_XTS_KEYLEN * 8) != 0)
+        ERR_RETURN("Failed to expand the aes-xts-plain64 key");
+
+    if (dc->accel->encrypt) {
+        dc->encrypt = aes_xts_plain64_encrypt_accel;
+        dc->decrypt = aes_xts_plain64_decrypt_accel;
+    }
+    return 0;
 }
 
 static int min(int a, int b)
@@ -136,10 +286,11 @@ static int min(int a, int b)
     return (a < b) ? a : b;
 }
 
-static int parse_options(int argc, const char *argv[], char *cipher, char *secret)
+static int parse_options(int argc, const char *argv[], char *cipher, char *secret, int *threads)
 {
     memset(cipher, 0, MAX_CIPHER_LEN + 1);
     memset(secret, 0, MAX_SECRET_LEN + 1);
+    *threads = 1;
 
     for (int i = 0; i < argc; i++) {
         const char *key;
@@ -166,7 +317,13 @@ static int parse_options(int argc, const char *argv[], char *cipher, char *secre
                 strncpy(cipher, value, min(MAX_CIPHER_LEN, value_len));
             else if (strncmp(key, "secret=", 7) == 0)
                 strncpy(secret, value, min(MAX_SECRET_LEN, value_len));
-            else
+            else if (strncmp(key, "threads=", 8) == 0) {
+                char *endptr;
+                long n = strtol(value, &endptr, 10);
+                if (endptr == value || endptr != value + value_len || n < 0)
+                    ERR_RETURN("Expecting a non-negative number of threads: %s", key);
+                *threads = n > DISK_CRYPTO_MAX_WORKERS ? DISK_CRYPTO_MAX_WORKERS : (int) n;
+            } else
                 ERR_RETURN("Unexpected parameter: %s", key);
 
             key = next_key;
@@ -181,12 +338,46 @@ static int parse_options(int argc, const char *argv[], char *cipher, char *secre
     return 0;
 }
 
+static void crypt_job(void *void_dc, int job)
+{
+    struct disk_crypto *dc = (struct disk_crypto *) void_dc;
+    size_t first = (size_t) job * DISK_CRYPTO_JOB_SECTORS;
+    size_t sectors = dc->run_sectors - first;
+    if (sectors > DISK_CRYPTO_JOB_SECTORS)
+        sectors = DISK_CRYPTO_JOB_SECTORS;
+
+    size_t offset = first * FWUP_BLOCK_SIZE;
+    dc->run_fun(dc, dc->run_lba + first, dc->run_input + offset, dc->run_output + offset, sectors);
+}
+
+// Encrypt or decrypt a run of sectors. XTS and CBC with the plain IV don't
+// chain between sectors, so large runs are spread across the workers.
+static void crypt_run(struct disk_crypto *dc, disk_crypto_fun *fun, const uint8_t *input, uint8_t *output, size_t count, off_t offset)
+{
+    uint64_t lba = (uint64_t) ((offset - dc->base_offset) / FWUP_BLOCK_SIZE);
+    size_t sectors = count / FWUP_BLOCK_SIZE;
+
+    if (dc->pool.num_threads > 0 && sectors >= 2 * DISK_CRYPTO_JOB_SECTORS) {
+        dc->run_fun = fun;
+        dc->run_lba = lba;
+        dc->run_input = input;
+        dc->run_output = output;
+        dc->run_sectors = sectors;
+        work_pool_run(&dc->pool, crypt_job, dc, (int) ((sectors + DISK_CRYPTO_JOB_SECTORS - 1) / DISK_CRYPTO_JOB_SECTORS));
+        return;
+    }
+
+    fun(dc, lba, input, output, sectors);
+}
+
 /**
  * Initialize a disk crypto session
  *
  * @param dc session info
  * @param argc argument count  which cipher (e.g., "aes-cbc-plain")
- * @param argv arguments (e.g. "cipher=aes-cbc-plain,secret=<base64 encoded>")
+ * @param argv arguments (e.g. "cipher=aes-cbc-plain,secret=<base64 encoded>"). An
+ *             optional "threads=<n>" encrypts large writes on n threads. The
+ *             default is 1 and 0 uses one thread per CPU.
  * @param base_offset subtract this offset from every block being written
  * @return 0 on success
  */
@@ -194,11 +385,14 @@ int disk_crypto_init(struct disk_crypto *dc, off_t base_offset, int argc, const
 {
     char cipher[MAX_CIPHER_LEN + 1];
     char secret[MAX_SECRET_LEN + 1];
+    int threads;
 
-    OK_OR_RETURN(parse_options(argc, argv, cipher, secret));
+    OK_OR_RETURN(parse_options(argc, argv, cipher, secret, &threads));
 
     memset(dc, 0, sizeof(*dc));
     dc->base_offset = base_offset;
+    dc->accel = aes_accel_current();
+    work_pool_init(&dc->pool, (threads > 0 ? threads : work_pool_cpus(DISK_CRYPTO_MAX_WORKERS)) - 1);
 
     if (strcmp(cipher, "aes-cbc-plain") == 0)
         return aes_cbc_plain_init(dc, secret);
@@ -218,15 +412,7 @@ int disk_crypto_init(struct disk_crypto *dc, off_t base_offset, int argc, const
  */
 void disk_crypto_encrypt(struct disk_crypto *dc, const uint8_t *input, uint8_t *output, size_t count, off_t offset)
 {
-    uint64_t lba = (uint64_t) ((offset - dc->base_offset) / FWUP_BLOCK_SIZE);
-    uint64_t last_lba = lba + (uint64_t) (count / FWUP_BLOCK_SIZE);
-
-    while (lba < last_lba) {
-        dc->encrypt(dc, lba, input, output);
-        lba++;
-        input += FWUP_BLOCK_SIZE;
-        output += FWUP_BLOCK_SIZE;
-    }
+    crypt_run(dc, dc->encrypt, input, output, count, offset);
 }
 
 /**
@@ -239,15 +425,7 @@ void disk_crypto_encrypt(struct disk_crypto *dc, const uint8_t *input, uint8_t *
  */
 void disk_crypto_decrypt(struct disk_crypto *dc, const uint8_t *input, uint8_t *output, size_t count, off_t offset)
 {
-    uint64_t lba = (uint64_t) ((offset - dc->base_offset) / FWUP_BLOCK_SIZE);
-    uint64_t last_lba = lba + (uint64_t) (count / FWUP_BLOCK_SIZE);
-
-    while (lba < last_lba) {
-        dc->decrypt(dc, lba, input, output);
-        lba++;
-        input += FWUP_BLOCK_SIZE;
-        output += FWUP_BLOCK_SIZE;
-    }
+    crypt_run(dc, dc->decrypt, input, output, count, offset);
 }
 
 /**
@@ -257,5 +435,8 @@ void disk_crypto_decrypt(struct disk_crypto *dc, const uint8_t *input, uint8_t *
  */
 void disk_crypto_free(struct disk_crypto *dc)
 {
-    memset(dc, 0, sizeof(struct disk_crypto));
+    work_pool_free(&dc->pool);
+
+    // This wipes the expanded key schedules too
+    mbedtls_platform_zeroize(dc, sizeof(struct disk_crypto));
 }
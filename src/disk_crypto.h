@@ -18,15 +18,48 @@
 #define DISK_CRYPTO_H
 
 #include "util.h"
+#include "work_pool.h"
+#include "aes_accel.h"
+#include "3rdparty/mbedtls/mbedtls_aes.h"
+
+#define DISK_CRYPTO_MAX_WORKERS 8
 
 struct disk_crypto;
-typedef void (disk_crypto_fun)(struct disk_crypto *dc, uint64_t lba, const uint8_t *input, uint8_t *output);
+
+// Encrypt or decrypt `sectors` consecutive 512-byte sectors starting at `lba`
+typedef void (disk_crypto_fun)(struct disk_crypto *dc, uint64_t lba, const uint8_t *input, uint8_t *output, size_t sectors);
 
 struct disk_crypto {
     disk_crypto_fun *encrypt;
     disk_crypto_fun *decrypt;
     uint8_t key[64]; // 32 bytes for aes-cbc-plain; 64 bytes for aes-xts-plain64 (AES-256-XTS)
     off_t base_offset;
+
+    // Multi-block AES instructions if the CPU has them
+    const struct aes_accel *accel;
+
+    // Key schedules are expanded once in disk_crypto_init
+    union {
+        struct {
+            mbedtls_aes_context enc;
+            mbedtls_aes_context dec;
+        } cbc;
+        struct {
+            mbedtls_aes_xts_context enc;
+            mbedtls_aes_xts_context dec;
+        } xts;
+    } ctx;
+
+    // Large runs of sectors are split up between worker threads. The
+    // threads are started on the first large run.
+    struct work_pool pool;
+
+    // The run being processed
+    disk_crypto_fun *run_fun;
+    uint64_t run_lba;
+    const uint8_t *run_input;
+    uint8_t *run_output;
+    size_t run_sectors;
 };
 
 int disk_crypto_init(struct disk_crypto *dc, off_t base_offset, int argc, const char *argv[]);
@@ -34,6 +67,4 @@ void disk_crypto_encrypt(struct disk_crypto *dc, const uint8_t *input, uint8_t *
 void disk_crypto_decrypt(struct disk_crypto *dc, const uint8_t *input, uint8_t *output, size_t count, off_t offset);
 void disk_crypto_free(struct disk_crypto *dc);
 
-#endif // EVAL_MATH_H
-
-
+#endif // DISK_CRYPTO_H
@@ -22,6 +22,7 @@
 #include "3rdparty/fatfs/source/diskio.h"  /* FatFs lower layer API */
 #include "util.h"
 #include "block_cache.h"
+#include "pad_to_block_writer.h"
 
 #include <string.h>
 #include <stdlib.h>
@@ -49,6 +50,40 @@ static int next_mount_ = 0;
 static char *current_file_ = NULL;
 static FIL fil_;
 
+// Writes to the open file are synced to the directory entry and FAT after
+// each write. In buffered mode, they're synced every this many bytes instead.
+// The file is always synced when it's closed.
+#define FATFS_SYNC_INTERVAL (4 * 1024 * 1024)
+#define FATFS_ZERO_FILL_SIZE (128 * 1024)
+
+static bool buffered_ = false;
+static size_t unsynced_bytes_ = 0;
+static char zero_buffer_[FATFS_ZERO_FILL_SIZE];
+
+// When fat_write knows the final size of a file, it's allocated as one
+// contiguous run of clusters up front. Sequential writes then go directly to
+// the clusters through the block cache. Anything skipped over gets
+// zero-filled. The directory entry's size follows the data that's been
+// written and is synced on the same schedule as normal writes, so an
+// interrupted write doesn't leave a full-sized file.
+static bool preallocated_ = false;
+static off_t prealloc_offset_;
+static FSIZE_t prealloc_size_;
+static FSIZE_t prealloc_written_;
+static struct pad_to_block_writer prealloc_ptbw_;
+
+// The file being read by fatfs_pread is kept open separately from the one
+// being written so that delta updates can read a source file while writing
+// the new one. Reads use FatFs's fast seek so that seeking doesn't walk the
+// FAT cluster chain each time.
+#define FATFS_INITIAL_CLMT_LEN 64
+
+static char *read_file_ = NULL;
+static TCHAR read_mount_path_[3];
+static FIL read_fil_;
+static DWORD *read_clmt_ = NULL;
+static size_t read_clmt_len_ = 0;
+
 const char *fatfs_error_to_string(FRESULT err)
 {
     switch (err) {
@@ -90,6 +125,55 @@ static FRESULT fatfs_error(const char *context, const char *filename, FRESULT rc
 #define CHECK_CLEANUP(CONTEXT, FILENAME, CMD) do { if (fatfs_error(CONTEXT, FILENAME, CMD) != FR_OK) { rc = -1; goto cleanup; } } while (0)
 #define CHECK_SYNC(FILENAME, FIL) CHECK("sync", FILENAME, f_sync(FIL))
 
+static void close_read_file()
+{
+    if (read_file_) {
+        f_close(&read_fil_);
+        free(read_file_);
+        read_file_ = NULL;
+    }
+}
+
+static bool is_read_file(const TCHAR *mount_path, const char *filename)
+{
+    return read_file_ &&
+           strcmp(read_mount_path_, mount_path) == 0 &&
+           strcmp(read_file_, filename) == 0;
+}
+
+// Build a cluster link map table for the file so that it can be seeked
+// without walking the FAT. The table is grown if the file has more fragments
+// than fit.
+static FRESULT create_link_map(FIL *fp, DWORD **clmt, size_t *clmt_len)
+{
+    if (!*clmt) {
+        *clmt_len = FATFS_INITIAL_CLMT_LEN;
+        *clmt = malloc(*clmt_len * sizeof(DWORD));
+        if (!*clmt)
+            fwup_err(EXIT_FAILURE, "malloc");
+    }
+
+    for (;;) {
+        fp->cltbl = *clmt;
+        (*clmt)[0] = (DWORD) *clmt_len;
+        FRESULT res = f_lseek(fp, CREATE_LINKMAP);
+        if (res != FR_NOT_ENOUGH_CORE)
+            return res;
+
+        // FatFs reports the size that's needed
+        *clmt_len = (*clmt)[0];
+        *clmt = realloc(*clmt, *clmt_len * sizeof(DWORD));
+        if (!*clmt)
+            fwup_err(EXIT_FAILURE, "realloc");
+    }
+}
+
+// Return the byte offset in the output of a cluster
+static off_t cluster_to_offset(FATFS *fs, DWORD cluster)
+{
+    return FWUP_BLOCK_SIZE * (mounted_[fs->pdrv].block_offset + (off_t) fs->database + (off_t) (cluster - 2) * fs->csize);
+}
+
 static void index_to_mount_path(int index, TCHAR *mount_path)
 {
     mount_path[0] = '0' + index;
@@ -128,6 +212,10 @@ static int maybe_mount(struct block_cache *block_cache, off_t block_offset, size
     // Try to mount
     mounted_[next_mount_].output = NULL;
 
+    // Any file being read on the old mount is no longer valid
+    if (read_file_ && read_mount_path_[0] == '0' + next_mount_)
+        close_read_file();
+
     // Make sure the fatfs's logical path to the drive is the cached index for ease of lookup.
     index_to_mount_path(next_mount_, mount_path);
     CHECK("fat_mount", NULL, f_mount(&mounted_[next_mount_].fs, mount_path, 0));
@@ -153,6 +241,9 @@ int fatfs_mkfs(struct block_cache *output, off_t block_offset, size_t block_coun
     TCHAR mount_path[3];
     OK_OR_RETURN(maybe_mount(output, block_offset, block_count, mount_path));
 
+    // Formatting invalidates anything being read
+    close_read_file();
+
     // Since we're going to format, clear out all blocks in the cache
     // in the formatted range. Additionally, mark these blocks so that
     // they don't need to be written to disk. If the format code writes
@@ -207,7 +298,16 @@ static void close_open_files()
         f_close(&fil_);
         free(current_file_);
         current_file_ = NULL;
+        unsynced_bytes_ = 0;
+        buffered_ = false;
+    }
+    if (preallocated_) {
+        // Keep whatever was written to the partial block. Errors are
+        // ignored like they are for f_close.
+        ptbw_flush(&prealloc_ptbw_);
+        preallocated_ = false;
     }
+    close_read_file();
 }
 
 /**
@@ -330,6 +430,7 @@ int fatfs_mv(struct block_cache *output, off_t block_offset, const char *cmd, co
  */
 int fatfs_cp(struct block_cache *output, off_t from_offset, const char *from_name, off_t to_offset, const char *to_name)
 {
+    int rc = 0;
     close_open_files();
     TCHAR from_mount_path[3];
     TCHAR to_mount_path[3];
@@ -345,24 +446,76 @@ int fatfs_cp(struct block_cache *output, off_t from_offset, const char *from_nam
     FIL tofil;
     CHECK("fatfs_cp can't open file", from_name, f_open(&fromfil, absolute_from_name, FA_READ));
     CHECK("fatfs_cp can't open file", to_name, f_open(&tofil, absolute_to_name, FA_CREATE_ALWAYS | FA_WRITE));
-    CHECK_SYNC(to_name, &tofil);
-
-    for (;;) {
-        char buffer[4096];
-        UINT bw, br;
 
-        CHECK("fatfs_cp can't read", from_name, f_read(&fromfil, buffer, sizeof(buffer), &br));
-        if (br == 0)
-            break;
-
-        CHECK("fatfs_cp can't write", to_name, f_write(&tofil, buffer, br, &bw));
-        if (br != bw)
-            ERR_RETURN("Error copying file to FAT");
-        CHECK_SYNC(to_name, &tofil);
+    char *buffer = malloc(BLOCK_CACHE_SEGMENT_SIZE);
+    DWORD *clmt = NULL;
+    size_t clmt_len = 0;
+    if (!buffer)
+        fwup_err(EXIT_FAILURE, "malloc");
+
+    FSIZE_t size = f_size(&fromfil);
+    FRESULT res = size ? f_expand(&tofil, size, 1) : FR_OK;
+    if (size && res == FR_OK) {
+        // The destination is one contiguous run of clusters, so copy each
+        // fragment of the source to it directly through the block cache.
+        CHECK_CLEANUP("fatfs_cp can't map file", from_name, create_link_map(&fromfil, &clmt, &clmt_len));
+
+        FATFS *fromfs = fromfil.obj.fs;
+        off_t to_data_offset = cluster_to_offset(tofil.obj.fs, tofil.obj.sclust);
+        FSIZE_t copied = 0;
+        for (DWORD *fragment = &clmt[1]; fragment[0] && copied < size; fragment += 2) {
+            off_t from_data_offset = cluster_to_offset(fromfs, fragment[1]);
+            FSIZE_t fragment_len = (FSIZE_t) fragment[0] * fromfs->csize * FWUP_BLOCK_SIZE;
+            if (fragment_len > size - copied)
+                fragment_len = size - copied;
+
+            while (fragment_len) {
+                size_t len = fragment_len < BLOCK_CACHE_SEGMENT_SIZE ? (size_t) fragment_len : BLOCK_CACHE_SEGMENT_SIZE;
+                OK_OR_CLEANUP_MSG(block_cache_pread(output, buffer, len, from_data_offset),
+                                  "fatfs_cp can't read %s", from_name);
+
+                // Zero out the rest of the final sector
+                size_t padded_len = (len + FWUP_BLOCK_SIZE - 1) & ~(FWUP_BLOCK_SIZE - 1);
+                memset(&buffer[len], 0, padded_len - len);
+                OK_OR_CLEANUP_MSG(block_cache_pwrite(output, buffer, padded_len, to_data_offset + copied, true),
+                                  "fatfs_cp can't write %s", to_name);
+
+                from_data_offset += len;
+                copied += len;
+                fragment_len -= len;
+            }
+        }
+        if (copied != size)
+            ERR_CLEANUP_MSG("fatfs_cp: %s is shorter than its directory entry", from_name);
+    } else if (size) {
+        // No contiguous space, so let FatFs allocate clusters as it goes.
+        if (res != FR_DENIED)
+            CHECK_CLEANUP("fatfs_cp can't allocate file", to_name, res);
+
+        for (;;) {
+            UINT bw, br;
+
+            CHECK_CLEANUP("fatfs_cp can't read", from_name, f_read(&fromfil, buffer, BLOCK_CACHE_SEGMENT_SIZE, &br));
+            if (br == 0)
+                break;
+
+            CHECK_CLEANUP("fatfs_cp can't write", to_name, f_write(&tofil, buffer, br, &bw));
+            if (br != bw)
+                ERR_CLEANUP_MSG("Error copying file to FAT");
+        }
     }
+
+cleanup:
     f_close(&fromfil);
-    f_close(&tofil);
-    return 0;
+
+    // Closing syncs the destination's directory entry
+    res = f_close(&tofil);
+    if (rc == 0 && fatfs_error("fatfs_cp can't close", to_name, res) != FR_OK)
+        rc = -1;
+
+    free(clmt);
+    free(buffer);
+    return rc;
 }
 
 /**
@@ -506,7 +659,15 @@ cleanup:
     return rc;
 }
 
-int fatfs_truncate(struct block_cache *output, off_t block_offset, const char *filename)
+/**
+ * @brief fatfs_truncate Create or truncate a file and keep it open for writing
+ *
+ * @param filename the file
+ * @param buffered true to only sync the file every FATFS_SYNC_INTERVAL bytes
+ *                 and when it's closed rather than after every write
+ * @return 0 on success
+ */
+int fatfs_truncate(struct block_cache *output, off_t block_offset, const char *filename, bool buffered)
 {
     // Check if this is the same file as a previous pwrite call
     if (current_file_ && strcmp(current_file_, filename) != 0)
@@ -515,6 +676,10 @@ int fatfs_truncate(struct block_cache *output, off_t block_offset, const char *f
     TCHAR mount_path[3];
     OK_OR_RETURN(maybe_mount(output, block_offset, 0, mount_path));
 
+    // Modifying a file invalidates its fast seek table
+    if (is_read_file(mount_path, filename))
+        close_read_file();
+
     TCHAR absolute_filename[FATFS_MAX_PATH];
     concatenate_path(mount_path, filename, absolute_filename);
 
@@ -526,16 +691,92 @@ int fatfs_truncate(struct block_cache *output, off_t block_offset, const char *f
         // Assuming it opens ok, cache the filename for future writes.
         current_file_ = strdup(filename);
     } else {
-        // Truncate an already open file
+        // Truncate an already open file. If it was preallocated, extend it
+        // to cover all of its clusters so that f_truncate frees them.
+        if (preallocated_)
+            CHECK("Can't seek to the end", filename, f_lseek(&fil_, prealloc_size_));
         CHECK("Can't seek to the beginning", filename, f_lseek(&fil_, 0));
         CHECK("Can't truncate file on FAT partition", filename, f_truncate(&fil_));
         CHECK_SYNC(filename, &fil_);
+        unsynced_bytes_ = 0;
+        preallocated_ = false;
     }
+    buffered_ = buffered;
 
     // Leave the file open since the main use case is to start writing to it afterwards.
     return 0;
 }
 
+/**
+ * @brief fatfs_preallocate Allocate contiguous space for a file
+ *
+ * This is called after fatfs_truncate when the final size of the file is
+ * known. If there's a contiguous run of free clusters that's big enough, the
+ * file is grown to its final size and subsequent fatfs_pwrite calls write
+ * straight to the clusters. Otherwise, writes go through FatFs like normal.
+ *
+ * @param filename the file that was just truncated
+ * @param size the final size of the file
+ * @return 0 on success
+ */
+int fatfs_preallocate(struct block_cache *output, off_t block_offset, const char *filename, off_t size)
+{
+    if (!current_file_ || strcmp(current_file_, filename) != 0 || f_size(&fil_) != 0)
+        ERR_RETURN("fat_write: %s must be truncated before preallocating", filename);
+
+    // Let the normal path handle empty files and report files that are too big
+    if (size <= 0 || size > 0xffffffff)
+        return 0;
+
+    TCHAR mount_path[3];
+    OK_OR_RETURN(maybe_mount(output, block_offset, 0, mount_path));
+
+    FRESULT res = f_expand(&fil_, (FSIZE_t) size, 1);
+    if (res == FR_DENIED)
+        return 0;
+
+    CHECK("fat_write can't allocate file", filename, res);
+
+    // Record the clusters, but not the size, until data is written.
+    fil_.obj.objsize = 0;
+    CHECK_SYNC(filename, &fil_);
+
+    preallocated_ = true;
+    prealloc_offset_ = cluster_to_offset(fil_.obj.fs, fil_.obj.sclust);
+    prealloc_size_ = (FSIZE_t) size;
+    prealloc_written_ = 0;
+    ptbw_init(&prealloc_ptbw_, output, NULL);
+    return 0;
+}
+
+static int zero_fill_preallocated(const char *filename, FSIZE_t end)
+{
+    while (prealloc_written_ < end) {
+        size_t len = (end - prealloc_written_ < sizeof(zero_buffer_) ? (size_t) (end - prealloc_written_) : sizeof(zero_buffer_));
+        OK_OR_RETURN_MSG(ptbw_pwrite(&prealloc_ptbw_, (const uint8_t *) zero_buffer_, len, prealloc_offset_ + prealloc_written_),
+                         "fat_write can't write %s", filename);
+        prealloc_written_ += len;
+    }
+    return 0;
+}
+
+// Finish writing a preallocated file so that FatFs can take over
+static int end_preallocation(const char *filename)
+{
+    if (!preallocated_)
+        return 0;
+
+    preallocated_ = false;
+    OK_OR_RETURN(zero_fill_preallocated(filename, prealloc_size_));
+    OK_OR_RETURN_MSG(ptbw_flush(&prealloc_ptbw_), "fat_write can't write %s", filename);
+
+    // Seeking past the end in write mode sets the file size
+    CHECK("fat_write can't extend file", filename, f_lseek(&fil_, prealloc_size_));
+    CHECK_SYNC(filename, &fil_);
+    unsynced_bytes_ = 0;
+    return 0;
+}
+
 /**
  * @brief fatfs_pread Read a file
  *
@@ -551,16 +792,38 @@ int fatfs_pread(struct block_cache *output, off_t block_offset, const char *file
     TCHAR mount_path[3];
     OK_OR_RETURN(maybe_mount(output, block_offset, 0, mount_path));
 
-    TCHAR absolute_filename[FATFS_MAX_PATH];
-    concatenate_path(mount_path, filename, absolute_filename);
+    if (!is_read_file(mount_path, filename)) {
+        close_read_file();
+
+        // Make sure that the directory entry is current if reading a file
+        // that's being written.
+        if (current_file_ && strcmp(current_file_, filename) == 0) {
+            OK_OR_RETURN(end_preallocation(filename));
+            if (unsynced_bytes_) {
+                CHECK_SYNC(filename, &fil_);
+                unsynced_bytes_ = 0;
+            }
+        }
+
+        TCHAR absolute_filename[FATFS_MAX_PATH];
+        concatenate_path(mount_path, filename, absolute_filename);
 
-    FIL tmp_fil;
-    CHECK("fat_pread can't open file", filename, f_open(&tmp_fil, absolute_filename, FA_READ));
-    CHECK("fat_pread can't seek to end of file", filename, f_lseek(&tmp_fil, offset));
+        CHECK("fat_pread can't open file", filename, f_open(&read_fil_, absolute_filename, FA_READ));
+
+        FRESULT res = create_link_map(&read_fil_, &read_clmt_, &read_clmt_len_);
+        if (fatfs_error("fat_pread can't map file", filename, res) != FR_OK) {
+            f_close(&read_fil_);
+            return -1;
+        }
+
+        read_file_ = strdup(filename);
+        strcpy(read_mount_path_, mount_path);
+    }
+
+    CHECK("fat_pread can't seek to end of file", filename, f_lseek(&read_fil_, offset));
 
     UINT br = 0;
-    CHECK("fat_read can't read", filename, f_read(&tmp_fil, buffer, (UINT) size, &br));
-    f_close(&tmp_fil);
+    CHECK("fat_read can't read", filename, f_read(&read_fil_, buffer, (UINT) size, &br));
 
     return (int) br;
 }
@@ -574,6 +837,10 @@ int fatfs_pwrite(struct block_cache *output, off_t block_offset, const char *fil
     TCHAR mount_path[3];
     OK_OR_RETURN(maybe_mount(output, block_offset, 0, mount_path));
 
+    // Modifying a file invalidates its fast seek table
+    if (is_read_file(mount_path, filename))
+        close_read_file();
+
     TCHAR absolute_filename[FATFS_MAX_PATH];
     concatenate_path(mount_path, filename, absolute_filename);
 
@@ -585,8 +852,35 @@ int fatfs_pwrite(struct block_cache *output, off_t block_offset, const char *fil
         current_file_ = strdup(filename);
     }
 
-    // Check if this pwrite requires a seek.
     FSIZE_t desired_offset = offset;
+    if (preallocated_) {
+        if (desired_offset >= prealloc_written_ && desired_offset + size <= prealloc_size_) {
+            unsynced_bytes_ += desired_offset + size - prealloc_written_;
+            OK_OR_RETURN(zero_fill_preallocated(filename, desired_offset));
+            OK_OR_RETURN_MSG(ptbw_pwrite(&prealloc_ptbw_, (const uint8_t *) buffer, size, prealloc_offset_ + desired_offset),
+                             "fat_write can't write %s", filename);
+            prealloc_written_ = desired_offset + size;
+
+            // Write out the final partial block once the file is complete
+            if (prealloc_written_ == prealloc_size_) {
+                OK_OR_RETURN(end_preallocation(filename));
+            } else if (!buffered_ || unsynced_bytes_ >= FATFS_SYNC_INTERVAL) {
+                // Only count whole blocks since the partial one is still
+                // buffered. Block-aligned seeks don't read from the disk.
+                FSIZE_t synced_size = prealloc_written_ & ~(FSIZE_t) (FWUP_BLOCK_SIZE - 1);
+                CHECK("fat_write can't extend file", filename, f_lseek(&fil_, synced_size));
+                CHECK_SYNC(filename, &fil_);
+                unsynced_bytes_ = 0;
+            }
+            return 0;
+        }
+
+        // Writing out of order or past the preallocated size, so let FatFs
+        // take over.
+        OK_OR_RETURN(end_preallocation(filename));
+    }
+
+    // Check if this pwrite requires a seek.
     if (desired_offset != f_tell(&fil_)) {
         // Need to seek, but if we're seeking past the end, be sure to fill in with zeros.
         if (desired_offset > f_size(&fil_)) {
@@ -594,17 +888,19 @@ int fatfs_pwrite(struct block_cache *output, off_t block_offset, const char *fil
             CHECK("fat_write can't seek to end of file", filename, f_lseek(&fil_, f_size(&fil_)));
 
             // Write zeros.
-            UINT zero_count = desired_offset - f_tell(&fil_);
-            char zero_buffer[FWUP_BLOCK_SIZE];
-            memset(zero_buffer, 0, sizeof(zero_buffer));
+            FSIZE_t zero_count = desired_offset - f_tell(&fil_);
             while (zero_count) {
-                UINT btw = (zero_count < sizeof(zero_buffer) ? zero_count : sizeof(zero_buffer));
+                UINT btw = (zero_count < sizeof(zero_buffer_) ? (UINT) zero_count : sizeof(zero_buffer_));
                 UINT bw;
-                CHECK("fat_write can't write", filename, f_write(&fil_, zero_buffer, btw, &bw));
+                CHECK("fat_write can't write", filename, f_write(&fil_, zero_buffer_, btw, &bw));
                 if (btw != bw)
-                    ERR_RETURN("Error writing file to FAT: %s, expected %ld bytes written, got %u (maybe the disk is full?)", filename, size, bw);
-                CHECK_SYNC(filename, &fil_);
+                    ERR_RETURN("Error writing file to FAT: %s, expected %u bytes written, got %u (maybe the disk is full?)", filename, btw, bw);
                 zero_count -= bw;
+                unsynced_bytes_ += bw;
+            }
+            if (!buffered_) {
+                CHECK_SYNC(filename, &fil_);
+                unsynced_bytes_ = 0;
             }
         } else {
             CHECK("fat_write can't seek in file", filename, f_lseek(&fil_, desired_offset));
@@ -615,7 +911,12 @@ int fatfs_pwrite(struct block_cache *output, off_t block_offset, const char *fil
     CHECK("fat_write can't write", filename, f_write(&fil_, buffer, size, &bw));
     if (size != bw)
         ERR_RETURN("Error writing file to FAT: %s, expected %ld bytes written, got %u (maybe the disk is full?)", filename, size, bw);
-    CHECK_SYNC(filename, &fil_);
+
+    unsynced_bytes_ += bw;
+    if (!buffered_ || unsynced_bytes_ >= FATFS_SYNC_INTERVAL) {
+        CHECK_SYNC(filename, &fil_);
+        unsynced_bytes_ = 0;
+    }
 
     return 0;
 }
@@ -624,6 +925,13 @@ void fatfs_closefs()
 {
     close_open_files();
 
+    free(read_clmt_);
+    read_clmt_ = NULL;
+    read_clmt_len_ = 0;
+
+    // Directory contents are cached across calls for the life of the mounts
+    ff_dircache_clear();
+
     for (int i = 0; i < FF_VOLUMES; i++) {
         if (mounted_[i].output) {
             // This unmounts. Ignore errors.
@@ -634,6 +942,31 @@ void fatfs_closefs()
     next_mount_ = 0;
 }
 
+// Return true if the sector holds file data rather than filesystem
+// metadata. Writes to file data are "streamed" to the block cache so that
+// they're written to disk as soon as possible. The reserved sectors, FATs and
+// root directory change frequently, so they're kept in the cache.
+static bool is_data_sector(const FATFS *fs, LBA_t sector)
+{
+    if (fs->fs_type == 0) {
+        // Not mounted (i.e., f_mkfs is running), so guess that the
+        // metadata is in the first 1 MB.
+        return sector > 2048;
+    }
+
+    if (sector < fs->database)
+        return false;
+
+    // The FAT32 root directory is in the data region
+    if (fs->fs_type == FS_FAT32) {
+        LBA_t root_dir = fs->database + (LBA_t) (fs->dirbase - 2) * fs->csize;
+        if (sector >= root_dir && sector < root_dir + fs->csize)
+            return false;
+    }
+
+    return true;
+}
+
 // Implementation of callbacks
 DSTATUS disk_initialize(BYTE pdrv)				/* Physical drive number (0..) */
 {
@@ -667,11 +1000,7 @@ DRESULT disk_write(BYTE pdrv,			/* Physical drive number (0..) */
     if (pdrv < 0 || pdrv >= FF_VOLUMES || mounted_[pdrv].output == NULL)
         return RES_PARERR;
 
-    // Arbitrarily tell the cache that any sector after 1 MB is a "streamed
-    // write". This means that it will be optimistically written to disk and
-    // not cached. There are two copies of the FAT at the beginning so try to
-    // keep in memory as those change frequently.
-    bool streamed = (sector > 2048);
+    bool streamed = is_data_sector(&mounted_[pdrv].fs, sector);
     if (block_cache_pwrite(mounted_[pdrv].output, buff, FWUP_BLOCK_SIZE * count, FWUP_BLOCK_SIZE * (mounted_[pdrv].block_offset + sector), streamed) < 0)
         return RES_ERROR;
     else
@@ -728,3 +1057,13 @@ DWORD get_fattime()
 {
     return fattime_;
 }
+
+void *ff_memalloc(UINT msize)
+{
+    return malloc(msize);
+}
+
+void ff_memfree(void *mblock)
+{
+    free(mblock);
+}
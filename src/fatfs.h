@@ -37,7 +37,8 @@ int fatfs_mkdir(struct block_cache *output, off_t block_offset, const char *dir)
 int fatfs_setlabel(struct block_cache *output, off_t block_offset, const char *label);
 int fatfs_mv(struct block_cache *output, off_t block_offset, const char *cmd, const char *from_name, const char *to_name, bool force);
 int fatfs_rm(struct block_cache *output, off_t block_offset, const char *cmd, const char *filename, bool file_must_exist);
-int fatfs_truncate(struct block_cache *output, off_t block_offset, const char *filename);
+int fatfs_truncate(struct block_cache *output, off_t block_offset, const char *filename, bool buffered);
+int fatfs_preallocate(struct block_cache *output, off_t block_offset, const char *filename, off_t size);
 int fatfs_pread(struct block_cache *output, off_t block_offset, const char *filename, int offset, size_t size, void *buffer);
 int fatfs_pwrite(struct block_cache *output, off_t block_offset, const char *filename, int offset, const char *buffer, off_t size);
 int fatfs_cp(struct block_cache *output, off_t from_offset, const char *from_name, off_t to_offset, const char *to_name);
@@ -27,6 +27,7 @@
 #include "sparse_file.h"
 #include "progress.h"
 #include "pad_to_block_writer.h"
+#include "resource_hash.h"
 
 #include <assert.h>
 #include <errno.h>
@@ -215,6 +216,49 @@ int fun_apply_funlist(struct fun_context *fctx, cfg_opt_t *funlist, int (*fun)(s
     return 0;
 }
 
+/**
+ * @brief Find where a funlist writes resource data
+ *
+ * Only raw_write and fat_write say where the data goes. This is a hint for
+ * ordering resources, so malformed funlists just stop the search.
+ *
+ * @param funlist the list
+ * @param first set to the lowest block offset or UINT64_MAX if not known
+ * @param last set to the highest block offset or 0 if not known
+ * @return true if every function in the list is a raw_write
+ */
+bool fun_funlist_block_offsets(cfg_opt_t *funlist, uint64_t *first, uint64_t *last)
+{
+    bool all_raw_write = true;
+    int ix = 0;
+    char *aritystr;
+
+    *first = UINT64_MAX;
+    *last = 0;
+    while ((aritystr = cfg_opt_getnstr(funlist, ix)) != NULL) {
+        int argc = strtoul(aritystr, NULL, 0);
+        if (argc <= 0 || argc > FUN_MAX_ARGS)
+            return false;
+
+        const char *fun = cfg_opt_getnstr(funlist, ix + 1);
+        const char *arg = argc > 1 ? cfg_opt_getnstr(funlist, ix + 2) : NULL;
+        bool is_raw_write = fun && strcmp(fun, "raw_write") == 0;
+        if (fun && arg &&
+                (is_raw_write || strcmp(fun, "fat_write") == 0)) {
+            uint64_t offset = strtoull(arg, NULL, 0);
+            if (offset < *first)
+                *first = offset;
+            if (offset > *last)
+                *last = offset;
+        }
+        if (!is_raw_write || !arg)
+            all_raw_write = false;
+
+        ix += argc + 1;
+    }
+    return all_raw_write;
+}
+
 /**
  * Helper function that is paired with process_resource() to compute
  * progress.
@@ -263,22 +307,23 @@ static int process_resource(struct fun_context *fctx,
     int rc = 0;
     struct sparse_file_map sfm;
     sparse_file_init(&sfm);
+    struct resource_hash hash_state;
+    hash_state.active = false;
 
     cfg_t *resource = cfg_gettsec(fctx->cfg, "file-resource", fctx->on_event->title);
     if (!resource)
         ERR_CLEANUP_MSG("%s can't find file-resource '%s'", fctx->argv[0], fctx->on_event->title);
 
-    char *expected_hash = cfg_getstr(resource, "blake2b-256");
-    if (!expected_hash || strlen(expected_hash) != FWUP_BLAKE2b_256_LEN * 2)
-        ERR_CLEANUP_MSG("invalid blake2b hash for '%s'", fctx->on_event->title);
+    enum resource_hash_type hash_type;
+    const char *expected_hash;
+    OK_OR_CLEANUP(resource_hash_get_expected(resource, &hash_type, &expected_hash));
 
     OK_OR_CLEANUP(sparse_file_get_map_from_resource(resource, &sfm));
     off_t expected_data_length = sparse_file_data_size(&sfm);
 
     off_t total_data_read = 0;
 
-    crypto_blake2b_ctx hash_state;
-    crypto_blake2b_general_init(&hash_state, FWUP_BLAKE2b_256_LEN, NULL, 0);
+    resource_hash_init(&hash_state, hash_type);
 
     off_t last_offset = 0;
     for (;;) {
@@ -292,7 +337,7 @@ static int process_resource(struct fun_context *fctx,
         if (len == 0)
             break;
 
-        crypto_blake2b_update(&hash_state, (const uint8_t*) buffer, len);
+        resource_hash_update(&hash_state, buffer, len);
 
         OK_OR_CLEANUP(pwrite_callback(cookie, buffer, len, offset));
 
@@ -327,18 +372,38 @@ static int process_resource(struct fun_context *fctx,
     }
 
     // Verify hash
-    unsigned char hash[32];
-    crypto_blake2b_final(&hash_state, hash);
+    unsigned char hash[FWUP_BLAKE2b_256_LEN];
+    resource_hash_final(&hash_state, hash);
     char hash_str[sizeof(hash) * 2 + 1];
     bytes_to_hex(hash, hash_str, sizeof(hash));
     if (memcmp(hash_str, expected_hash, sizeof(hash_str)) != 0)
         ERR_CLEANUP_MSG("%s detected blake2b mismatch on '%s'", fctx->argv[0], fctx->on_event->title);
 
 cleanup:
+    resource_hash_free(&hash_state);
     sparse_file_free(&sfm);
     return rc;
 }
 
+// Trimmed blocks don't decrypt to zeros and without --enable-trim they
+// keep whatever was there before, so trimming holes only works for
+// unencrypted writes. Every option other than "holes" is for encryption.
+static int raw_write_check_holes(struct fun_context *fctx)
+{
+    bool trim_holes = false;
+    bool encrypted = false;
+    for (int i = 2; i < fctx->argc; i++) {
+        if (strcmp(fctx->argv[i], "holes=trim") == 0)
+            trim_holes = true;
+        else if (strncmp(fctx->argv[i], "holes=", 6) != 0)
+            encrypted = true;
+    }
+
+    if (trim_holes && encrypted)
+        ERR_RETURN("raw_write can't use holes=trim with encryption");
+
+    return 0;
+}
 int raw_write_validate(struct fun_context *fctx)
 {
     if (fctx->type != FUN_CONTEXT_FILE)
@@ -350,6 +415,7 @@ int raw_write_validate(struct fun_context *fctx)
     CHECK_ARG_UINT64(fctx->argv[1], "raw_write requires a non-negative integer block offset");
 
     // Encryption options aren't check to allow for runtime variable substitutions
+    OK_OR_RETURN(raw_write_check_holes(fctx));
     return 0;
 }
 int raw_write_compute_progress(struct fun_context *fctx)
@@ -359,10 +425,52 @@ int raw_write_compute_progress(struct fun_context *fctx)
 struct raw_write_cookie {
     off_t dest_offset;
     struct pad_to_block_writer ptbw;
+
+    // Set to trim holes rather than skip them
+    bool trim_holes;
+    off_t next_offset;
 };
+static int raw_write_zeros(struct raw_write_cookie *rwc, off_t offset, off_t end)
+{
+    uint8_t zeros[8 * FWUP_BLOCK_SIZE];
+    memset(zeros, 0, sizeof(zeros));
+    while (offset < end) {
+        off_t to_write = end - offset;
+        if (to_write > (off_t) sizeof(zeros))
+            to_write = sizeof(zeros);
+        OK_OR_RETURN(ptbw_pwrite(&rwc->ptbw, zeros, to_write, offset));
+        offset += to_write;
+    }
+    return 0;
+}
+static int raw_write_trim_hole(struct raw_write_cookie *rwc, off_t offset, off_t count)
+{
+    off_t start = rwc->dest_offset + offset;
+    off_t end = start + count;
+
+    // Trimming without sending TRIM requests leaves the old data, so write
+    // zeros to the whole hole.
+    if (!rwc->ptbw.output->hw_trim_enabled)
+        return raw_write_zeros(rwc, start, end);
+
+    // Trim the cache segments that are completely in the hole and write
+    // zeros to the partial segments at either end.
+    off_t aligned_start = (start + BLOCK_CACHE_SEGMENT_SIZE - 1) & BLOCK_CACHE_SEGMENT_MASK;
+    off_t aligned_end = end & BLOCK_CACHE_SEGMENT_MASK;
+    if (aligned_start >= aligned_end)
+        return raw_write_zeros(rwc, start, end);
+
+    OK_OR_RETURN(raw_write_zeros(rwc, start, aligned_start));
+    OK_OR_RETURN(block_cache_trim(rwc->ptbw.output, aligned_start, aligned_end - aligned_start, true));
+    return raw_write_zeros(rwc, aligned_end, end);
+}
 static int raw_write_pwrite_callback(void *cookie, const void *buf, size_t count, off_t offset)
 {
     struct raw_write_cookie *rwc = (struct raw_write_cookie *) cookie;
+    if (rwc->trim_holes && offset > rwc->next_offset)
+        OK_OR_RETURN(raw_write_trim_hole(rwc, rwc->next_offset, offset - rwc->next_offset));
+    rwc->next_offset = offset + count;
+
     return ptbw_pwrite(&rwc->ptbw, buf, count, rwc->dest_offset + offset);
 }
 static int raw_write_final_hole_callback(void *cookie, off_t hole_size, off_t file_size)
@@ -377,6 +485,10 @@ static int raw_write_final_hole_callback(void *cookie, off_t hole_size, off_t fi
     if (hole_size < to_write)
         to_write = hole_size;
     off_t offset = file_size - to_write;
+
+    if (rwc->trim_holes)
+        OK_OR_RETURN(raw_write_trim_hole(rwc, file_size - hole_size, hole_size - to_write));
+
     return ptbw_pwrite(&rwc->ptbw, zeros, to_write, rwc->dest_offset + offset);
 }
 int raw_write_run(struct fun_context *fctx)
@@ -389,11 +501,30 @@ int raw_write_run(struct fun_context *fctx)
 
     struct raw_write_cookie rwc;
     rwc.dest_offset = strtoull(fctx->argv[1], NULL, 0) * FWUP_BLOCK_SIZE;
+    rwc.trim_holes = false;
+    rwc.next_offset = 0;
+
+    // Handle the "holes" option here and pass the rest to the disk
+    // encryption code.
+    const char *crypto_argv[FUN_MAX_ARGS];
+    int crypto_argc = 0;
+    for (int i = 2; i < fctx->argc; i++) {
+        if (strcmp(fctx->argv[i], "holes=trim") == 0)
+            rwc.trim_holes = true;
+        else if (strcmp(fctx->argv[i], "holes=skip") == 0)
+            rwc.trim_holes = false;
+        else if (strncmp(fctx->argv[i], "holes=", 6) == 0)
+            ERR_RETURN("raw_write expects holes=skip or holes=trim, but got '%s'", fctx->argv[i]);
+        else
+            crypto_argv[crypto_argc++] = fctx->argv[i];
+    }
+
+    OK_OR_RETURN(raw_write_check_holes(fctx));
 
     struct disk_crypto dc_info;
     struct disk_crypto *dc = NULL;
-    if (fctx->argc > 2) {
-        if (disk_crypto_init(&dc_info, rwc.dest_offset, fctx->argc - 2, &fctx->argv[2]) < 0)
+    if (crypto_argc > 0) {
+        if (disk_crypto_init(&dc_info, rwc.dest_offset, crypto_argc, crypto_argv) < 0)
             return -1;
         dc = &dc_info;
     }
@@ -409,6 +540,7 @@ int raw_write_run(struct fun_context *fctx)
     rc = ptbw_flush(&rwc.ptbw);
 
 cleanup:
+    ptbw_free(&rwc.ptbw);
     if (dc)
         disk_crypto_free(dc);
 
@@ -537,12 +669,18 @@ int fat_write_validate(struct fun_context *fctx)
         // versions of fwup.
         fctx->argc = 3;
         fctx->argv[2] = fctx->task->title;
-    } else if (fctx->argc != 3) {
+    } else if (fctx->argc < 3) {
         ERR_RETURN("fat_write requires a block offset and optional destination filename");
     }
 
     CHECK_ARG_UINT64(fctx->argv[1], "fat_write requires a non-negative integer block offset");
 
+    for (int i = 3; i < fctx->argc; i++) {
+        if (strcmp(fctx->argv[i], "sync=always") != 0 &&
+                strcmp(fctx->argv[i], "sync=buffered") != 0)
+            ERR_RETURN("fat_write expects sync=always or sync=buffered, but got '%s'", fctx->argv[i]);
+    }
+
     return 0;
 }
 int fat_write_compute_progress(struct fun_context *fctx)
@@ -576,8 +714,20 @@ int fat_write_run(struct fun_context *fctx)
     fwc.fctx = fctx;
     fwc.block_offset = strtoull(fctx->argv[1], NULL, 0);
 
+    bool buffered = false;
+    for (int i = 3; i < fctx->argc; i++)
+        buffered = (strcmp(fctx->argv[i], "sync=buffered") == 0);
+
     // Enforce truncation semantics if the file exists
-    OK_OR_RETURN(fatfs_truncate(fctx->output, fwc.block_offset, fctx->argv[2]));
+    OK_OR_RETURN(fatfs_truncate(fctx->output, fwc.block_offset, fctx->argv[2], buffered));
+
+    // The final size is known, so try to allocate the file contiguously
+    struct sparse_file_map sfm;
+    sparse_file_init(&sfm);
+    OK_OR_RETURN(sparse_file_get_map_from_config(fctx->cfg, fctx->on_event->title, &sfm));
+    off_t file_size = sparse_file_size(&sfm);
+    sparse_file_free(&sfm);
+    OK_OR_RETURN(fatfs_preallocate(fctx->output, fwc.block_offset, fctx->argv[2], file_size));
 
     return process_resource(fctx,
                             true,
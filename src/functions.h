@@ -19,6 +19,7 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <confuse.h>
 #include "uboot_env.h"
@@ -70,6 +71,12 @@ struct fun_context {
     const char *xd_source_path;
     struct disk_crypto *xd_source_dc;
 
+    // Delta source cache settings
+    size_t xd_cache_blocks;
+    size_t xd_block_size;
+    int xd_decode_threads;
+    int xd_decrypt_cache_mb;
+
     // Reboot parameters
     const char *reboot_param_path;
 
@@ -83,5 +90,6 @@ int fun_validate(struct fun_context *fctx);
 int fun_compute_progress(struct fun_context *fctx);
 int fun_run(struct fun_context *fctx);
 int fun_apply_funlist(struct fun_context *fctx, cfg_opt_t *funlist, int (*fun)(struct fun_context *fctx));
+bool fun_funlist_block_offsets(cfg_opt_t *funlist, uint64_t *first, uint64_t *last);
 
 #endif // FUNCTIONS_H
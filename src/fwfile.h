@@ -20,9 +20,17 @@
 #include <confuse.h>
 #include <archive.h>
 #include "sparse_file.h"
+#include "util.h"
 
 #define FWFILE_MAX_ARCHIVE_PATH     512
 
+// Resources larger than this aren't deduplicated since applying them
+// requires holding a decompressed copy in memory.
+#define FWFILE_MAX_DUPLICATE_SIZE   (16 * ONE_MiB)
+
+// First fwup version that can apply archives with duplicate-of resources
+#define FWFILE_DUPLICATE_OF_VERSION "1.17.0"
+
 struct fwfile_assertions {
     off_t assert_lte; // bytes
     off_t assert_gte; // bytes
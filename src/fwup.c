@@ -38,6 +38,8 @@
 #include "fwup_metadata.h"
 #include "fwup_genkeys.h"
 #include "fwup_sign.h"
+#include "fwup_delta.h"
+#include "fwup_from_image.h"
 #include "fwup_verify.h"
 #include "progress.h"
 #include "simple_string.h"
@@ -84,6 +86,8 @@ static void print_usage()
     printf("Options:\n");
     printf("  -a, --apply   Apply the firmware update\n");
     printf("  -c, --create  Create the firmware update\n");
+    printf("  --create-delta <old.fw> Create a delta firmware update from <old.fw> to the -i firmware (specify -i and -o)\n");
+    printf("  --cache-dir <dir> Cache file-resource metadata and compressed data in <dir> to speed up repeated creates\n");
     printf("  -d <file> Device file for the memory card\n");
     printf("  -D, --detect List attached SDCards or MMC devices and their sizes\n");
     printf("  -E, --eject Eject removable media after successfully writing firmware.\n");
@@ -91,6 +95,7 @@ static void print_usage()
     printf("  --enable-trim Enable use of the hardware TRIM command\n");
     printf("  --exit-handshake Send a Ctrl+Z on exit and wait for stdin to close (Erlang)\n");
     printf("  -f <fwup.conf> Specify the firmware update configuration file\n");
+    printf("  --from-image <disk.img> Create a firmware update that writes a disk image (specify -o)\n");
     printf("  -F, --framing Apply framing on stdin/stdout\n");
     printf("  -g, --gen-keys Generate firmware signing keys (fwup-key.pub and fwup-key.priv, or specify with -o)\n");
     printf("  -i <input.fw> Specify the input firmware update file (Use - for stdin)\n");
@@ -111,6 +116,8 @@ static void print_usage()
     printf("  --reboot-param-path Path to write reboot parameters (defaults to systemd and Nerves locations)\n");
     printf("  -s, --private-key-file <keyfile> A private key file for signing firmware updates\n");
     printf("  -S, --sign Sign an existing firmware file (specify -i and -o)\n");
+    printf("  --skip-zero-blocks When creating, record aligned runs of zeros in file-resources as holes\n");
+    printf("  --sort-resources When creating, store resources in the order that they're written to the destination\n");
     printf("  --sparse-check <path> Check if the OS and file system supports sparse files at path\n");
     printf("  --sparse-check-size <bytes> Hole size to check for --sparse-check\n");
     printf("  -t, --task <task> Task to apply within the firmware update\n");
@@ -171,8 +178,11 @@ static void print_version()
 
 enum fwup_long_option_only_value {
     OPTION_NO_EJECT = 0x1000,
+    OPTION_CACHE_DIR,
+    OPTION_CREATE_DELTA,
     OPTION_ENABLE_TRIM,
     OPTION_EXIT_HANDSHAKE,
+    OPTION_FROM_IMAGE,
     OPTION_MAX_SIZE,
     OPTION_METADATA_KEY,
     OPTION_MINIMIZE_WRITES,
@@ -182,6 +192,8 @@ enum fwup_long_option_only_value {
     OPTION_PROGRESS_LOW,
     OPTION_PROGRESS_HIGH,
     OPTION_REBOOT_PARAM_PATH,
+    OPTION_SKIP_ZERO_BLOCKS,
+    OPTION_SORT_RESOURCES,
     OPTION_SPARSE_CHECK,
     OPTION_SPARSE_CHECK_SIZE,
     OPTION_UNSAFE,
@@ -192,13 +204,16 @@ enum fwup_long_option_only_value {
 
 static struct option long_options[] = {
     {"apply",    no_argument,       0, 'a'},
+    {"cache-dir", required_argument, 0, OPTION_CACHE_DIR},
     {"create",   no_argument,       0, 'c'},
+    {"create-delta", required_argument, 0, OPTION_CREATE_DELTA},
     {"detect",   no_argument,       0, 'D'},
     {"eject",    no_argument,       0, 'E'},
     {"no-eject", no_argument,       0, OPTION_NO_EJECT},
     {"enable-trim", no_argument,    0, OPTION_ENABLE_TRIM},
     {"exit-handshake", no_argument, 0, OPTION_EXIT_HANDSHAKE},
     {"framing",  no_argument,       0, 'F'},
+    {"from-image", required_argument, 0, OPTION_FROM_IMAGE},
     {"gen-keys", no_argument,       0, 'g'},
     {"help",     no_argument,       0, 'h'},
     {"metadata-key", required_argument, 0, OPTION_METADATA_KEY},
@@ -215,6 +230,8 @@ static struct option long_options[] = {
     {"progress-high", required_argument, 0, OPTION_PROGRESS_HIGH},
     {"quiet",    no_argument,       0, 'q'},
     {"reboot-param-path", required_argument, 0, OPTION_REBOOT_PARAM_PATH},
+    {"skip-zero-blocks", no_argument, 0, OPTION_SKIP_ZERO_BLOCKS},
+    {"sort-resources", no_argument, 0, OPTION_SORT_RESOURCES},
     {"sparse-check", required_argument, 0, OPTION_SPARSE_CHECK},
     {"sparse-check-size", required_argument, 0, OPTION_SPARSE_CHECK_SIZE},
     {"sign",     no_argument,       0, 'S'},
@@ -239,6 +256,8 @@ static struct option long_options[] = {
 #define CMD_SIGN          6
 #define CMD_VERIFY        7
 #define CMD_SPARSE_CHECK  8
+#define CMD_CREATE_DELTA  9
+#define CMD_FROM_IMAGE    10
 
 static unsigned char *decode_key(const char *buffer,
                                  size_t buffer_len,
@@ -393,6 +412,11 @@ int main(int argc, char **argv)
     const char *sparse_check = NULL;
     int sparse_check_size = 4096; // Arbitrary default.
     int compression_level = 9; // 1 - 9
+    const char *cache_dir = NULL;
+    bool skip_zero_blocks = false;
+    bool sort_resources = false;
+    const char *old_filename = NULL;
+    const char *image_filename = NULL;
     bool accept_found_device = false;
 #endif
     unsigned char *signing_key = NULL;
@@ -451,6 +475,16 @@ int main(int argc, char **argv)
             command = CMD_SIGN;
             easy_mode = false;
             break;
+        case OPTION_CREATE_DELTA: // --create-delta
+            command = CMD_CREATE_DELTA;
+            old_filename = optarg;
+            easy_mode = false;
+            break;
+        case OPTION_FROM_IMAGE: // --from-image
+            command = CMD_FROM_IMAGE;
+            image_filename = optarg;
+            easy_mode = false;
+            break;
         case OPTION_SPARSE_CHECK: // --sparse-check
             sparse_check = optarg;
             command = CMD_SPARSE_CHECK;
@@ -481,6 +515,15 @@ int main(int argc, char **argv)
             signing_key = parse_signing_key(optarg, strlen(optarg));
             easy_mode = false;
             break;
+        case OPTION_CACHE_DIR: // --cache-dir
+            cache_dir = optarg;
+            break;
+        case OPTION_SKIP_ZERO_BLOCKS: // --skip-zero-blocks
+            skip_zero_blocks = true;
+            break;
+        case OPTION_SORT_RESOURCES: // --sort-resources
+            sort_resources = true;
+            break;
 #endif
         case 'd':
             mmc_device_path = optarg;
@@ -625,6 +668,12 @@ int main(int argc, char **argv)
             task = "complete";
     }
 
+#ifndef FWUP_MINIMAL
+    // Support "--create-delta old.fw new.fw" in addition to "-i new.fw"
+    if (command == CMD_CREATE_DELTA && !input_filename && optind == argc - 1)
+        input_filename = argv[optind++];
+#endif
+
     if (optind < argc) {
         fwup_errx(EXIT_FAILURE, "unexpected parameter: %s", argv[optind]);
     }
@@ -783,10 +832,35 @@ int main(int argc, char **argv)
 
 #ifndef FWUP_MINIMAL
     case CMD_CREATE:
-        if (fwup_create(configfile, output_filename, signing_key, compression_level) < 0)
+    {
+        struct fwup_create_options options;
+        options.signing_key = signing_key;
+        options.compression_level = compression_level;
+        options.cache_dir = cache_dir;
+        options.skip_zero_blocks = skip_zero_blocks;
+        options.sort_resources = sort_resources;
+        options.parallel_compression = false;
+
+        if (fwup_create(configfile, output_filename, &options) < 0)
+            fwup_errx(EXIT_FAILURE, "%s", last_error());
+
+        break;
+    }
+    case CMD_FROM_IMAGE:
+    {
+        struct fwup_create_options options;
+        options.signing_key = signing_key;
+        options.compression_level = compression_level;
+        options.cache_dir = cache_dir;
+        options.skip_zero_blocks = true;
+        options.sort_resources = sort_resources;
+        options.parallel_compression = true;
+
+        if (fwup_from_image(image_filename, output_filename, &options) < 0)
             fwup_errx(EXIT_FAILURE, "%s", last_error());
 
         break;
+    }
     case CMD_GENERATE_KEYS:
         if (fwup_genkeys(output_filename) < 0)
             fwup_errx(EXIT_FAILURE, "%s", last_error());
@@ -799,6 +873,12 @@ int main(int argc, char **argv)
 
         break;
 
+    case CMD_CREATE_DELTA:
+        if (fwup_create_delta(old_filename, input_filename, output_filename, signing_key) < 0)
+            fwup_errx(EXIT_FAILURE, "%s", last_error());
+
+        break;
+
     case CMD_SPARSE_CHECK:
         if (sparse_file_is_supported(sparse_check, sparse_check_size) < 0)
             fwup_errx(EXIT_FAILURE, "%s", last_error());
@@ -42,6 +42,7 @@
 #include "block_cache.h"
 #include "fwup_xdelta3.h"
 #include "disk_crypto.h"
+#include "zip_raw.h"
 
 static bool deprecated_task_is_applicable(cfg_t *task, struct block_cache *output)
 {
@@ -125,6 +126,12 @@ struct fwup_apply_data
     struct archive *a;
     bool reading_stdin;
 
+    // Random access to resources when applying from a regular file
+    const char *fw_filename;
+    struct fwup_progress *progress;
+    bool random_access;
+    struct zip_raw_directory dir;
+
     // Sparse file handling
     struct sparse_file_map sfm;
     int sparse_map_ix;
@@ -132,8 +139,69 @@ struct fwup_apply_data
     off_t actual_offset;
     const void *sparse_leftover;
     off_t sparse_leftover_len;
+
+    // Deduplicated resources. The first resource to use the data records
+    // it so that it can be replayed for the others.
+    bool recording;
+    bool replaying;
+    uint8_t *replay_buffer;
+    size_t replay_len;
+    size_t replay_offset;
 };
 
+static int record_data(struct fwup_apply_data *p, const void *buffer, size_t len)
+{
+    if (p->replay_buffer == NULL) {
+        off_t data_size = sparse_file_data_size(&p->sfm);
+        if (data_size > FWFILE_MAX_DUPLICATE_SIZE)
+            ERR_RETURN("Deduplicated resource is too large (%" PRId64 " bytes)", (int64_t) data_size);
+
+        p->replay_buffer = (uint8_t *) malloc(data_size > 0 ? data_size : 1);
+        if (!p->replay_buffer)
+            ERR_RETURN("Can't allocate %" PRId64 " bytes for deduplicated resource", (int64_t) data_size);
+        p->replay_len = 0;
+    }
+
+    if ((off_t) (p->replay_len + len) > sparse_file_data_size(&p->sfm))
+        ERR_RETURN("Deduplicated resource is larger than expected");
+
+    memcpy(p->replay_buffer + p->replay_len, buffer, len);
+    p->replay_len += len;
+    return 0;
+}
+
+static int record_remaining_data(struct fwup_apply_data *p)
+{
+    // The first resource's handlers may not have read all of the data, but
+    // the duplicates need every byte of it.
+    for (;;) {
+        const void *buffer;
+        size_t len;
+        int64_t ignored;
+        int rc = fwup_archive_read_data_block(p->a, &buffer, &len, &ignored);
+        if (rc == ARCHIVE_EOF)
+            return 0;
+        else if (rc != ARCHIVE_OK)
+            ERR_RETURN(archive_error_string(p->a));
+
+        OK_OR_RETURN(record_data(p, buffer, len));
+    }
+}
+
+static int replay_data(struct fwup_apply_data *p, const void **buffer, size_t *len)
+{
+    size_t remaining = p->replay_len - p->replay_offset;
+    if (remaining == 0)
+        return ARCHIVE_EOF;
+
+    // Return data in reasonably sized chunks so that progress updates
+    // look like they do when decompressing.
+    *len = remaining < BLOCK_CACHE_SEGMENT_SIZE ? remaining : BLOCK_CACHE_SEGMENT_SIZE;
+    *buffer = p->replay_buffer + p->replay_offset;
+    p->replay_offset += *len;
+    return ARCHIVE_OK;
+}
+
 static int read_callback_normal(struct fun_context *fctx, const void **buffer, size_t *len, off_t *offset)
 {
     struct fwup_apply_data *p = (struct fwup_apply_data *) fctx->cookie;
@@ -182,8 +250,15 @@ static int read_callback_normal(struct fun_context *fctx, const void **buffer, s
     }
 
     // Decompress more data
-    int64_t ignored;
-    int rc = fwup_archive_read_data_block(p->a, buffer, len, &ignored);
+    int rc;
+    if (p->replaying) {
+        rc = replay_data(p, buffer, len);
+    } else {
+        int64_t ignored;
+        rc = fwup_archive_read_data_block(p->a, buffer, len, &ignored);
+        if (rc == ARCHIVE_OK && p->recording)
+            OK_OR_RETURN(record_data(p, *buffer, *len));
+    }
 
     if (rc == ARCHIVE_EOF) {
         *len = 0;
@@ -262,6 +337,19 @@ static int xdelta_read_source_callback(void *cookie, void *buf, size_t count, of
     return rc;
 }
 
+static void xdelta_prefetch_source_callback(void *cookie, off_t offset, off_t count)
+{
+    struct fun_context *fctx = (struct fun_context *) cookie;
+
+    // Prefetching is only a hint, so ignore anything out of range.
+    if (offset < 0 || offset >= (off_t) fctx->xd_source_count)
+        return;
+    if (count > (off_t) fctx->xd_source_count - offset)
+        count = fctx->xd_source_count - offset;
+
+    block_cache_prefetch(fctx->output, fctx->xd_source_offset + offset, count);
+}
+
 static int xdelta_read_fat_callback(void *cookie, void *buf, size_t count, off_t offset)
 {
     struct fun_context *fctx = (struct fun_context *) cookie;
@@ -346,65 +434,32 @@ static int compute_progress(struct fun_context *fctx)
     return 0;
 }
 
-static int run_task(struct fun_context *fctx, struct fwup_apply_data *pd)
+static int run_resource(struct fun_context *fctx, struct fwup_apply_data *pd, struct archive_entry *ae, struct resource_list *item)
 {
-    int rc = 0;
-
-    struct resource_list *resources = NULL;
-    OK_OR_CLEANUP(rlist_get_from_task(fctx->cfg, fctx->task, &resources));
-
-    fctx->type = FUN_CONTEXT_INIT;
-    OK_OR_CLEANUP(apply_event(fctx, fctx->task, "on-init", NULL, fun_run));
-
-    fctx->type = FUN_CONTEXT_FILE;
-    fctx->read = read_callback;
-    struct archive_entry *ae;
-    while (archive_read_next_header(pd->a, &ae) == ARCHIVE_OK) {
-        const char *filename = archive_entry_pathname(ae);
-        char resource_name[FWFILE_MAX_ARCHIVE_PATH];
-
-        OK_OR_CLEANUP(archive_filename_to_resource(filename, resource_name, sizeof(resource_name)));
-
-        // Skip an empty filename. This is easy to get when you run 'zip'
-        // on the command line to create a firmware update file and include
-        // the 'data' directory. It's annoying when it creates an error
-        // (usually when debugging something else), so ignore it.
-        if (resource_name[0] == '\0')
-            continue;
-
-        // See if this resource is used by this task
-        struct resource_list *item = rlist_find_by_name(resources, resource_name);
-        if (item == NULL)
-            continue;
-
-        // See if there's metadata associated with this resource
-        if (item->resource == NULL)
-            ERR_CLEANUP_MSG("Resource '%s' used, but metadata is missing. Archive is corrupt.", resource_name);
-
-        OK_OR_CLEANUP(sparse_file_get_map_from_resource(item->resource, &pd->sfm));
-        pd->sparse_map_ix = 0;
-        pd->sparse_block_offset = 0;
-        pd->actual_offset = 0;
-        pd->sparse_leftover = NULL;
-        pd->sparse_leftover_len = 0;
-        if (pd->sfm.map[0] == 0) {
-            if (pd->sfm.map_len > 2) {
-                // This is the case where there's a hole at the beginning. Advance to
-                // the offset of the data.
-                pd->sparse_map_ix = 2;
-                pd->actual_offset = pd->sfm.map[1];
-            } else {
-                // sparse map has a 0 length data block and possibly a hole,
-                // but it doesn't have another data block. This means that it's
-                // either a 0-length file or it's all sparse. Signal EOF. This
-                // might be a bug, but I can't think of a real use case for a completely
-                // sparse file.
-                pd->sparse_map_ix = pd->sfm.map_len;
-            }
+    const char *resource_name = cfg_title(item->resource);
+
+    OK_OR_RETURN(sparse_file_get_map_from_resource(item->resource, &pd->sfm));
+    pd->sparse_map_ix = 0;
+    pd->sparse_block_offset = 0;
+    pd->actual_offset = 0;
+    pd->sparse_leftover = NULL;
+    pd->sparse_leftover_len = 0;
+    if (pd->sfm.map[0] == 0) {
+        if (pd->sfm.map_len > 2) {
+            // This is the case where there's a hole at the beginning. Advance to
+            // the offset of the data.
+            pd->sparse_map_ix = 2;
+            pd->actual_offset = pd->sfm.map[1];
+        } else {
+            // sparse map has a 0 length data block and possibly a hole,
+            // but it doesn't have another data block. This means that it's
+            // either a 0-length file or it's all sparse. Signal EOF. This
+            // might be a bug, but I can't think of a real use case for a completely
+            // sparse file.
+            pd->sparse_map_ix = pd->sfm.map_len;
         }
+    }
 
-// MOVE ME!!!
-{
     cfg_t *on_resource = cfg_gettsec(fctx->task, "on-resource", resource_name);
     if (on_resource) {
         off_t size_in_archive = archive_entry_size(ae);
@@ -418,6 +473,9 @@ static int run_task(struct fun_context *fctx, struct fwup_apply_data *pd)
             const char *source_fat_offset_str = cfg_getstr(on_resource, "delta-source-fat-offset");
             const char *source_fat_path = cfg_getstr(on_resource, "delta-source-fat-path");
 
+            if (pd->recording || pd->replaying)
+                ERR_RETURN("Resource '%s' can't be both a delta update and have duplicates", resource_name);
+
             if (source_raw_count > 0 && source_raw_offset_str != NULL) {
                 // Found delta-source-raw-offset and delta-source-raw-count directives
                 off_t source_raw_offset = strtoul(source_raw_offset_str, NULL, 0);
@@ -425,13 +483,15 @@ static int run_task(struct fun_context *fctx, struct fwup_apply_data *pd)
                 fctx->xd_source_dc = NULL;
                 if (source_raw_options) {
                     fctx->xd_source_dc = malloc(sizeof(struct disk_crypto));
-                    OK_OR_CLEANUP(disk_crypto_init(fctx->xd_source_dc, source_raw_offset * FWUP_BLOCK_SIZE, 1, &source_raw_options));
+                    OK_OR_RETURN(disk_crypto_init(fctx->xd_source_dc, source_raw_offset * FWUP_BLOCK_SIZE, 1, &source_raw_options));
                     // Set decrypt callback on block cache to decrypt once when loading from disk
-                    block_cache_set_decrypt(fctx->output, block_cache_decrypt_wrapper, fctx->xd_source_dc);
+                    block_cache_set_decrypt(fctx->output, block_cache_decrypt_wrapper, fctx->xd_source_dc, fctx->xd_decrypt_cache_mb);
                 }
 
                 fctx->xd = malloc(sizeof(struct xdelta_state));
-                xdelta_init(fctx->xd, xdelta_read_patch_callback, xdelta_read_source_callback, fctx);
+                xdelta_init(fctx->xd, xdelta_read_patch_callback, xdelta_read_source_callback, fctx, fctx->xd_cache_blocks, fctx->xd_block_size);
+                xdelta_set_prefetch(fctx->xd, xdelta_prefetch_source_callback);
+                xdelta_set_threads(fctx->xd, fctx->xd_decode_threads);
                 fctx->xd_source_offset = source_raw_offset * FWUP_BLOCK_SIZE;
                 fctx->xd_source_count = source_raw_count * FWUP_BLOCK_SIZE;
                 fctx->xd_source_path = NULL;
@@ -440,37 +500,321 @@ static int run_task(struct fun_context *fctx, struct fwup_apply_data *pd)
                 off_t source_fat_offset = strtoul(source_fat_offset_str, NULL, 0);
 
                 fctx->xd = malloc(sizeof(struct xdelta_state));
-                xdelta_init(fctx->xd, xdelta_read_patch_callback, xdelta_read_fat_callback, fctx);
+                xdelta_init(fctx->xd, xdelta_read_patch_callback, xdelta_read_fat_callback, fctx, fctx->xd_cache_blocks, fctx->xd_block_size);
+                xdelta_set_threads(fctx->xd, fctx->xd_decode_threads);
                 fctx->xd_source_offset = source_fat_offset * FWUP_BLOCK_SIZE;
                 fctx->xd_source_path = source_fat_path;
                 fctx->xd_source_count = 0; // unused
                 fctx->xd_source_dc = NULL; // unused
             } else {
-                ERR_CLEANUP_MSG("File '%s' isn't expected size (%d vs %d) and xdelta3 patch support not enabled on it. (Add delta-source-raw-offset / delta-source-raw-count or delta-source-fat-offset / delta-source-fat-path)", resource_name, (int) size_in_archive, (int) expected_size_in_archive);
+                ERR_RETURN("File '%s' isn't expected size (%d vs %d) and xdelta3 patch support not enabled on it. (Add delta-source-raw-offset / delta-source-raw-count or delta-source-fat-offset / delta-source-fat-path)", resource_name, (int) size_in_archive, (int) expected_size_in_archive);
             }
         }
     }
-}
-        OK_OR_CLEANUP(apply_event(fctx, fctx->task, "on-resource", resource_name, fun_run));
 
-        item->processed = true;
-        sparse_file_free(&pd->sfm);
+    OK_OR_RETURN(apply_event(fctx, fctx->task, "on-resource", resource_name, fun_run));
+
+    if (pd->recording)
+        OK_OR_RETURN(record_remaining_data(pd));
+
+    item->processed = true;
+    sparse_file_free(&pd->sfm);
 
-{ // MOVE ME!!!
     if (fctx->xd) {
         // Clear decrypt callback before freeing crypto context
-        if (fctx->xd_source_dc)
-            block_cache_set_decrypt(fctx->output, NULL, NULL);
-            
+        if (fctx->xd_source_dc) {
+            INFO("Decrypted %" PRIu64 " source segments for '%s' (%" PRIu64 " re-reads served from the decrypted segment cache)",
+                 fctx->output->decrypted_segments, resource_name, fctx->output->decrypted_hits);
+            block_cache_set_decrypt(fctx->output, NULL, NULL, 0);
+        }
+
         xdelta_free(fctx->xd);
         free(fctx->xd);
-        if (fctx->xd_source_dc)
+        if (fctx->xd_source_dc) {
+            disk_crypto_free(fctx->xd_source_dc);
             free(fctx->xd_source_dc);
+        }
         fctx->xd = NULL;
         fctx->xd_source_dc = NULL;
     }
+
+    return 0;
 }
+
+static int run_archive_entry(struct fun_context *fctx, struct fwup_apply_data *pd, struct resource_list *resources, const char *resource_name, struct archive_entry *ae)
+{
+    // See if this resource is used by this task either directly or
+    // through resources that were deduplicated into it.
+    struct resource_list *item = rlist_find_by_name(resources, resource_name);
+    struct resource_list *duplicate = rlist_find_duplicate(resources, resource_name, NULL);
+    if (item == NULL) {
+        if (duplicate == NULL)
+            return 0;
+
+        item = duplicate;
+        duplicate = rlist_find_duplicate(resources, resource_name, item);
+    }
+
+    // See if there's metadata associated with this resource
+    if (item->resource == NULL)
+        ERR_RETURN("Resource '%s' used, but metadata is missing. Archive is corrupt.", resource_name);
+
+    // If duplicates need the data too, save a copy as it's decompressed
+    // so that it can be replayed for them.
+    pd->recording = (duplicate != NULL);
+    OK_OR_RETURN(run_resource(fctx, pd, ae, item));
+    pd->recording = false;
+
+    while (duplicate) {
+        pd->replaying = true;
+        pd->replay_offset = 0;
+        OK_OR_RETURN(run_resource(fctx, pd, ae, duplicate));
+        duplicate = rlist_find_duplicate(resources, resource_name, duplicate);
     }
+    pd->replaying = false;
+    free(pd->replay_buffer);
+    pd->replay_buffer = NULL;
+    pd->replay_len = 0;
+
+    return 0;
+}
+
+static int run_archive_entries(struct fun_context *fctx, struct fwup_apply_data *pd, struct resource_list *resources)
+{
+    struct archive_entry *ae;
+    while (archive_read_next_header(pd->a, &ae) == ARCHIVE_OK) {
+        const char *filename = archive_entry_pathname(ae);
+        char resource_name[FWFILE_MAX_ARCHIVE_PATH];
+
+        OK_OR_RETURN(archive_filename_to_resource(filename, resource_name, sizeof(resource_name)));
+
+        // Skip an empty filename. This is easy to get when you run 'zip'
+        // on the command line to create a firmware update file and include
+        // the 'data' directory. It's annoying when it creates an error
+        // (usually when debugging something else), so ignore it.
+        if (resource_name[0] == '\0')
+            continue;
+
+        OK_OR_RETURN(run_archive_entry(fctx, pd, resources, resource_name, ae));
+    }
+    return 0;
+}
+
+#ifndef FWUP_MINIMAL
+struct entry_order
+{
+    const struct zip_raw_entry *entry;
+
+    // Byte range written on the destination
+    uint64_t start;
+    uint64_t end;
+};
+
+static int compare_archive_order(const void *a, const void *b)
+{
+    const struct entry_order *ea = (const struct entry_order *) a;
+    const struct entry_order *eb = (const struct entry_order *) b;
+
+    if (ea->entry->offset != eb->entry->offset)
+        return ea->entry->offset < eb->entry->offset ? -1 : 1;
+    return 0;
+}
+
+static int compare_destination_order(const void *a, const void *b)
+{
+    const struct entry_order *ea = (const struct entry_order *) a;
+    const struct entry_order *eb = (const struct entry_order *) b;
+
+    if (ea->start != eb->start)
+        return ea->start < eb->start ? -1 : 1;
+    return compare_archive_order(a, b);
+}
+
+/**
+ * @brief Add where a resource gets written to an entry's byte range
+ *
+ * @return true if the range is known. It's only known for resources that
+ *         are only handled by raw_write and that aren't delta updates.
+ */
+static bool add_destination_range(struct fun_context *fctx, cfg_t *resource, struct entry_order *eo)
+{
+    cfg_t *on_resource = cfg_gettsec(fctx->task, "on-resource", cfg_title(resource));
+    cfg_opt_t *funlist = on_resource ? cfg_getopt(on_resource, "funlist") : NULL;
+    if (!funlist)
+        return false;
+
+    // Delta updates read their source from the destination, so moving them
+    // before or after other writes could change what they read.
+    if (cfg_getstr(on_resource, "delta-source-raw-offset") ||
+            cfg_getstr(on_resource, "delta-source-fat-offset"))
+        return false;
+
+    uint64_t first;
+    uint64_t last;
+    if (!fun_funlist_block_offsets(funlist, &first, &last) || first == UINT64_MAX)
+        return false;
+
+    struct sparse_file_map sfm;
+    sparse_file_init(&sfm);
+    if (sparse_file_get_map_from_resource(resource, &sfm) < 0) {
+        sparse_file_free(&sfm);
+        return false;
+    }
+    uint64_t end = last * FWUP_BLOCK_SIZE + sparse_file_size(&sfm);
+    sparse_file_free(&sfm);
+
+    if (first * FWUP_BLOCK_SIZE < eo->start)
+        eo->start = first * FWUP_BLOCK_SIZE;
+    if (end > eo->end)
+        eo->end = end;
+    return true;
+}
+
+/**
+ * @brief Run the resources for a task using the ZIP central directory
+ *
+ * Only entries that the task uses are read and everything else is skipped
+ * without reading it. When possible, entries are visited in the order that
+ * they're written to the destination so that writes mostly move forward.
+ */
+static int run_archive_entries_random_access(struct fun_context *fctx, struct fwup_apply_data *pd, struct resource_list *resources)
+{
+    int rc = 0;
+    struct archive *stream_a = pd->a;
+    struct entry_order *order = NULL;
+    int num_entries = 0;
+    bool known_ranges = true;
+
+    if (pd->dir.num_entries > 0) {
+        order = (struct entry_order *) malloc(pd->dir.num_entries * sizeof(struct entry_order));
+        if (!order)
+            fwup_err(EXIT_FAILURE, "malloc");
+    }
+
+    for (int i = 0; i < pd->dir.num_entries; i++) {
+        const struct zip_raw_entry *entry = &pd->dir.entries[i];
+        char resource_name[FWFILE_MAX_ARCHIVE_PATH];
+
+        OK_OR_CLEANUP(archive_filename_to_resource(entry->name, resource_name, sizeof(resource_name)));
+        if (resource_name[0] == '\0')
+            continue;
+
+        // Find everywhere that the data gets written whether it's for this
+        // resource or ones deduplicated into it.
+        struct entry_order *eo = &order[num_entries];
+        eo->entry = entry;
+        eo->start = UINT64_MAX;
+        eo->end = 0;
+        bool used = false;
+        struct resource_list *item = rlist_find_by_name(resources, resource_name);
+        if (item) {
+            known_ranges = add_destination_range(fctx, item->resource, eo) && known_ranges;
+            used = true;
+        }
+        for (item = rlist_find_duplicate(resources, resource_name, NULL);
+             item != NULL;
+             item = rlist_find_duplicate(resources, resource_name, item)) {
+            known_ranges = add_destination_range(fctx, item->resource, eo) && known_ranges;
+            used = true;
+        }
+
+        if (used)
+            num_entries++;
+    }
+
+    // Visit the entries in the order that they're written when that can't
+    // change the result. Resources that overlap or aren't written by
+    // raw_write are processed in archive order like when streaming.
+    if (known_ranges && num_entries > 1) {
+        qsort(order, num_entries, sizeof(struct entry_order), compare_destination_order);
+
+        uint64_t end = 0;
+        for (int i = 0; i < num_entries; i++) {
+            if (order[i].start < end) {
+                qsort(order, num_entries, sizeof(struct entry_order), compare_archive_order);
+                break;
+            }
+            if (order[i].end > end)
+                end = order[i].end;
+        }
+    }
+
+    for (int i = 0; i < num_entries; i++) {
+        const struct zip_raw_entry *entry = order[i].entry;
+        char resource_name[FWFILE_MAX_ARCHIVE_PATH];
+        OK_OR_CLEANUP(archive_filename_to_resource(entry->name, resource_name, sizeof(resource_name)));
+
+        // libarchive reads a Zip64-sized data descriptor even when the
+        // real one is shorter, so the range can go a little past the entry.
+        pd->a = archive_read_new();
+        archive_read_support_format_zip(pd->a);
+        if (fwup_archive_open_range(pd->a, pd->fw_filename, entry->offset, zip_raw_stream_len(entry), pd->progress) != ARCHIVE_OK)
+            ERR_CLEANUP_MSG("%s", archive_error_string(pd->a));
+
+        // The local header has to agree with the central directory
+        struct archive_entry *ae;
+        if (archive_read_next_header(pd->a, &ae) != ARCHIVE_OK ||
+                strcmp(archive_entry_pathname(ae), entry->name) != 0)
+            ERR_CLEANUP_MSG("Unexpected ZIP entry at the location of '%s'. Archive is corrupt.", entry->name);
+
+        OK_OR_CLEANUP(run_archive_entry(fctx, pd, resources, resource_name, ae));
+
+        archive_read_free(pd->a);
+        pd->a = stream_a;
+    }
+
+cleanup:
+    if (pd->a != stream_a) {
+        archive_read_free(pd->a);
+        pd->a = stream_a;
+    }
+    free(order);
+    return rc;
+}
+
+/**
+ * @brief Read the ZIP central directory if the input can be read out of order
+ *
+ * Reading from stdin or anything else that isn't a regular file falls back
+ * to processing the archive from front to back.
+ */
+static void init_random_access(struct fwup_apply_data *pd, const char *fw_filename)
+{
+    pd->random_access = false;
+    if (fw_filename == NULL || fw_filename[0] == '\0')
+        return;
+
+    int fd = open(fw_filename, O_RDONLY | O_WIN32_BINARY);
+    if (fd < 0)
+        return;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+            zip_raw_read_directory(fd, &pd->dir) == 0)
+        pd->random_access = true;
+
+    close(fd);
+}
+#endif // FWUP_MINIMAL
+
+static int run_task(struct fun_context *fctx, struct fwup_apply_data *pd)
+{
+    int rc = 0;
+
+    struct resource_list *resources = NULL;
+    OK_OR_CLEANUP(rlist_get_from_task(fctx->cfg, fctx->task, &resources));
+
+    fctx->type = FUN_CONTEXT_INIT;
+    OK_OR_CLEANUP(apply_event(fctx, fctx->task, "on-init", NULL, fun_run));
+
+    fctx->type = FUN_CONTEXT_FILE;
+    fctx->read = read_callback;
+#ifndef FWUP_MINIMAL
+    if (pd->random_access)
+        OK_OR_CLEANUP(run_archive_entries_random_access(fctx, pd, resources));
+    else
+#endif
+        OK_OR_CLEANUP(run_archive_entries(fctx, pd, resources));
 
     // Make sure that all "on-resource" blocks have been run.
     for (const struct resource_list *r = resources; r != NULL; r = r->next) {
@@ -527,6 +871,8 @@ int fwup_apply(const char *fw_filename,
     struct fwup_apply_data pd;
     memset(&pd, 0, sizeof(pd));
     fctx.cookie = &pd;
+    pd.fw_filename = fw_filename;
+    pd.progress = progress;
     pd.a = archive_read_new();
 
     archive_read_support_format_zip(pd.a);
@@ -557,9 +903,20 @@ int fwup_apply(const char *fw_filename,
 
     OK_OR_CLEANUP(cfgfile_parse_fw_ae(pd.a, ae, &fctx.cfg, meta_conf_signature, options->public_keys));
 
+#ifndef FWUP_MINIMAL
+    init_random_access(&pd, fw_filename);
+#endif
+
     initialize_timestamps();
 
     fctx.cache_size_mb = cfg_getint(fctx.cfg, "block-cache-size-mb");
+    fctx.xd_cache_blocks = cfg_getint(fctx.cfg, "delta-source-cache-blocks");
+    fctx.xd_block_size = cfg_getint(fctx.cfg, "delta-source-block-size-kb") * 1024;
+    OK_OR_CLEANUP(xdelta_check_source_cache(fctx.xd_cache_blocks, fctx.xd_block_size));
+    fctx.xd_decode_threads = cfg_getint(fctx.cfg, "delta-decode-threads");
+    OK_OR_CLEANUP(xdelta_check_decode_threads(fctx.xd_decode_threads));
+    fctx.xd_decrypt_cache_mb = cfg_getint(fctx.cfg, "delta-source-decrypt-cache-mb");
+    OK_OR_CLEANUP(block_cache_check_decrypted_size(fctx.xd_decrypt_cache_mb));
 
     // Initialize the output. Nothing should have been written before now
     // and waiting to initialize the output until now forces the point.
@@ -606,6 +963,10 @@ cleanup:
     }
 
     sparse_file_free(&pd.sfm);
+    free(pd.replay_buffer);
+#ifndef FWUP_MINIMAL
+    zip_raw_free_directory(&pd.dir);
+#endif
 
     archive_read_free(pd.a);
 
@@ -19,7 +19,15 @@
 #include "util.h"
 #include "fwfile.h"
 #include "sparse_file.h"
+#include "create_cache.h"
+#include "resource_hash.h"
+#include "fwup_xdelta3.h"
+#include "block_cache.h"
+#include "functions.h"
+#include "zip_raw.h"
+#include "work_pool.h"
 #include "config.h"
+#include "3rdparty/semver.c/semver.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -30,40 +38,52 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <assert.h>
 
 #ifndef FWUP_MINIMAL
 
+#define CALC_HASH_BUFFER_SIZE (256 * 1024)
+#define MAX_COMPRESS_WORKERS  8
+
 struct calc_metadata_state
 {
     struct sparse_file_map sfm;
     struct sparse_file_read_iterator read_iterator;
     bool no_sparse_files;
+    bool skip_zero_blocks;
 
-    crypto_blake2b_ctx hash_state;
+    struct resource_hash hash_state;
 };
 
 static int build_sparse_map(int fd, void *cookie)
 {
     struct calc_metadata_state *state = (struct calc_metadata_state *) cookie;
-    return sparse_file_build_map_from_fd(fd, state->no_sparse_files, &state->sfm);
+    return sparse_file_build_map_from_fd(fd, state->no_sparse_files, state->skip_zero_blocks, &state->sfm);
 }
 
 static int calc_hash(int fd, void *cookie)
 {
     struct calc_metadata_state *state = (struct calc_metadata_state *) cookie;
 
+    int rc = 0;
+    char *buffer = (char *) malloc(CALC_HASH_BUFFER_SIZE);
+    if (!buffer)
+        ERR_RETURN("Out of memory");
+
     off_t offset = 0;
     for (;;) {
-        char buffer[4096];
         size_t len;
-        OK_OR_RETURN(sparse_file_read_next_data(&state->read_iterator, fd, &offset, buffer, sizeof(buffer), &len));
+        OK_OR_CLEANUP(sparse_file_read_next_data(&state->read_iterator, fd, &offset, buffer, CALC_HASH_BUFFER_SIZE, &len));
         if (len == 0)
             break;
 
-        crypto_blake2b_update(&state->hash_state, (const uint8_t*) buffer, len);
+        resource_hash_update(&state->hash_state, buffer, len);
     }
-    return 0;
+
+cleanup:
+    free(buffer);
+    return rc;
 }
 
 struct write_file_state
@@ -114,11 +134,22 @@ static int run_on_each_path(cfg_t *sec, const char *paths, int (*func)(int, void
     return rc;
 }
 
-static int compute_file_metadata(cfg_t *cfg)
+static int add_to_cache_key(int fd, void *cookie)
+{
+    struct create_cache_key *key = (struct create_cache_key *) cookie;
+    return create_cache_key_add_fd(key, fd);
+}
+
+static int compute_file_metadata(cfg_t *cfg, struct create_cache *cache, bool skip_zero_blocks)
 {
     cfg_t *sec;
     int i = 0;
 
+    enum resource_hash_type hash_type;
+    OK_OR_RETURN(resource_hash_type_from_name(cfg_getstr(cfg, "resource-hash"), &hash_type));
+    const char *hash_name = resource_hash_name(hash_type);
+    const char *other_hash_name = resource_hash_name(hash_type == RESOURCE_HASH_BLAKE2B_256 ? RESOURCE_HASH_BLAKE2B_256_TREE : RESOURCE_HASH_BLAKE2B_256);
+
     while ((sec = cfg_getnsec(cfg, "file-resource", i++)) != NULL) {
         const char *paths = cfg_getstr(sec, "host-path");
 
@@ -128,18 +159,40 @@ static int compute_file_metadata(cfg_t *cfg)
 
             // Check whether the user wants to skip holes in files
             state.no_sparse_files = !cfg_getbool(sec, "skip-holes");
-
-            // Compute the sparse file map
+            state.skip_zero_blocks = skip_zero_blocks;
             sparse_file_init(&state.sfm);
-            OK_OR_RETURN(run_on_each_path(sec, paths, build_sparse_map, &state));
-            OK_OR_RETURN(sparse_file_set_map_in_resource(sec, &state.sfm));
-
-            // Compute the hash across the files
-            crypto_blake2b_general_init(&state.hash_state, FWUP_BLAKE2b_256_LEN, NULL, 0);
-            sparse_file_start_read(&state.sfm, &state.read_iterator);
-            OK_OR_RETURN(run_on_each_path(sec, paths, calc_hash, &state));
 
-            crypto_blake2b_final(&state.hash_state, hash);
+            // If the host files haven't changed since the last run, use the
+            // cached sparse map and hash rather than reading everything again.
+            struct create_cache_key key;
+            bool cached = false;
+            if (cache) {
+                create_cache_key_start(&key, sec->filename, paths, !state.no_sparse_files, skip_zero_blocks, hash_name);
+                OK_OR_RETURN(run_on_each_path(sec, paths, add_to_cache_key, &key));
+                create_cache_key_finish(&key);
+                cached = create_cache_lookup(cache, &key, &state.sfm, hash);
+            }
+
+            if (cached) {
+                INFO("file-resource '%s': using cached metadata", cfg_title(sec));
+            } else {
+                // Compute the sparse file map
+                OK_OR_RETURN(run_on_each_path(sec, paths, build_sparse_map, &state));
+
+                // Compute the hash across the files
+                resource_hash_init(&state.hash_state, hash_type);
+                sparse_file_start_read(&state.sfm, &state.read_iterator);
+                if (run_on_each_path(sec, paths, calc_hash, &state) < 0) {
+                    resource_hash_free(&state.hash_state);
+                    return -1;
+                }
+
+                resource_hash_final(&state.hash_state, hash);
+
+                if (cache)
+                    OK_OR_RETURN(create_cache_store(cache, &key, &state.sfm, hash));
+            }
+            OK_OR_RETURN(sparse_file_set_map_in_resource(sec, &state.sfm));
             sparse_file_free(&state.sfm);
         } else {
             const char *contents = cfg_getstr(sec, "contents");
@@ -152,16 +205,122 @@ static int compute_file_metadata(cfg_t *cfg)
             cfg_setint(sec, "length", len);
 #endif
 
-            crypto_blake2b_general(hash, FWUP_BLAKE2b_256_LEN, NULL, 0, (const uint8_t *) contents, len);
+            resource_hash_buffer(hash_type, contents, len, hash);
         }
         char hash_str[sizeof(hash) * 2 + 1];
         bytes_to_hex(hash, hash_str, sizeof(hash));
-        cfg_setstr(sec, "blake2b-256", hash_str);
+        cfg_setstr(sec, hash_name, hash_str);
+        if (cfg_getstr(sec, other_hash_name))
+            cfg_setstr(sec, other_hash_name, NULL);
     }
 
     return 0;
 }
 
+static bool same_sparse_map(const struct sparse_file_map *a, const struct sparse_file_map *b)
+{
+    return a->map_len == b->map_len &&
+           memcmp(a->map, b->map, a->map_len * sizeof(off_t)) == 0;
+}
+
+// Raise require-fwup-version to at least version. Nothing's done if the
+// config already requires something newer.
+static void require_fwup_version(cfg_t *cfg, const char *version)
+{
+    semver_t current_version = {0};
+    semver_t new_version = {0};
+    semver_t old_version = {0};
+    if (semver_parse(VERSION, &current_version) < 0)
+        fwup_errx(EXIT_FAILURE, "Invalid fwup version: " VERSION);
+    if (semver_parse(version, &new_version) < 0)
+        fwup_errx(EXIT_FAILURE, "Invalid fwup version: %s", version);
+
+    // Development builds report the previous release, so don't require more
+    // than the fwup that's making the archive.
+    if (semver_lt(current_version, new_version)) {
+        semver_free(&new_version);
+        new_version = current_version;
+        current_version = (semver_t) {0};
+        version = VERSION;
+    }
+
+    const char *old_version_str = cfg_getstr(cfg, "require-fwup-version");
+    if (semver_parse(old_version_str, &old_version) < 0 ||
+            semver_lt(old_version, new_version)) {
+        INFO("Setting require-fwup-version to %s", version);
+        cfg_setstr(cfg, "require-fwup-version", version);
+    }
+
+    semver_free(&current_version);
+    semver_free(&new_version);
+    semver_free(&old_version);
+}
+
+static int find_duplicate_resources(cfg_t *cfg)
+{
+    cfg_t *sec;
+    int i = 0;
+    int rc = 0;
+    bool found_duplicate = false;
+    struct sparse_file_map sfm;
+    struct sparse_file_map other_sfm;
+    sparse_file_init(&sfm);
+    sparse_file_init(&other_sfm);
+
+    bool dedup = cfg_getbool(cfg, "dedup-resources");
+
+    while ((sec = cfg_getnsec(cfg, "file-resource", i++)) != NULL) {
+        if (cfg_getstr(sec, "duplicate-of"))
+            ERR_CLEANUP_MSG("duplicate-of can't be set in file-resource '%s'", cfg_title(sec));
+
+        if (!dedup || !cfg_getstr(sec, "host-path"))
+            continue;
+
+        OK_OR_CLEANUP(sparse_file_get_map_from_resource(sec, &sfm));
+        if (sparse_file_data_size(&sfm) > FWFILE_MAX_DUPLICATE_SIZE)
+            continue;
+
+        // Look for an earlier resource that will be stored in the archive
+        // with the same contents. The sparse maps have to match too so that
+        // the data gets written to the same places.
+        enum resource_hash_type hash_type;
+        const char *hash;
+        OK_OR_CLEANUP(resource_hash_get_expected(sec, &hash_type, &hash));
+
+        cfg_t *other;
+        for (int j = 0; j < i - 1; j++) {
+            other = cfg_getnsec(cfg, "file-resource", j);
+            if (!cfg_getstr(other, "host-path") ||
+                    cfg_getstr(other, "duplicate-of"))
+                continue;
+
+            enum resource_hash_type other_hash_type;
+            const char *other_hash;
+            OK_OR_CLEANUP(resource_hash_get_expected(other, &other_hash_type, &other_hash));
+            if (hash_type != other_hash_type || strcmp(hash, other_hash) != 0)
+                continue;
+
+            OK_OR_CLEANUP(sparse_file_get_map_from_resource(other, &other_sfm));
+            if (same_sparse_map(&sfm, &other_sfm)) {
+                INFO("file-resource '%s' is a duplicate of '%s'", cfg_title(sec), cfg_title(other));
+                cfg_setstr(sec, "duplicate-of", cfg_title(other));
+                found_duplicate = true;
+                break;
+            }
+        }
+    }
+
+    // Older versions of fwup don't know about duplicate-of and would write
+    // nothing for those resources, so make them refuse the archive instead.
+    if (found_duplicate)
+        require_fwup_version(cfg, FWFILE_DUPLICATE_OF_VERSION);
+
+cleanup:
+    sparse_file_free(&other_sfm);
+    sparse_file_free(&sfm);
+    return rc;
+}
+
 static int resource_name_to_archive_path(const char *resource_name, char *archive_path)
 {
     // Convert the resource name to an archive path (most resources should be in the data directory)
@@ -195,6 +354,34 @@ static int resource_name_to_archive_path(const char *resource_name, char *archiv
     return 0;
 }
 
+static int check_file_assertions(const char *local_paths,
+                                 const struct sparse_file_map *sfm,
+                                 const struct fwfile_assertions *assertions)
+{
+    off_t total_len = sparse_file_size(sfm);
+
+    if (assertions) {
+        if (assertions->assert_gte >= 0 &&
+                !(total_len >= assertions->assert_gte))
+            ERR_RETURN("file size assertion failed on '%s'. Size is %lu bytes. It must be >= %lu bytes (%lu blocks)",
+                       local_paths, total_len, assertions->assert_gte, assertions->assert_gte / FWUP_BLOCK_SIZE);
+        if (assertions->assert_lte >= 0 &&
+                !(total_len <= assertions->assert_lte))
+            ERR_RETURN("file size assertion failed on '%s'. Size is %lu bytes. It must be <= %lu bytes (%lu blocks)",
+                       local_paths, total_len, assertions->assert_lte, assertions->assert_lte / FWUP_BLOCK_SIZE);
+    }
+    return 0;
+}
+
+static void write_file_header(struct archive *a, struct archive_entry *entry, const char *archive_path, off_t data_len)
+{
+    archive_entry_set_pathname(entry, archive_path);
+    archive_entry_set_size(entry, data_len);
+    archive_entry_set_filetype(entry, AE_IFREG);
+    archive_entry_set_perm(entry, 0644);
+    archive_write_header(a, entry);
+}
+
 static int add_file_resource(cfg_t *sec,
                              struct archive *a,
                              const char *local_paths,
@@ -207,29 +394,12 @@ static int add_file_resource(cfg_t *sec,
     if (*local_paths == '\0')
         ERR_CLEANUP_MSG("must specify a host-path for resource '%s'", cfg_title(sec));
 
-    off_t total_len = sparse_file_size(sfm);
-
-    if (assertions) {
-        if (assertions->assert_gte >= 0 &&
-                !(total_len >= assertions->assert_gte))
-            ERR_CLEANUP_MSG("file size assertion failed on '%s'. Size is %lu bytes. It must be >= %lu bytes (%lu blocks)",
-                            local_paths, total_len, assertions->assert_gte, assertions->assert_gte / FWUP_BLOCK_SIZE);
-        if (assertions->assert_lte >= 0 &&
-                !(total_len <= assertions->assert_lte))
-            ERR_CLEANUP_MSG("file size assertion failed on '%s'. Size is %lu bytes. It must be <= %lu bytes (%lu blocks)",
-                            local_paths, total_len, assertions->assert_lte, assertions->assert_lte / FWUP_BLOCK_SIZE);
-    }
+    OK_OR_CLEANUP(check_file_assertions(local_paths, sfm, assertions));
 
     char archive_path[FWFILE_MAX_ARCHIVE_PATH];
     OK_OR_CLEANUP(resource_name_to_archive_path(cfg_title(sec), archive_path));
 
-    off_t data_len = sparse_file_data_size(sfm);
-
-    archive_entry_set_pathname(entry, archive_path);
-    archive_entry_set_size(entry, data_len);
-    archive_entry_set_filetype(entry, AE_IFREG);
-    archive_entry_set_perm(entry, 0644);
-    archive_write_header(a, entry);
+    write_file_header(a, entry, archive_path, sparse_file_data_size(sfm));
 
     struct write_file_state state;
     state.a = a;
@@ -269,25 +439,126 @@ cleanup:
     return rc;
 }
 
-static int add_file_resources(cfg_t *cfg, struct archive *a)
+struct resource_order
 {
     cfg_t *sec;
+    uint64_t block_offset;
+    int index;
+};
+
+/**
+ * @brief Find the lowest block offset that a resource gets written to
+ *
+ * All tasks are checked since it's not known which one will be run.
+ *
+ * @param cfg the configuration
+ * @param resource_name the name of the file-resource
+ * @return the block offset or UINT64_MAX if not known
+ */
+static uint64_t resource_block_offset(cfg_t *cfg, const char *resource_name)
+{
+    uint64_t block_offset = UINT64_MAX;
+    cfg_t *task;
     int i = 0;
+
+    while ((task = cfg_getnsec(cfg, "task", i++)) != NULL) {
+        cfg_t *on_resource = cfg_gettsec(task, "on-resource", resource_name);
+        if (!on_resource)
+            continue;
+
+        cfg_opt_t *funlist = cfg_getopt(on_resource, "funlist");
+        if (!funlist)
+            continue;
+
+        uint64_t first;
+        uint64_t last;
+        fun_funlist_block_offsets(funlist, &first, &last);
+        if (first < block_offset)
+            block_offset = first;
+    }
+    return block_offset;
+}
+
+static int compare_resource_order(const void *a, const void *b)
+{
+    const struct resource_order *ra = (const struct resource_order *) a;
+    const struct resource_order *rb = (const struct resource_order *) b;
+
+    if (ra->block_offset != rb->block_offset)
+        return ra->block_offset < rb->block_offset ? -1 : 1;
+
+    // Keep the configuration order for ties
+    return ra->index - rb->index;
+}
+
+/**
+ * @brief Return the order to store the file-resources in the archive
+ *
+ * @param cfg the configuration
+ * @param sort_resources true to sort by destination offset
+ * @param order set to an array of resources. Call free() when done.
+ * @return the number of resources
+ */
+static int get_resource_order(cfg_t *cfg, bool sort_resources, struct resource_order **order)
+{
+    int count = 0;
+    while (cfg_getnsec(cfg, "file-resource", count) != NULL)
+        count++;
+
+    *order = NULL;
+    if (count == 0)
+        return 0;
+
+    *order = (struct resource_order *) malloc(count * sizeof(struct resource_order));
+    if (!*order)
+        fwup_err(EXIT_FAILURE, "malloc");
+
+    for (int i = 0; i < count; i++) {
+        cfg_t *sec = cfg_getnsec(cfg, "file-resource", i);
+        (*order)[i].sec = sec;
+        (*order)[i].block_offset = sort_resources ? resource_block_offset(cfg, cfg_title(sec)) : 0;
+        (*order)[i].index = i;
+    }
+
+    // Storing resources in the order that they're written lets fwup_apply
+    // write the destination from front to back. meta.conf is always first.
+    if (sort_resources && count > 1)
+        qsort(*order, count, sizeof(struct resource_order), compare_resource_order);
+
+    return count;
+}
+
+static void get_file_assertions(cfg_t *sec, struct fwfile_assertions *assertions)
+{
+    assertions->assert_lte = cfg_getint(sec, "assert-size-lte") * FWUP_BLOCK_SIZE;
+    assertions->assert_gte = cfg_getint(sec, "assert-size-gte") * FWUP_BLOCK_SIZE;
+}
+
+static int add_file_resources(cfg_t *cfg, struct archive *a, bool sort_resources)
+{
     int rc = 0;
 
     struct sparse_file_map sfm;
     sparse_file_init(&sfm);
 
-    while ((sec = cfg_getnsec(cfg, "file-resource", i++)) != NULL) {
+    struct resource_order *order;
+    int count = get_resource_order(cfg, sort_resources, &order);
+
+    for (int i = 0; i < count; i++) {
+        cfg_t *sec = order[i].sec;
         const char *hostpath = cfg_getstr(sec, "host-path");
         if (hostpath) {
             struct fwfile_assertions assertions;
-            assertions.assert_lte = cfg_getint(sec, "assert-size-lte") * FWUP_BLOCK_SIZE;
-            assertions.assert_gte = cfg_getint(sec, "assert-size-gte") * FWUP_BLOCK_SIZE;
+            get_file_assertions(sec, &assertions);
 
             OK_OR_CLEANUP(sparse_file_get_map_from_resource(sec, &sfm));
 
-            OK_OR_CLEANUP(add_file_resource(sec, a, hostpath, &sfm, &assertions));
+            if (cfg_getstr(sec, "duplicate-of")) {
+                // The data is only stored once under the resource that this duplicates
+                OK_OR_CLEANUP(check_file_assertions(hostpath, &sfm, &assertions));
+            } else {
+                OK_OR_CLEANUP(add_file_resource(sec, a, hostpath, &sfm, &assertions));
+            }
         } else {
             const char *contents = cfg_getstr(sec, "contents");
             OK_OR_CLEANUP(add_string_resource(a, cfg_title(sec), contents));
@@ -295,17 +566,16 @@ static int add_file_resources(cfg_t *cfg, struct archive *a)
     }
 
 cleanup:
+    free(order);
     sparse_file_free(&sfm);
     return rc;
 }
 
-static int create_archive(cfg_t *cfg, const char *filename, const unsigned char *signing_key, int compression_level)
+static int open_archive(struct archive *a, const char *filename, int compression_level)
 {
-    int rc = 0;
-    struct archive *a = archive_write_new();
     if (archive_write_set_format_zip(a) != ARCHIVE_OK ||
         archive_write_zip_set_compression_deflate(a) != ARCHIVE_OK)
-        ERR_CLEANUP_MSG("error configuring libarchive: %s", archive_error_string(a));
+        ERR_RETURN("error configuring libarchive: %s", archive_error_string(a));
 
     // Setting the compression-level is only supported on more recent versions
     // of libarchive, so don't check for errors.
@@ -313,11 +583,20 @@ static int create_archive(cfg_t *cfg, const char *filename, const unsigned char
     archive_write_set_format_option(a, "zip", "compression-level", compression_level_string);
 
     if (archive_write_open_filename(a, filename) != ARCHIVE_OK)
-        ERR_CLEANUP_MSG("error creating archive '%s': %s", filename, archive_error_string(a));
+        ERR_RETURN("error creating archive '%s': %s", filename, archive_error_string(a));
 
-    OK_OR_CLEANUP(fwfile_add_meta_conf(cfg, a, signing_key));
+    return 0;
+}
 
-    OK_OR_CLEANUP(add_file_resources(cfg, a));
+static int create_archive(cfg_t *cfg, const char *filename, const struct fwup_create_options *options)
+{
+    int rc = 0;
+    struct archive *a = archive_write_new();
+    OK_OR_CLEANUP(open_archive(a, filename, options->compression_level));
+
+    OK_OR_CLEANUP(fwfile_add_meta_conf(cfg, a, options->signing_key));
+
+    OK_OR_CLEANUP(add_file_resources(cfg, a, options->sort_resources));
 
 cleanup:
     archive_write_close(a);
@@ -326,22 +605,433 @@ cleanup:
     return rc;
 }
 
+/**
+ * @brief Create the archive that holds the entries that aren't cached
+ *
+ * meta.conf, its signature and contents resources are small and quick to
+ * compress, so they're always created fresh. They're copied from here
+ * into the final archive.
+ */
+static int create_staging_archive(cfg_t *cfg, const char *filename, const struct fwup_create_options *options)
+{
+    int rc = 0;
+    struct archive *a = archive_write_new();
+    OK_OR_CLEANUP(open_archive(a, filename, options->compression_level));
+
+    OK_OR_CLEANUP(fwfile_add_meta_conf(cfg, a, options->signing_key));
+
+    cfg_t *sec;
+    int i = 0;
+    while ((sec = cfg_getnsec(cfg, "file-resource", i++)) != NULL) {
+        const char *contents = cfg_getstr(sec, "contents");
+        if (!cfg_getstr(sec, "host-path") && contents)
+            OK_OR_CLEANUP(add_string_resource(a, cfg_title(sec), contents));
+    }
+
+cleanup:
+    if (archive_write_close(a) != ARCHIVE_OK && rc == 0)
+        ERR_CLEANUP_MSG("error writing archive '%s': %s", filename, archive_error_string(a));
+    archive_write_free(a);
+
+    return rc;
+}
+
+static int open_cached_entry(const char *path, const char *archive_path, off_t data_len, int *fd, struct zip_raw_directory *dir)
+{
+    *fd = open(path, O_RDONLY | O_WIN32_BINARY);
+    if (*fd < 0)
+        return -1;
+
+    // Anything unexpected is treated as a miss and the entry is recreated
+    if (zip_raw_read_directory(*fd, dir) < 0 ||
+            dir->num_entries != 1 ||
+            strcmp(dir->entries[0].name, archive_path) != 0 ||
+            dir->entries[0].uncompressed_size != (uint64_t) data_len) {
+        zip_raw_free_directory(dir);
+        close(*fd);
+        *fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// A file-resource that gets compressed into its own one entry archive
+struct compress_job {
+    cfg_t *sec;
+    char archive_path[FWFILE_MAX_ARCHIVE_PATH];
+    struct sparse_file_map sfm;
+
+    // Host paths are resolved before starting the workers since
+    // update_relative_path() uses dirname(), which isn't always thread-safe.
+    char **paths;
+    int num_paths;
+
+    char *path;    // The one entry archive
+    bool compress; // False if the cache already has it
+    int rc;
+};
+
+struct compress_jobs {
+    struct compress_job *jobs;
+    int num_jobs;
+    int compression_level;
+};
+
+static void resolve_paths(struct compress_job *job, const char *local_paths)
+{
+    int max_paths = 1;
+    for (const char *p = local_paths; *p != '\0'; p++) {
+        if (*p == ';')
+            max_paths++;
+    }
+
+    job->paths = (char **) malloc(max_paths * sizeof(char *));
+    if (!job->paths)
+        fwup_err(EXIT_FAILURE, "malloc");
+
+    char *paths_copy = strdup(local_paths);
+    for (char *path = strtok(paths_copy, ";");
+         path != NULL;
+         path = strtok(NULL, ";"))
+        update_relative_path(job->sec->filename, path, &job->paths[job->num_paths++]);
+    free(paths_copy);
+}
+
+static int compress_file_resource(struct compress_job *job, int compression_level)
+{
+    int rc = 0;
+    size_t tmp_path_len = strlen(job->path) + 5;
+    char *tmp_path = (char *) malloc(tmp_path_len);
+    if (!tmp_path)
+        fwup_err(EXIT_FAILURE, "malloc");
+    snprintf(tmp_path, tmp_path_len, "%s.tmp", job->path);
+
+    struct archive *a = archive_write_new();
+    struct archive_entry *entry = archive_entry_new();
+    OK_OR_CLEANUP(open_archive(a, tmp_path, compression_level));
+
+    write_file_header(a, entry, job->archive_path, sparse_file_data_size(&job->sfm));
+
+    struct write_file_state state;
+    state.a = a;
+    sparse_file_start_read(&job->sfm, &state.read_iterator);
+    for (int i = 0; i < job->num_paths; i++) {
+        int fd = open(job->paths[i], O_RDONLY | O_WIN32_BINARY);
+        if (fd < 0)
+            ERR_CLEANUP_MSG("can't open path '%s' in file-resource '%s'", job->paths[i], cfg_title(job->sec));
+
+        rc = write_file_to_archive(fd, &state);
+        close(fd);
+        if (rc < 0)
+            goto cleanup;
+    }
+
+cleanup:
+    archive_entry_free(entry);
+    if (archive_write_close(a) != ARCHIVE_OK && rc == 0) {
+        set_last_error("error writing archive '%s': %s", tmp_path, archive_error_string(a));
+        rc = -1;
+    }
+    archive_write_free(a);
+
+    if (rc == 0) {
+#ifdef _WIN32
+        // rename() won't replace existing files on Windows
+        unlink(job->path);
+#endif
+        if (rename(tmp_path, job->path) < 0) {
+            set_last_error("can't rename compressed entry to '%s'", job->path);
+            rc = -1;
+        }
+    }
+    if (rc < 0)
+        unlink(tmp_path);
+    free(tmp_path);
+    return rc;
+}
+
+static void compress_worker(void *void_jobs, int i)
+{
+    struct compress_jobs *jobs = (struct compress_jobs *) void_jobs;
+    struct compress_job *job = &jobs->jobs[i];
+
+    if (job->compress)
+        job->rc = compress_file_resource(job, jobs->compression_level);
+}
+
+/**
+ * @brief Compress the file-resources that aren't in the cache
+ *
+ * Each file-resource is compressed on its own thread.
+ */
+static int run_compress_jobs(struct compress_jobs *jobs)
+{
+    int to_compress = 0;
+    for (int i = 0; i < jobs->num_jobs; i++) {
+        if (jobs->jobs[i].compress)
+            to_compress++;
+    }
+
+    int workers = work_pool_cpus(MAX_COMPRESS_WORKERS);
+    if (workers > to_compress)
+        workers = to_compress;
+
+    struct work_pool pool;
+    work_pool_init(&pool, workers - 1);
+    work_pool_run(&pool, compress_worker, jobs, jobs->num_jobs);
+    work_pool_free(&pool);
+
+    // The failing job already set the error message
+    for (int i = 0; i < jobs->num_jobs; i++) {
+        if (jobs->jobs[i].rc < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Find where each file-resource's compressed data will come from
+ *
+ * With a cache, entries are looked up in it and new ones are added to it.
+ * Without one, every file-resource is compressed to a temporary file next
+ * to the output.
+ */
+static int prepare_compress_jobs(const struct resource_order *order,
+                                 int count,
+                                 struct create_cache *cache,
+                                 const char *filename,
+                                 struct compress_jobs *jobs)
+{
+    jobs->jobs = (struct compress_job *) calloc(count > 0 ? count : 1, sizeof(struct compress_job));
+    if (!jobs->jobs)
+        fwup_err(EXIT_FAILURE, "calloc");
+
+    for (int i = 0; i < count; i++) {
+        cfg_t *sec = order[i].sec;
+        const char *hostpath = cfg_getstr(sec, "host-path");
+        if (!hostpath)
+            continue;
+
+        struct fwfile_assertions assertions;
+        get_file_assertions(sec, &assertions);
+
+        if (cfg_getstr(sec, "duplicate-of")) {
+            // The data is only stored once under the resource that this duplicates
+            struct sparse_file_map sfm;
+            sparse_file_init(&sfm);
+            int rc = sparse_file_get_map_from_resource(sec, &sfm);
+            if (rc == 0)
+                rc = check_file_assertions(hostpath, &sfm, &assertions);
+            sparse_file_free(&sfm);
+            OK_OR_RETURN(rc);
+            continue;
+        }
+
+        struct compress_job *job = &jobs->jobs[jobs->num_jobs++];
+        job->sec = sec;
+        sparse_file_init(&job->sfm);
+        OK_OR_RETURN(sparse_file_get_map_from_resource(sec, &job->sfm));
+
+        if (*hostpath == '\0')
+            ERR_RETURN("must specify a host-path for resource '%s'", cfg_title(sec));
+
+        OK_OR_RETURN(check_file_assertions(hostpath, &job->sfm, &assertions));
+        OK_OR_RETURN(resource_name_to_archive_path(cfg_title(sec), job->archive_path));
+
+        off_t data_len = sparse_file_data_size(&job->sfm);
+        if (cache) {
+            enum resource_hash_type hash_type;
+            const char *hash;
+            OK_OR_RETURN(resource_hash_get_expected(sec, &hash_type, &hash));
+
+            struct create_cache_key key;
+            create_cache_entry_key(&key, job->archive_path, resource_hash_name(hash_type), hash, data_len, jobs->compression_level);
+            job->path = create_cache_path(cache, &key, ".zip");
+
+            int fd;
+            struct zip_raw_directory dir;
+            if (open_cached_entry(job->path, job->archive_path, data_len, &fd, &dir) == 0) {
+                INFO("file-resource '%s': using cached compressed data", cfg_title(sec));
+                cache->entry_hits++;
+                close(fd);
+                zip_raw_free_directory(&dir);
+                continue;
+            }
+            cache->entry_misses++;
+        } else {
+            size_t path_len = strlen(filename) + 16;
+            job->path = (char *) malloc(path_len);
+            if (!job->path)
+                fwup_err(EXIT_FAILURE, "malloc");
+            snprintf(job->path, path_len, "%s.%d.tmp", filename, jobs->num_jobs);
+        }
+
+        job->compress = true;
+        resolve_paths(job, hostpath);
+    }
+    return 0;
+}
+
+static void free_compress_jobs(struct compress_jobs *jobs, bool remove_files)
+{
+    for (int i = 0; i < jobs->num_jobs; i++) {
+        struct compress_job *job = &jobs->jobs[i];
+        if (remove_files && job->path)
+            unlink(job->path);
+
+        for (int j = 0; j < job->num_paths; j++)
+            free(job->paths[j]);
+        free(job->paths);
+        free(job->path);
+        sparse_file_free(&job->sfm);
+    }
+    free(jobs->jobs);
+    jobs->jobs = NULL;
+    jobs->num_jobs = 0;
+}
+
+static int copy_compressed_entry(struct zip_raw_writer *w, const struct compress_job *job)
+{
+    int fd;
+    struct zip_raw_directory dir;
+    if (open_cached_entry(job->path, job->archive_path, sparse_file_data_size(&job->sfm), &fd, &dir) < 0)
+        ERR_RETURN("can't read compressed entry '%s'", job->path);
+
+    int rc = zip_raw_copy_entry(w, fd, &dir.entries[0]);
+    close(fd);
+    zip_raw_free_directory(&dir);
+    return rc;
+}
+
+/**
+ * @brief Create the archive by compressing each file-resource separately
+ *
+ * The file-resources are compressed in parallel into one entry archives and
+ * then their compressed entries are copied into the final archive. This
+ * produces the same archive contents as create_archive(). With a cache,
+ * unchanged file-resources aren't read or compressed again.
+ */
+static int create_archive_from_entries(cfg_t *cfg, const char *filename, const struct fwup_create_options *options, struct create_cache *cache)
+{
+    int rc = 0;
+    int staging_fd = -1;
+    int out_fd = -1;
+    struct resource_order *order = NULL;
+    struct zip_raw_directory staging_dir;
+    struct zip_raw_writer writer;
+    struct compress_jobs jobs;
+    staging_dir.entries = NULL;
+    staging_dir.num_entries = 0;
+    zip_raw_writer_init(&writer, -1);
+    jobs.jobs = NULL;
+    jobs.num_jobs = 0;
+    jobs.compression_level = options->compression_level;
+
+    size_t staging_filename_len = strlen(filename) + 5;
+    char *staging_filename = malloc(staging_filename_len);
+    if (!staging_filename)
+        fwup_err(EXIT_FAILURE, "malloc");
+    snprintf(staging_filename, staging_filename_len, "%s.tmp", filename);
+
+    int count = get_resource_order(cfg, options->sort_resources, &order);
+    OK_OR_CLEANUP(prepare_compress_jobs(order, count, cache, filename, &jobs));
+    OK_OR_CLEANUP(run_compress_jobs(&jobs));
+
+    OK_OR_CLEANUP(create_staging_archive(cfg, staging_filename, options));
+
+    staging_fd = open(staging_filename, O_RDONLY | O_WIN32_BINARY);
+    if (staging_fd < 0)
+        ERR_CLEANUP_MSG("Error opening '%s'", staging_filename);
+    OK_OR_CLEANUP(zip_raw_read_directory(staging_fd, &staging_dir));
+
+    out_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_WIN32_BINARY, 0644);
+    if (out_fd < 0)
+        ERR_CLEANUP_MSG("error creating archive '%s'", filename);
+    writer.fd = out_fd;
+
+    // meta.conf and its signature are first just like create_archive()
+    for (int i = 0; i < staging_dir.num_entries; i++) {
+        const char *name = staging_dir.entries[i].name;
+        if (strcmp(name, "meta.conf") == 0 || strcmp(name, "meta.conf.ed25519") == 0)
+            OK_OR_CLEANUP(zip_raw_copy_entry(&writer, staging_fd, &staging_dir.entries[i]));
+    }
+
+    // The jobs are in the same order as the file-resources with host paths
+    int next_job = 0;
+    for (int i = 0; i < count; i++) {
+        cfg_t *sec = order[i].sec;
+        if (cfg_getstr(sec, "host-path")) {
+            if (next_job < jobs.num_jobs && jobs.jobs[next_job].sec == sec)
+                OK_OR_CLEANUP(copy_compressed_entry(&writer, &jobs.jobs[next_job++]));
+        } else {
+            char archive_path[FWFILE_MAX_ARCHIVE_PATH];
+            OK_OR_CLEANUP(resource_name_to_archive_path(cfg_title(sec), archive_path));
+
+            const struct zip_raw_entry *entry = zip_raw_find(&staging_dir, archive_path);
+            if (!entry)
+                ERR_CLEANUP_MSG("resource '%s' missing from staging archive", cfg_title(sec));
+            OK_OR_CLEANUP(zip_raw_copy_entry(&writer, staging_fd, entry));
+        }
+    }
+    OK_OR_CLEANUP(zip_raw_writer_finish(&writer));
+
+    if (close(out_fd) < 0) {
+        out_fd = -1;
+        ERR_CLEANUP_MSG("error writing archive '%s'", filename);
+    }
+    out_fd = -1;
+
+cleanup:
+    if (out_fd >= 0)
+        close(out_fd);
+    if (staging_fd >= 0)
+        close(staging_fd);
+    unlink(staging_filename);
+    free(staging_filename);
+    free(order);
+    free_compress_jobs(&jobs, cache == NULL);
+    zip_raw_writer_free(&writer);
+    zip_raw_free_directory(&staging_dir);
+    return rc;
+}
+
 int fwup_create(const char *configfile,
                 const char *output_firmware,
-                const unsigned char *signing_key,
-                int compression_level)
+                const struct fwup_create_options *options)
 {
     cfg_t *cfg = NULL;
     int rc = 0;
+    struct create_cache cache;
+    struct create_cache *cachep = NULL;
+
+    if (options->cache_dir) {
+        OK_OR_CLEANUP(create_cache_init(&cache, options->cache_dir));
+        cachep = &cache;
+    }
 
     // Parse configuration
     OK_OR_CLEANUP(cfgfile_parse_file(configfile, &cfg));
+    OK_OR_CLEANUP(xdelta_check_source_cache(cfg_getint(cfg, "delta-source-cache-blocks"),
+                                            cfg_getint(cfg, "delta-source-block-size-kb") * 1024));
+    OK_OR_CLEANUP(xdelta_check_decode_threads(cfg_getint(cfg, "delta-decode-threads")));
+    OK_OR_CLEANUP(block_cache_check_decrypted_size(cfg_getint(cfg, "delta-source-decrypt-cache-mb")));
 
     // Compute all metadata
-    OK_OR_CLEANUP(compute_file_metadata(cfg));
-
-    // Create the archive
-    OK_OR_CLEANUP(create_archive(cfg, output_firmware, signing_key, compression_level));
+    OK_OR_CLEANUP(compute_file_metadata(cfg, cachep, options->skip_zero_blocks));
+    OK_OR_CLEANUP(find_duplicate_resources(cfg));
+
+    if (cachep)
+        INFO("create cache: %d hits, %d misses", cachep->hits, cachep->misses);
+
+    // Create the archive. Compressed entries can only be copied into the
+    // archive when writing to a file since the ZIP writer needs to seek.
+    if ((cachep || options->parallel_compression) && output_firmware) {
+        OK_OR_CLEANUP(create_archive_from_entries(cfg, output_firmware, options, cachep));
+        if (cachep)
+            INFO("create cache: %d compressed entries reused, %d compressed", cachep->entry_hits, cachep->entry_misses);
+    } else {
+        OK_OR_CLEANUP(create_archive(cfg, output_firmware, options));
+    }
 
 cleanup:
     if (cfg)
@@ -17,6 +17,26 @@
 #ifndef FWUP_CREATE_H
 #define FWUP_CREATE_H
 
-int fwup_create(const char *configfile, const char *output_firmware, const unsigned char *signing_key, int compression_level);
+#include <stdbool.h>
+
+struct fwup_create_options {
+    const unsigned char *signing_key;
+    int compression_level;
+
+    // Optional directory for caching file-resource metadata between runs
+    const char *cache_dir;
+
+    // Record aligned blocks of zeros in file-resources as holes
+    bool skip_zero_blocks;
+
+    // Store file-resources in the archive by destination offset
+    bool sort_resources;
+
+    // Compress file-resources on multiple threads. This is always done
+    // with a cache_dir. It only works when the output is a file.
+    bool parallel_compression;
+};
+
+int fwup_create(const char *configfile, const char *output_firmware, const struct fwup_create_options *options);
 
 #endif // FWUP_CREATE_H
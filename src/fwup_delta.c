@@ -0,0 +1,699 @@
+/*
+ * Copyright 2026 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fwup_delta.h"
+#include "fwup_xdelta3.h"
+#include "fwfile.h"
+#include "util.h"
+#include "cfgfile.h"
+#include "sparse_file.h"
+#include "zip_raw.h"
+#include "work_pool.h"
+#include "archive_open.h"
+#include "cfgprint.h"
+#include "monocypher-ed25519.h"
+
+#include <archive.h>
+#include <archive_entry.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#ifndef FWUP_MINIMAL
+
+struct delta_job {
+    const char *name;        // Resource name in the new firmware
+    const char *source_name; // Resource holding the data in the old firmware
+    char archive_path[FWFILE_MAX_ARCHIVE_PATH];
+    const struct zip_raw_entry *entry;
+    const struct zip_raw_entry *source_entry;
+
+    uint8_t *source;
+    size_t source_len;
+    size_t source_limit;     // The delta can't reference more than this
+
+    uint8_t *target;
+    size_t target_len;
+
+    uint8_t *patch;
+    size_t patch_len;
+    int load_rc;
+    int rc;
+};
+
+struct delta_jobs {
+    const char *old_filename;
+    const char *new_filename;
+    struct delta_job *jobs;
+    int num_jobs;
+};
+
+// Where an on-resource in an A/B upgrade task writes its resource
+struct resource_write {
+    cfg_t *on_resource;
+    const char *fun;
+    const char *offset;
+    const char *path;
+};
+
+static void resource_to_archive_path(const char *name, char *archive_path)
+{
+    // See resource_name_to_archive_path() in fwup_create.c. The names have
+    // already been checked, so just convert them.
+    if (name[0] == '/')
+        snprintf(archive_path, FWFILE_MAX_ARCHIVE_PATH, "%s", &name[1]);
+    else
+        snprintf(archive_path, FWFILE_MAX_ARCHIVE_PATH, "data/%s", name);
+}
+
+static bool has_duplicates(cfg_t *cfg, const char *name)
+{
+    for (unsigned int i = 0; i < cfg_size(cfg, "file-resource"); i++) {
+        cfg_t *sec = cfg_getnsec(cfg, "file-resource", i);
+        const char *duplicate_of = cfg_getstr(sec, "duplicate-of");
+        if (duplicate_of && strcmp(duplicate_of, name) == 0)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Check whether any task can apply the resource as a delta
+ *
+ * @param cfg the new firmware's configuration
+ * @param name the resource name
+ * @param source_limit set to the most source bytes that every task can read
+ * @return true if some on-resource has delta-source settings
+ */
+static bool is_delta_resource(cfg_t *cfg, const char *name, size_t *source_limit)
+{
+    bool found = false;
+    *source_limit = SIZE_MAX;
+
+    for (unsigned int i = 0; i < cfg_size(cfg, "task"); i++) {
+        cfg_t *task = cfg_getnsec(cfg, "task", i);
+        cfg_t *on_resource = cfg_gettsec(task, "on-resource", name);
+        if (!on_resource)
+            continue;
+
+        int source_raw_count = cfg_getint(on_resource, "delta-source-raw-count");
+        if (source_raw_count > 0 && cfg_getstr(on_resource, "delta-source-raw-offset")) {
+            // The raw source is a partition, so don't let the delta reference
+            // anything past the end of the smallest one.
+            size_t limit = (size_t) source_raw_count * FWUP_BLOCK_SIZE;
+            if (limit < *source_limit)
+                *source_limit = limit;
+            found = true;
+        } else if (cfg_getstr(on_resource, "delta-source-fat-offset") &&
+                   cfg_getstr(on_resource, "delta-source-fat-path")) {
+            found = true;
+        }
+    }
+    return found;
+}
+
+static off_t resource_data_size(cfg_t *sec)
+{
+    struct sparse_file_map sfm;
+    sparse_file_init(&sfm);
+    off_t len = -1;
+    if (sparse_file_get_map_from_resource(sec, &sfm) >= 0 && sfm.map_len == 1)
+        len = sparse_file_data_size(&sfm);
+    sparse_file_free(&sfm);
+    return len;
+}
+
+/**
+ * @brief Get the destination of an on-resource that only writes the resource
+ *
+ * @return true if the on-resource is just a raw_write without options or a fat_write
+ */
+static bool get_resource_write(cfg_t *on_resource, struct resource_write *w)
+{
+    w->on_resource = on_resource;
+    w->path = NULL;
+
+    unsigned int len = cfg_size(on_resource, "funlist");
+    if (len == 3 && strcmp(cfg_getnstr(on_resource, "funlist", 0), "2") == 0 &&
+            strcmp(cfg_getnstr(on_resource, "funlist", 1), "raw_write") == 0) {
+        w->fun = "raw_write";
+        w->offset = cfg_getnstr(on_resource, "funlist", 2);
+        return true;
+    } else if (len == 4 && strcmp(cfg_getnstr(on_resource, "funlist", 0), "3") == 0 &&
+            strcmp(cfg_getnstr(on_resource, "funlist", 1), "fat_write") == 0) {
+        w->fun = "fat_write";
+        w->offset = cfg_getnstr(on_resource, "funlist", 2);
+        w->path = cfg_getnstr(on_resource, "funlist", 3);
+        return true;
+    }
+    return false;
+}
+
+static bool same_destination(const struct resource_write *a, const struct resource_write *b)
+{
+    return strcmp(a->fun, b->fun) == 0 &&
+            strtoull(a->offset, NULL, 0) == strtoull(b->offset, NULL, 0) &&
+            (a->path == NULL || strcmp(a->path, b->path) == 0);
+}
+
+static bool task_has_requirements(cfg_t *task)
+{
+    return cfg_size(task, "reqlist") > 0 || cfg_getint(task, "require-partition1-offset") >= 0;
+}
+
+/**
+ * @brief Find the two places that the A/B upgrade tasks write a resource
+ *
+ * Only tasks with requirements are looked at since those are the ones that
+ * check which slot is active. Tasks like "complete" are skipped.
+ *
+ * @param cfg the configuration
+ * @param name the resource name
+ * @param slots set to the two destinations
+ * @return true if every upgrade task only writes the resource to one of two places
+ */
+static bool find_ab_slots(cfg_t *cfg, const char *name, struct resource_write slots[2])
+{
+    int num_slots = 0;
+
+    for (unsigned int i = 0; i < cfg_size(cfg, "task"); i++) {
+        cfg_t *task = cfg_getnsec(cfg, "task", i);
+        cfg_t *on_resource = cfg_gettsec(task, "on-resource", name);
+        if (!on_resource || !task_has_requirements(task))
+            continue;
+
+        struct resource_write w;
+        if (!get_resource_write(on_resource, &w))
+            return false;
+
+        int slot;
+        for (slot = 0; slot < num_slots; slot++) {
+            if (same_destination(&slots[slot], &w))
+                break;
+        }
+        if (slot == num_slots) {
+            if (num_slots == 2)
+                return false;
+            slots[num_slots++] = w;
+        }
+    }
+
+    return num_slots == 2 &&
+            strcmp(slots[0].fun, slots[1].fun) == 0 &&
+            (slots[0].path == NULL || strcmp(slots[0].path, slots[1].path) == 0);
+}
+
+/**
+ * @brief Add delta-source settings for resources in A/B layouts
+ *
+ * If the upgrade tasks of both the old and new firmware write a resource to
+ * the same two places, then the slot that's not being written has the old
+ * resource. Each upgrade task gets delta-source settings that point to the
+ * other slot. Resources that already have delta-source settings anywhere
+ * are left alone.
+ *
+ * @param old_cfg the old firmware's configuration
+ * @param new_cfg the new firmware's configuration, updated with the settings
+ * @return the number of resources that got delta-source settings
+ */
+static int add_ab_delta_sources(cfg_t *old_cfg, cfg_t *new_cfg)
+{
+    int num_added = 0;
+
+    for (unsigned int i = 0; i < cfg_size(new_cfg, "file-resource"); i++) {
+        cfg_t *sec = cfg_getnsec(new_cfg, "file-resource", i);
+        const char *name = cfg_title(sec);
+        size_t source_limit;
+
+        cfg_t *old_sec = cfg_gettsec(old_cfg, "file-resource", name);
+        if (!old_sec || is_delta_resource(new_cfg, name, &source_limit) ||
+                cfg_getstr(sec, "duplicate-of") || has_duplicates(new_cfg, name))
+            continue;
+
+        // Both firmware versions have to use the same slots. Otherwise, the
+        // other slot might not have the old resource.
+        struct resource_write slots[2];
+        struct resource_write old_slots[2];
+        if (!find_ab_slots(new_cfg, name, slots) ||
+                !find_ab_slots(old_cfg, name, old_slots) ||
+                !((same_destination(&slots[0], &old_slots[0]) && same_destination(&slots[1], &old_slots[1])) ||
+                  (same_destination(&slots[0], &old_slots[1]) && same_destination(&slots[1], &old_slots[0]))))
+            continue;
+
+        off_t old_len = resource_data_size(old_sec);
+        off_t new_len = resource_data_size(sec);
+        if (old_len <= 0 || new_len < 0)
+            continue;
+
+        // raw_write sources can't reference more than the old resource and
+        // neither the source nor the destination can run into the other slot.
+        bool is_raw = strcmp(slots[0].fun, "raw_write") == 0;
+        int64_t source_count = (old_len + FWUP_BLOCK_SIZE - 1) / FWUP_BLOCK_SIZE;
+        int64_t dest_count = (new_len + FWUP_BLOCK_SIZE - 1) / FWUP_BLOCK_SIZE;
+        int64_t offset0 = (int64_t) strtoull(slots[0].offset, NULL, 0);
+        int64_t offset1 = (int64_t) strtoull(slots[1].offset, NULL, 0);
+        int64_t distance = offset0 > offset1 ? offset0 - offset1 : offset1 - offset0;
+        if (is_raw && (source_count > INT32_MAX || source_count > distance || dest_count > distance))
+            continue;
+
+        for (unsigned int j = 0; j < cfg_size(new_cfg, "task"); j++) {
+            cfg_t *task = cfg_getnsec(new_cfg, "task", j);
+            cfg_t *on_resource = cfg_gettsec(task, "on-resource", name);
+            if (!on_resource || !task_has_requirements(task))
+                continue;
+
+            struct resource_write w;
+            get_resource_write(on_resource, &w);
+            const struct resource_write *other = same_destination(&w, &slots[0]) ? &slots[1] : &slots[0];
+            if (is_raw) {
+                cfg_setstr(on_resource, "delta-source-raw-offset", other->offset);
+                cfg_setint(on_resource, "delta-source-raw-count", (long) source_count);
+            } else {
+                cfg_setstr(on_resource, "delta-source-fat-offset", other->offset);
+                cfg_setstr(on_resource, "delta-source-fat-path", other->path);
+            }
+        }
+        INFO("'%s': using the other A/B slot as the delta source", name);
+        num_added++;
+    }
+
+    return num_added;
+}
+
+static int find_jobs(cfg_t *old_cfg, cfg_t *new_cfg, struct delta_jobs *jobs)
+{
+    int max_jobs = cfg_size(new_cfg, "file-resource");
+    jobs->jobs = (struct delta_job *) calloc(max_jobs > 0 ? max_jobs : 1, sizeof(struct delta_job));
+    if (!jobs->jobs)
+        fwup_err(EXIT_FAILURE, "malloc");
+
+    for (int i = 0; i < max_jobs; i++) {
+        cfg_t *sec = cfg_getnsec(new_cfg, "file-resource", i);
+        const char *name = cfg_title(sec);
+        size_t source_limit;
+
+        if (!is_delta_resource(new_cfg, name, &source_limit)) {
+            INFO("'%s' has no delta-source settings, so keeping the full resource", name);
+            continue;
+        }
+
+        // These cases can't be applied as deltas. See run_resource() in fwup_apply.c.
+        if (cfg_getstr(sec, "duplicate-of") || has_duplicates(new_cfg, name)) {
+            INFO("'%s' has duplicates, so keeping the full resource", name);
+            continue;
+        }
+
+        struct sparse_file_map sfm;
+        sparse_file_init(&sfm);
+        OK_OR_RETURN(sparse_file_get_map_from_resource(sec, &sfm));
+        bool is_sparse = sfm.map_len != 1;
+        off_t target_len = sparse_file_data_size(&sfm);
+        sparse_file_free(&sfm);
+        if (is_sparse) {
+            INFO("'%s' is a sparse file, so keeping the full resource", name);
+            continue;
+        }
+
+        cfg_t *old_sec = cfg_gettsec(old_cfg, "file-resource", name);
+        if (!old_sec) {
+            INFO("'%s' isn't in the old firmware, so keeping the full resource", name);
+            continue;
+        }
+
+        // The holes in the old resource weren't written, so the device
+        // may not have zeros there.
+        sparse_file_init(&sfm);
+        OK_OR_RETURN(sparse_file_get_map_from_resource(old_sec, &sfm));
+        is_sparse = sfm.map_len != 1;
+        off_t source_len = sparse_file_data_size(&sfm);
+        sparse_file_free(&sfm);
+        if (is_sparse) {
+            INFO("'%s' is a sparse file in the old firmware, so keeping the full resource", name);
+            continue;
+        }
+
+        struct delta_job *job = &jobs->jobs[jobs->num_jobs++];
+        job->name = name;
+        job->source_name = cfg_getstr(old_sec, "duplicate-of");
+        if (!job->source_name)
+            job->source_name = name;
+        resource_to_archive_path(name, job->archive_path);
+        job->source_len = (size_t) source_len;
+        job->source_limit = source_limit;
+        job->target_len = (size_t) target_len;
+    }
+
+    return 0;
+}
+
+static int read_resource(struct archive *a, struct archive_entry *ae, const char *name, size_t expected_len, uint8_t **data)
+{
+    char *buffer;
+    off_t len;
+
+    // Ask for one extra byte to detect resources that are too long
+    if (archive_read_all_data(a, ae, &buffer, expected_len + 1, &len) < 0)
+        ERR_RETURN("Error reading '%s': %s", name, archive_error_string(a));
+    if (len != (off_t) expected_len) {
+        free(buffer);
+        ERR_RETURN("Unexpected size for '%s' (%" PRId64 " vs %" PRIu64 "). Is this a delta update already?",
+                   name, (int64_t) len, (uint64_t) expected_len);
+    }
+
+    *data = (uint8_t *) buffer;
+    return 0;
+}
+
+/**
+ * @brief Read a resource using its location from the central directory
+ *
+ * Each job opens the archives on its own so that jobs can load their
+ * resources in parallel.
+ *
+ * @param filename the firmware update file
+ * @param entry the resource's ZIP entry
+ * @param name the resource name for error messages
+ * @param expected_len the resource's uncompressed size
+ * @param data set to the contents
+ * @return 0 if successful
+ */
+static int read_entry(const char *filename, const struct zip_raw_entry *entry, const char *name, size_t expected_len, uint8_t **data)
+{
+    int rc = 0;
+    struct archive *a = archive_read_new();
+    archive_read_support_format_zip(a);
+
+    if (fwup_archive_open_range(a, filename, entry->offset, zip_raw_stream_len(entry), NULL) != ARCHIVE_OK)
+        ERR_CLEANUP_MSG("%s", archive_error_string(a));
+
+    struct archive_entry *ae;
+    if (archive_read_next_header(a, &ae) != ARCHIVE_OK ||
+            strcmp(archive_entry_pathname(ae), entry->name) != 0)
+        ERR_CLEANUP_MSG("Unexpected ZIP entry at the location of '%s' in '%s'. Archive is corrupt.", entry->name, filename);
+
+    OK_OR_CLEANUP(read_resource(a, ae, name, expected_len, data));
+
+cleanup:
+    archive_read_free(a);
+    return rc;
+}
+
+static void encode_job(const struct delta_jobs *jobs, struct delta_job *job)
+{
+    // Resources are loaded here rather than up front so that only the jobs
+    // being encoded have their contents in memory.
+    if (read_entry(jobs->old_filename, job->source_entry, job->source_name, job->source_len, &job->source) < 0 ||
+            read_entry(jobs->new_filename, job->entry, job->name, job->target_len, &job->target) < 0) {
+        job->load_rc = -1;
+        free(job->source);
+        job->source = NULL;
+        return;
+    }
+
+    // Only keep the delta if it's smaller than what's already in the
+    // archive. It also can't be the resource's size or fwup apply would
+    // think that it's the full resource.
+    size_t max_patch_len = job->entry->compressed_size;
+    if (max_patch_len > job->target_len)
+        max_patch_len = job->target_len;
+    if (max_patch_len > UINT32_MAX)
+        max_patch_len = UINT32_MAX;
+    if (max_patch_len > 0)
+        max_patch_len--;
+
+    size_t source_len = job->source_len;
+    if (source_len > job->source_limit)
+        source_len = job->source_limit;
+
+    job->patch = (uint8_t *) malloc(max_patch_len + 1);
+    if (!job->patch)
+        fwup_err(EXIT_FAILURE, "malloc");
+
+    job->rc = xdelta_encode(source_len > 0 ? job->source : NULL, source_len,
+                            job->target, job->target_len,
+                            job->patch, max_patch_len, &job->patch_len);
+
+    // The contents aren't needed any more, so free them early since
+    // firmware resources can be large.
+    free(job->source);
+    free(job->target);
+    job->source = NULL;
+    job->target = NULL;
+}
+
+static void encode_worker(void *void_jobs, int job)
+{
+    struct delta_jobs *jobs = (struct delta_jobs *) void_jobs;
+    encode_job(jobs, &jobs->jobs[job]);
+}
+
+static void encode_jobs(struct delta_jobs *jobs)
+{
+    // Set up xdelta3's shared tables before starting the workers
+    xdelta_encode_init();
+
+    // Each resource is loaded and encoded by one thread, so there are never
+    // more resources in memory than workers. This thread helps out too.
+    int workers = work_pool_cpus(FWUP_DELTA_MAX_WORKERS);
+    if (workers > jobs->num_jobs)
+        workers = jobs->num_jobs;
+
+    struct work_pool pool;
+    work_pool_init(&pool, workers - 1);
+    work_pool_run(&pool, encode_worker, jobs, jobs->num_jobs);
+    work_pool_free(&pool);
+}
+
+static void free_jobs(struct delta_jobs *jobs)
+{
+    for (int i = 0; i < jobs->num_jobs; i++) {
+        free(jobs->jobs[i].source);
+        free(jobs->jobs[i].target);
+        free(jobs->jobs[i].patch);
+    }
+    free(jobs->jobs);
+    jobs->jobs = NULL;
+    jobs->num_jobs = 0;
+}
+
+static const struct delta_job *find_job(const struct delta_jobs *jobs, const struct zip_raw_entry *entry)
+{
+    for (int i = 0; i < jobs->num_jobs; i++) {
+        if (jobs->jobs[i].entry == entry)
+            return &jobs->jobs[i];
+    }
+    return NULL;
+}
+
+/**
+ * @brief Create a delta firmware update
+ *
+ * Resources in the new firmware update that have delta-source settings
+ * in one of their on-resource handlers are replaced with xdelta3 patches
+ * against the resource with the same name in the old firmware update.
+ * Resources are only replaced when the patch is smaller. Resources that
+ * are written to A/B slots get delta-source settings that point to the
+ * other slot if they don't have any. meta.conf is only changed for those
+ * and is then signed with the signing key. Everything else is copied as is.
+ *
+ * @param old_filename the firmware update that's on the device
+ * @param new_filename the firmware update to upgrade to
+ * @param output_filename where to store the delta firmware update
+ * @param signing_key the key for signing meta.conf if it's changed or NULL
+ * @return 0 if successful
+ */
+int fwup_create_delta(const char *old_filename, const char *new_filename, const char *output_filename, const unsigned char *signing_key)
+{
+    int rc = 0;
+    cfg_t *old_cfg = NULL;
+    cfg_t *new_cfg = NULL;
+    char *temp_filename = NULL;
+    char *configtxt = NULL;
+    int in_fd = -1;
+    int old_fd = -1;
+    int out_fd = -1;
+    struct delta_jobs jobs;
+    struct zip_raw_directory dir;
+    struct zip_raw_directory old_dir;
+    struct zip_raw_writer writer;
+
+    jobs.old_filename = old_filename;
+    jobs.new_filename = new_filename;
+    jobs.jobs = NULL;
+    jobs.num_jobs = 0;
+    dir.entries = NULL;
+    dir.num_entries = 0;
+    old_dir.entries = NULL;
+    old_dir.num_entries = 0;
+    zip_raw_writer_init(&writer, -1);
+
+    if (!old_filename)
+        ERR_CLEANUP_MSG("Specify the old firmware file");
+    if (!new_filename)
+        ERR_CLEANUP_MSG("Specify the new firmware file with -i");
+    if (!output_filename)
+        ERR_CLEANUP_MSG("Specify an output firmware file");
+
+    size_t temp_filename_len = strlen(output_filename) + 5;
+    temp_filename = malloc(temp_filename_len);
+    if (!temp_filename)
+        ERR_CLEANUP_MSG("Out of memory");
+    snprintf(temp_filename, temp_filename_len, "%s.tmp", output_filename);
+
+    // Signatures aren't checked since nothing is applied. The new
+    // firmware's signature is carried over to the output.
+    unsigned char *no_public_keys[1] = {NULL};
+    OK_OR_CLEANUP(cfgfile_parse_fw_meta_conf(old_filename, &old_cfg, no_public_keys));
+    OK_OR_CLEANUP(cfgfile_parse_fw_meta_conf(new_filename, &new_cfg, no_public_keys));
+
+    in_fd = open(new_filename, O_RDONLY | O_WIN32_BINARY);
+    if (in_fd < 0)
+        ERR_CLEANUP_MSG("Error opening '%s'", new_filename);
+    OK_OR_CLEANUP(zip_raw_read_directory(in_fd, &dir));
+
+    old_fd = open(old_filename, O_RDONLY | O_WIN32_BINARY);
+    if (old_fd < 0)
+        ERR_CLEANUP_MSG("Error opening '%s'", old_filename);
+    OK_OR_CLEANUP(zip_raw_read_directory(old_fd, &old_dir));
+    close(old_fd);
+    old_fd = -1;
+
+    // Changing meta.conf invalidates its signature, so only do it when it
+    // can be signed again.
+    const struct zip_raw_entry *meta_conf = zip_raw_find(&dir, "meta.conf");
+    if (!meta_conf)
+        ERR_CLEANUP_MSG("Invalid firmware. No meta.conf found in '%s'", new_filename);
+    if (zip_raw_find(&dir, "meta.conf.ed25519") && !signing_key)
+        INFO("meta.conf is signed, so not adding delta-source settings. Pass -s to add them.");
+    else if (add_ab_delta_sources(old_cfg, new_cfg) > 0 &&
+             fwup_cfg_to_string(new_cfg, &configtxt) == 0)
+        ERR_CLEANUP_MSG("Error creating meta.conf");
+
+    OK_OR_CLEANUP(find_jobs(old_cfg, new_cfg, &jobs));
+
+    for (int i = 0; i < jobs.num_jobs; i++) {
+        struct delta_job *job = &jobs.jobs[i];
+        job->entry = zip_raw_find(&dir, job->archive_path);
+        if (!job->entry)
+            ERR_CLEANUP_MSG("Resource '%s' not found in '%s'", job->name, new_filename);
+
+        char source_path[FWFILE_MAX_ARCHIVE_PATH];
+        resource_to_archive_path(job->source_name, source_path);
+        job->source_entry = zip_raw_find(&old_dir, source_path);
+        if (!job->source_entry)
+            ERR_CLEANUP_MSG("Resource '%s' not found in '%s'", job->source_name, old_filename);
+    }
+
+    encode_jobs(&jobs);
+
+    for (int i = 0; i < jobs.num_jobs; i++) {
+        struct delta_job *job = &jobs.jobs[i];
+        if (job->load_rc < 0) {
+            ERR_CLEANUP();
+        } else if (job->rc == ENOSPC) {
+            INFO("'%s': delta isn't smaller, so keeping the full resource", job->name);
+            free(job->patch);
+            job->patch = NULL;
+        } else if (job->rc != 0) {
+            ERR_CLEANUP_MSG("Error creating a delta for '%s' (xdelta3 error %d)", job->name, job->rc);
+        } else {
+            INFO("'%s': %" PRIu64 " byte delta replaces %" PRIu64 " bytes",
+                 job->name, (uint64_t) job->patch_len, job->entry->compressed_size);
+        }
+    }
+
+    out_fd = open(temp_filename, O_WRONLY | O_CREAT | O_TRUNC | O_WIN32_BINARY, 0644);
+    if (out_fd < 0)
+        ERR_CLEANUP_MSG("Error creating archive '%s'", temp_filename);
+    writer.fd = out_fd;
+
+    // Keep the original order so that meta.conf and its signature stay
+    // at the beginning. Patches are stored uncompressed so that fwup apply
+    // can tell them apart from the full resource by their size.
+    for (int i = 0; i < dir.num_entries; i++) {
+        const struct zip_raw_entry *entry = &dir.entries[i];
+        const struct delta_job *job = find_job(&jobs, entry);
+
+        if (configtxt && strcmp(entry->name, "meta.conf.ed25519") == 0)
+            continue;
+
+        if (configtxt && entry == meta_conf) {
+            size_t configtxt_len = strlen(configtxt);
+            if (signing_key) {
+                uint8_t signature[FWUP_SIGNATURE_LEN];
+                crypto_ed25519_sign(signature, &signing_key[0], &signing_key[FWUP_PRIVATE_KEY_LEN], (const uint8_t *) configtxt, configtxt_len);
+                OK_OR_CLEANUP(zip_raw_add_stored(&writer, "meta.conf.ed25519", signature, sizeof(signature), meta_conf));
+            }
+            OK_OR_CLEANUP(zip_raw_add_stored(&writer, "meta.conf", configtxt, (uint32_t) configtxt_len, meta_conf));
+        } else if (job && job->patch)
+            OK_OR_CLEANUP(zip_raw_add_stored(&writer, entry->name, job->patch, (uint32_t) job->patch_len, entry));
+        else
+            OK_OR_CLEANUP(zip_raw_copy_entry(&writer, in_fd, entry));
+    }
+    OK_OR_CLEANUP(zip_raw_writer_finish(&writer));
+
+    if (close(out_fd) < 0) {
+        out_fd = -1;
+        ERR_CLEANUP_MSG("Error writing '%s'", temp_filename);
+    }
+    out_fd = -1;
+    close(in_fd);
+    in_fd = -1;
+
+#ifdef _WIN32
+    // On Windows, the output_file must not exist or the rename fails.
+    if (unlink(output_filename) < 0 && errno != ENOENT)
+        ERR_CLEANUP_MSG("Error overwriting '%s': %s", output_filename, strerror(errno));
+#endif
+
+    if (rename(temp_filename, output_filename) < 0)
+        ERR_CLEANUP_MSG("Error creating '%s': %s", output_filename, strerror(errno));
+    free(temp_filename);
+    temp_filename = NULL;
+
+    fwup_output(FRAMING_TYPE_SUCCESS, 0, "");
+
+cleanup:
+    if (out_fd >= 0)
+        close(out_fd);
+    if (in_fd >= 0)
+        close(in_fd);
+    if (old_fd >= 0)
+        close(old_fd);
+
+    zip_raw_writer_free(&writer);
+    zip_raw_free_directory(&dir);
+    zip_raw_free_directory(&old_dir);
+    free_jobs(&jobs);
+    free(configtxt);
+
+    // Only unlink the temporary file if something failed.
+    if (temp_filename) {
+        unlink(temp_filename);
+        free(temp_filename);
+    }
+    if (old_cfg)
+        cfgfile_free(old_cfg);
+    if (new_cfg)
+        cfgfile_free(new_cfg);
+
+    return rc;
+}
+#endif // FWUP_MINIMAL
@@ -0,0 +1,25 @@
+/*
+ * Copyright 2026 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FWUP_DELTA_H
+#define FWUP_DELTA_H
+
+// Maximum number of resources to encode at the same time
+#define FWUP_DELTA_MAX_WORKERS 8
+
+int fwup_create_delta(const char *old_filename, const char *new_filename, const char *output_filename, const unsigned char *signing_key);
+
+#endif // FWUP_DELTA_H
@@ -0,0 +1,367 @@
+/*
+ * Copyright 2026 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fwup_from_image.h"
+#include "fwup_create.h"
+#include "gpt.h"
+#include "mbr.h"
+#include "sparse_file.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef _WIN32
+#include <direct.h> // for mkdir
+#endif
+
+#ifndef FWUP_MINIMAL
+
+// Each partition plus the space before it and the space at the end
+#define MAX_REGIONS (2 * GPT_MAX_PARTITIONS + 1)
+
+#define COPY_BUFFER_SIZE (1024 * 1024)
+
+struct image_region {
+    char name[32];
+    off_t offset; // in bytes
+    off_t length; // in bytes
+};
+
+// Leave room after the temporary directory for "/" and a region name or
+// "/fwup.conf" so that paths in it always fit in PATH_MAX
+#define MAX_DIR_LEN (PATH_MAX - 64)
+
+struct image_layout {
+    char dir[MAX_DIR_LEN];
+    off_t size;
+    struct image_region regions[MAX_REGIONS];
+    int num_regions;
+};
+
+static int read_gpt_partitions(int fd, struct gpt_extent *partitions, int *num_partitions)
+{
+    int rc = 0;
+    uint8_t *gpt = (uint8_t *) malloc(GPT_SIZE);
+    if (!gpt)
+        fwup_err(EXIT_FAILURE, "malloc");
+
+    if (pread(fd, gpt, GPT_SIZE, FWUP_BLOCK_SIZE) != GPT_SIZE)
+        ERR_CLEANUP_MSG("image is too small to hold a GPT");
+
+    rc = gpt_decode(gpt, partitions, num_partitions);
+
+cleanup:
+    free(gpt);
+    return rc;
+}
+
+static int read_partitions(int fd, off_t size, struct gpt_extent *partitions, int *num_partitions)
+{
+    *num_partitions = 0;
+
+    uint8_t mbr[FWUP_BLOCK_SIZE];
+    if (size < FWUP_BLOCK_SIZE || pread(fd, mbr, sizeof(mbr), 0) != sizeof(mbr))
+        return 0;
+
+    struct mbr_table table;
+    if (mbr_decode(mbr, &table) < 0) {
+        // No partition table, so treat the image as one big blob
+        return 0;
+    }
+
+    for (int i = 0; i < MBR_MAX_PRIMARY_PARTITIONS; i++) {
+        // A protective MBR means that the partitions are in the GPT
+        if (table.partitions[i].partition_type == 0xee)
+            return read_gpt_partitions(fd, partitions, num_partitions);
+    }
+
+    for (int i = 0; i < MBR_MAX_PRIMARY_PARTITIONS; i++) {
+        const struct mbr_partition *partition = &table.partitions[i];
+        if (partition->partition_type == 0 || partition->block_count == 0)
+            continue;
+
+        partitions[*num_partitions].block_offset = partition->block_offset;
+        partitions[*num_partitions].block_count = partition->block_count;
+        *num_partitions += 1;
+    }
+    return 0;
+}
+
+static int compare_extents(const void *a, const void *b)
+{
+    const struct gpt_extent *x = (const struct gpt_extent *) a;
+    const struct gpt_extent *y = (const struct gpt_extent *) b;
+    if (x->block_offset < y->block_offset)
+        return -1;
+    else if (x->block_offset > y->block_offset)
+        return 1;
+    else
+        return 0;
+}
+
+static void add_region(struct image_layout *layout, const char *name, off_t offset, off_t length)
+{
+    struct image_region *region = &layout->regions[layout->num_regions++];
+    snprintf(region->name, sizeof(region->name), "%s", name);
+    region->offset = offset;
+    region->length = length;
+}
+
+/**
+ * @brief Split the image into one region per partition and regions for what's between them
+ */
+static int build_layout(int fd, struct image_layout *layout)
+{
+    struct gpt_extent partitions[GPT_MAX_PARTITIONS];
+    int num_partitions;
+    OK_OR_RETURN(read_partitions(fd, layout->size, partitions, &num_partitions));
+
+    qsort(partitions, num_partitions, sizeof(struct gpt_extent), compare_extents);
+
+    layout->num_regions = 0;
+    off_t next = 0;
+    for (int i = 0; i < num_partitions; i++) {
+        off_t offset = (off_t) partitions[i].block_offset * FWUP_BLOCK_SIZE;
+        off_t length = (off_t) partitions[i].block_count * FWUP_BLOCK_SIZE;
+        if (offset < next)
+            ERR_RETURN("image partitions overlap at block %" PRIu64, partitions[i].block_offset);
+
+        // Images are commonly truncated after the last partition's data
+        if (offset >= layout->size)
+            break;
+        if (length > layout->size - offset)
+            length = layout->size - offset;
+
+        char name[32];
+        if (offset > next) {
+            snprintf(name, sizeof(name), "blocks-%" PRId64 ".img", (int64_t) (next / FWUP_BLOCK_SIZE));
+            add_region(layout, name, next, offset - next);
+        }
+        snprintf(name, sizeof(name), "partition-%d.img", i + 1);
+        add_region(layout, name, offset, length);
+        next = offset + length;
+    }
+
+    if (next < layout->size) {
+        char name[32];
+        if (next == 0)
+            snprintf(name, sizeof(name), "image.img");
+        else
+            snprintf(name, sizeof(name), "blocks-%" PRId64 ".img", (int64_t) (next / FWUP_BLOCK_SIZE));
+        add_region(layout, name, next, layout->size - next);
+    }
+    return 0;
+}
+
+static int write_run(int fd, const uint8_t *buf, size_t count, off_t offset, const char *path)
+{
+    if (pwrite(fd, buf, count, offset) != (ssize_t) count)
+        ERR_RETURN("error writing '%s'", path);
+    return 0;
+}
+
+/**
+ * @brief Copy a region of the image to its own file and leave holes for zero blocks
+ */
+static int copy_region(int fd, const struct image_layout *layout, const struct image_region *region)
+{
+    int rc = 0;
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", layout->dir, region->name);
+
+    uint8_t *buffer = (uint8_t *) malloc(COPY_BUFFER_SIZE);
+    if (!buffer)
+        fwup_err(EXIT_FAILURE, "malloc");
+
+    int out_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_WIN32_BINARY, 0644);
+    if (out_fd < 0)
+        ERR_CLEANUP_MSG("can't create '%s'", path);
+
+    for (off_t offset = 0; offset < region->length; ) {
+        off_t to_read = region->length - offset;
+        if (to_read > COPY_BUFFER_SIZE)
+            to_read = COPY_BUFFER_SIZE;
+
+        ssize_t amount = pread(fd, buffer, to_read, region->offset + offset);
+        if (amount <= 0)
+            ERR_CLEANUP_MSG("error reading image at offset %" PRId64, (int64_t) (region->offset + offset));
+
+        // Write runs of blocks that aren't all zeros
+        ssize_t run_start = -1;
+        for (ssize_t pos = 0; pos < amount; pos += SPARSE_FILE_ZERO_BLOCK_SIZE) {
+            ssize_t block_len = amount - pos;
+            if (block_len > SPARSE_FILE_ZERO_BLOCK_SIZE)
+                block_len = SPARSE_FILE_ZERO_BLOCK_SIZE;
+
+            bool zero = sparse_file_is_zero(buffer + pos, block_len);
+            if (!zero && run_start < 0) {
+                run_start = pos;
+            } else if (zero && run_start >= 0) {
+                OK_OR_CLEANUP(write_run(out_fd, buffer + run_start, pos - run_start, offset + run_start, path));
+                run_start = -1;
+            }
+        }
+        if (run_start >= 0)
+            OK_OR_CLEANUP(write_run(out_fd, buffer + run_start, amount - run_start, offset + run_start, path));
+        offset += amount;
+    }
+
+    if (ftruncate(out_fd, region->length) < 0)
+        ERR_CLEANUP_MSG("can't set the size of '%s'", path);
+
+cleanup:
+    if (out_fd >= 0)
+        close(out_fd);
+    free(buffer);
+    return rc;
+}
+
+static int write_config(const struct image_layout *layout, const char *path)
+{
+    FILE *fp = fopen(path, "w");
+    if (!fp)
+        ERR_RETURN("can't create '%s'", path);
+
+    fprintf(fp, "# Generated by fwup --from-image\n\n");
+    for (int i = 0; i < layout->num_regions; i++) {
+        const struct image_region *region = &layout->regions[i];
+        fprintf(fp, "file-resource \"%s\" {\n", region->name);
+        fprintf(fp, "    host-path = \"%s\"\n", region->name);
+        fprintf(fp, "    skip-holes = true\n");
+        fprintf(fp, "}\n");
+    }
+
+    // Every region gets written, even ones that are all zeros, so that
+    // nothing from before the update is left behind. The holes are
+    // written as zeros or trimmed if TRIM is enabled.
+    fprintf(fp, "\ntask complete {\n");
+    for (int i = 0; i < layout->num_regions; i++) {
+        const struct image_region *region = &layout->regions[i];
+        fprintf(fp, "    on-resource \"%s\" { raw_write(%" PRId64 ", \"holes=trim\") }\n",
+                region->name, (int64_t) (region->offset / FWUP_BLOCK_SIZE));
+    }
+    fprintf(fp, "}\n");
+
+    if (fclose(fp) != 0)
+        ERR_RETURN("error writing '%s'", path);
+    return 0;
+}
+
+static int make_temp_dir(char *dir, size_t len)
+{
+#ifdef _WIN32
+    const char *tmp = getenv("TEMP");
+#else
+    const char *tmp = getenv("TMPDIR");
+#endif
+    if (!tmp || *tmp == '\0')
+        tmp = "/tmp";
+
+    int dir_len = snprintf(dir, len, "%s/fwup-from-image-XXXXXX", tmp);
+    if (dir_len < 0 || (size_t) dir_len >= len) {
+        dir[0] = '\0';
+        ERR_RETURN("temporary directory path is too long: '%s'", tmp);
+    }
+
+#ifdef _WIN32
+    bool created = _mktemp(dir) && mkdir(dir) == 0;
+#else
+    bool created = mkdtemp(dir) != NULL;
+#endif
+    if (!created) {
+        dir[0] = '\0';
+        ERR_RETURN("can't create temporary directory in '%s'", tmp);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Create a firmware update that writes a disk image
+ *
+ * The image is split into one resource per partition and resources for the
+ * areas before and between partitions. The resources are compressed in
+ * parallel. Blocks of zeros are left out of the resources and written back
+ * with raw_write's "holes=trim" option.
+ *
+ * @param image_filename the disk image
+ * @param output_firmware the firmware update to create
+ * @param options options for fwup_create
+ * @return 0 if successful
+ */
+int fwup_from_image(const char *image_filename, const char *output_firmware, const struct fwup_create_options *options)
+{
+    int rc = 0;
+    char config_path[PATH_MAX];
+    struct image_layout *layout = (struct image_layout *) calloc(1, sizeof(struct image_layout));
+    if (!layout)
+        fwup_err(EXIT_FAILURE, "calloc");
+
+    int fd = open(image_filename, O_RDONLY | O_WIN32_BINARY);
+    if (fd < 0)
+        ERR_CLEANUP_MSG("can't open image '%s'", image_filename);
+
+    layout->size = lseek(fd, 0, SEEK_END);
+    if (layout->size <= 0)
+        ERR_CLEANUP_MSG("image '%s' is empty or can't be read", image_filename);
+
+    OK_OR_CLEANUP(build_layout(fd, layout));
+    OK_OR_CLEANUP(make_temp_dir(layout->dir, sizeof(layout->dir)));
+
+    for (int i = 0; i < layout->num_regions; i++) {
+        INFO("%s: %" PRId64 " bytes at offset %" PRId64, layout->regions[i].name,
+             (int64_t) layout->regions[i].length, (int64_t) layout->regions[i].offset);
+        OK_OR_CLEANUP(copy_region(fd, layout, &layout->regions[i]));
+    }
+
+    snprintf(config_path, sizeof(config_path), "%s/fwup.conf", layout->dir);
+    OK_OR_CLEANUP(write_config(layout, config_path));
+
+    // The zero blocks were left as holes in the copies, but also look for
+    // them in case the temporary directory's filesystem doesn't support
+    // sparse files.
+    struct fwup_create_options create_options = *options;
+    create_options.skip_zero_blocks = true;
+    create_options.parallel_compression = true;
+    OK_OR_CLEANUP(fwup_create(config_path, output_firmware, &create_options));
+
+cleanup:
+    if (layout->dir[0]) {
+        for (int i = 0; i < layout->num_regions; i++) {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", layout->dir, layout->regions[i].name);
+            unlink(path);
+        }
+        snprintf(config_path, sizeof(config_path), "%s/fwup.conf", layout->dir);
+        unlink(config_path);
+        rmdir(layout->dir);
+    }
+    if (fd >= 0)
+        close(fd);
+    free(layout);
+    return rc;
+}
+
+#endif // FWUP_MINIMAL
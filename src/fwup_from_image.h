@@ -0,0 +1,24 @@
+/*
+ * Copyright 2026 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FWUP_FROM_IMAGE_H
+#define FWUP_FROM_IMAGE_H
+
+struct fwup_create_options;
+
+int fwup_from_image(const char *image_filename, const char *output_firmware, const struct fwup_create_options *options);
+
+#endif // FWUP_FROM_IMAGE_H
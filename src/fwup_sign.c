@@ -18,18 +18,64 @@
 #include "fwfile.h"
 #include "util.h"
 #include "cfgfile.h"
+#include "zip_raw.h"
+#include "monocypher-ed25519.h"
 
 #include <archive.h>
 #include <archive_entry.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #ifndef FWUP_MINIMAL
 
+static int read_meta_conf(const char *input_filename, char **configtxt, off_t *configtxt_len)
+{
+    int rc = 0;
+    struct archive *in = archive_read_new();
+    archive_read_support_format_zip(in);
+
+    // NOTE: Normally we'd call fwup_archive_read_open, but that function has
+    // been optimized for the streaming case. That disables seeking to the
+    // central directory at the end for file attributes. Old libarchive
+    // versions don't process the local headers properly and this code breaks.
+    if (archive_read_open_filename(in, input_filename, 65536) != ARCHIVE_OK)
+        ERR_CLEANUP_MSG("%s", archive_error_string(in));
+
+    struct archive_entry *in_ae;
+    while (archive_read_next_header(in, &in_ae) == ARCHIVE_OK) {
+        if (strcmp(archive_entry_pathname(in_ae), "meta.conf.ed25519") == 0) {
+            // Skip old signature
+        } else if (strcmp(archive_entry_pathname(in_ae), "meta.conf") == 0) {
+            if (archive_read_all_data(in, in_ae, configtxt, 50000, configtxt_len) < 0)
+                ERR_CLEANUP_MSG("Error reading meta.conf from archive.");
+
+            if (*configtxt_len < 10 || *configtxt_len >= 50000)
+                ERR_CLEANUP_MSG("Unexpected meta.conf size: %d", *configtxt_len);
+            break;
+        } else {
+            ERR_CLEANUP_MSG("Invalid firmware. meta.conf must be at the beginning of archive");
+        }
+    }
+
+    if (!*configtxt)
+        ERR_CLEANUP_MSG("Invalid firmware. No meta.conf not found");
+
+cleanup:
+    archive_read_close(in);
+    archive_read_free(in);
+    return rc;
+}
+
 /**
  * @brief Sign a firmware update file
+ *
+ * Only the signature is replaced. All other entries are copied as is
+ * without decompressing and recompressing them.
+ *
  * @param input_filename the firmware update filename
  * @param output_filename where to store the signed firmware update
  * @param signing_key the signing key
@@ -39,19 +85,15 @@ int fwup_sign(const char *input_filename, const char *output_filename, const uns
 {
     int rc = 0;
     char *configtxt = NULL;
-    char buffer[4096];
     char *temp_filename = NULL;
+    int in_fd = -1;
+    int out_fd = -1;
+    struct zip_raw_directory dir;
+    struct zip_raw_writer writer;
 
-    struct archive *in = archive_read_new();
-    archive_read_support_format_zip(in);
-    struct archive *out = archive_write_new();
-    if (archive_write_set_format_zip(out) != ARCHIVE_OK ||
-        archive_write_zip_set_compression_deflate(out) != ARCHIVE_OK)
-        ERR_CLEANUP_MSG("error configuring libarchive: %s", archive_error_string(out));
-
-    // Setting the compression-level is only supported on more recent versions
-    // of libarchive, so don't check for errors.
-    archive_write_set_format_option(out, "zip", "compression-level", "9");
+    dir.entries = NULL;
+    dir.num_entries = 0;
+    zip_raw_writer_init(&writer, -1);
 
     if (!input_filename)
         ERR_CLEANUP_MSG("Specify an input firmware file");
@@ -66,79 +108,51 @@ int fwup_sign(const char *input_filename, const char *output_filename, const uns
         ERR_CLEANUP_MSG("Out of memory");
     snprintf(temp_filename, temp_filename_len, "%s.tmp", input_filename);
 
-    // NOTE: Normally we'd call fwup_archive_read_open, but that function has
-    // been optimized for the streaming case. That disables seeking to the
-    // central directory at the end for file attributes. Old libarchive
-    // versions don't process the local headers properly and this code breaks.
-    rc = archive_read_open_filename(in, input_filename, 65536);
-    if (rc != ARCHIVE_OK)
-        ERR_CLEANUP_MSG("%s", archive_error_string(in));
+    off_t configtxt_len;
+    OK_OR_CLEANUP(read_meta_conf(input_filename, &configtxt, &configtxt_len));
 
-    if (archive_write_open_filename(out, temp_filename) != ARCHIVE_OK)
-        ERR_CLEANUP_MSG("Error creating archive '%s'", temp_filename);
+    in_fd = open(input_filename, O_RDONLY | O_WIN32_BINARY);
+    if (in_fd < 0)
+        ERR_CLEANUP_MSG("Error opening '%s'", input_filename);
+    OK_OR_CLEANUP(zip_raw_read_directory(in_fd, &dir));
 
-    struct archive_entry *in_ae;
-    while (archive_read_next_header(in, &in_ae) == ARCHIVE_OK) {
-        if (strcmp(archive_entry_pathname(in_ae), "meta.conf.ed25519") == 0) {
-            // Skip old signature
-        } else if (strcmp(archive_entry_pathname(in_ae), "meta.conf") == 0) {
-            if (configtxt)
-                ERR_CLEANUP_MSG("Invalid firmware. More than one meta.conf found");
+    const struct zip_raw_entry *meta_conf = zip_raw_find(&dir, "meta.conf");
+    if (!meta_conf)
+        ERR_CLEANUP_MSG("Invalid firmware. No meta.conf not found");
 
-            off_t configtxt_len;
-            if (archive_read_all_data(in, in_ae, &configtxt, 50000, &configtxt_len) < 0)
-                ERR_CLEANUP_MSG("Error reading meta.conf from archive.");
+    // Only the first meta.conf was read and would be signed, so don't let
+    // another one get copied along with it.
+    for (int i = 0; i < dir.num_entries; i++) {
+        if (&dir.entries[i] != meta_conf && strcmp(dir.entries[i].name, "meta.conf") == 0)
+            ERR_CLEANUP_MSG("Invalid firmware. More than one meta.conf found");
+    }
 
-            if (configtxt_len < 10 || configtxt_len >= 50000)
-                ERR_CLEANUP_MSG("Unexpected meta.conf size: %d", configtxt_len);
+    out_fd = open(temp_filename, O_WRONLY | O_CREAT | O_TRUNC | O_WIN32_BINARY, 0644);
+    if (out_fd < 0)
+        ERR_CLEANUP_MSG("Error creating archive '%s'", temp_filename);
+    writer.fd = out_fd;
 
-            OK_OR_CLEANUP(fwfile_add_meta_conf_str(configtxt, configtxt_len, out, signing_key));
-        } else {
-            if (!configtxt)
-                ERR_CLEANUP_MSG("Invalid firmware. meta.conf must be at the beginning of archive");
-
-            // Normalize attributes in case extraneous ones got added via other tools
-            struct archive_entry *out_ae = archive_entry_new();
-            archive_entry_set_pathname(out_ae, archive_entry_pathname(in_ae));
-            if (archive_entry_size_is_set(in_ae))
-                archive_entry_set_size(out_ae, archive_entry_size(in_ae));
-            archive_entry_set_filetype(out_ae, AE_IFREG);
-            archive_entry_set_perm(out_ae, 0644);
-
-            // Copy the file
-            rc = archive_write_header(out, out_ae);
-            if (rc != ARCHIVE_OK)
-                ERR_CLEANUP_MSG("Error writing '%s' header to '%s'", archive_entry_pathname(out_ae), temp_filename);
-
-            ssize_t size_left = archive_entry_size(in_ae);
-            while (size_left > 0) {
-                ssize_t to_read = sizeof(buffer);
-                if (to_read > size_left)
-                    to_read = size_left;
-
-                ssize_t len = archive_read_data(in, buffer, to_read);
-                if (len <= 0)
-                    ERR_CLEANUP_MSG("Error reading '%s' in '%s'", archive_entry_pathname(in_ae), input_filename);
-
-                if (archive_write_data(out, buffer, len) != len)
-                    ERR_CLEANUP_MSG("Error writing '%s' to '%s'", archive_entry_pathname(out_ae), temp_filename);
-
-                size_left -= len;
-            }
-            archive_entry_free(out_ae);
-        }
-    }
+    // The signature goes first followed by everything else in the original order
+    uint8_t signature[FWUP_SIGNATURE_LEN];
+    crypto_ed25519_sign(signature, &signing_key[0], &signing_key[FWUP_PRIVATE_KEY_LEN], (const uint8_t *) configtxt, configtxt_len);
+    OK_OR_CLEANUP(zip_raw_add_stored(&writer, "meta.conf.ed25519", signature, sizeof(signature), meta_conf));
 
-    if (!configtxt)
-        ERR_CLEANUP_MSG("Invalid firmware. No meta.conf not found");
+    for (int i = 0; i < dir.num_entries; i++) {
+        if (strcmp(dir.entries[i].name, "meta.conf.ed25519") == 0)
+            continue;
+
+        OK_OR_CLEANUP(zip_raw_copy_entry(&writer, in_fd, &dir.entries[i]));
+    }
+    OK_OR_CLEANUP(zip_raw_writer_finish(&writer));
 
     // Close the files now that we're done reading and writing to them.
-    archive_write_close(out);
-    archive_write_free(out);
-    archive_read_close(in);
-    archive_read_free(in);
-    out = NULL;
-    in = NULL;
+    if (close(out_fd) < 0) {
+        out_fd = -1;
+        ERR_CLEANUP_MSG("Error writing '%s'", temp_filename);
+    }
+    out_fd = -1;
+    close(in_fd);
+    in_fd = -1;
 
 #ifdef _WIN32
     // On Windows, the output_file must not exist or the rename fails.
@@ -156,14 +170,13 @@ int fwup_sign(const char *input_filename, const char *output_filename, const uns
 
 cleanup:
     // Close the files if they're still open.
-    if (out) {
-        archive_write_close(out);
-        archive_write_free(out);
-    }
-    if (in) {
-        archive_read_close(in);
-        archive_read_free(in);
-    }
+    if (out_fd >= 0)
+        close(out_fd);
+    if (in_fd >= 0)
+        close(in_fd);
+
+    zip_raw_writer_free(&writer);
+    zip_raw_free_directory(&dir);
 
     // Only unlink the temporary file if something failed.
     if (temp_filename) {
@@ -21,6 +21,7 @@
 #include "archive_open.h"
 #include "sparse_file.h"
 #include "resources.h"
+#include "resource_hash.h"
 
 #include <archive.h>
 #include <archive_entry.h>
@@ -32,10 +33,11 @@
 
 #define VERIFICATION_CHUNK_SIZE (64 * 1024)
 
-static int process_entry(struct archive *a, struct archive_entry *ae, off_t *length_read, uint8_t *hash)
+static int process_entry(struct archive *a, enum resource_hash_type hash_type, off_t *length_read, uint8_t *hash)
 {
-    crypto_blake2b_ctx hash_state;
-    crypto_blake2b_general_init(&hash_state, FWUP_BLAKE2b_256_LEN, NULL, 0);
+    int rc = 0;
+    struct resource_hash hash_state;
+    resource_hash_init(&hash_state, hash_type);
 
     *length_read = 0;
     int64_t expected_offset = 0;
@@ -45,33 +47,33 @@ static int process_entry(struct archive *a, struct archive_entry *ae, off_t *len
         const void *buffer;
         size_t len;
         int64_t offset64;
-        int rc = fwup_archive_read_data_block(a, &buffer, &len, &offset64);
+        int read_rc = fwup_archive_read_data_block(a, &buffer, &len, &offset64);
 
-        if (rc == ARCHIVE_EOF)
+        if (read_rc == ARCHIVE_EOF)
             break;
-        else if (rc != ARCHIVE_OK)
-            ERR_RETURN(archive_error_string(a));
+        else if (read_rc != ARCHIVE_OK)
+            ERR_CLEANUP_MSG("%s", archive_error_string(a));
 
         if (offset64 != expected_offset)
-            ERR_RETURN("Unexpected offset hole when decoding archive");
+            ERR_CLEANUP_MSG("Unexpected offset hole when decoding archive");
         expected_offset += len;
 
-        crypto_blake2b_update(&hash_state, (const uint8_t*) buffer, len);
+        resource_hash_update(&hash_state, buffer, len);
         *length_read += len;
     }
 
-    crypto_blake2b_final(&hash_state, hash);
-    return 0;
+    resource_hash_final(&hash_state, hash);
+
+cleanup:
+    resource_hash_free(&hash_state);
+    return rc;
 }
 
-static int get_expected_hash(struct resource_list *item, const char *file_resource_name, const char **expected_hash)
+static int get_expected_hash(struct resource_list *item, const char *file_resource_name, enum resource_hash_type *hash_type, const char **expected_hash)
 {
-    const char *hash = cfg_getstr(item->resource, "blake2b-256");
-    if (!hash || strlen(hash) != FWUP_BLAKE2b_256_LEN * 2)
+    if (resource_hash_get_expected(item->resource, hash_type, expected_hash) < 0)
         ERR_RETURN("invalid blake2b-256 hash for '%s'", file_resource_name);
 
-    *expected_hash = hash;
-
     return 0;
 }
 
@@ -84,14 +86,15 @@ static int check_normal_resource(struct resource_list *item,
     uint8_t hash[FWUP_BLAKE2b_256_LEN];
     off_t length_read;
 
-    OK_OR_RETURN(process_entry(a, ae, &length_read, hash));
+    enum resource_hash_type hash_type;
+    const char *expected_hash;
+    OK_OR_RETURN(get_expected_hash(item, file_resource_name, &hash_type, &expected_hash));
+
+    OK_OR_RETURN(process_entry(a, hash_type, &length_read, hash));
 
     if (length_read != expected_length)
         ERR_RETURN("ZIP data length mismatch for %s", file_resource_name);
 
-    const char *expected_hash;
-    OK_OR_RETURN(get_expected_hash(item, file_resource_name, &expected_hash));
-
     char hash_str[sizeof(hash) * 2 + 1];
     bytes_to_hex(hash, hash_str, sizeof(hash));
     if (memcmp(hash_str, expected_hash, sizeof(hash_str)) != 0)
@@ -127,11 +130,12 @@ static int check_xdelta3_resource(struct resource_list *item, const char *file_r
     // do a bunch of sanity checks.
 
     // Check that there's a Blake 2B hash.
+    enum resource_hash_type hash_type;
     const char *expected_hash;
-    OK_OR_RETURN(get_expected_hash(item, file_resource_name, &expected_hash));
+    OK_OR_RETURN(get_expected_hash(item, file_resource_name, &hash_type, &expected_hash));
 
     struct xdelta_state xd;
-    xdelta_init(&xd, xdelta_read_patch_callback, NULL, a);
+    xdelta_init(&xd, xdelta_read_patch_callback, NULL, a, 0, 0);
 
     // This will check that the data at least looks like an xdelta3 patch and the
     // options in the header look decodeable. (xdelta3 will return errors)
@@ -141,6 +145,46 @@ static int check_xdelta3_resource(struct resource_list *item, const char *file_r
     return 0;
 }
 
+static int check_duplicate_resources(struct resource_list *list, struct resource_list *item, const char *file_resource_name)
+{
+    // Resources that were deduplicated into this one don't have their own
+    // entries in the archive. They must describe exactly the same data.
+    int rc = 0;
+    struct sparse_file_map sfm;
+    struct sparse_file_map duplicate_sfm;
+    sparse_file_init(&sfm);
+    sparse_file_init(&duplicate_sfm);
+    OK_OR_CLEANUP(sparse_file_get_map_from_resource(item->resource, &sfm));
+
+    enum resource_hash_type hash_type;
+    const char *expected_hash;
+    OK_OR_CLEANUP(get_expected_hash(item, file_resource_name, &hash_type, &expected_hash));
+
+    for (struct resource_list *duplicate = rlist_find_duplicate(list, file_resource_name, NULL);
+         duplicate != NULL;
+         duplicate = rlist_find_duplicate(list, file_resource_name, duplicate)) {
+        const char *duplicate_name = cfg_title(duplicate->resource);
+        if (duplicate->processed)
+            ERR_CLEANUP_MSG("Processing %s twice. Archive is corrupt.", duplicate_name);
+        duplicate->processed = true;
+
+        enum resource_hash_type duplicate_hash_type;
+        const char *hash;
+        OK_OR_CLEANUP(get_expected_hash(duplicate, duplicate_name, &duplicate_hash_type, &hash));
+        OK_OR_CLEANUP(sparse_file_get_map_from_resource(duplicate->resource, &duplicate_sfm));
+        if (duplicate_hash_type != hash_type ||
+            strcmp(hash, expected_hash) != 0 ||
+            duplicate_sfm.map_len != sfm.map_len ||
+            memcmp(duplicate_sfm.map, sfm.map, sfm.map_len * sizeof(off_t)) != 0)
+            ERR_CLEANUP_MSG("Resource %s doesn't match %s even though it's marked as a duplicate", duplicate_name, file_resource_name);
+    }
+
+cleanup:
+    sparse_file_free(&duplicate_sfm);
+    sparse_file_free(&sfm);
+    return rc;
+}
+
 static int check_resource(struct resource_list *list, const char *file_resource_name, struct archive *a, struct archive_entry *ae)
 {
     struct resource_list *item = rlist_find_by_name(list, file_resource_name);
@@ -151,6 +195,11 @@ static int check_resource(struct resource_list *list, const char *file_resource_
         ERR_RETURN("Processing %s twice. Archive is corrupt.", file_resource_name);
     item->processed = true;
 
+    if (cfg_getstr(item->resource, "duplicate-of"))
+        ERR_RETURN("Found data for %s, but it's marked as a duplicate. Archive is corrupt.", file_resource_name);
+
+    OK_OR_RETURN(check_duplicate_resources(list, item, file_resource_name));
+
     struct sparse_file_map sfm;
     sparse_file_init(&sfm);
     OK_OR_RETURN(sparse_file_get_map_from_resource(item->resource, &sfm));
@@ -3,13 +3,117 @@
 #include <string.h>
 #include <sys/stat.h>
 
+// The encoder declares a helper that's only defined for 32-bit usize_t. GCC
+// reports it at the end of the file, so this can't be scoped to the include.
+#pragma GCC diagnostic ignored "-Wunused-function"
 #include "3rdparty/xdelta3/xdelta3.c"
 #include "util.h"
 
 #define READ_SIZE (128 * 1024)
 #define MAX_READ_RETURN_SIZE (128 * 1024)
 
-void xdelta_init(struct xdelta_state *xd, xdelta_read_patch_block *read_patch, xdelta_pread_source *pread_source, void *cookie)
+/**
+ * Check the source cache options
+ *
+ * @param num_blocks - the number of source blocks to cache
+ * @param block_size - the size of each block in bytes
+ * @returns 0 if ok; <0 on error
+ */
+int xdelta_check_source_cache(long num_blocks, long block_size)
+{
+    if (num_blocks < 1 || num_blocks > XDELTA_MAX_SOURCE_CACHE_BLOCKS)
+        ERR_RETURN("delta-source-cache-blocks should be between 1 and %d", XDELTA_MAX_SOURCE_CACHE_BLOCKS);
+
+    if (block_size < XDELTA_MIN_SOURCE_BLOCK_SIZE ||
+        block_size > XDELTA_MAX_SOURCE_BLOCK_SIZE ||
+        (block_size & (block_size - 1)) != 0)
+        ERR_RETURN("delta-source-block-size-kb should be a power of 2 between %d and %d",
+                   XDELTA_MIN_SOURCE_BLOCK_SIZE / 1024, XDELTA_MAX_SOURCE_BLOCK_SIZE / 1024);
+
+    return 0;
+}
+
+/**
+ * Check the number of decode threads
+ *
+ * @param num_threads - the number of threads (1 decodes on the calling thread)
+ * @returns 0 if ok; <0 on error
+ */
+int xdelta_check_decode_threads(long num_threads)
+{
+    if (num_threads < 1 || num_threads > XDELTA_MAX_DECODE_THREADS)
+        ERR_RETURN("delta-decode-threads should be between 1 and %d", XDELTA_MAX_DECODE_THREADS);
+
+    return 0;
+}
+
+static void cache_init(struct xdelta_source_cache *cache, size_t num_blocks)
+{
+    cache->blocks = (struct xdelta_source_block *) calloc(num_blocks, sizeof(struct xdelta_source_block));
+    if (!cache->blocks)
+        fwup_err(EXIT_FAILURE, "calloc");
+    cache->num_blocks = num_blocks;
+    cache->timestamp = 0;
+}
+
+static void cache_free(struct xdelta_source_cache *cache)
+{
+    for (size_t i = 0; i < cache->num_blocks; i++)
+        free(cache->blocks[i].data);
+    free(cache->blocks);
+    cache->blocks = NULL;
+    cache->num_blocks = 0;
+}
+
+// Return the block holding blkno or, on a miss, the least recently used
+// block to load it into.
+static struct xdelta_source_block *cache_lookup(struct xdelta_source_cache *cache, xoff_t blkno, usize_t blksize, bool *hit)
+{
+    struct xdelta_source_block *lru = &cache->blocks[0];
+    for (size_t i = 0; i < cache->num_blocks; i++) {
+        struct xdelta_source_block *block = &cache->blocks[i];
+        if (block->in_use && block->blkno == blkno) {
+            *hit = true;
+            return block;
+        }
+        if (lru->in_use && (!block->in_use || block->last_access < lru->last_access))
+            lru = block;
+    }
+
+    if (!lru->data) {
+        lru->data = (uint8_t *) malloc(blksize);
+        if (!lru->data)
+            fwup_err(EXIT_FAILURE, "malloc");
+    }
+    lru->in_use = false;
+    *hit = false;
+    return lru;
+}
+
+static void cache_use(struct xdelta_source_cache *cache, struct xdelta_source_block *block, xd3_source *source)
+{
+    block->last_access = cache->timestamp++;
+    source->curblk = block->data;
+    source->onblk = block->onblk;
+    source->curblkno = block->blkno;
+}
+
+static bool cache_contains(const struct xdelta_source_cache *cache, xoff_t blkno)
+{
+    for (size_t i = 0; i < cache->num_blocks; i++) {
+        if (cache->blocks[i].in_use && cache->blocks[i].blkno == blkno)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Initialize xdelta3 decoding
+ *
+ * @param num_blocks - how many source blocks to cache (0 for the default)
+ * @param block_size - the source block size in bytes (0 for the default)
+ */
+void xdelta_init(struct xdelta_state *xd, xdelta_read_patch_block *read_patch, xdelta_pread_source *pread_source, void *cookie, size_t num_blocks, size_t block_size)
 {
     memset(xd, 0, sizeof(*xd));
 
@@ -17,20 +121,65 @@ void xdelta_init(struct xdelta_state *xd, xdelta_read_patch_block *read_patch, x
     xd3_init_config(&config, XD3_ADLER32);
     xd3_config_stream(&xd->stream, &config);
 
-    // There's an assumption when decrypting that source block reads are block-aligned.
-    xd->source.blksize = READ_SIZE;
-    xd->source.curblk = malloc(READ_SIZE);
+    if (num_blocks == 0)
+        num_blocks = XDELTA_DEFAULT_SOURCE_CACHE_BLOCKS;
+    if (block_size == 0)
+        block_size = READ_SIZE;
+
+    // There's an assumption when decrypting that source block reads are
+    // block-aligned. Block sizes are multiples of READ_SIZE to keep that true.
+    xd->source.blksize = block_size;
+    cache_init(&xd->cache, num_blocks);
 
     xd->read_patch = read_patch;
     xd->pread_source = pread_source;
     xd->cookie = cookie;
     xd->end_of_patch = false;
     xd->bytes_already_reported = 0;
+    xd->num_threads = 1;
 }
 
+/**
+ * Set a callback for reading source ranges ahead of time
+ *
+ * When each window starts, the callback is passed the parts of the window's
+ * source range that aren't already cached.
+ */
+void xdelta_set_prefetch(struct xdelta_state *xd, xdelta_prefetch_source *prefetch_source)
+{
+    xd->prefetch_source = prefetch_source;
+}
+
+/**
+ * Decode VCDIFF windows on worker threads
+ *
+ * xdelta3 doesn't support windows that copy from earlier target output
+ * (VCD_TARGET), so every window only depends on the source and can be
+ * decoded by itself. Output is still returned in order by xdelta_read and
+ * the source is only read from the thread calling xdelta_read. Call this
+ * before the first xdelta_read.
+ *
+ * @param num_threads - the number of decode threads (1 to decode on the calling thread)
+ */
+void xdelta_set_threads(struct xdelta_state *xd, int num_threads)
+{
+#if USE_PTHREADS
+    xd->num_threads = num_threads > 1 ? num_threads : 1;
+#else
+    (void) num_threads;
+#endif
+}
+
+#if USE_PTHREADS
+static void stop_workers(struct xdelta_state *xd);
+#endif
+
 void xdelta_free(struct xdelta_state *xd)
 {
-    free((void*) xd->source.curblk);
+#if USE_PTHREADS
+    stop_workers(xd);
+#endif
+    cache_free(&xd->cache);
     xd->source.curblk = 0;
 
     xd3_close_stream(&xd->stream);
@@ -68,19 +217,532 @@ static int xdelta_read_more(struct xdelta_state *xd)
 
 static int xdelta_read_source_block(struct xdelta_state *xd, xoff_t blkno)
 {
-    int rc = xd->pread_source(xd->cookie,
-                              (void *) xd->source.curblk,
-                              xd->source.blksize,
-                              xd->source.blksize * blkno);
-    if (rc < 0)
+    bool hit;
+    struct xdelta_source_block *block = cache_lookup(&xd->cache, blkno, xd->source.blksize, &hit);
+    if (!hit) {
+        int rc = xd->pread_source(xd->cookie,
+                                  block->data,
+                                  xd->source.blksize,
+                                  xd->source.blksize * blkno);
+        if (rc < 0)
+            return -1;
+
+        block->in_use = true;
+        block->blkno = blkno;
+        block->onblk = rc;
+    }
+
+    cache_use(&xd->cache, block, &xd->source);
+    return 1;
+}
+
+static void xdelta_prefetch_range(struct xdelta_state *xd, xoff_t cpyoff, xoff_t cpylen, const struct xdelta_source_cache *cache)
+{
+    // Ask for the blocks in the window's source range that aren't cached
+    if (!xd->prefetch_source || cpylen == 0)
+        return;
+
+    xoff_t blksize = xd->source.blksize;
+    xoff_t first = cpyoff / blksize;
+    xoff_t last = (cpyoff + cpylen - 1) / blksize;
+    xoff_t run_start = first;
+    for (xoff_t blkno = first; blkno <= last + 1; blkno++) {
+        if (blkno > last || (cache && cache_contains(cache, blkno))) {
+            if (blkno > run_start)
+                xd->prefetch_source(xd->cookie, run_start * blksize, (blkno - run_start) * blksize);
+            run_start = blkno + 1;
+        }
+    }
+}
+
+static void xdelta_prefetch_window(struct xdelta_state *xd)
+{
+    // The window header has the range of the source that the window copies
+    // from.
+    if ((xd->stream.dec_win_ind & VCD_SOURCE) == 0)
+        return;
+
+    xdelta_prefetch_range(xd, xd->stream.dec_cpyoff, xd->stream.dec_cpylen, &xd->cache);
+}
+
+#if USE_PTHREADS
+// Largest window that will be accepted. This matches xdelta3's own limit.
+#define MAX_WINDOW_SIZE XD3_HARDMAXWINSIZE
+
+// The longest VCDIFF integer is 10 bytes for 64-bit values
+#define MAX_VARINT_LEN 10
+
+// Returns the number of bytes read. This is less than count at the end of the patch.
+static ssize_t patch_read(struct xdelta_state *xd, uint8_t *dest, size_t count)
+{
+    size_t amount_read = 0;
+    while (amount_read < count) {
+        if (xd->patch_avail == 0) {
+            if (xd->end_of_patch)
+                break;
+
+            const void *buffer;
+            size_t len;
+            if (xd->read_patch(xd->cookie, &buffer, &len) < 0)
+                return -1;
+            if (len == 0) {
+                xd->end_of_patch = true;
+                break;
+            }
+            xd->patch_next = (const uint8_t *) buffer;
+            xd->patch_avail = len;
+        }
+
+        size_t to_copy = count - amount_read;
+        if (to_copy > xd->patch_avail)
+            to_copy = xd->patch_avail;
+        memcpy(dest + amount_read, xd->patch_next, to_copy);
+        xd->patch_next += to_copy;
+        xd->patch_avail -= to_copy;
+        amount_read += to_copy;
+    }
+    return amount_read;
+}
+
+// Read a VCDIFF integer and append its encoding to raw
+static int patch_read_varint(struct xdelta_state *xd, uint8_t *raw, size_t *raw_len, xoff_t *value)
+{
+    *value = 0;
+    for (int i = 0; i < MAX_VARINT_LEN; i++) {
+        uint8_t b;
+        ssize_t amount_read = patch_read(xd, &b, 1);
+        if (amount_read < 0)
+            return -1;
+        if (amount_read == 0)
+            ERR_RETURN("xdelta3 error: truncated patch");
+
+        raw[(*raw_len)++] = b;
+        *value = (*value << 7) | (b & 0x7f);
+        if ((b & 0x80) == 0)
+            return 0;
+    }
+    ERR_RETURN("xdelta3 error: bad integer in patch");
+}
+
+static int decode_varint(const uint8_t *data, size_t len, xoff_t *value)
+{
+    *value = 0;
+    for (size_t i = 0; i < len && i < MAX_VARINT_LEN; i++) {
+        *value = (*value << 7) | (data[i] & 0x7f);
+        if ((data[i] & 0x80) == 0)
+            return 0;
+    }
+    ERR_RETURN("xdelta3 error: bad integer in patch");
+}
+
+static int read_file_header(struct xdelta_state *xd)
+{
+    // Magic (3 bytes), version, header indicator and then an optional
+    // application header. See RFC 3284 and xd3_decode_input.
+    uint8_t raw[5 + MAX_VARINT_LEN];
+    size_t raw_len = 0;
+
+    ssize_t amount_read = patch_read(xd, raw, 5);
+    if (amount_read < 0)
+        return -1;
+    if (amount_read != 5 || raw[0] != VCDIFF_MAGIC1 || raw[1] != VCDIFF_MAGIC2 || raw[2] != VCDIFF_MAGIC3)
+        ERR_RETURN("xdelta3 error: not a VCDIFF input");
+    raw_len = 5;
+
+    uint8_t hdr_ind = raw[4];
+    if (hdr_ind & (VCD_SECONDARY | VCD_CODETABLE))
+        ERR_RETURN("xdelta3 error: unsupported VCDIFF header options");
+
+    xoff_t appheader_len = 0;
+    if (hdr_ind & VCD_APPHEADER) {
+        OK_OR_RETURN(patch_read_varint(xd, raw, &raw_len, &appheader_len));
+        if (appheader_len > MAX_WINDOW_SIZE)
+            ERR_RETURN("xdelta3 error: application header too large");
+    }
+
+    xd->file_header_len = raw_len + appheader_len;
+    xd->file_header = (uint8_t *) malloc(xd->file_header_len);
+    if (!xd->file_header)
+        fwup_err(EXIT_FAILURE, "malloc");
+    memcpy(xd->file_header, raw, raw_len);
+
+    amount_read = patch_read(xd, xd->file_header + raw_len, appheader_len);
+    if (amount_read < 0)
+        return -1;
+    if ((xoff_t) amount_read != appheader_len)
+        ERR_RETURN("xdelta3 error: truncated patch");
+
+    return 0;
+}
+
+/**
+ * Read the next window from the patch
+ *
+ * @returns 1 if a window was read; 0 at the end of the patch; <0 on error
+ */
+static int read_window(struct xdelta_state *xd, struct xdelta_window *window)
+{
+    if (!xd->file_header)
+        OK_OR_RETURN(read_file_header(xd));
+
+    // Window indicator, copy window length and offset, and the length of
+    // the delta encoding
+    uint8_t raw[1 + 3 * MAX_VARINT_LEN];
+    size_t raw_len = 0;
+
+    ssize_t amount_read = patch_read(xd, raw, 1);
+    if (amount_read <= 0)
+        return (int) amount_read;
+    raw_len = 1;
+
+    uint8_t win_ind = raw[0];
+    if (win_ind & VCD_TARGET)
+        ERR_RETURN("xdelta3 error: VCD_TARGET not implemented");
+
+    xoff_t cpylen = 0;
+    xoff_t cpyoff = 0;
+    if (win_ind & VCD_SOURCE) {
+        OK_OR_RETURN(patch_read_varint(xd, raw, &raw_len, &cpylen));
+        OK_OR_RETURN(patch_read_varint(xd, raw, &raw_len, &cpyoff));
+    }
+
+    xoff_t enc_len;
+    OK_OR_RETURN(patch_read_varint(xd, raw, &raw_len, &enc_len));
+    if (enc_len > 2 * (xoff_t) MAX_WINDOW_SIZE)
+        ERR_RETURN("xdelta3 error: window too large");
+
+    window->patch_len = raw_len + enc_len;
+    window->patch = (uint8_t *) malloc(window->patch_len);
+    if (!window->patch)
+        fwup_err(EXIT_FAILURE, "malloc");
+
+    uint8_t *p = window->patch;
+    memcpy(p, raw, raw_len);
+    p += raw_len;
+
+    amount_read = patch_read(xd, p, enc_len);
+    if (amount_read < 0)
         return -1;
+    if ((xoff_t) amount_read != enc_len)
+        ERR_RETURN("xdelta3 error: truncated patch");
+
+    // The delta encoding starts with the target window length
+    xoff_t tgtlen;
+    OK_OR_RETURN(decode_varint(p, enc_len, &tgtlen));
+    if (tgtlen > MAX_WINDOW_SIZE)
+        ERR_RETURN("xdelta3 error: window too large");
 
-    xd->source.onblk = rc;
-    xd->source.curblkno = blkno;
+    // Start reading the source while the window waits for a worker
+    if (win_ind & VCD_SOURCE)
+        xdelta_prefetch_range(xd, cpyoff, cpylen, NULL);
 
     return 1;
 }
 
+// Called once the window's output has been returned
+static void release_window(struct xdelta_window *window)
+{
+    if (window->stream_open)
+        xd3_consume_output(&window->stream);
+    free(window->patch);
+    window->patch = NULL;
+    window->patch_len = 0;
+    window->bytes_reported = 0;
+    window->error = NULL;
+    window->state = XDELTA_WINDOW_EMPTY;
+}
+
+static void free_window(struct xdelta_window *window)
+{
+    release_window(window);
+    if (window->stream_open) {
+        xd3_close_stream(&window->stream);
+        xd3_free_stream(&window->stream);
+        window->stream_open = false;
+    }
+    cache_free(&window->cache);
+}
+
+// Called with the mutex held
+static int worker_read_source_block(struct xdelta_state *xd, struct xdelta_window *window, xoff_t blkno)
+{
+    bool hit;
+    struct xdelta_source_block *block = cache_lookup(&window->cache, blkno, window->source.blksize, &hit);
+    if (!hit) {
+        window->request_blkno = blkno;
+        window->request_data = block->data;
+        window->request_pending = true;
+        pthread_cond_signal(&xd->main_cond);
+
+        while (window->request_pending && !xd->quit)
+            pthread_cond_wait(&xd->work_cond, &xd->mutex);
+
+        if (window->request_pending || window->request_rc < 0) {
+            window->request_pending = false;
+            return -1;
+        }
+
+        block->in_use = true;
+        block->blkno = blkno;
+        block->onblk = window->request_rc;
+    }
+
+    cache_use(&window->cache, block, &window->source);
+    return 0;
+}
+
+// Called with the mutex held. Returns 0 on success.
+static int decode_window(struct xdelta_state *xd, struct xdelta_window *window)
+{
+    if (!window->stream_open) {
+        xd3_config config;
+        xd3_init_config(&config, XD3_ADLER32);
+        if (xd3_config_stream(&window->stream, &config) != 0) {
+            window->error = window->stream.msg;
+            return -1;
+        }
+        window->stream_open = true;
+        window->source.blksize = xd->source.blksize;
+    }
+
+    // The stream is reused for later windows, so the file header is only
+    // needed the first time.
+    bool have_window_input = true;
+    if (!window->sent_file_header) {
+        xd3_avail_input(&window->stream, xd->file_header, xd->file_header_len);
+        window->sent_file_header = true;
+        have_window_input = false;
+    } else {
+        xd3_avail_input(&window->stream, window->patch, window->patch_len);
+    }
+
+    for (;;) {
+        pthread_mutex_unlock(&xd->mutex);
+        int ret = xd3_decode_input(&window->stream);
+        pthread_mutex_lock(&xd->mutex);
+
+        switch (ret) {
+        case XD3_INPUT:
+            if (have_window_input) {
+                window->error = "truncated window";
+                return -1;
+            }
+            xd3_avail_input(&window->stream, window->patch, window->patch_len);
+            have_window_input = true;
+            break;
+
+        case XD3_GOTHEADER:
+            if (worker_read_source_block(xd, window, 0) < 0)
+                return -1;
+            xd3_set_source(&window->stream, &window->source);
+            break;
+
+        case XD3_WINSTART:
+        case XD3_WINFINISH:
+            break;
+
+        case XD3_GETSRCBLK:
+            if (worker_read_source_block(xd, window, window->source.getblkno) < 0)
+                return -1;
+            break;
+
+        case XD3_OUTPUT:
+            // The output stays in the stream until xdelta_read returns it
+            return 0;
+
+        default:
+            window->error = window->stream.msg ? window->stream.msg : "decode failed";
+            return -1;
+        }
+    }
+}
+
+static struct xdelta_window *next_queued_window(struct xdelta_state *xd)
+{
+    for (int i = 0; i < xd->num_queued; i++) {
+        struct xdelta_window *window = &xd->windows[(xd->head + i) % xd->num_windows];
+        if (window->state == XDELTA_WINDOW_QUEUED)
+            return window;
+    }
+    return NULL;
+}
+
+// Each worker thread runs one of these until xdelta_free
+static void decode_worker(void *void_xd, int job)
+{
+    struct xdelta_state *xd = (struct xdelta_state *) void_xd;
+    (void) job;
+
+    pthread_mutex_lock(&xd->mutex);
+    while (!xd->quit) {
+        struct xdelta_window *window = next_queued_window(xd);
+        if (!window) {
+            pthread_cond_wait(&xd->work_cond, &xd->mutex);
+            continue;
+        }
+
+        window->state = XDELTA_WINDOW_DECODING;
+        int rc = decode_window(xd, window);
+        window->state = rc == 0 ? XDELTA_WINDOW_DONE : XDELTA_WINDOW_FAILED;
+        pthread_cond_signal(&xd->main_cond);
+    }
+    pthread_mutex_unlock(&xd->mutex);
+}
+
+static void start_workers(struct xdelta_state *xd)
+{
+    // xdelta3 builds its code table on first use. Do that before there
+    // are threads.
+    (void) xd3_rfc3284_code_table();
+
+    // One window is being returned while the others decode
+    xd->num_windows = xd->num_threads + 1;
+    xd->windows = (struct xdelta_window *) calloc(xd->num_windows, sizeof(struct xdelta_window));
+    if (!xd->windows)
+        fwup_err(EXIT_FAILURE, "calloc");
+
+    // Split the source block cache between the windows. Reads that miss
+    // still go through the caller's cache (the block cache for raw sources).
+    size_t blocks_per_window = xd->cache.num_blocks / xd->num_windows;
+    if (blocks_per_window < 2)
+        blocks_per_window = 2;
+    for (int i = 0; i < xd->num_windows; i++)
+        cache_init(&xd->windows[i].cache, blocks_per_window);
+
+    pthread_mutex_init(&xd->mutex, NULL);
+    pthread_cond_init(&xd->work_cond, NULL);
+    pthread_cond_init(&xd->main_cond, NULL);
+    xd->quit = false;
+    xd->head = 0;
+    xd->num_queued = 0;
+
+    // The decode loops run until stop_workers, so every job gets its own
+    // thread and this thread is left to service source reads.
+    work_pool_init(&xd->pool, xd->num_threads);
+    work_pool_submit(&xd->pool, decode_worker, xd, xd->num_threads);
+    xd->workers_started = true;
+}
+
+static void stop_workers(struct xdelta_state *xd)
+{
+    if (!xd->workers_started)
+        return;
+
+    pthread_mutex_lock(&xd->mutex);
+    xd->quit = true;
+    pthread_cond_broadcast(&xd->work_cond);
+    pthread_mutex_unlock(&xd->mutex);
+
+    work_pool_wait(&xd->pool);
+    work_pool_free(&xd->pool);
+    for (int i = 0; i < xd->num_windows; i++)
+        free_window(&xd->windows[i]);
+
+    pthread_cond_destroy(&xd->main_cond);
+    pthread_cond_destroy(&xd->work_cond);
+    pthread_mutex_destroy(&xd->mutex);
+
+    free(xd->windows);
+    free(xd->file_header);
+    xd->workers_started = false;
+    xd->windows = NULL;
+    xd->file_header = NULL;
+    xd->num_windows = 0;
+}
+
+// Called with the mutex held. Returns true if any requests were handled.
+static bool service_source_requests(struct xdelta_state *xd)
+{
+    bool serviced = false;
+    for (int i = 0; i < xd->num_windows; i++) {
+        struct xdelta_window *window = &xd->windows[i];
+        if (!window->request_pending)
+            continue;
+
+        // The worker is waiting, so its buffer can be filled without the lock
+        pthread_mutex_unlock(&xd->mutex);
+        int rc = xd->pread_source(xd->cookie,
+                                  window->request_data,
+                                  xd->source.blksize,
+                                  xd->source.blksize * window->request_blkno);
+        pthread_mutex_lock(&xd->mutex);
+
+        window->request_rc = rc;
+        window->request_pending = false;
+        serviced = true;
+    }
+
+    if (serviced)
+        pthread_cond_broadcast(&xd->work_cond);
+    return serviced;
+}
+
+static int xdelta_read_parallel(struct xdelta_state *xd, const void **buffer, size_t *count)
+{
+    int rc = 0;
+
+    if (!xd->workers_started)
+        start_workers(xd);
+
+    pthread_mutex_lock(&xd->mutex);
+    for (;;) {
+        struct xdelta_window *head = &xd->windows[xd->head];
+
+        if (xd->num_queued > 0 && head->state == XDELTA_WINDOW_DONE) {
+            size_t remaining = head->stream.avail_out - head->bytes_reported;
+            if (remaining > 0) {
+                *buffer = head->stream.next_out + head->bytes_reported;
+                *count = remaining > MAX_READ_RETURN_SIZE ? MAX_READ_RETURN_SIZE : remaining;
+                head->bytes_reported += *count;
+                break;
+            }
+
+            // Returned everything, so move on to the next window
+            release_window(head);
+            xd->head = (xd->head + 1) % xd->num_windows;
+            xd->num_queued--;
+            continue;
+        }
+
+        if (xd->num_queued > 0 && head->state == XDELTA_WINDOW_FAILED) {
+            // Source read errors have already been reported
+            if (head->error)
+                set_last_error("xdelta3 error: %s", head->error);
+            rc = -1;
+            break;
+        }
+
+        if (xd->num_queued < xd->num_windows && !xd->end_of_patch) {
+            // Only this thread touches empty windows, so read without the lock.
+            struct xdelta_window *tail = &xd->windows[(xd->head + xd->num_queued) % xd->num_windows];
+            pthread_mutex_unlock(&xd->mutex);
+            int read_rc = read_window(xd, tail);
+            pthread_mutex_lock(&xd->mutex);
+
+            if (read_rc < 0) {
+                release_window(tail);
+                rc = -1;
+                break;
+            } else if (read_rc > 0) {
+                tail->state = XDELTA_WINDOW_QUEUED;
+                xd->num_queued++;
+                pthread_cond_signal(&xd->work_cond);
+            }
+            continue;
+        }
+
+        if (xd->num_queued == 0)
+            break; // End of the patch
+
+        if (!service_source_requests(xd))
+            pthread_cond_wait(&xd->main_cond, &xd->mutex);
+    }
+    pthread_mutex_unlock(&xd->mutex);
+
+    return rc;
+}
+#endif
+
 // Returns 0 when done; >0 when more to do; <0 on error
 static int xdelta_read_impl(struct xdelta_state *xd, const void **buffer, size_t *count)
 {
@@ -103,6 +765,7 @@ static int xdelta_read_impl(struct xdelta_state *xd, const void **buffer, size_t
         return xdelta_read_more(xd);
 
     case XD3_GOTHEADER:
+        xdelta_prefetch_window(xd);
         if (xdelta_read_source_block(xd, 0) > 0) {
             xd3_set_source(&xd->stream, &xd->source);
             return 1;
@@ -111,6 +774,9 @@ static int xdelta_read_impl(struct xdelta_state *xd, const void **buffer, size_t
         }
 
     case XD3_WINSTART:
+        xdelta_prefetch_window(xd);
+        return 1;
+
     case XD3_WINFINISH:
         return 1;
 
@@ -137,6 +803,11 @@ int xdelta_read(struct xdelta_state *xd, const void **buffer, size_t *count)
 {
     *count = 0;
 
+#if USE_PTHREADS
+    if (xd->num_threads > 1)
+        return xdelta_read_parallel(xd, buffer, count);
+#endif
+
     int rc;
     while ((rc = xdelta_read_impl(xd, buffer, count)) > 0);
 
@@ -182,3 +853,37 @@ int xdelta_read_header(struct xdelta_state *xd)
 
     return rc;
 }
+
+#if XD3_ENCODER
+/**
+ * Prepare for calls to xdelta_encode from multiple threads
+ *
+ * xdelta3 builds its default code table on first use, so do that now.
+ */
+void xdelta_encode_init(void)
+{
+    (void) xd3_rfc3284_code_table();
+}
+
+/**
+ * Create a VCDIFF patch for turning source into target
+ *
+ * This doesn't call set_last_error so that it can be called from
+ * worker threads.
+ *
+ * @param patch - where to store the patch
+ * @param max_patch_len - the size of the patch buffer
+ * @param patch_len - the patch's length is returned
+ * @returns 0 on success; ENOSPC if the patch is larger than max_patch_len; other xdelta3 errors
+ */
+int xdelta_encode(const uint8_t *source, size_t source_len,
+                  const uint8_t *target, size_t target_len,
+                  uint8_t *patch, size_t max_patch_len, size_t *patch_len)
+{
+    usize_t len = 0;
+    int rc = xd3_encode_memory(target, target_len, source, source_len,
+                               patch, &len, max_patch_len, XD3_ADLER32);
+    *patch_len = len;
+    return rc;
+}
+#endif
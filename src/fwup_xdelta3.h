@@ -4,20 +4,87 @@
 #include <stdio.h>
 #include <stdbool.h>
 
-// Force XD3 defines to avoid compiling extra code.
+#include "config.h"
+
+// Force XD3 defines to avoid compiling extra code. The encoder is only
+// needed for creating delta firmware updates.
+#ifdef FWUP_MINIMAL
 #define XD3_ENCODER 0
+#else
+#define XD3_ENCODER 1
+#endif
 #define XD3_DEBUG 0
 #define SECONDARY_FGK 0
 #define SECONDARY_DJW 0
 #define SECONDARY_LZMA 0
 
-#include "config.h"
 #include "3rdparty/xdelta3/xdelta3.h"
 
+#include "work_pool.h"
+
 // The patch read block interface matches the zero-copy API of libarchive
 // for convenience, and not as an optimization.
 typedef int (xdelta_read_patch_block)(void *cookie, const void **buffer, size_t *count);
 typedef int (xdelta_pread_source)(void *cookie, void *buffer, size_t count, off_t offset);
+typedef void (xdelta_prefetch_source)(void *cookie, off_t offset, off_t count);
+
+// Source blocks are cached so that xdelta3 can jump between source regions
+// without reading them again. Block sizes are powers of two.
+#define XDELTA_DEFAULT_SOURCE_CACHE_BLOCKS 32
+#define XDELTA_MAX_SOURCE_CACHE_BLOCKS     1024
+#define XDELTA_MIN_SOURCE_BLOCK_SIZE       (128 * 1024)
+#define XDELTA_MAX_SOURCE_BLOCK_SIZE       (4 * 1024 * 1024)
+
+// VCDIFF windows can be decoded on worker threads. See xdelta_set_threads().
+#define XDELTA_MAX_DECODE_THREADS          8
+
+struct xdelta_source_block {
+    bool in_use;
+    xoff_t blkno;
+    usize_t onblk;
+    uint32_t last_access;
+    uint8_t *data;
+};
+
+struct xdelta_source_cache {
+    struct xdelta_source_block *blocks;
+    size_t num_blocks;
+    uint32_t timestamp;
+};
+
+#if USE_PTHREADS
+enum xdelta_window_state {
+    XDELTA_WINDOW_EMPTY = 0,
+    XDELTA_WINDOW_QUEUED,
+    XDELTA_WINDOW_DECODING,
+    XDELTA_WINDOW_DONE,
+    XDELTA_WINDOW_FAILED
+};
+
+// Window slots are reused so that xdelta3's buffers and the source block
+// cache are only allocated once.
+struct xdelta_window {
+    enum xdelta_window_state state;
+    uint8_t *patch;
+    size_t patch_len;
+
+    xd3_stream stream;
+    xd3_source source;
+    bool stream_open;
+    bool sent_file_header;
+    size_t bytes_reported;
+    const char *error;
+
+    struct xdelta_source_cache cache;
+
+    // Workers don't read the source. They ask the thread calling
+    // xdelta_read to do it so that all I/O stays on that thread.
+    bool request_pending;
+    xoff_t request_blkno;
+    uint8_t *request_data;
+    int request_rc;
+};
+#endif
 
 struct xdelta_state {
     xd3_stream stream;
@@ -25,14 +92,49 @@ struct xdelta_state {
 
     xdelta_read_patch_block *read_patch;
     xdelta_pread_source *pread_source;
+    xdelta_prefetch_source *prefetch_source;
     void *cookie;
     bool end_of_patch;
     size_t bytes_already_reported;
+
+    struct xdelta_source_cache cache;
+
+    int num_threads;
+#if USE_PTHREADS
+    struct work_pool pool;
+    bool workers_started;
+    bool quit;
+    pthread_mutex_t mutex;
+    pthread_cond_t work_cond;
+    pthread_cond_t main_cond;
+
+    // Windows are decoded out of order and returned in order
+    struct xdelta_window *windows;
+    int num_windows;
+    int head;
+    int num_queued;
+
+    uint8_t *file_header;
+    size_t file_header_len;
+    const uint8_t *patch_next;
+    size_t patch_avail;
+#endif
 };
 
-void xdelta_init(struct xdelta_state *xd, xdelta_read_patch_block *read_patch, xdelta_pread_source *pread_source, void *cookie);
+int xdelta_check_source_cache(long num_blocks, long block_size);
+int xdelta_check_decode_threads(long num_threads);
+void xdelta_init(struct xdelta_state *xd, xdelta_read_patch_block *read_patch, xdelta_pread_source *pread_source, void *cookie, size_t num_blocks, size_t block_size);
+void xdelta_set_prefetch(struct xdelta_state *xd, xdelta_prefetch_source *prefetch_source);
+void xdelta_set_threads(struct xdelta_state *xd, int num_threads);
 int xdelta_read(struct xdelta_state *xd, const void **buffer, size_t *count);
 int xdelta_read_header(struct xdelta_state *xd);
 void xdelta_free(struct xdelta_state *xd);
 
+#if XD3_ENCODER
+void xdelta_encode_init(void);
+int xdelta_encode(const uint8_t *source, size_t source_len,
+                  const uint8_t *target, size_t target_len,
+                  uint8_t *patch, size_t max_patch_len, size_t *patch_len);
+#endif
+
 #endif
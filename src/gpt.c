@@ -373,3 +373,75 @@ int gpt_create_cfg(cfg_t *cfg, uint32_t num_blocks, uint8_t *mbr_and_primary_gpt
 
     return 0;
 }
+
+static uint32_t from_le32(const uint8_t *input)
+{
+    return input[0] | (input[1] << 8) | (input[2] << 16) | ((uint32_t) input[3] << 24);
+}
+
+static uint64_t from_le64(const uint8_t *input)
+{
+    return from_le32(input) | ((uint64_t) from_le32(&input[4]) << 32);
+}
+
+/**
+ * @brief Decode the locations of the partitions in a primary GPT
+ *
+ * Only GPTs laid out like the ones that fwup creates are supported. I.e., the
+ * partition entries must immediately follow the header.
+ *
+ * @param gpt the GPT starting at LBA 1 (must be GPT_SIZE bytes)
+ * @param partitions where to store the partitions
+ * @param num_partitions how many partitions were found
+ * @return 0 if successful
+ */
+int gpt_decode(const uint8_t *gpt, struct gpt_extent partitions[GPT_MAX_PARTITIONS], int *num_partitions)
+{
+    if (memcmp(gpt, "EFI PART", 8) != 0)
+        ERR_RETURN("GPT signature missing");
+
+    uint32_t header_size = from_le32(&gpt[12]);
+    if (header_size < 92 || header_size > FWUP_BLOCK_SIZE)
+        ERR_RETURN("Unexpected GPT header size: %" PRIu32, header_size);
+
+    uint8_t header[FWUP_BLOCK_SIZE];
+    memcpy(header, gpt, header_size);
+    memset(&header[16], 0, 4);
+    if (crc32buf((const char *) header, header_size) != from_le32(&gpt[16]))
+        ERR_RETURN("GPT header CRC mismatch");
+
+    uint64_t partition_lba = from_le64(&gpt[72]);
+    uint32_t num_entries = from_le32(&gpt[80]);
+    uint32_t entry_size = from_le32(&gpt[84]);
+    if (partition_lba != 2 ||
+        entry_size != GPT_PARTITION_SIZE ||
+        num_entries > GPT_PARTITION_TABLE_BLOCKS * FWUP_BLOCK_SIZE / GPT_PARTITION_SIZE)
+        ERR_RETURN("Unsupported GPT partition table layout");
+
+    const uint8_t *entries = &gpt[FWUP_BLOCK_SIZE];
+    if (crc32buf((const char *) entries, num_entries * GPT_PARTITION_SIZE) != from_le32(&gpt[88]))
+        ERR_RETURN("GPT partition table CRC mismatch");
+
+    static const uint8_t unused_type[UUID_LENGTH] = {0};
+    int found = 0;
+    for (uint32_t i = 0; i < num_entries; i++) {
+        const uint8_t *entry = &entries[i * GPT_PARTITION_SIZE];
+        if (memcmp(entry, unused_type, UUID_LENGTH) == 0)
+            continue;
+
+        if (found == GPT_MAX_PARTITIONS)
+            ERR_RETURN("Too many GPT partitions (max %d)", GPT_MAX_PARTITIONS);
+
+        uint64_t first_lba = from_le64(&entry[32]);
+        uint64_t last_lba = from_le64(&entry[40]);
+        if (last_lba < first_lba)
+            ERR_RETURN("GPT partition %" PRIu32 " ends before it starts", i);
+
+        partitions[found].block_offset = first_lba;
+        partitions[found].block_count = last_lba - first_lba + 1;
+        found++;
+    }
+
+    *num_partitions = found;
+    return 0;
+}
@@ -32,7 +32,13 @@
 #define GPT_SIZE_BLOCKS (1 + GPT_PARTITION_TABLE_BLOCKS)
 #define GPT_SIZE (GPT_SIZE_BLOCKS * FWUP_BLOCK_SIZE)
 
+struct gpt_extent {
+    uint64_t block_offset;
+    uint64_t block_count;
+};
+
 int gpt_verify_cfg(cfg_t *cfg);
 int gpt_create_cfg(cfg_t *cfg, uint32_t num_blocks, uint8_t *primary_gpt, uint8_t *secondary_gpt, off_t *secondary_gpt_offset);
+int gpt_decode(const uint8_t *gpt, struct gpt_extent partitions[GPT_MAX_PARTITIONS], int *num_partitions);
 
 #endif // GPT_H
@@ -53,11 +53,15 @@ static int encrypt_and_pwrite_const(struct pad_to_block_writer *ptbw, const uint
 {
     if (ptbw->dc) {
         // If encrypting and we can't encrypt in-place, then encrypt to a temporary buffer.
-        uint8_t *tmp = malloc(count);
-        disk_crypto_encrypt(ptbw->dc, buf, tmp, count, offset);
-        int rc = block_cache_pwrite(ptbw->output, tmp, count, offset, streamed);
-        free(tmp);
-        return rc;
+        if (count > ptbw->crypt_buffer_size) {
+            free(ptbw->crypt_buffer);
+            ptbw->crypt_buffer = (uint8_t *) malloc(count);
+            if (!ptbw->crypt_buffer)
+                fwup_err(EXIT_FAILURE, "malloc");
+            ptbw->crypt_buffer_size = count;
+        }
+        disk_crypto_encrypt(ptbw->dc, buf, ptbw->crypt_buffer, count, offset);
+        return block_cache_pwrite(ptbw->output, ptbw->crypt_buffer, count, offset, streamed);
     } else {
         return block_cache_pwrite(ptbw->output, buf, count, offset, streamed);
     }
@@ -69,6 +73,8 @@ void ptbw_init(struct pad_to_block_writer *ptbw, struct block_cache *output, str
     ptbw->index = 0;
     ptbw->offset = 0;
     ptbw->dc = dc;
+    ptbw->crypt_buffer = NULL;
+    ptbw->crypt_buffer_size = 0;
 }
 
 int ptbw_pwrite(struct pad_to_block_writer *ptbw, const uint8_t *buf, size_t count, off_t offset)
@@ -155,3 +161,10 @@ int ptbw_flush(struct pad_to_block_writer *ptbw)
     }
     return 0;
 }
+
+void ptbw_free(struct pad_to_block_writer *ptbw)
+{
+    free(ptbw->crypt_buffer);
+    ptbw->crypt_buffer = NULL;
+    ptbw->crypt_buffer_size = 0;
+}
@@ -30,9 +30,15 @@ struct pad_to_block_writer
     uint8_t buffer[FWUP_BLOCK_SIZE];
     size_t index;
     off_t offset;
+
+    // Scratch space for encrypting data that can't be modified in place.
+    // It grows to the largest write and is reused after that.
+    uint8_t *crypt_buffer;
+    size_t crypt_buffer_size;
 };
 void ptbw_init(struct pad_to_block_writer *ptbw, struct block_cache *output, struct disk_crypto *dc);
 int ptbw_pwrite(struct pad_to_block_writer *ptbw, const uint8_t *buf, size_t count, off_t offset);
 int ptbw_flush(struct pad_to_block_writer *ptbw);
+void ptbw_free(struct pad_to_block_writer *ptbw);
 
 #endif // PAD_TO_BLOCK_WRITER_H
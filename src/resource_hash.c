@@ -0,0 +1,247 @@
+/*
+ * Copyright 2026 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "resource_hash.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static const char *hash_names[] = {
+    "blake2b-256",
+    "blake2b-256-tree"
+};
+
+/**
+ * @brief Look up a hash by name
+ *
+ * @param name the name as used in the resource-hash option
+ * @param type the type if found
+ * @return 0 if found, -1 if not
+ */
+int resource_hash_type_from_name(const char *name, enum resource_hash_type *type)
+{
+    for (size_t i = 0; i < sizeof(hash_names) / sizeof(hash_names[0]); i++) {
+        if (strcmp(name, hash_names[i]) == 0) {
+            *type = (enum resource_hash_type) i;
+            return 0;
+        }
+    }
+    ERR_RETURN("unknown resource-hash '%s'. Use blake2b-256 or blake2b-256-tree", name);
+}
+
+const char *resource_hash_name(enum resource_hash_type type)
+{
+    return hash_names[type];
+}
+
+/**
+ * @brief Find the hash that a file-resource was created with
+ *
+ * @param resource the file-resource section
+ * @param type the hash type
+ * @param expected_hash the expected digest as a hex string
+ * @return 0 if there's exactly one valid hash
+ */
+int resource_hash_get_expected(cfg_t *resource, enum resource_hash_type *type, const char **expected_hash)
+{
+    const char *blake2b = cfg_getstr(resource, "blake2b-256");
+    const char *tree = cfg_getstr(resource, "blake2b-256-tree");
+
+    if (blake2b && tree)
+        ERR_RETURN("file-resource '%s' has more than one hash", cfg_title(resource));
+
+    *type = tree ? RESOURCE_HASH_BLAKE2B_256_TREE : RESOURCE_HASH_BLAKE2B_256;
+    *expected_hash = tree ? tree : blake2b;
+    if (!*expected_hash || strlen(*expected_hash) != FWUP_BLAKE2b_256_LEN * 2)
+        ERR_RETURN("invalid %s hash for '%s'", resource_hash_name(*type), cfg_title(resource));
+
+    return 0;
+}
+
+static void hash_leaf(void *void_tree, int leaf)
+{
+    struct resource_hash_tree *tree = (struct resource_hash_tree *) void_tree;
+    size_t offset = (size_t) leaf * RESOURCE_HASH_TREE_LEAF_SIZE;
+    size_t len = tree->batch_len - offset;
+    if (len > RESOURCE_HASH_TREE_LEAF_SIZE)
+        len = RESOURCE_HASH_TREE_LEAF_SIZE;
+
+    uint8_t header[9];
+    header[0] = 0;
+    copy_le64(&header[1], tree->next_leaf + leaf);
+
+    struct fwup_blake2b_ctx ctx;
+    fwup_blake2b_init(&ctx, FWUP_BLAKE2b_256_LEN);
+    fwup_blake2b_update(&ctx, header, sizeof(header));
+    fwup_blake2b_update(&ctx, tree->batch_data + offset, len);
+    fwup_blake2b_final(&ctx, &tree->digests[leaf * FWUP_BLAKE2b_256_LEN]);
+}
+
+static void hash_batch(struct resource_hash_tree *tree, const uint8_t *data, size_t len)
+{
+    tree->batch_data = data;
+    tree->batch_len = len;
+    tree->batch_leaves = (int) ((len + RESOURCE_HASH_TREE_LEAF_SIZE - 1) / RESOURCE_HASH_TREE_LEAF_SIZE);
+
+    work_pool_run(&tree->pool, hash_leaf, tree, tree->batch_leaves);
+
+    fwup_blake2b_update(&tree->root, tree->digests, tree->batch_leaves * FWUP_BLAKE2b_256_LEN);
+    tree->next_leaf += tree->batch_leaves;
+}
+
+static void tree_init(struct resource_hash_tree *tree)
+{
+    static const uint8_t root_prefix = 1;
+
+    fwup_blake2b_init(&tree->root, FWUP_BLAKE2b_256_LEN);
+    fwup_blake2b_update(&tree->root, &root_prefix, 1);
+    tree->total_length = 0;
+    tree->next_leaf = 0;
+
+    // Give each worker a few leaves per batch to even out the load
+    int workers = work_pool_cpus(RESOURCE_HASH_MAX_WORKERS);
+    size_t leaves_per_batch = workers > 1 ? workers * 4 : 1;
+    tree->batch_size = leaves_per_batch * RESOURCE_HASH_TREE_LEAF_SIZE;
+    tree->buffer = (uint8_t *) malloc(tree->batch_size);
+    tree->buffer_len = 0;
+    tree->digests = (uint8_t *) malloc(leaves_per_batch * FWUP_BLAKE2b_256_LEN);
+    if (!tree->buffer || !tree->digests)
+        fwup_err(EXIT_FAILURE, "malloc");
+
+    work_pool_init(&tree->pool, workers - 1);
+}
+
+static void tree_update(struct resource_hash_tree *tree, const uint8_t *data, size_t len)
+{
+    tree->total_length += len;
+
+    while (len > 0) {
+        if (tree->buffer_len == 0 && len >= tree->batch_size) {
+            // Hash directly from the caller's buffer when possible
+            hash_batch(tree, data, tree->batch_size);
+            data += tree->batch_size;
+            len -= tree->batch_size;
+            continue;
+        }
+
+        size_t to_copy = tree->batch_size - tree->buffer_len;
+        if (to_copy > len)
+            to_copy = len;
+        memcpy(tree->buffer + tree->buffer_len, data, to_copy);
+        tree->buffer_len += to_copy;
+        data += to_copy;
+        len -= to_copy;
+
+        if (tree->buffer_len == tree->batch_size) {
+            hash_batch(tree, tree->buffer, tree->buffer_len);
+            tree->buffer_len = 0;
+        }
+    }
+}
+
+static void tree_final(struct resource_hash_tree *tree, uint8_t *hash)
+{
+    if (tree->buffer_len > 0)
+        hash_batch(tree, tree->buffer, tree->buffer_len);
+
+    uint8_t length[8];
+    copy_le64(length, tree->total_length);
+    fwup_blake2b_update(&tree->root, length, sizeof(length));
+    fwup_blake2b_final(&tree->root, hash);
+}
+
+static void tree_free(struct resource_hash_tree *tree)
+{
+    work_pool_free(&tree->pool);
+    free(tree->buffer);
+    free(tree->digests);
+    tree->buffer = NULL;
+    tree->digests = NULL;
+}
+
+/**
+ * @brief Start hashing a resource
+ *
+ * @param rh the hash state
+ * @param type which hash
+ */
+void resource_hash_init(struct resource_hash *rh, enum resource_hash_type type)
+{
+    rh->type = type;
+    rh->active = true;
+
+    if (type == RESOURCE_HASH_BLAKE2B_256_TREE)
+        tree_init(&rh->tree);
+    else
+        fwup_blake2b_init(&rh->blake2b, FWUP_BLAKE2b_256_LEN);
+}
+
+void resource_hash_update(struct resource_hash *rh, const void *data, size_t len)
+{
+    if (rh->type == RESOURCE_HASH_BLAKE2B_256_TREE)
+        tree_update(&rh->tree, (const uint8_t *) data, len);
+    else
+        fwup_blake2b_update(&rh->blake2b, data, len);
+}
+
+/**
+ * @brief Finish hashing and free resources
+ *
+ * @param rh the hash state
+ * @param hash a FWUP_BLAKE2b_256_LEN buffer for the digest
+ */
+void resource_hash_final(struct resource_hash *rh, uint8_t *hash)
+{
+    if (rh->type == RESOURCE_HASH_BLAKE2B_256_TREE)
+        tree_final(&rh->tree, hash);
+    else
+        fwup_blake2b_final(&rh->blake2b, hash);
+
+    resource_hash_free(rh);
+}
+
+/**
+ * @brief Free the hash state without computing the digest
+ *
+ * This is safe to call more than once and after resource_hash_final().
+ *
+ * @param rh the hash state
+ */
+void resource_hash_free(struct resource_hash *rh)
+{
+    if (!rh->active)
+        return;
+
+    if (rh->type == RESOURCE_HASH_BLAKE2B_256_TREE)
+        tree_free(&rh->tree);
+    rh->active = false;
+}
+
+/**
+ * @brief Hash a buffer in one call
+ *
+ * @param type which hash
+ * @param data the data
+ * @param len how many bytes
+ * @param hash a FWUP_BLAKE2b_256_LEN buffer for the digest
+ */
+void resource_hash_buffer(enum resource_hash_type type, const void *data, size_t len, uint8_t *hash)
+{
+    struct resource_hash rh;
+    resource_hash_init(&rh, type);
+    resource_hash_update(&rh, data, len);
+    resource_hash_final(&rh, hash);
+}
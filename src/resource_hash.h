@@ -0,0 +1,90 @@
+/*
+ * Copyright 2026 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RESOURCE_HASH_H
+#define RESOURCE_HASH_H
+
+#include <confuse.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "blake2b_simd.h"
+#include "config.h"
+#include "util.h"
+#include "work_pool.h"
+
+// File-resources are hashed with one of these. The name of the hash is
+// also the name of the file-resource option that holds the digest.
+//
+// blake2b-256 is a plain BLAKE2b-256 over the resource's data.
+//
+// blake2b-256-tree splits the data into RESOURCE_HASH_TREE_LEAF_SIZE
+// chunks and hashes each one independently so that the work can be spread
+// across cores. The digest is:
+//
+//   leaf[i] = BLAKE2b-256(0x00 || le64(i) || chunk[i])
+//   digest  = BLAKE2b-256(0x01 || leaf[0] || ... || leaf[n-1] || le64(length))
+enum resource_hash_type {
+    RESOURCE_HASH_BLAKE2B_256 = 0,
+    RESOURCE_HASH_BLAKE2B_256_TREE
+};
+
+#define RESOURCE_HASH_TREE_LEAF_SIZE    (256 * 1024)
+#define RESOURCE_HASH_MAX_WORKERS       8
+
+struct resource_hash_tree {
+    struct fwup_blake2b_ctx root;
+    uint64_t total_length;
+
+    // Index of the first leaf in the current batch
+    uint64_t next_leaf;
+
+    // Batches of leaves are hashed in parallel. Data is collected in
+    // buffer until there's a full batch.
+    uint8_t *buffer;
+    size_t buffer_len;
+    size_t batch_size;
+    uint8_t *digests;
+
+    // The batch being hashed
+    const uint8_t *batch_data;
+    size_t batch_len;
+    int batch_leaves;
+
+    struct work_pool pool;
+};
+
+struct resource_hash {
+    enum resource_hash_type type;
+    bool active;
+
+    struct fwup_blake2b_ctx blake2b;
+    struct resource_hash_tree tree;
+};
+
+int resource_hash_type_from_name(const char *name, enum resource_hash_type *type);
+const char *resource_hash_name(enum resource_hash_type type);
+int resource_hash_get_expected(cfg_t *resource, enum resource_hash_type *type, const char **expected_hash);
+
+void resource_hash_init(struct resource_hash *rh, enum resource_hash_type type);
+void resource_hash_update(struct resource_hash *rh, const void *data, size_t len);
+void resource_hash_final(struct resource_hash *rh, uint8_t *hash);
+void resource_hash_free(struct resource_hash *rh);
+
+void resource_hash_buffer(enum resource_hash_type type, const void *data, size_t len, uint8_t *hash);
+
+#endif // RESOURCE_HASH_H
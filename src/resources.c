@@ -110,3 +110,29 @@ struct resource_list *rlist_find_by_name(struct resource_list *list, const char
     }
     return NULL;
 }
+
+/**
+ * @brief Find a resource whose data is stored under another resource's name
+ *
+ * Resources that were deduplicated when the archive was created have a
+ * "duplicate-of" field that names the resource holding their data.
+ *
+ * @param list a resource list
+ * @param name the name of the resource holding the data
+ * @param after if non-NULL, start searching after this list item
+ *
+ * @return the resource information or NULL if not found
+ */
+struct resource_list *rlist_find_duplicate(struct resource_list *list, const char *name, struct resource_list *after)
+{
+    if (after)
+        list = after->next;
+
+    while (list) {
+        const char *duplicate_of = cfg_getstr(list->resource, "duplicate-of");
+        if (duplicate_of && strcmp(name, duplicate_of) == 0)
+            return list;
+        list = list->next;
+    }
+    return NULL;
+}
@@ -22,9 +22,11 @@
 
 #include "sparse_file.h"
 #include "util.h"
+#include "3rdparty/base64.h"
 
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -41,6 +43,7 @@ void sparse_file_init(struct sparse_file_map *sfm)
 {
     sfm->map = NULL;
     sfm->map_len = 0;
+    sfm->map_capacity = 0;
 }
 
 /**
@@ -53,6 +56,91 @@ void sparse_file_free(struct sparse_file_map *sfm)
         free(sfm->map);
     sfm->map = NULL;
     sfm->map_len = 0;
+    sfm->map_capacity = 0;
+}
+
+static void sparse_file_reserve(struct sparse_file_map *sfm, int map_len)
+{
+    if (map_len <= sfm->map_capacity)
+        return;
+
+    int capacity = sfm->map_capacity > 0 ? sfm->map_capacity : 16;
+    while (capacity < map_len)
+        capacity *= 2;
+
+    off_t *map = (off_t *) realloc(sfm->map, capacity * sizeof(off_t));
+    if (!map)
+        fwup_err(EXIT_FAILURE, "realloc");
+
+    sfm->map = map;
+    sfm->map_capacity = capacity;
+}
+
+// Maps that are too long for the "length" list are stored as unsigned
+// LEB128 varints of each entry that are then base64 encoded.
+static char *sparse_file_encode_map(const struct sparse_file_map *sfm)
+{
+    // Each entry is at most 63 bits, so it takes at most 9 bytes
+    uint8_t *raw = (uint8_t *) malloc(sfm->map_len * 9);
+    if (!raw)
+        fwup_err(EXIT_FAILURE, "malloc");
+
+    size_t raw_len = 0;
+    for (int i = 0; i < sfm->map_len; i++) {
+        uint64_t value = (uint64_t) sfm->map[i];
+        do {
+            uint8_t b = value & 0x7f;
+            value >>= 7;
+            raw[raw_len++] = value ? (b | 0x80) : b;
+        } while (value);
+    }
+
+    size_t encoded_len = base64_raw_to_encoded_count(raw_len) + 1;
+    char *encoded = (char *) malloc(encoded_len);
+    if (!encoded)
+        fwup_err(EXIT_FAILURE, "malloc");
+
+    to_base64(encoded, encoded_len, raw, raw_len);
+    free(raw);
+    return encoded;
+}
+
+static int sparse_file_decode_map(const char *encoded, struct sparse_file_map *sfm)
+{
+    int rc = 0;
+    size_t raw_len = strlen(encoded) * 3 / 4 + 3;
+    uint8_t *raw = (uint8_t *) malloc(raw_len);
+    if (!raw)
+        fwup_err(EXIT_FAILURE, "malloc");
+
+    const char *end = from_base64(raw, &raw_len, encoded);
+    if (end == NULL || *end != '\0')
+        ERR_CLEANUP_MSG("sparse-map isn't valid base64");
+
+    size_t ix = 0;
+    while (ix < raw_len) {
+        uint64_t value = 0;
+        int shift = 0;
+        uint8_t b;
+        do {
+            if (ix == raw_len || shift > 56)
+                ERR_CLEANUP_MSG("sparse-map has a bad entry");
+
+            b = raw[ix++];
+            value |= (uint64_t) (b & 0x7f) << shift;
+            shift += 7;
+        } while (b & 0x80);
+
+        sparse_file_reserve(sfm, sfm->map_len + 1);
+        sfm->map[sfm->map_len++] = (off_t) value;
+    }
+
+    if (sfm->map_len == 0)
+        ERR_CLEANUP_MSG("sparse-map is empty");
+
+cleanup:
+    free(raw);
+    return rc;
 }
 
 /**
@@ -92,6 +180,17 @@ int sparse_file_get_map_from_resource(cfg_t *resource, struct sparse_file_map *s
     // If this map was in use, free any memory associated with it.
     sparse_file_free(sfm);
 
+    // Long maps use the compact encoding. The "length" list only has the
+    // file size in this case for the benefit of older fwup versions.
+    const char *encoded = cfg_getstr(resource, "sparse-map");
+    if (encoded) {
+        if (sparse_file_decode_map(encoded, sfm) < 0) {
+            sparse_file_free(sfm);
+            return -1;
+        }
+        return 0;
+    }
+
     int map_len = cfg_size(resource, "length");
     if (map_len <= 0) {
         // If not found, then libconfuse supplies the default value of 0
@@ -112,18 +211,37 @@ int sparse_file_get_map_from_resource(cfg_t *resource, struct sparse_file_map *s
 
     sfm->map = map;
     sfm->map_len = map_len;
+    sfm->map_capacity = map_len;
     return 0;
 }
 
 /**
  * @brief Set the sparse map in the specified resource config
  *
+ * Maps longer than SPARSE_FILE_MAP_COMPAT_LEN are stored in "sparse-map"
+ * and "length" is set to the file size. Older fwup versions ignore
+ * "sparse-map", so they see one data segment that doesn't match the
+ * archive contents and refuse to apply it rather than writing garbage.
+ *
  * @param resource the cft_t * to the resource
  * @param sfm
  * @return
  */
 int sparse_file_set_map_in_resource(cfg_t *resource, const struct sparse_file_map *sfm)
 {
+    if (sfm->map_len > SPARSE_FILE_MAP_COMPAT_LEN) {
+        char *encoded = sparse_file_encode_map(sfm);
+        cfg_setstr(resource, "sparse-map", encoded);
+        free(encoded);
+
+#if (SIZEOF_INT == 4 && SIZEOF_OFF_T > 4)
+        cfg_setfloat(resource, "length", sparse_file_size(sfm));
+#else
+        cfg_setint(resource, "length", sparse_file_size(sfm));
+#endif
+        return 0;
+    }
+
     for (int i = 0; i < sfm->map_len; i++) {
 #if (SIZEOF_INT == 4 && SIZEOF_OFF_T > 4)
         cfg_setnfloat(resource, "length", sfm->map[i], i);
@@ -178,6 +296,108 @@ off_t sparse_ending_hole_size(const struct sparse_file_map *sfm)
         return 0;
 }
 
+#define ZERO_SCAN_BUFFER_SIZE (256 * 1024)
+
+/**
+ * @brief Check whether a buffer only contains zeros
+ *
+ * @param buf the buffer
+ * @param len its length
+ * @return true if all zeros
+ */
+bool sparse_file_is_zero(const void *buf, size_t len)
+{
+    const uint8_t *p = (const uint8_t *) buf;
+
+    // OR words together without branching so that the compiler can
+    // vectorize the inner loop, but check often enough that data
+    // blocks are rejected quickly.
+    size_t i = 0;
+    while (i + 256 <= len) {
+        uint64_t acc = 0;
+        for (size_t j = 0; j < 256; j += sizeof(uint64_t)) {
+            uint64_t word;
+            memcpy(&word, p + i + j, sizeof(word));
+            acc |= word;
+        }
+        if (acc)
+            return false;
+        i += 256;
+    }
+    for (; i < len; i++) {
+        if (p[i])
+            return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Add a data segment to the map with blocks of zeros turned into holes
+ *
+ * @param fd the file being scanned
+ * @param base the offset of the start of fd in the concatenated files
+ * @param start where the data segment starts in fd
+ * @param end where the data segment ends in fd
+ * @param sfm the sparse map
+ * @param ix the entry to start at. On return, this is the last entry written.
+ * @param leftover the number of bytes already in the starting entry
+ * @return 0 if successful
+ */
+static int add_data_without_zero_blocks(int fd, off_t base, off_t start, off_t end,
+                                        struct sparse_file_map *sfm, int *ix, off_t leftover)
+{
+    int rc = 0;
+    int i = *ix;
+    off_t len = leftover;
+    uint8_t *buffer = (uint8_t *) malloc(ZERO_SCAN_BUFFER_SIZE);
+    if (!buffer)
+        fwup_err(EXIT_FAILURE, "malloc");
+
+    // Fold an empty data entry back into the previous hole so that
+    // zeros at the start merge with it.
+    if (!IN_HOLE(i) && len == 0 && i > 0) {
+        i--;
+        len = sfm->map[i];
+    }
+
+    off_t offset = start;
+    while (offset < end) {
+        // End reads on block boundaries so that blocks aren't split
+        off_t to_read = ZERO_SCAN_BUFFER_SIZE - (base + offset) % SPARSE_FILE_ZERO_BLOCK_SIZE;
+        if (to_read > end - offset)
+            to_read = end - offset;
+
+        ssize_t amount = pread(fd, buffer, to_read, offset);
+        if (amount <= 0)
+            ERR_CLEANUP_MSG("Error reading resource while looking for zero blocks");
+
+        ssize_t pos = 0;
+        while (pos < amount) {
+            ssize_t block_len = SPARSE_FILE_ZERO_BLOCK_SIZE - (base + offset + pos) % SPARSE_FILE_ZERO_BLOCK_SIZE;
+            if (block_len > amount - pos)
+                block_len = amount - pos;
+
+            bool zero = block_len == SPARSE_FILE_ZERO_BLOCK_SIZE && sparse_file_is_zero(buffer + pos, block_len);
+            if (zero != IN_HOLE(i)) {
+                sparse_file_reserve(sfm, i + 1);
+                sfm->map[i++] = len;
+                len = 0;
+            }
+            len += block_len;
+            pos += block_len;
+        }
+        offset += amount;
+    }
+
+    sparse_file_reserve(sfm, i + 1);
+    sfm->map[i] = len;
+    *ix = i;
+
+cleanup:
+    free(buffer);
+    return rc;
+}
+
 /**
  * @brief Compute a sparse map of a file from a file descriptor
  *
@@ -186,20 +406,22 @@ off_t sparse_ending_hole_size(const struct sparse_file_map *sfm)
  * files that will be concatenated.
  *
  * Note that if sparse seeking isn't supported, the map will have
- * only one entry.
+ * only one entry unless zero blocks are being skipped.
  *
  * @param fd a file descriptor with read access
  * @param sparse_file_disabled set to true to skip sparse file scanning
+ * @param skip_zero_blocks set to true to record aligned blocks of zeros as holes
  * @param sfm a location to store the sparse map
  * @return 0 if successful
  */
-int sparse_file_build_map_from_fd(int fd, bool sparse_file_disabled, struct sparse_file_map *sfm)
+int sparse_file_build_map_from_fd(int fd, bool sparse_file_disabled, bool skip_zero_blocks, struct sparse_file_map *sfm)
 {
+    off_t base = sfm->map ? sparse_file_size(sfm) : 0;
     off_t leftover;
     int i;
     if (!sfm->map) {
         // First file -> start fresh
-        sfm->map = (off_t *) malloc(SPARSE_FILE_MAP_MAX_LEN * sizeof(off_t));
+        sparse_file_reserve(sfm, 16);
         sfm->map_len = 0;
         leftover = 0;
         i = 0;
@@ -216,13 +438,15 @@ int sparse_file_build_map_from_fd(int fd, bool sparse_file_disabled, struct spar
 
 #if HAVE_SPARSE_SEEK
     if (!sparse_file_disabled) {
-        for (; i < SPARSE_FILE_MAP_MAX_LEN - 2; i++) {
+        for (;; i++) {
             next = lseek(fd, offset, IN_HOLE(i) ? SEEK_DATA : SEEK_HOLE);
             if (next < 0) {
                 // Normal case -> we hit the end
                 next = lseek(fd, 0, SEEK_END);
-                if (next != offset)
+                if (next != offset || leftover) {
+                    sparse_file_reserve(sfm, i + 1);
                     sfm->map[i++] = next - offset + leftover;
+                }
                 sfm->map_len = i;
                 return 0;
             }
@@ -233,18 +457,20 @@ int sparse_file_build_map_from_fd(int fd, bool sparse_file_disabled, struct spar
                 sfm->map_len = i;
                 return 0;
             }
-            sfm->map[i] = next - offset + leftover;
-            leftover = 0;
-            offset = next;
-        }
-
-        // Ran out of entries, so the remainder is one big data segment.
-        if (IN_HOLE(i)) {
-            // Current in a hole, so advance to an even location for a data fragment
-            sfm->map[i] = next - offset + leftover;
-            leftover = 0;
+            if (skip_zero_blocks && !IN_HOLE(i)) {
+                OK_OR_RETURN(add_data_without_zero_blocks(fd, base, offset, next, sfm, &i, leftover));
+                leftover = 0;
+                if (IN_HOLE(i)) {
+                    // Ended with zeros, so merge them into the next hole
+                    leftover = sfm->map[i];
+                    i--;
+                }
+            } else {
+                sparse_file_reserve(sfm, i + 1);
+                sfm->map[i] = next - offset + leftover;
+                leftover = 0;
+            }
             offset = next;
-            i++;
         }
     }
 #endif
@@ -252,6 +478,13 @@ int sparse_file_build_map_from_fd(int fd, bool sparse_file_disabled, struct spar
     if (next < 0)
         return -1;
 
+    if (skip_zero_blocks) {
+        OK_OR_RETURN(add_data_without_zero_blocks(fd, base, offset, next, sfm, &i, leftover));
+        sfm->map_len = i + 1;
+        return 0;
+    }
+
+    sparse_file_reserve(sfm, i + 1);
     sfm->map[i] = next - offset + leftover;
     sfm->map_len = i + 1;
     return 0;
@@ -274,7 +507,7 @@ void sparse_file_start_read(const struct sparse_file_map *sfm,
  *
  * This uses the sparse_file_map information to determine what's a hole
  * and what's not. This usually corresponds to what's on disk, but not
- * always (i.e. too many holes). Since the sparse_file_map is "truth", it
+ * always (e.g. skip-holes is off). Since the sparse_file_map is "truth", it
  * has to drive what gets read.
  *
  * @param iterator the sparse file map iterator
@@ -31,6 +31,9 @@ struct sparse_file_map
 
     // This is the number of entries in the map.
     int map_len;
+
+    // This is the number of entries allocated for the map.
+    int map_capacity;
 };
 
 struct sparse_file_read_iterator
@@ -40,10 +43,15 @@ struct sparse_file_read_iterator
     off_t offset_in_segment;
 };
 
-// Only support so many data/hole fragments in a file. After
-// this amount, everything is merged together in one big data
-// fragment.
-#define SPARSE_FILE_MAP_MAX_LEN    256
+// Maps with up to this many data/hole fragments are stored as a "length"
+// list in meta.conf so that older versions of fwup can read them. Longer
+// maps are stored in the compact "sparse-map" encoding.
+#define SPARSE_FILE_MAP_COMPAT_LEN 256
+
+// Zero runs are only turned into holes in whole blocks of this size. Blocks
+// are aligned to the start of the resource so that holes stay on 512-byte
+// block boundaries when the resource is written to a device.
+#define SPARSE_FILE_ZERO_BLOCK_SIZE 4096
 
 void sparse_file_init(struct sparse_file_map *sfm);
 void sparse_file_free(struct sparse_file_map *sfm);
@@ -52,7 +60,8 @@ int sparse_file_get_map_from_config(cfg_t *cfg, const char *resource_name, struc
 int sparse_file_get_map_from_resource(cfg_t *resource, struct sparse_file_map *sfm);
 int sparse_file_set_map_in_resource(cfg_t *resource, const struct sparse_file_map *sfm);
 
-int sparse_file_build_map_from_fd(int fd, bool sparse_file_disabled, struct sparse_file_map *sfm);
+bool sparse_file_is_zero(const void *buf, size_t len);
+int sparse_file_build_map_from_fd(int fd, bool sparse_file_disabled, bool skip_zero_blocks, struct sparse_file_map *sfm);
 
 
 off_t sparse_file_size(const struct sparse_file_map *sfm);
@@ -17,6 +17,7 @@
 #include "util.h"
 #include "simple_string.h"
 #include "progress.h"
+#include "work_pool.h"
 
 #include <errno.h>
 #include <libgen.h>
@@ -33,6 +34,10 @@
 char *strptime(const char *s, const char *format, struct tm *tm);
 
 static char *last_error_message = NULL;
+#if USE_PTHREADS
+// Jobs running on a work_pool can fail at the same time
+static pthread_mutex_t last_error_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
 static char time_string[200] = {0};
 static time_t now_time = 0;
 static const char *timestamp_format = "%Y-%m-%dT%H:%M:%SZ";
@@ -126,6 +131,9 @@ void set_last_error(const char *fmt, ...)
     va_list ap;
     va_start(ap, fmt);
 
+#if USE_PTHREADS
+    pthread_mutex_lock(&last_error_mutex);
+#endif
     if (last_error_message)
         free(last_error_message);
 
@@ -133,6 +141,9 @@ void set_last_error(const char *fmt, ...)
     // the error message pointer
     if (vasprintf(&last_error_message, fmt, ap) < 0)
         last_error_message = NULL;
+#if USE_PTHREADS
+    pthread_mutex_unlock(&last_error_mutex);
+#endif
 
     va_end(ap);
 }
@@ -0,0 +1,237 @@
+/*
+ * Copyright 2026 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "work_pool.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * @brief Return the number of CPUs that are online
+ *
+ * @param max_cpus the most that will be returned
+ * @return a number between 1 and max_cpus
+ */
+int work_pool_cpus(int max_cpus)
+{
+#if USE_PTHREADS && defined(_SC_NPROCESSORS_ONLN)
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1)
+        return 1;
+    return cpus > max_cpus ? max_cpus : (int) cpus;
+#else
+    (void) max_cpus;
+    return 1;
+#endif
+}
+
+/**
+ * @brief Initialize a work pool
+ *
+ * @param pool the pool
+ * @param num_threads how many worker threads to run in addition to the
+ *                    thread that calls work_pool_run. 0 runs everything on
+ *                    the calling thread.
+ */
+void work_pool_init(struct work_pool *pool, int num_threads)
+{
+    memset(pool, 0, sizeof(*pool));
+
+#if USE_PTHREADS
+    if (num_threads > WORK_POOL_MAX_THREADS)
+        num_threads = WORK_POOL_MAX_THREADS;
+    pool->num_threads = num_threads > 0 ? num_threads : 0;
+#else
+    (void) num_threads;
+#endif
+}
+
+#if USE_PTHREADS
+static void run_jobs(struct work_pool *pool)
+{
+    for (;;) {
+        pthread_mutex_lock(&pool->mutex);
+        int job = pool->next_job < pool->num_jobs ? pool->next_job++ : -1;
+        pthread_mutex_unlock(&pool->mutex);
+
+        if (job < 0)
+            break;
+
+        pool->fun(pool->cookie, job);
+    }
+}
+
+static void *pool_worker(void *void_pool)
+{
+    struct work_pool *pool = (struct work_pool *) void_pool;
+    unsigned int generation = 0;
+
+    pthread_mutex_lock(&pool->mutex);
+    for (;;) {
+        while (!pool->quit && pool->generation == generation)
+            pthread_cond_wait(&pool->work_cond, &pool->mutex);
+
+        if (pool->quit)
+            break;
+
+        generation = pool->generation;
+        pthread_mutex_unlock(&pool->mutex);
+
+        run_jobs(pool);
+
+        pthread_mutex_lock(&pool->mutex);
+        pool->busy--;
+        if (pool->busy == 0)
+            pthread_cond_signal(&pool->done_cond);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+static void start_threads(struct work_pool *pool)
+{
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    pool->generation = 0;
+    pool->quit = false;
+
+    for (int i = 0; i < pool->num_threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, pool_worker, pool))
+            fwup_errx(EXIT_FAILURE, "pthread_create");
+    }
+    pool->threads_started = true;
+}
+
+static void stop_threads(struct work_pool *pool)
+{
+    if (!pool->threads_started)
+        return;
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (int i = 0; i < pool->num_threads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_mutex_destroy(&pool->mutex);
+    pool->threads_started = false;
+}
+#endif
+
+/**
+ * @brief Start running a batch of jobs
+ *
+ * The worker threads start on the jobs right away. Call work_pool_wait
+ * before submitting another batch. If the pool has no worker threads, the
+ * jobs are run before this returns.
+ *
+ * @param pool the pool
+ * @param fun called for each job
+ * @param cookie passed to fun
+ * @param num_jobs the jobs are numbered 0 to num_jobs - 1
+ */
+void work_pool_submit(struct work_pool *pool, work_pool_fun *fun, void *cookie, int num_jobs)
+{
+#if USE_PTHREADS
+    if (pool->num_threads > 0) {
+        if (!pool->threads_started)
+            start_threads(pool);
+
+        pthread_mutex_lock(&pool->mutex);
+        pool->fun = fun;
+        pool->cookie = cookie;
+        pool->num_jobs = num_jobs;
+        pool->next_job = 0;
+        pool->busy = pool->num_threads;
+        pool->generation++;
+        pthread_cond_broadcast(&pool->work_cond);
+        pthread_mutex_unlock(&pool->mutex);
+        return;
+    }
+#endif
+
+    for (int i = 0; i < num_jobs; i++)
+        fun(cookie, i);
+}
+
+/**
+ * @brief Wait for the batch from work_pool_submit to finish
+ *
+ * The calling thread runs any jobs that haven't been started.
+ *
+ * @param pool the pool
+ */
+void work_pool_wait(struct work_pool *pool)
+{
+#if USE_PTHREADS
+    if (!pool->threads_started)
+        return;
+
+    // Help out rather than sit idle
+    run_jobs(pool);
+
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->busy > 0)
+        pthread_cond_wait(&pool->done_cond, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+#else
+    (void) pool;
+#endif
+}
+
+/**
+ * @brief Run a batch of jobs and wait for them to finish
+ *
+ * @param pool the pool
+ * @param fun called for each job
+ * @param cookie passed to fun
+ * @param num_jobs the jobs are numbered 0 to num_jobs - 1
+ */
+void work_pool_run(struct work_pool *pool, work_pool_fun *fun, void *cookie, int num_jobs)
+{
+    if (num_jobs < 2) {
+        // Not worth waking up the threads
+        for (int i = 0; i < num_jobs; i++)
+            fun(cookie, i);
+        return;
+    }
+
+    work_pool_submit(pool, fun, cookie, num_jobs);
+    work_pool_wait(pool);
+}
+
+/**
+ * @brief Stop the worker threads
+ *
+ * Any submitted batch must have been waited on.
+ *
+ * @param pool the pool
+ */
+void work_pool_free(struct work_pool *pool)
+{
+#if USE_PTHREADS
+    stop_threads(pool);
+#else
+    (void) pool;
+#endif
+}
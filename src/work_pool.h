@@ -0,0 +1,73 @@
+/*
+ * Copyright 2026 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef WORK_POOL_H
+#define WORK_POOL_H
+
+#include <stdbool.h>
+
+#include "config.h"
+
+// Don't use pthreads on Windows yet.
+#ifndef _WIN32
+#if HAVE_PTHREAD
+#define USE_PTHREADS 1
+#endif
+#endif
+
+#if USE_PTHREADS
+#include <pthread.h>
+#endif
+
+#define WORK_POOL_MAX_THREADS 8
+
+// Called once for each job number in a batch. Jobs in a batch can run in
+// any order and on any thread.
+typedef void (work_pool_fun)(void *cookie, int job);
+
+// A work pool runs batches of numbered jobs on worker threads. The threads
+// are started when the first batch is submitted so that pools that never
+// have enough work to split don't cost anything.
+struct work_pool {
+    int num_threads;
+
+#if USE_PTHREADS
+    bool threads_started;
+    pthread_t threads[WORK_POOL_MAX_THREADS];
+    pthread_mutex_t mutex;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    unsigned int generation;
+    int busy;
+    bool quit;
+
+    // The batch being run
+    work_pool_fun *fun;
+    void *cookie;
+    int num_jobs;
+    int next_job;
+#endif
+};
+
+int work_pool_cpus(int max_cpus);
+
+void work_pool_init(struct work_pool *pool, int num_threads);
+void work_pool_submit(struct work_pool *pool, work_pool_fun *fun, void *cookie, int num_jobs);
+void work_pool_wait(struct work_pool *pool);
+void work_pool_run(struct work_pool *pool, work_pool_fun *fun, void *cookie, int num_jobs);
+void work_pool_free(struct work_pool *pool);
+
+#endif // WORK_POOL_H
@@ -0,0 +1,603 @@
+/*
+ * Copyright 2026 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "zip_raw.h"
+#include "crc32.h"
+#include "util.h"
+
+#include <inttypes.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef FWUP_MINIMAL
+
+// See APPNOTE.TXT from PKWARE for the format
+#define ZIP_LOCAL_HEADER_SIG    0x04034b50
+#define ZIP_CENTRAL_HEADER_SIG  0x02014b50
+#define ZIP_EOCD_SIG            0x06054b50
+#define ZIP64_EOCD_SIG          0x06064b50
+#define ZIP64_LOCATOR_SIG       0x07064b50
+
+#define ZIP_LOCAL_HEADER_LEN    30
+#define ZIP64_DESCRIPTOR_LEN    24
+#define ZIP_CENTRAL_HEADER_LEN  46
+#define ZIP_EOCD_LEN            22
+#define ZIP64_EOCD_LEN          56
+#define ZIP64_LOCATOR_LEN       20
+#define ZIP_MAX_COMMENT_LEN     65535
+
+#define ZIP_FLAG_DESCRIPTOR     0x0008
+#define ZIP64_EXTRA_ID          0x0001
+#define ZIP64_VERSION_NEEDED    45
+
+#define ZIP_RAW_COPY_SIZE       (1024 * 1024)
+
+// fwup archives have a handful of entries, so anything bigger than this is
+// corrupt or crafted to use up memory.
+#define ZIP_RAW_MAX_CD_SIZE     (16 * 1024 * 1024)
+
+static uint16_t get_le16(const uint8_t *p)
+{
+    return (uint16_t) (p[0] | (p[1] << 8));
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint64_t get_le64(const uint8_t *p)
+{
+    return get_le32(p) | ((uint64_t) get_le32(p + 4) << 32);
+}
+
+static int pread_all(int fd, void *buf, size_t count, off_t offset)
+{
+    uint8_t *p = (uint8_t *) buf;
+    while (count > 0) {
+        ssize_t amount = pread(fd, p, count, offset);
+        if (amount <= 0)
+            ERR_RETURN("Unexpected end of ZIP file");
+
+        p += amount;
+        count -= amount;
+        offset += amount;
+    }
+    return 0;
+}
+
+static int write_all(struct zip_raw_writer *w, const void *buf, size_t count)
+{
+    const uint8_t *p = (const uint8_t *) buf;
+    while (count > 0) {
+        ssize_t amount = pwrite(w->fd, p, count, w->offset);
+        if (amount <= 0)
+            ERR_RETURN("Error writing ZIP file");
+
+        p += amount;
+        count -= amount;
+        w->offset += amount;
+    }
+    return 0;
+}
+
+static int parse_extra(struct zip_raw_entry *e, const uint8_t *extra, uint16_t extra_len)
+{
+    e->extra = (uint8_t *) malloc(extra_len > 0 ? extra_len : 1);
+    if (!e->extra)
+        fwup_err(EXIT_FAILURE, "malloc");
+    e->extra_len = 0;
+
+    while (extra_len >= 4) {
+        uint16_t id = get_le16(extra);
+        uint16_t len = get_le16(extra + 2);
+        if (len > extra_len - 4)
+            ERR_RETURN("Corrupt ZIP extra field in '%s'", e->name);
+
+        if (id == ZIP64_EXTRA_ID) {
+            // Fields are only present if the 32-bit version is maxed out
+            const uint8_t *p = extra + 4;
+            const uint8_t *end = p + len;
+            if (e->uncompressed_size == 0xffffffff) {
+                if (end - p < 8)
+                    ERR_RETURN("Corrupt Zip64 field in '%s'", e->name);
+                e->uncompressed_size = get_le64(p);
+                p += 8;
+            }
+            if (e->compressed_size == 0xffffffff) {
+                if (end - p < 8)
+                    ERR_RETURN("Corrupt Zip64 field in '%s'", e->name);
+                e->compressed_size = get_le64(p);
+                p += 8;
+            }
+            if (e->offset == 0xffffffff) {
+                if (end - p < 8)
+                    ERR_RETURN("Corrupt Zip64 field in '%s'", e->name);
+                e->offset = get_le64(p);
+            }
+        } else {
+            // Keep everything else as is
+            memcpy(e->extra + e->extra_len, extra, len + 4);
+            e->extra_len += len + 4;
+        }
+
+        extra += len + 4;
+        extra_len -= len + 4;
+    }
+    return 0;
+}
+
+static int compare_offsets(const void *a, const void *b)
+{
+    const struct zip_raw_entry *ea = (const struct zip_raw_entry *) a;
+    const struct zip_raw_entry *eb = (const struct zip_raw_entry *) b;
+
+    if (ea->offset < eb->offset)
+        return -1;
+    else if (ea->offset > eb->offset)
+        return 1;
+    else
+        return 0;
+}
+
+/**
+ * @brief Read the central directory of a ZIP file
+ *
+ * @param fd the ZIP file
+ * @param dir where to store the entries
+ * @return 0 on success
+ */
+int zip_raw_read_directory(int fd, struct zip_raw_directory *dir)
+{
+    int rc = 0;
+    uint8_t *tail = NULL;
+    uint8_t *cd = NULL;
+
+    dir->entries = NULL;
+    dir->num_entries = 0;
+
+    off_t file_size = lseek(fd, 0, SEEK_END);
+    if (file_size < ZIP_EOCD_LEN)
+        ERR_CLEANUP_MSG("Not a ZIP file");
+
+    // The end of central directory record is at the end of the file unless
+    // there's a comment. Search backwards for it.
+    size_t tail_len = file_size < ZIP_EOCD_LEN + ZIP_MAX_COMMENT_LEN ? (size_t) file_size : ZIP_EOCD_LEN + ZIP_MAX_COMMENT_LEN;
+    tail = (uint8_t *) malloc(tail_len);
+    if (!tail)
+        fwup_err(EXIT_FAILURE, "malloc");
+    OK_OR_CLEANUP(pread_all(fd, tail, tail_len, file_size - tail_len));
+
+    const uint8_t *eocd = NULL;
+    for (size_t i = tail_len - ZIP_EOCD_LEN + 1; i > 0; i--) {
+        if (get_le32(&tail[i - 1]) == ZIP_EOCD_SIG) {
+            eocd = &tail[i - 1];
+            break;
+        }
+    }
+    if (!eocd)
+        ERR_CLEANUP_MSG("Can't find the end of the ZIP central directory");
+
+    off_t eocd_offset = file_size - tail_len + (eocd - tail);
+    uint64_t num_entries = get_le16(&eocd[10]);
+    uint64_t cd_size = get_le32(&eocd[12]);
+    uint64_t cd_offset = get_le32(&eocd[16]);
+
+    if (num_entries == 0xffff || cd_size == 0xffffffff || cd_offset == 0xffffffff) {
+        uint8_t locator[ZIP64_LOCATOR_LEN];
+        uint8_t eocd64[ZIP64_EOCD_LEN];
+
+        if (eocd_offset < ZIP64_LOCATOR_LEN)
+            ERR_CLEANUP_MSG("Missing Zip64 end of central directory locator");
+        OK_OR_CLEANUP(pread_all(fd, locator, sizeof(locator), eocd_offset - ZIP64_LOCATOR_LEN));
+        if (get_le32(locator) != ZIP64_LOCATOR_SIG)
+            ERR_CLEANUP_MSG("Missing Zip64 end of central directory locator");
+
+        OK_OR_CLEANUP(pread_all(fd, eocd64, sizeof(eocd64), get_le64(&locator[8])));
+        if (get_le32(eocd64) != ZIP64_EOCD_SIG)
+            ERR_CLEANUP_MSG("Missing Zip64 end of central directory record");
+
+        num_entries = get_le64(&eocd64[32]);
+        cd_size = get_le64(&eocd64[40]);
+        cd_offset = get_le64(&eocd64[48]);
+    }
+
+    if (cd_offset > (uint64_t) file_size ||
+        cd_size > (uint64_t) file_size - cd_offset ||
+        num_entries > cd_size / ZIP_CENTRAL_HEADER_LEN)
+        ERR_CLEANUP_MSG("Corrupt ZIP central directory");
+    if (cd_size > ZIP_RAW_MAX_CD_SIZE || num_entries > INT_MAX)
+        ERR_CLEANUP_MSG("ZIP central directory is too large (%" PRIu64 " bytes)", cd_size);
+
+    cd = (uint8_t *) malloc(cd_size > 0 ? (size_t) cd_size : 1);
+    if (!cd)
+        fwup_err(EXIT_FAILURE, "malloc");
+    OK_OR_CLEANUP(pread_all(fd, cd, (size_t) cd_size, cd_offset));
+
+    dir->entries = (struct zip_raw_entry *) calloc(num_entries > 0 ? (size_t) num_entries : 1, sizeof(struct zip_raw_entry));
+    if (!dir->entries)
+        fwup_err(EXIT_FAILURE, "malloc");
+
+    const uint8_t *p = cd;
+    const uint8_t *end = cd + cd_size;
+    for (uint64_t i = 0; i < num_entries; i++) {
+        if (end - p < ZIP_CENTRAL_HEADER_LEN || get_le32(p) != ZIP_CENTRAL_HEADER_SIG)
+            ERR_CLEANUP_MSG("Corrupt ZIP central directory");
+
+        uint16_t name_len = get_le16(&p[28]);
+        uint16_t extra_len = get_le16(&p[30]);
+        uint16_t comment_len = get_le16(&p[32]);
+        if (end - p < ZIP_CENTRAL_HEADER_LEN + name_len + extra_len + comment_len)
+            ERR_CLEANUP_MSG("Corrupt ZIP central directory");
+
+        struct zip_raw_entry *e = &dir->entries[dir->num_entries++];
+        e->name = strndup((const char *) &p[ZIP_CENTRAL_HEADER_LEN], name_len);
+        if (!e->name)
+            fwup_err(EXIT_FAILURE, "malloc");
+        e->version_made_by = get_le16(&p[4]);
+        e->version_needed = get_le16(&p[6]);
+        e->flags = get_le16(&p[8]);
+        e->method = get_le16(&p[10]);
+        e->mod_time = get_le16(&p[12]);
+        e->mod_date = get_le16(&p[14]);
+        e->crc32 = get_le32(&p[16]);
+        e->compressed_size = get_le32(&p[20]);
+        e->uncompressed_size = get_le32(&p[24]);
+        e->internal_attributes = get_le16(&p[36]);
+        e->external_attributes = get_le32(&p[38]);
+        e->offset = get_le32(&p[42]);
+        OK_OR_CLEANUP(parse_extra(e, &p[ZIP_CENTRAL_HEADER_LEN + name_len], extra_len));
+
+        p += ZIP_CENTRAL_HEADER_LEN + name_len + extra_len + comment_len;
+    }
+
+    // Each entry extends to the start of the next one. This picks up data
+    // descriptors without needing to parse them.
+    qsort(dir->entries, dir->num_entries, sizeof(struct zip_raw_entry), compare_offsets);
+    for (int i = 0; i < dir->num_entries; i++) {
+        struct zip_raw_entry *e = &dir->entries[i];
+        uint64_t next_offset = (i + 1 < dir->num_entries) ? dir->entries[i + 1].offset : cd_offset;
+        if (next_offset < e->offset + ZIP_LOCAL_HEADER_LEN)
+            ERR_CLEANUP_MSG("Corrupt ZIP file: '%s' overlaps another entry", e->name);
+
+        e->span = next_offset - e->offset;
+
+        // The local header's name and extra fields can be different from
+        // the central directory's, so read it to find where the data starts.
+        uint8_t header[ZIP_LOCAL_HEADER_LEN];
+        OK_OR_CLEANUP(pread_all(fd, header, sizeof(header), e->offset));
+        if (get_le32(header) != ZIP_LOCAL_HEADER_SIG)
+            ERR_CLEANUP_MSG("Corrupt ZIP file: missing local header for '%s'", e->name);
+
+        e->data_offset = e->offset + ZIP_LOCAL_HEADER_LEN + get_le16(&header[26]) + get_le16(&header[28]);
+        if (e->data_offset + e->compressed_size > next_offset)
+            ERR_CLEANUP_MSG("Corrupt ZIP file: '%s' is truncated", e->name);
+    }
+
+cleanup:
+    free(tail);
+    free(cd);
+    if (rc < 0)
+        zip_raw_free_directory(dir);
+    return rc;
+}
+
+/**
+ * @brief Find an entry by name
+ *
+ * @param dir the directory
+ * @param name the entry's path in the archive
+ * @return the entry or NULL if not found
+ */
+const struct zip_raw_entry *zip_raw_find(const struct zip_raw_directory *dir, const char *name)
+{
+    for (int i = 0; i < dir->num_entries; i++) {
+        if (strcmp(dir->entries[i].name, name) == 0)
+            return &dir->entries[i];
+    }
+    return NULL;
+}
+
+/**
+ * @brief Return how many bytes a streaming reader may read for an entry
+ *
+ * A streaming reader can't tell whether an entry's data descriptor is the
+ * 32-bit or Zip64 form until it has read it, so it reads as much as the
+ * Zip64 form would take. That can be a few bytes past the entry's span when
+ * the real descriptor is shorter. Whatever follows the entry (another local
+ * header or the central directory) is always longer than that.
+ *
+ * @param entry the entry from zip_raw_read_directory()
+ * @return the number of bytes from the start of the local header
+ */
+uint64_t zip_raw_stream_len(const struct zip_raw_entry *entry)
+{
+    uint64_t len = entry->span;
+    if (entry->flags & ZIP_FLAG_DESCRIPTOR) {
+        uint64_t descriptor_end = entry->data_offset + entry->compressed_size + ZIP64_DESCRIPTOR_LEN - entry->offset;
+        if (descriptor_end > len)
+            len = descriptor_end;
+    }
+    return len;
+}
+
+static void free_entries(struct zip_raw_entry *entries, int num_entries)
+{
+    if (!entries)
+        return;
+
+    for (int i = 0; i < num_entries; i++) {
+        free(entries[i].name);
+        free(entries[i].extra);
+    }
+    free(entries);
+}
+
+void zip_raw_free_directory(struct zip_raw_directory *dir)
+{
+    free_entries(dir->entries, dir->num_entries);
+    dir->entries = NULL;
+    dir->num_entries = 0;
+}
+
+void zip_raw_writer_init(struct zip_raw_writer *w, int fd)
+{
+    w->fd = fd;
+    w->offset = 0;
+    w->entries = NULL;
+    w->num_entries = 0;
+    w->max_entries = 0;
+}
+
+static void add_entry(struct zip_raw_writer *w, const struct zip_raw_entry *e, uint64_t offset)
+{
+    if (w->num_entries == w->max_entries) {
+        w->max_entries = w->max_entries ? w->max_entries * 2 : 16;
+        w->entries = (struct zip_raw_entry *) realloc(w->entries, w->max_entries * sizeof(struct zip_raw_entry));
+        if (!w->entries)
+            fwup_err(EXIT_FAILURE, "realloc");
+    }
+
+    struct zip_raw_entry *copy = &w->entries[w->num_entries++];
+    *copy = *e;
+    copy->name = strdup(e->name);
+    copy->extra = (uint8_t *) malloc(e->extra_len > 0 ? e->extra_len : 1);
+    if (!copy->name || !copy->extra)
+        fwup_err(EXIT_FAILURE, "malloc");
+    if (e->extra_len > 0)
+        memcpy(copy->extra, e->extra, e->extra_len);
+    copy->offset = offset;
+}
+
+/**
+ * @brief Add an uncompressed entry to the archive
+ *
+ * @param w the writer
+ * @param name the entry's path
+ * @param data the contents
+ * @param len the length of data
+ * @param attributes_from copy the timestamp and file attributes from this entry
+ * @return 0 on success
+ */
+int zip_raw_add_stored(struct zip_raw_writer *w, const char *name, const void *data, uint32_t len, const struct zip_raw_entry *attributes_from)
+{
+    size_t name_len = strlen(name);
+    if (name_len > 0xffff)
+        ERR_RETURN("ZIP entry name too long");
+
+    struct zip_raw_entry e;
+    memset(&e, 0, sizeof(e));
+    e.name = (char *) name;
+    e.version_made_by = attributes_from->version_made_by;
+    e.version_needed = 20;
+    e.mod_time = attributes_from->mod_time;
+    e.mod_date = attributes_from->mod_date;
+    e.crc32 = crc32buf((const char *) data, len);
+    e.compressed_size = len;
+    e.uncompressed_size = len;
+    e.internal_attributes = attributes_from->internal_attributes;
+    e.external_attributes = attributes_from->external_attributes;
+    e.span = ZIP_LOCAL_HEADER_LEN + name_len + len;
+
+    uint8_t header[ZIP_LOCAL_HEADER_LEN];
+    copy_le32(&header[0], ZIP_LOCAL_HEADER_SIG);
+    copy_le16(&header[4], e.version_needed);
+    copy_le16(&header[6], e.flags);
+    copy_le16(&header[8], e.method);
+    copy_le16(&header[10], e.mod_time);
+    copy_le16(&header[12], e.mod_date);
+    copy_le32(&header[14], e.crc32);
+    copy_le32(&header[18], len);
+    copy_le32(&header[22], len);
+    copy_le16(&header[26], name_len);
+    copy_le16(&header[28], 0);
+
+    uint64_t offset = w->offset;
+    OK_OR_RETURN(write_all(w, header, sizeof(header)));
+    OK_OR_RETURN(write_all(w, name, name_len));
+    OK_OR_RETURN(write_all(w, data, len));
+
+    add_entry(w, &e, offset);
+    return 0;
+}
+
+/**
+ * @brief Copy an entry from another archive without decompressing it
+ *
+ * @param w the writer
+ * @param in_fd the archive that the entry is in
+ * @param entry the entry from zip_raw_read_directory()
+ * @return 0 on success
+ */
+int zip_raw_copy_entry(struct zip_raw_writer *w, int in_fd, const struct zip_raw_entry *entry)
+{
+    int rc = 0;
+    uint8_t *buffer = NULL;
+
+    // Sanity check the local header before copying
+    uint8_t header[ZIP_LOCAL_HEADER_LEN];
+    OK_OR_CLEANUP(pread_all(in_fd, header, sizeof(header), entry->offset));
+    if (get_le32(header) != ZIP_LOCAL_HEADER_SIG)
+        ERR_CLEANUP_MSG("Corrupt ZIP file: missing local header for '%s'", entry->name);
+
+    uint64_t header_len = ZIP_LOCAL_HEADER_LEN + get_le16(&header[26]) + get_le16(&header[28]);
+    if (header_len + entry->compressed_size > entry->span)
+        ERR_CLEANUP_MSG("Corrupt ZIP file: '%s' is truncated", entry->name);
+
+    buffer = (uint8_t *) malloc(ZIP_RAW_COPY_SIZE);
+    if (!buffer)
+        fwup_err(EXIT_FAILURE, "malloc");
+    uint64_t offset = w->offset;
+    uint64_t from = entry->offset;
+    uint64_t remaining = entry->span;
+    while (remaining > 0) {
+        size_t amount = remaining < ZIP_RAW_COPY_SIZE ? (size_t) remaining : ZIP_RAW_COPY_SIZE;
+        OK_OR_CLEANUP(pread_all(in_fd, buffer, amount, from));
+        OK_OR_CLEANUP(write_all(w, buffer, amount));
+        from += amount;
+        remaining -= amount;
+    }
+
+    add_entry(w, entry, offset);
+
+cleanup:
+    free(buffer);
+    return rc;
+}
+
+static int write_central_header(struct zip_raw_writer *w, const struct zip_raw_entry *e)
+{
+    size_t name_len = strlen(e->name);
+
+    // Add a Zip64 extra field for anything that doesn't fit in 32 bits
+    uint8_t zip64[4 + 3 * 8];
+    uint16_t zip64_len = 0;
+    bool big_uncompressed = e->uncompressed_size >= 0xffffffff;
+    bool big_compressed = e->compressed_size >= 0xffffffff;
+    bool big_offset = e->offset >= 0xffffffff;
+    if (big_uncompressed) {
+        copy_le64(&zip64[4 + zip64_len], e->uncompressed_size);
+        zip64_len += 8;
+    }
+    if (big_compressed) {
+        copy_le64(&zip64[4 + zip64_len], e->compressed_size);
+        zip64_len += 8;
+    }
+    if (big_offset) {
+        copy_le64(&zip64[4 + zip64_len], e->offset);
+        zip64_len += 8;
+    }
+    if (zip64_len > 0) {
+        copy_le16(&zip64[0], ZIP64_EXTRA_ID);
+        copy_le16(&zip64[2], zip64_len);
+        zip64_len += 4;
+    }
+
+    if (zip64_len + e->extra_len > 0xffff)
+        ERR_RETURN("ZIP extra fields too long for '%s'", e->name);
+
+    uint16_t version_needed = e->version_needed;
+    if (zip64_len > 0 && version_needed < ZIP64_VERSION_NEEDED)
+        version_needed = ZIP64_VERSION_NEEDED;
+
+    uint8_t header[ZIP_CENTRAL_HEADER_LEN];
+    copy_le32(&header[0], ZIP_CENTRAL_HEADER_SIG);
+    copy_le16(&header[4], e->version_made_by);
+    copy_le16(&header[6], version_needed);
+    copy_le16(&header[8], e->flags);
+    copy_le16(&header[10], e->method);
+    copy_le16(&header[12], e->mod_time);
+    copy_le16(&header[14], e->mod_date);
+    copy_le32(&header[16], e->crc32);
+    copy_le32(&header[20], big_compressed ? 0xffffffff : (uint32_t) e->compressed_size);
+    copy_le32(&header[24], big_uncompressed ? 0xffffffff : (uint32_t) e->uncompressed_size);
+    copy_le16(&header[28], name_len);
+    copy_le16(&header[30], zip64_len + e->extra_len);
+    copy_le16(&header[32], 0); // comment length
+    copy_le16(&header[34], 0); // disk number
+    copy_le16(&header[36], e->internal_attributes);
+    copy_le32(&header[38], e->external_attributes);
+    copy_le32(&header[42], big_offset ? 0xffffffff : (uint32_t) e->offset);
+
+    OK_OR_RETURN(write_all(w, header, sizeof(header)));
+    OK_OR_RETURN(write_all(w, e->name, name_len));
+    OK_OR_RETURN(write_all(w, zip64, zip64_len));
+    OK_OR_RETURN(write_all(w, e->extra, e->extra_len));
+    return 0;
+}
+
+/**
+ * @brief Write the central directory to finish the archive
+ *
+ * @param w the writer
+ * @return 0 on success
+ */
+int zip_raw_writer_finish(struct zip_raw_writer *w)
+{
+    uint64_t cd_offset = w->offset;
+    for (int i = 0; i < w->num_entries; i++)
+        OK_OR_RETURN(write_central_header(w, &w->entries[i]));
+
+    uint64_t cd_size = w->offset - cd_offset;
+    uint64_t num_entries = w->num_entries;
+
+    if (num_entries >= 0xffff || cd_size >= 0xffffffff || cd_offset >= 0xffffffff) {
+        uint64_t eocd64_offset = w->offset;
+
+        uint8_t eocd64[ZIP64_EOCD_LEN];
+        copy_le32(&eocd64[0], ZIP64_EOCD_SIG);
+        copy_le64(&eocd64[4], ZIP64_EOCD_LEN - 12);
+        copy_le16(&eocd64[12], ZIP64_VERSION_NEEDED);
+        copy_le16(&eocd64[14], ZIP64_VERSION_NEEDED);
+        copy_le32(&eocd64[16], 0);
+        copy_le32(&eocd64[20], 0);
+        copy_le64(&eocd64[24], num_entries);
+        copy_le64(&eocd64[32], num_entries);
+        copy_le64(&eocd64[40], cd_size);
+        copy_le64(&eocd64[48], cd_offset);
+        OK_OR_RETURN(write_all(w, eocd64, sizeof(eocd64)));
+
+        uint8_t locator[ZIP64_LOCATOR_LEN];
+        copy_le32(&locator[0], ZIP64_LOCATOR_SIG);
+        copy_le32(&locator[4], 0);
+        copy_le64(&locator[8], eocd64_offset);
+        copy_le32(&locator[16], 1);
+        OK_OR_RETURN(write_all(w, locator, sizeof(locator)));
+    }
+
+    uint8_t eocd[ZIP_EOCD_LEN];
+    copy_le32(&eocd[0], ZIP_EOCD_SIG);
+    copy_le16(&eocd[4], 0);
+    copy_le16(&eocd[6], 0);
+    copy_le16(&eocd[8], num_entries >= 0xffff ? 0xffff : (uint16_t) num_entries);
+    copy_le16(&eocd[10], num_entries >= 0xffff ? 0xffff : (uint16_t) num_entries);
+    copy_le32(&eocd[12], cd_size >= 0xffffffff ? 0xffffffff : (uint32_t) cd_size);
+    copy_le32(&eocd[16], cd_offset >= 0xffffffff ? 0xffffffff : (uint32_t) cd_offset);
+    copy_le16(&eocd[20], 0);
+    return write_all(w, eocd, sizeof(eocd));
+}
+
+void zip_raw_writer_free(struct zip_raw_writer *w)
+{
+    free_entries(w->entries, w->num_entries);
+    w->entries = NULL;
+    w->num_entries = 0;
+    w->max_entries = 0;
+}
+
+#endif // FWUP_MINIMAL
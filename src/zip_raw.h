@@ -0,0 +1,82 @@
+/*
+ * Copyright 2026 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ZIP_RAW_H
+#define ZIP_RAW_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Minimal ZIP reading and writing at the byte level. This is used to copy
+// entries from one archive to another without decompressing and
+// recompressing them. libarchive doesn't support this.
+
+struct zip_raw_entry {
+    char *name;
+
+    // Fields from the central directory
+    uint16_t version_made_by;
+    uint16_t version_needed;
+    uint16_t flags;
+    uint16_t method;
+    uint16_t mod_time;
+    uint16_t mod_date;
+    uint32_t crc32;
+    uint64_t compressed_size;
+    uint64_t uncompressed_size;
+    uint16_t internal_attributes;
+    uint32_t external_attributes;
+
+    // Central directory extra fields except for Zip64 (that's regenerated)
+    uint8_t *extra;
+    uint16_t extra_len;
+
+    // Where the local header starts
+    uint64_t offset;
+
+    // Where the compressed data starts (after the local header)
+    uint64_t data_offset;
+
+    // Number of bytes in the local header, data and data descriptor
+    uint64_t span;
+};
+
+struct zip_raw_directory {
+    struct zip_raw_entry *entries; // Sorted by offset
+    int num_entries;
+};
+
+struct zip_raw_writer {
+    int fd;
+    uint64_t offset;
+
+    struct zip_raw_entry *entries;
+    int num_entries;
+    int max_entries;
+};
+
+int zip_raw_read_directory(int fd, struct zip_raw_directory *dir);
+const struct zip_raw_entry *zip_raw_find(const struct zip_raw_directory *dir, const char *name);
+void zip_raw_free_directory(struct zip_raw_directory *dir);
+uint64_t zip_raw_stream_len(const struct zip_raw_entry *entry);
+
+void zip_raw_writer_init(struct zip_raw_writer *w, int fd);
+int zip_raw_add_stored(struct zip_raw_writer *w, const char *name, const void *data, uint32_t len, const struct zip_raw_entry *attributes_from);
+int zip_raw_copy_entry(struct zip_raw_writer *w, int in_fd, const struct zip_raw_entry *entry);
+int zip_raw_writer_finish(struct zip_raw_writer *w);
+void zip_raw_writer_free(struct zip_raw_writer *w);
+
+#endif // ZIP_RAW_H
@@ -91,12 +91,16 @@ TESTS_DIR=$(pwd)
 FWUP_DEFAULT=$TESTS_DIR/../src/fwup
 FWUP_BINARY=$TESTS_DIR/../src/fwup
 FRAMING_HELPER=$TESTS_DIR/fixture/framing-helper
+BLAKE2B_BENCH=$TESTS_DIR/fixture/blake2b-bench
+DISK_CRYPTO_BENCH=$TESTS_DIR/fixture/disk-crypto-bench
 if [ ! -e $FWUP_DEFAULT ]; then
     if [ -e $FWUP_DEFAULT.exe ]; then
         EXEEXT=.exe
         FWUP_BINARY="$FWUP_DEFAULT.exe"
         FWUP_DEFAULT="wine $FWUP_BINARY"
         FRAMING_HELPER="wine $TESTS_DIR/fixture/framing-helper.exe"
+        BLAKE2B_BENCH="wine $TESTS_DIR/fixture/blake2b-bench.exe"
+        DISK_CRYPTO_BENCH="wine $TESTS_DIR/fixture/disk-crypto-bench.exe"
     fi
 fi
 
@@ -0,0 +1,139 @@
+/*
+ * Copyright 2026 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmark and cross-check the BLAKE2b implementations that fwup was
+// built with. Every implementation supported by this CPU hashes the same
+// input and the digests must match monocypher's.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "blake2b_simd.h"
+#include "monocypher.h"
+
+#define DIGEST_LEN 32
+#define RUNS 5
+#define MAX_IMPLEMENTATIONS 8
+
+static void usage()
+{
+    printf("Usage: blake2b-bench [size in MiB]\n");
+}
+
+static void print_digest(const uint8_t *digest)
+{
+    for (int i = 0; i < DIGEST_LEN; i++)
+        printf("%02x", digest[i]);
+}
+
+static double hash(const uint8_t *data, size_t size, uint8_t *digest)
+{
+    struct fwup_blake2b_ctx ctx;
+
+    clock_t start = clock();
+    fwup_blake2b_init(&ctx, DIGEST_LEN);
+    size_t offset = 0;
+    size_t piece = 65536 + 3;
+    while (offset < size) {
+        size_t len = size - offset < piece ? size - offset : piece;
+        fwup_blake2b_update(&ctx, &data[offset], len);
+        offset += len;
+    }
+    fwup_blake2b_final(&ctx, digest);
+    clock_t elapsed = clock() - start;
+
+    double seconds = (double) elapsed / CLOCKS_PER_SEC;
+    return seconds > 0 ? (size / (1024.0 * 1024.0)) / seconds : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t size = 64;
+    if (argc == 2) {
+        size = strtoul(argv[1], NULL, 0);
+    } else if (argc > 2) {
+        usage();
+        exit(EXIT_FAILURE);
+    }
+    if (size == 0) {
+        usage();
+        exit(EXIT_FAILURE);
+    }
+    size *= 1024 * 1024;
+
+    // Odd lengths check the partial final block. The data is hashed in
+    // uneven pieces to exercise buffering.
+    size += 77;
+    uint8_t *data = (uint8_t *) malloc(size);
+    if (!data) {
+        fprintf(stderr, "blake2b-bench: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < size; i++)
+        data[i] = (uint8_t) (i * 131 + (i >> 12));
+
+    uint8_t expected[DIGEST_LEN];
+    crypto_blake2b_general(expected, DIGEST_LEN, NULL, 0, data, size);
+
+    printf("Automatically selected: %s\n", fwup_blake2b_selected());
+
+    // Every implementation, including the portable one, goes through the
+    // same fwup_blake2b_*() calls so that they're timed the same way. Runs
+    // alternate between implementations and the fastest run is reported so
+    // that CPU warm up and interruptions don't favor any one of them.
+    double best[MAX_IMPLEMENTATIONS];
+    bool supported[MAX_IMPLEMENTATIONS];
+    int failures = 0;
+    int count;
+    for (count = 0; count < MAX_IMPLEMENTATIONS && fwup_blake2b_implementation(count); count++) {
+        best[count] = 0;
+        supported[count] = fwup_blake2b_select(fwup_blake2b_implementation(count)) == 0;
+    }
+
+    for (int run = 0; run < RUNS; run++) {
+        for (int i = 0; i < count; i++) {
+            if (!supported[i])
+                continue;
+
+            fwup_blake2b_select(fwup_blake2b_implementation(i));
+            uint8_t digest[DIGEST_LEN];
+            double mbps = hash(data, size, digest);
+            if (mbps > best[i])
+                best[i] = mbps;
+
+            if (memcmp(digest, expected, DIGEST_LEN) != 0) {
+                printf("%-10s MISMATCH ", fwup_blake2b_implementation(i));
+                print_digest(digest);
+                printf("\n");
+                failures++;
+                supported[i] = false;
+            }
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (supported[i])
+            printf("%-10s %8.1f MiB/s\n", fwup_blake2b_implementation(i), best[i]);
+        else
+            printf("%-10s not supported on this CPU\n", fwup_blake2b_implementation(i));
+    }
+
+    free(data);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
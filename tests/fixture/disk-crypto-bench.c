@@ -0,0 +1,340 @@
+/*
+ * Copyright 2026 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmark the disk_crypto ciphers with every AES implementation that the
+// CPU supports. Each cipher encrypts and decrypts the same buffer in large
+// runs of sectors and the results are checked against a reference that
+// sets up a fresh mbedtls context for every sector.
+//
+// It can also check known ciphertext such as the images from the
+// disk_crypto regression tests.
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Build the implementation directly into this program to avoid pulling in
+// the rest of fwup.
+#include "../../src/disk_crypto.c"
+#include "../../src/work_pool.c"
+#include "../../src/aes_accel.c"
+#include "../../src/3rdparty/mbedtls/mbedtls_aes.c"
+#include "../../src/3rdparty/base64.c"
+
+// The few util.c functions that disk_crypto.c needs
+void set_last_error(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+}
+
+void fwup_err(int status, const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    vfprintf(stderr, format, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+    exit(status);
+}
+
+void fwup_errx(int status, const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    vfprintf(stderr, format, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+    exit(status);
+}
+
+int hex_to_bytes(const char *str, uint8_t *bytes, size_t numbytes)
+{
+    if (strlen(str) != numbytes * 2)
+        return -1;
+
+    for (size_t i = 0; i < numbytes; i++) {
+        unsigned int v;
+        if (sscanf(&str[i * 2], "%2x", &v) != 1)
+            return -1;
+        bytes[i] = (uint8_t) v;
+    }
+    return 0;
+}
+
+void copy_le32(uint8_t *output, uint32_t v)
+{
+    output[0] = (uint8_t) v;
+    output[1] = (uint8_t) (v >> 8);
+    output[2] = (uint8_t) (v >> 16);
+    output[3] = (uint8_t) (v >> 24);
+}
+
+// Chunk size used when calling into disk_crypto. This is similar to what
+// the block cache passes when writing segments.
+#define RUN_SIZE (128 * 1024)
+
+// Base offset and starting offset of the simulated partition. These make
+// the LBAs non-zero so that IV and tweak handling is exercised.
+#define BASE_OFFSET (2048 * FWUP_BLOCK_SIZE)
+#define START_OFFSET (BASE_OFFSET + 77 * FWUP_BLOCK_SIZE)
+
+struct cipher_info {
+    const char *name;
+    const char *options;
+    const char *threads;
+};
+
+#define CBC_OPTIONS "cipher=aes-cbc-plain,secret=000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+#define XTS_OPTIONS "cipher=aes-xts-plain64,secret=000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f" \
+                    "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff202122232425262728292a2b2c2d2e2f"
+
+// Each cipher runs on the calling thread only and then with workers
+static const struct cipher_info ciphers[] = {
+    {"aes-cbc-plain", CBC_OPTIONS, "threads=1"},
+    {"aes-cbc-plain", CBC_OPTIONS, "threads=4"},
+    {"aes-xts-plain64", XTS_OPTIONS, "threads=1"},
+    {"aes-xts-plain64", XTS_OPTIONS, "threads=4"},
+};
+
+static void usage()
+{
+    printf("Usage: disk-crypto-bench [size in MiB]\n");
+    printf("       disk-crypto-bench <cipher options> <plaintext file> <ciphertext file>\n");
+}
+
+// Wall clock time since the work may be split across threads
+static double now(void)
+{
+#if defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+    return (double) clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+static double mibps(size_t size, double seconds)
+{
+    return seconds > 0 ? (size / (1024.0 * 1024.0)) / seconds : 0;
+}
+
+// What disk_crypto did before the key schedules were cached
+static void reference_encrypt(const struct disk_crypto *dc, bool xts, const uint8_t *input, uint8_t *output, size_t size)
+{
+    uint64_t lba = (START_OFFSET - BASE_OFFSET) / FWUP_BLOCK_SIZE;
+    for (size_t i = 0; i < size; i += FWUP_BLOCK_SIZE, lba++) {
+        uint8_t iv[AES_BLOCKLEN] = {0};
+        if (xts) {
+            aes_xts_plain64_data_unit(lba, iv);
+
+            mbedtls_aes_xts_context ctx;
+            mbedtls_aes_xts_init(&ctx);
+            mbedtls_aes_xts_setkey_enc(&ctx, dc->key, AES_XTS_KEYLEN * 8);
+            mbedtls_aes_crypt_xts(&ctx, MBEDTLS_AES_ENCRYPT, FWUP_BLOCK_SIZE, iv, &input[i], &output[i]);
+            mbedtls_aes_xts_free(&ctx);
+        } else {
+            copy_le32(iv, (uint32_t) lba);
+
+            mbedtls_aes_context ctx;
+            mbedtls_aes_init(&ctx);
+            mbedtls_aes_setkey_enc(&ctx, dc->key, AES_KEYLEN * 8);
+            mbedtls_aes_crypt_cbc(&ctx, MBEDTLS_AES_ENCRYPT, FWUP_BLOCK_SIZE, iv, &input[i], &output[i]);
+            mbedtls_aes_free(&ctx);
+        }
+    }
+}
+
+static int bench_cipher(const struct cipher_info *cipher, const uint8_t *plaintext, size_t size)
+{
+    uint8_t *expected = malloc(size);
+    uint8_t *ciphertext = malloc(size);
+    uint8_t *decrypted = malloc(size);
+    if (!expected || !ciphertext || !decrypted) {
+        fprintf(stderr, "disk-crypto-bench: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Touch the output buffers so that page faults aren't timed
+    memset(expected, 0, size);
+    memset(ciphertext, 0, size);
+    memset(decrypted, 0, size);
+
+    struct disk_crypto dc;
+    const char *argv[] = {cipher->options, cipher->threads};
+    if (disk_crypto_init(&dc, BASE_OFFSET, 2, argv) < 0) {
+        fprintf(stderr, "disk-crypto-bench: %s init failed\n", cipher->name);
+        exit(EXIT_FAILURE);
+    }
+    bool xts = strcmp(cipher->name, "aes-xts-plain64") == 0;
+
+    double start = now();
+    reference_encrypt(&dc, xts, plaintext, expected, size);
+    double reference_time = now() - start;
+
+    start = now();
+    for (size_t i = 0; i < size; i += RUN_SIZE) {
+        size_t len = size - i < RUN_SIZE ? size - i : RUN_SIZE;
+        disk_crypto_encrypt(&dc, &plaintext[i], &ciphertext[i], len, START_OFFSET + i);
+    }
+    double encrypt_time = now() - start;
+
+    start = now();
+    for (size_t i = 0; i < size; i += RUN_SIZE) {
+        size_t len = size - i < RUN_SIZE ? size - i : RUN_SIZE;
+        disk_crypto_decrypt(&dc, &ciphertext[i], &decrypted[i], len, START_OFFSET + i);
+    }
+    double decrypt_time = now() - start;
+
+    disk_crypto_free(&dc);
+
+    bool encrypt_ok = memcmp(ciphertext, expected, size) == 0;
+    bool decrypt_ok = memcmp(decrypted, plaintext, size) == 0;
+
+    printf("%-9s %-16s %-9s per-sector setup %8.1f MiB/s  encrypt %8.1f MiB/s %s  decrypt %8.1f MiB/s %s\n",
+           aes_accel_selected(),
+           cipher->name,
+           cipher->threads,
+           mibps(size, reference_time),
+           mibps(size, encrypt_time), encrypt_ok ? "ok" : "MISMATCH",
+           mibps(size, decrypt_time), decrypt_ok ? "ok" : "MISMATCH");
+
+    free(expected);
+    free(ciphertext);
+    free(decrypted);
+    return encrypt_ok && decrypt_ok ? 0 : -1;
+}
+
+static uint8_t *read_file(const char *path, size_t *len)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, "disk-crypto-bench: can't open %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    fseek(fp, 0, SEEK_END);
+    *len = (size_t) ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    uint8_t *data = malloc(*len ? *len : 1);
+    if (!data || fread(data, 1, *len, fp) != *len) {
+        fprintf(stderr, "disk-crypto-bench: can't read %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    fclose(fp);
+    return data;
+}
+
+// Encrypt and decrypt a known vector starting at sector 0
+static int check_vector(const char *options, const char *plaintext_path, const char *ciphertext_path)
+{
+    size_t len;
+    size_t ciphertext_len;
+    uint8_t *plaintext = read_file(plaintext_path, &len);
+    uint8_t *ciphertext = read_file(ciphertext_path, &ciphertext_len);
+    if (len != ciphertext_len || len % FWUP_BLOCK_SIZE != 0) {
+        fprintf(stderr, "disk-crypto-bench: vectors must be the same number of sectors\n");
+        exit(EXIT_FAILURE);
+    }
+    uint8_t *output = malloc(len ? len : 1);
+
+    int failures = 0;
+    for (int i = 0; aes_accel_implementation(i); i++) {
+        const char *name = aes_accel_implementation(i);
+        if (aes_accel_select(name) < 0) {
+            printf("%-9s not supported on this CPU\n", name);
+            continue;
+        }
+
+        struct disk_crypto dc;
+        const char *argv[] = {options};
+        if (disk_crypto_init(&dc, 0, 1, argv) < 0) {
+            fprintf(stderr, "disk-crypto-bench: init failed for %s\n", options);
+            exit(EXIT_FAILURE);
+        }
+
+        disk_crypto_encrypt(&dc, plaintext, output, len, 0);
+        bool encrypt_ok = memcmp(output, ciphertext, len) == 0;
+        disk_crypto_decrypt(&dc, ciphertext, output, len, 0);
+        bool decrypt_ok = memcmp(output, plaintext, len) == 0;
+        disk_crypto_free(&dc);
+
+        printf("%-9s encrypt %s  decrypt %s\n", name,
+               encrypt_ok ? "ok" : "MISMATCH",
+               decrypt_ok ? "ok" : "MISMATCH");
+        if (!encrypt_ok || !decrypt_ok)
+            failures++;
+    }
+
+    free(plaintext);
+    free(ciphertext);
+    free(output);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc == 4)
+        return check_vector(argv[1], argv[2], argv[3]);
+
+    size_t size = 16;
+    if (argc == 2) {
+        size = strtoul(argv[1], NULL, 0);
+    } else if (argc > 2) {
+        usage();
+        exit(EXIT_FAILURE);
+    }
+    if (size == 0) {
+        usage();
+        exit(EXIT_FAILURE);
+    }
+    size *= 1024 * 1024;
+
+    // Don't end on a run boundary so that the last call is a partial run
+    size += 3 * FWUP_BLOCK_SIZE;
+    uint8_t *data = (uint8_t *) malloc(size);
+    if (!data) {
+        fprintf(stderr, "disk-crypto-bench: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < size; i++)
+        data[i] = (uint8_t) (i * 131 + (i >> 12));
+
+    printf("Automatically selected: %s\n", aes_accel_selected());
+
+    int failures = 0;
+    for (int i = 0; aes_accel_implementation(i); i++) {
+        const char *name = aes_accel_implementation(i);
+        if (aes_accel_select(name) < 0) {
+            printf("%-9s not supported on this CPU\n", name);
+            continue;
+        }
+
+        for (size_t j = 0; j < sizeof(ciphers) / sizeof(ciphers[0]); j++) {
+            if (bench_cipher(&ciphers[j], data, size) < 0)
+                failures++;
+        }
+    }
+
+    free(data);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}